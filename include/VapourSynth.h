@@ -24,7 +24,7 @@
 #include <stdint.h>
 
 #define VAPOURSYNTH_API_MAJOR 3
-#define VAPOURSYNTH_API_MINOR 6
+#define VAPOURSYNTH_API_MINOR 7
 #define VAPOURSYNTH_API_VERSION ((VAPOURSYNTH_API_MAJOR << 16) | (VAPOURSYNTH_API_MINOR))
 
 /* Convenience for C++ users. */
@@ -70,6 +70,7 @@ typedef struct VSFuncRef VSFuncRef;
 typedef struct VSMap VSMap;
 typedef struct VSAPI VSAPI;
 typedef struct VSFrameContext VSFrameContext;
+typedef struct VSCancelToken VSCancelToken;
 
 typedef enum VSColorFamily {
     /* all planar formats */
@@ -215,6 +216,13 @@ typedef enum VSActivationReason {
     arError = -1
 } VSActivationReason;
 
+typedef enum VSRequestPriority {
+    rpSpeculative = 0,
+    rpBackground = 1,
+    rpNormal = 2,
+    rpInteractive = 3
+} VSRequestPriority;
+
 typedef enum VSMessageType {
     mtDebug = 0,
     mtWarning = 1,
@@ -234,6 +242,8 @@ typedef void (VS_CC *VSFreeFuncData)(void *userData);
 typedef void (VS_CC *VSFilterInit)(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi);
 typedef const VSFrameRef *(VS_CC *VSFilterGetFrame)(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi);
 typedef void (VS_CC *VSFilterFree)(void *instanceData, VSCore *core, const VSAPI *vsapi);
+typedef void (VS_CC *VSFilterGetRegion)(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData);
+typedef void (VS_CC *VSParallelFunc)(int begin, int end, void *userData);
 
 /* other */
 typedef void (VS_CC *VSFrameDoneCallback)(void *userData, const VSFrameRef *f, int n, VSNodeRef *, const char *errorMsg);
@@ -341,6 +351,22 @@ struct VSAPI {
     int (VS_CC *addMessageHandler)(VSMessageHandler handler, VSMessageHandlerFree free, void *userData) VS_NOEXCEPT;
     int (VS_CC *removeMessageHandler)(int id) VS_NOEXCEPT;
     void (VS_CC *getCoreInfo2)(VSCore *core, VSCoreInfo *info) VS_NOEXCEPT;
+
+    /* api 3.7 */
+    int (VS_CC *setLargePages)(int enable, VSCore *core) VS_NOEXCEPT;
+    int64_t (VS_CC *getLargePageMemory)(VSCore *core) VS_NOEXCEPT;
+    void (VS_CC *setRegionSupport)(VSFilterGetRegion getRegion, VSNodeRef **inputs, int numInputs, int apron, int propSource, VSNode *node) VS_NOEXCEPT;
+    void (VS_CC *parallelFor)(VSParallelFunc func, void *userData, int count, int grain, VSCore *core) VS_NOEXCEPT;
+    VSFrameRef *(VS_CC *cropFrame)(const VSFrameRef *f, int left, int top, int width, int height, VSCore *core) VS_NOEXCEPT;
+    int (VS_CC *setProfiling)(int enable, VSCore *core) VS_NOEXCEPT;
+    VSMap *(VS_CC *getProfile)(VSCore *core) VS_NOEXCEPT;
+    int (VS_CC *setTracing)(int enable, VSCore *core) VS_NOEXCEPT;
+    int (VS_CC *saveTrace)(const char *filename, VSCore *core) VS_NOEXCEPT;
+    void (VS_CC *getFrameAsyncPriority)(int n, VSNodeRef *node, VSFrameDoneCallback callback, void *userData, int priority, int64_t deadline) VS_NOEXCEPT; /* same restrictions as getFrameAsync */
+    VSCancelToken *(VS_CC *createCancelToken)(VSCore *core) VS_NOEXCEPT;
+    void (VS_CC *cancelRequests)(VSCancelToken *token) VS_NOEXCEPT;
+    void (VS_CC *freeCancelToken)(VSCancelToken *token) VS_NOEXCEPT;
+    void (VS_CC *getFrameAsyncCancellable)(int n, VSNodeRef *node, VSFrameDoneCallback callback, void *userData, int priority, int64_t deadline, VSCancelToken *token) VS_NOEXCEPT; /* same restrictions as getFrameAsync */
 };
 
 VS_API(const VSAPI *) getVapourSynthAPI(int version) VS_NOEXCEPT;
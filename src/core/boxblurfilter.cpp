@@ -39,6 +39,7 @@ std::string operator""_s(const char *str, size_t len) { return{ str, len }; }
 struct BoxBlurData {
     VSNodeRef *node;
     int radius, passes;
+    const VSVideoInfo *vi;
 };
 
 template<typename T>
@@ -69,7 +70,7 @@ static void blurH(const T * VS_RESTRICT src, T * VS_RESTRICT dst, const int widt
 }
 
 template<typename T>
-static void processPlane(const uint8_t *src, uint8_t *dst, int stride, int width, int height, int passes, int radius, uint8_t *tmp) {
+static void processPlane(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride, int width, int height, int passes, int radius, uint8_t *tmp) {
     const unsigned div = radius * 2 + 1;
     const unsigned round = div - 1;
     for (int h = 0; h < height; h++) {
@@ -80,8 +81,8 @@ static void processPlane(const uint8_t *src, uint8_t *dst, int stride, int width
             blurH(reinterpret_cast<const T *>(dst1), reinterpret_cast<T *>(dst2), width, radius, div, (p & 1) ? 0 : round);
             std::swap(dst1, dst2);
         }
-        src += stride;
-        dst += stride;
+        src += srcStride;
+        dst += dstStride;
     }
 }
 
@@ -113,7 +114,7 @@ static void blurHF(const T * VS_RESTRICT src, T * VS_RESTRICT dst, const int wid
 }
 
 template<typename T>
-static void processPlaneF(const uint8_t *src, uint8_t *dst, int stride, int width, int height, int passes, int radius, uint8_t *tmp) {
+static void processPlaneF(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride, int width, int height, int passes, int radius, uint8_t *tmp) {
     const T div = static_cast<T>(1) / (radius * 2 + 1);
     for (int h = 0; h < height; h++) {
         uint8_t *dst1 = (passes & 1) ? dst : tmp;
@@ -123,8 +124,8 @@ static void processPlaneF(const uint8_t *src, uint8_t *dst, int stride, int widt
             blurHF(reinterpret_cast<const T *>(dst1), reinterpret_cast<T *>(dst2), width, radius, div);
             std::swap(dst1, dst2);
         }
-        src += stride;
-        dst += stride;
+        src += srcStride;
+        dst += dstStride;
     }
 }
 
@@ -170,13 +171,13 @@ static void blurHR1(const T *src, T *dst, int width, const unsigned round) {
 }
 
 template<typename T>
-static void processPlaneR1(const uint8_t *src, uint8_t *dst, int stride, int width, int height, int passes) {
+static void processPlaneR1(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride, int width, int height, int passes) {
     for (int h = 0; h < height; h++) {
         blurHR1(reinterpret_cast<const T *>(src), reinterpret_cast<T *>(dst), width, 2);
         for (int p = 1; p < passes; p++)
             blurHR1(reinterpret_cast<const T *>(dst), reinterpret_cast<T *>(dst), width, (p & 1) ? 0 : 2);
-        src += stride;
-        dst += stride;
+        src += srcStride;
+        dst += dstStride;
     }
 }
 
@@ -224,16 +225,45 @@ static void blurHR1F(const T *src, T *dst, int width) {
 }
 
 template<typename T>
-static void processPlaneR1F(const uint8_t *src, uint8_t *dst, int stride, int width, int height, int passes) {
+static void processPlaneR1F(const uint8_t *src, int srcStride, uint8_t *dst, int dstStride, int width, int height, int passes) {
     for (int h = 0; h < height; h++) {
         blurHR1F(reinterpret_cast<const T *>(src), reinterpret_cast<T *>(dst), width);
         for (int p = 1; p < passes; p++)
             blurHR1F(reinterpret_cast<const T *>(dst), reinterpret_cast<T *>(dst), width);
-        src += stride;
-        dst += stride;
+        src += srcStride;
+        dst += dstStride;
     }
 }
 
+static void boxBlurProcessRows(const BoxBlurData *d, const VSFormat *fi, const uint8_t *srcp, int srcStride, uint8_t *dstp, int dstStride, int w, int h) {
+    int bytesPerSample = fi->bytesPerSample;
+    int radius = d->radius;
+    uint8_t *tmp = (radius > 1 && d->passes > 1) ? new uint8_t[bytesPerSample * w] : nullptr;
+
+    if (radius == 1) {
+        if (bytesPerSample == 1)
+            processPlaneR1<uint8_t>(srcp, srcStride, dstp, dstStride, w, h, d->passes);
+        else if (bytesPerSample == 2)
+            processPlaneR1<uint16_t>(srcp, srcStride, dstp, dstStride, w, h, d->passes);
+        else
+            processPlaneR1F<float>(srcp, srcStride, dstp, dstStride, w, h, d->passes);
+    } else {
+        if (bytesPerSample == 1)
+            processPlane<uint8_t>(srcp, srcStride, dstp, dstStride, w, h, d->passes, radius, tmp);
+        else if (bytesPerSample == 2)
+            processPlane<uint16_t>(srcp, srcStride, dstp, dstStride, w, h, d->passes, radius, tmp);
+        else
+            processPlaneF<float>(srcp, srcStride, dstp, dstStride, w, h, d->passes, radius, tmp);
+    }
+
+    delete[] tmp;
+}
+
+static void VS_CC boxBlurGetRegion(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData) {
+    BoxBlurData *d = reinterpret_cast<BoxBlurData *>(instanceData);
+    boxBlurProcessRows(d, d->vi->format, srcp[0] + static_cast<ptrdiff_t>(top) * srcStride[0], srcStride[0], dstp + static_cast<ptrdiff_t>(top) * dstStride, dstStride, width, bottom - top);
+}
+
 static const VSFrameRef *VS_CC boxBlurGetframe(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     BoxBlurData *d = reinterpret_cast<BoxBlurData *>(*instanceData);
 
@@ -243,33 +273,7 @@ static const VSFrameRef *VS_CC boxBlurGetframe(int n, int activationReason, void
         const VSFrameRef *src = vsapi->getFrameFilter(n, d->node, frameCtx);
         const VSFormat *fi = vsapi->getFrameFormat(src);
         VSFrameRef *dst = vsapi->newVideoFrame(fi, vsapi->getFrameWidth(src, 0), vsapi->getFrameHeight(src, 0), src, core);
-        int bytesPerSample = fi->bytesPerSample;
-        int radius = d->radius;
-        uint8_t *tmp = (radius > 1 && d->passes > 1) ? new uint8_t[bytesPerSample * vsapi->getFrameWidth(src, 0)] : nullptr;
-
-        const uint8_t *srcp = vsapi->getReadPtr(src, 0);
-        int stride = vsapi->getStride(src, 0);
-        uint8_t *dstp = vsapi->getWritePtr(dst, 0);
-        int h = vsapi->getFrameHeight(src, 0);
-        int w = vsapi->getFrameWidth(src, 0);
-
-        if (radius == 1) {
-            if (bytesPerSample == 1)
-                processPlaneR1<uint8_t>(srcp, dstp, stride, w, h, d->passes);
-            else if (bytesPerSample == 2)
-                processPlaneR1<uint16_t>(srcp, dstp, stride, w, h, d->passes);
-            else
-                processPlaneR1F<float>(srcp, dstp, stride, w, h, d->passes);
-        } else {
-            if (bytesPerSample == 1)
-                processPlane<uint8_t>(srcp, dstp, stride, w, h, d->passes, radius, tmp);
-            else if (bytesPerSample == 2)
-                processPlane<uint16_t>(srcp, dstp, stride, w, h, d->passes, radius, tmp);
-            else
-                processPlaneF<float>(srcp, dstp, stride, w, h, d->passes, radius, tmp);
-        }
-
-        delete[] tmp;
+        processPlaneBands(boxBlurGetRegion, &src, 1, dst, 0, d, core, vsapi);
 
         vsapi->freeFrame(src);
         return dst;
@@ -278,6 +282,15 @@ static const VSFrameRef *VS_CC boxBlurGetframe(int n, int activationReason, void
     return nullptr;
 }
 
+static void VS_CC boxBlurInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    BoxBlurData *d = reinterpret_cast<BoxBlurData *>(*instanceData);
+    d->vi = vsapi->getVideoInfo(d->node);
+    vsapi->setVideoInfo(d->vi, 1, node);
+    // every row is blurred on its own, the vertical blur is done on a transposed clip
+    if (d->vi->format)
+        vsapi->setRegionSupport(boxBlurGetRegion, &d->node, 1, 0, 0, node);
+}
+
 static VSNodeRef *applyBoxBlurPlaneFiltering(VSPlugin *stdplugin, VSNodeRef *node, int hradius, int hpasses, int vradius, int vpasses, VSCore *core, const VSAPI *vsapi) {
     bool hblur = (hradius > 0) && (hpasses > 0);
     bool vblur = (vradius > 0) && (vpasses > 0);
@@ -285,7 +298,7 @@ static VSNodeRef *applyBoxBlurPlaneFiltering(VSPlugin *stdplugin, VSNodeRef *nod
     if (hblur) {
         VSMap *vtmp1 = vsapi->createMap();
         VSMap *vtmp2 = vsapi->createMap();
-        vsapi->createFilter(vtmp1, vtmp2, "BoxBlur", templateNodeInit<BoxBlurData>, boxBlurGetframe, templateNodeFree<BoxBlurData>, fmParallel, 0, new BoxBlurData{ node, hradius, hpasses }, core);
+        vsapi->createFilter(vtmp1, vtmp2, "BoxBlur", boxBlurInit, boxBlurGetframe, templateNodeFree<BoxBlurData>, fmParallel, 0, new BoxBlurData{ node, hradius, hpasses, nullptr }, core);
         node = vsapi->propGetNode(vtmp2, "clip", 0, nullptr);
         vsapi->freeMap(vtmp1);
         vsapi->freeMap(vtmp2);
@@ -299,7 +312,7 @@ static VSNodeRef *applyBoxBlurPlaneFiltering(VSPlugin *stdplugin, VSNodeRef *nod
         vsapi->clearMap(vtmp1);
         node = vsapi->propGetNode(vtmp2, "clip", 0, nullptr);
         vsapi->clearMap(vtmp2);
-        vsapi->createFilter(vtmp1, vtmp2, "BoxBlur", templateNodeInit<BoxBlurData>, boxBlurGetframe, templateNodeFree<BoxBlurData>, fmParallel, 0, new BoxBlurData{ node, vradius, vpasses }, core);
+        vsapi->createFilter(vtmp1, vtmp2, "BoxBlur", boxBlurInit, boxBlurGetframe, templateNodeFree<BoxBlurData>, fmParallel, 0, new BoxBlurData{ node, vradius, vpasses, nullptr }, core);
         vsapi->freeMap(vtmp1);
         vtmp1 = vsapi->invoke(stdplugin, "Transpose", vtmp2);
         vsapi->freeMap(vtmp2);
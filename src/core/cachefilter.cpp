@@ -23,43 +23,24 @@
 #include <string>
 #include <algorithm>
 
-
-VSCache::CacheAction VSCache::recommendSize() {
-    // fixme, constants pulled out of my ass
-    int total = hits + nearMiss + farMiss;
-
-    if (total == 0)
-        return caClear;
-
-    if (total < 30) {
-        clearStats();
-        return caNoChange; // not enough requests to know what to do so keep it this way
-    }
-
-    bool shrink = (nearMiss == 0 && hits == 0 && ((farMiss * 10) / total >= 9));
-    bool grow = ((nearMiss * 10) / total >= 1);
-#ifdef VS_CACHE_DEBUG
-    vsWarning("Cache (%p) stats (%s): %d %d %d %d, size: %d", (void *)this, shrink ? "shrink" : (grow ? "grow" : "keep"), total, farMiss, nearMiss, hits, maxSize);
-#endif
-    if (grow) { // growing the cache would be beneficial
-        clearStats();
-        return caGrow;
-    } else if (shrink) { // probably a linear scan, no reason to waste space here
-        clearStats();
-        return caShrink;
-    } else {
-        clearStats();
-        return caNoChange; // probably fine the way it is
-    }
-}
+const int VSCache::minHistory;
 
 inline VSCache::VSCache(int maxSize, int maxHistorySize, bool fixedSize)
-    : maxSize(maxSize), maxHistorySize(maxHistorySize), fixedSize(fixedSize) {
+    : maxSize(maxSize), maxHistorySize(maxHistorySize), fixedSize(fixedSize), frameBytes(0), nearMissRate(0), averageCost(0), spill(nullptr), core(nullptr) {
     clear();
+    clearTotals();
 }
 
 inline PVideoFrame VSCache::object(const int key) {
-    return this->relink(key);
+    PVideoFrame f = this->relink(key);
+    if (!f && spill) {
+        // promote the frame back to memory if it was spilled
+        int64_t cost = 0;
+        f = spill->load(this, key, core, cost);
+        if (f)
+            insert(key, f, cost);
+    }
+    return f;
 }
 
 
@@ -79,12 +60,27 @@ inline bool VSCache::remove(const int key) {
 }
 
 
-bool VSCache::insert(const int akey, const PVideoFrame &aobject) {
+// GreedyDual-Size, frames that took a long time to produce relative to the memory they use are kept the longest
+size_t VSCache::getFrameBytes(const PVideoFrame &frame) {
+    const VSFormat *fi = frame->getFormat();
+    size_t bytes = 0;
+    for (int plane = 0; plane < fi->numPlanes; plane++)
+        bytes += static_cast<size_t>(frame->getStride(plane)) * frame->getHeight(plane);
+    return std::max<size_t>(bytes, 1);
+}
+
+double VSCache::getValue(const PVideoFrame &frame, int64_t cost) {
+    return static_cast<double>(cost) / getFrameBytes(frame);
+}
+
+bool VSCache::insert(const int akey, const PVideoFrame &aobject, int64_t cost) {
     assert(aobject);
     assert(akey >= 0);
     remove(akey);
-    trim(maxSize - 1, maxHistorySize);
-    auto i = hash.insert(std::make_pair(akey, Node(akey, aobject)));
+    frameBytes = getFrameBytes(aobject);
+    insertedCost += cost;
+    inserts++;
+    auto i = hash.insert(std::make_pair(akey, Node(akey, aobject, cost, inflation + getValue(aobject, cost))));
     currentSize++;
     Node *n = &i.first->second;
 
@@ -104,62 +100,143 @@ bool VSCache::insert(const int akey, const PVideoFrame &aobject) {
 
 
 void VSCache::trim(int max, int maxHistory) {
-    // first adjust the number of cached frames and extra history length
+    // first move the frames with the lowest priority to the history, ties go to the least recently used one
     while (currentSize > max) {
-        if (!weakpoint)
-            weakpoint = last;
-        else
-            weakpoint = weakpoint->prevNode;
+        Node *victim = nullptr;
+        for (Node *n = last; n; n = n->prevNode) {
+            if (n->frame && (!victim || n->priority < victim->priority))
+                victim = n;
+        }
 
-        if (weakpoint)
-            weakpoint->frame.reset();
+        inflation = std::max(inflation, victim->priority);
+        // only spill frames that take longer to produce than to write and read back at roughly 1GB/s
+        if (spill && victim->cost > static_cast<int64_t>(getFrameBytes(victim->frame)))
+            spill->store(this, victim->key, victim->frame, victim->cost);
+        victim->frame.reset();
 
         currentSize--;
         historySize++;
     }
 
-    // remove history until the tail is small enough
-    while (last && historySize > maxHistory) {
-        unlink(*last);
+    // remove the oldest history until it is small enough
+    Node *n = last;
+    while (n && historySize > maxHistory) {
+        Node *prev = n->prevNode;
+        if (!n->frame)
+            unlink(*n);
+        n = prev;
     }
 }
 
-void VSCache::adjustSize(bool needMemory) {
-    if (!fixedSize) {
-        if (!needMemory) {
-            switch (recommendSize()) {
-            case VSCache::caClear:
-                clear();
-                setMaxFrames(std::max(getMaxFrames() - 1, 1));
-                break;
-            case VSCache::caGrow:
-                setMaxFrames(getMaxFrames() + 2);
-                break;
-            case VSCache::caShrink:
-                setMaxFrames(std::max(getMaxFrames() - 1, 1));
-                break;
-            default:;
-            }
+void VSCache::collectStats(VSCacheStats &stats) {
+    // smooth the rates a bit so a single odd period doesn't make the sizes jump around
+    const double weight = 0.5;
+    int requests = hits + nearMiss + farMiss;
+    if (requests > 0)
+        nearMissRate = nearMissRate * (1 - weight) + weight * nearMiss / std::max(maxHistorySize, 1);
+    if (inserts > 0)
+        averageCost = averageCost * (1 - weight) + weight * insertedCost / inserts;
+
+    stats.fixed = fixedSize;
+    stats.maxFrames = maxSize;
+    stats.frames = currentSize;
+    stats.frameBytes = frameBytes;
+    stats.requests = requests;
+    stats.hits = hits;
+    stats.nearMiss = nearMiss;
+    stats.nearMissRate = nearMissRate;
+    stats.cost = averageCost;
+#ifdef VS_CACHE_DEBUG
+    vsWarning("Cache (%p) stats: %d %d %d %d, size: %d, near miss rate: %f, cost: %f", (void *)this, requests, farMiss, nearMiss, hits, maxSize, nearMissRate, averageCost);
+#endif
+    clearStats();
+}
+
+void balanceCaches(const std::set<VSNode *> &caches, MemoryUse *memory, bool needMemory) {
+    struct Entry {
+        VSNode *node;
+        VSCacheStats stats;
+        double weight;
+        int target;
+        bool clear;
+    };
+
+    std::vector<Entry> entries;
+    entries.reserve(caches.size());
+    size_t cacheBytes = 0;
+    for (VSNode *node : caches) {
+        Entry e = { node, {}, 0, 0, false };
+        node->getCacheStats(e.stats);
+        cacheBytes += e.stats.frameBytes * e.stats.frames;
+        entries.push_back(e);
+    }
+
+    // everything not held by the caches is frames in flight or referenced elsewhere, the caches can have what's left
+    // with a bit of headroom so the limit isn't constantly hit
+    size_t limit = memory->getLimit();
+    size_t used = memory->memoryUse();
+    size_t otherBytes = used > cacheBytes ? used - cacheBytes : 0;
+    double budget = (limit > otherBytes) ? 0.9 * (limit - otherBytes) : 0;
+    double keptBytes = 0;
+
+    // the hits gained by the k-th frame of a cache are modeled as decreasing with 1/k, anchored at the
+    // observed near miss rate at its current size, giving every frame the value cost * rate * size / k
+    // per byte, handing out memory to the most valuable frames first then works out to a size proportional to the weight
+    double weightedBytes = 0;
+    for (auto &e : entries) {
+        const VSCacheStats &s = e.stats;
+        int current = s.maxFrames;
+        if (s.fixed) {
+            budget -= static_cast<double>(s.frameBytes) * current;
+            e.target = current;
+        } else if (s.requests == 0) {
+            // unused since the last time, release the frames
+            e.target = std::max(current / 2, 1);
+            e.clear = true;
+            keptBytes += static_cast<double>(s.frameBytes) * e.target;
+        } else if (s.hits == 0 && s.nearMiss == 0) {
+            // probably a linear scan, no reason to waste space here
+            e.target = std::max(current / 2, 1);
+            keptBytes += static_cast<double>(s.frameBytes) * e.target;
+        } else if (s.nearMissRate < 0.01) {
+            // the frames beyond the current size wouldn't be used so it's big enough
+            e.target = current;
+            keptBytes += static_cast<double>(s.frameBytes) * e.target;
         } else {
-            switch (recommendSize()) {
-            case VSCache::caClear:
-                clear();
-                setMaxFrames(std::max(getMaxFrames() - 2, 1));
-                break;
-            case VSCache::caShrink:
-                if (getMaxFrames() <= 2)
-                    clear();
-                setMaxFrames(std::max(getMaxFrames() - 2, 1));
-                break;
-            case VSCache::caNoChange:
-                if (getMaxFrames() <= 1)
-                    clear();
-                setMaxFrames(std::max(getMaxFrames() - 1, 1));
-                break;
-            default:;
-            }
+            // a cost of 0 only means it was too fast to measure, it still saves some work
+            e.weight = (s.cost + 1000.0) * s.nearMissRate * current / std::max<size_t>(s.frameBytes, 1);
+            weightedBytes += e.weight * s.frameBytes;
         }
     }
+
+    // scale the caches that aren't growing down evenly when they don't fit, otherwise the rest goes to the growing ones
+    double scale = 1;
+    if (keptBytes > budget) {
+        scale = std::max(budget, 0.0) / keptBytes;
+        budget = 0;
+    } else {
+        budget -= keptBytes;
+    }
+
+    for (auto &e : entries) {
+        if (e.stats.fixed)
+            continue;
+        int current = e.stats.maxFrames;
+        int target;
+        if (e.weight > 0)
+            target = static_cast<int>(e.weight * budget / weightedBytes);
+        else
+            target = static_cast<int>(e.target * scale);
+
+        // limit how fast a cache can change so it doesn't oscillate, unless memory is needed right away
+        if (!needMemory)
+            target = std::max(target, current / 2);
+        target = std::min(target, std::max(current * 2, current + 2));
+        target = std::max(target, 1);
+
+        if (target != current || e.clear)
+            e.node->setCacheSize(target, e.clear);
+    }
 }
 
 static void VS_CC cacheInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
@@ -194,16 +271,21 @@ static const VSFrameRef *VS_CC cacheGetframe(int n, int activationReason, void *
         c->lastN = n;
         return nullptr;
     } else if (activationReason == arAllFramesReady) {
+        // the cost of everything requested is known at this point, split it evenly when several frames were requested
+        int64_t cost = frameCtx->ctx->cost;
+        if (*fd >= -1)
+            cost /= (n - *fd);
+
         if (*fd >= -1) {
             for (intptr_t i = *fd + 1; i < n; i++) {
                 const VSFrameRef *r = vsapi->getFrameFilter((int)i, c->clip, frameCtx);
-                c->cache.insert((int)i, r->frame);
+                c->cache.insert((int)i, r->frame, cost);
                 vsapi->freeFrame(r);
             }
         }
 
         const VSFrameRef *r = vsapi->getFrameFilter(n, c->clip, frameCtx);
-        c->cache.insert(n, r->frame);
+        c->cache.insert(n, r->frame, cost);
         return r;
     }
 
@@ -223,6 +305,12 @@ static void VS_CC createCacheFilter(const VSMap *in, VSMap *out, void *userData,
     VSNodeRef *video = vsapi->propGetNode(in, "clip", 0, nullptr);
     int err;
     bool fixed = !!vsapi->propGetInt(in, "fixed", 0, &err);
+    bool spill = !!vsapi->propGetInt(in, "spill", 0, &err);
+    if (spill && !core->spillStore) {
+        vsapi->freeNode(video);
+        vsapi->setError(out, "Cache: spilling requires a spill cache to be set up with SetCacheSpill first");
+        return;
+    }
     CacheInstance *c = new CacheInstance(video, core, fixed);
     VSCoreInfo ci;
     vsapi->getCoreInfo2(core, &ci);
@@ -241,11 +329,36 @@ static void VS_CC createCacheFilter(const VSMap *in, VSMap *out, void *userData,
     else
         c->cache.setMaxFrames(20 + c->numThreads);
 
+    if (spill)
+        c->cache.setSpillStore(core->spillStore, core);
+
     vsapi->createFilter(in, out, ("Cache" + std::to_string(cacheId++)).c_str(), cacheInit, cacheGetframe, cacheFree, c->makeLinear ? fmUnorderedLinear : fmUnordered, nfNoCache | nfIsCache, c, core);
 
     c->addCache();
 }
 
+static void VS_CC setCacheSpill(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    const char *path = vsapi->propGetData(in, "path", 0, nullptr);
+    int64_t size = vsapi->propGetInt(in, "size", 0, nullptr);
+
+    if (size <= 0) {
+        vsapi->setError(out, "SetCacheSpill: size must be a positive number");
+        return;
+    }
+
+    try {
+        VSSpillStore *store = new VSSpillStore(path, static_cast<size_t>(size) * 1024 * 1024);
+        VSSpillStore *expected = nullptr;
+        if (!core->spillStore.compare_exchange_strong(expected, store)) {
+            delete store;
+            vsapi->setError(out, "SetCacheSpill: the spill cache can only be set up once");
+        }
+    } catch (VSException &e) {
+        vsapi->setError(out, (std::string("SetCacheSpill: ") + e.what()).c_str());
+    }
+}
+
 void VS_CC cacheInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
-    registerFunc("Cache", "clip:clip;size:int:opt;fixed:int:opt;make_linear:int:opt;", createCacheFilter, nullptr, plugin);
+    registerFunc("Cache", "clip:clip;size:int:opt;fixed:int:opt;make_linear:int:opt;spill:int:opt;", createCacheFilter, nullptr, plugin);
+    registerFunc("SetCacheSpill", "path:data;size:int;", setCacheSpill, nullptr, plugin);
 }
@@ -22,23 +22,39 @@
 #define CACHEFILTER_H
 
 #include "vscore.h"
+#include "spillcache.h"
 #include <unordered_map>
 #include <cassert>
 
+// what a cache did since the last time the sizes were balanced, the rates are smoothed over several periods
+struct VSCacheStats {
+    bool fixed;
+    int maxFrames;
+    int frames; // the number of frames currently held
+    size_t frameBytes; // the size of the most recently inserted frame
+    int requests;
+    int hits;
+    int nearMiss;
+    double nearMissRate; // near misses per history slot, an estimate of the hits gained by each extra frame
+    double cost; // nanoseconds needed to produce a frame
+};
+
 class VSCache {
 private:
     struct Node {
         inline Node() : key(-1) {}
-        inline Node(int key, const PVideoFrame &frame) : key(key), frame(frame), weakFrame(frame), prevNode(0), nextNode(0) {}
+        inline Node(int key, const PVideoFrame &frame, int64_t cost, double priority) : key(key), frame(frame), weakFrame(frame), prevNode(0), nextNode(0), cost(cost), priority(priority) {}
         int key;
         PVideoFrame frame;
         WVideoFrame weakFrame;
         Node *prevNode;
         Node *nextNode;
+        int64_t cost;
+        double priority;
     };
 
+    // all frames ordered by last access, the ones only referenced by weakFrame make up the history
     Node *first;
-    Node *weakpoint;
     Node *last;
 
     std::unordered_map<int, Node> hash;
@@ -53,11 +69,28 @@ private:
     int hits;
     int nearMiss;
     int farMiss;
+    // never reset by the size balancing, unlike above a near miss isn't also counted as a hit
+    int64_t totalHits;
+    int64_t totalNearMiss;
+    int64_t totalFarMiss;
+    int64_t insertedCost;
+    int inserts;
+    size_t frameBytes;
+
+    double nearMissRate;
+    double averageCost;
+
+    // the priority of the last evicted frame, everything inserted or used later is ranked relative to it
+    double inflation;
+
+    // frames moved out of memory are written here when spilling is enabled
+    VSSpillStore *spill;
+    VSCore *core;
 
-    inline void unlink(Node &n) {
-        if (&n == weakpoint)
-            weakpoint = weakpoint->nextNode;
+    static size_t getFrameBytes(const PVideoFrame &frame);
+    static double getValue(const PVideoFrame &frame, int64_t cost);
 
+    inline void unlink(Node &n) {
         if (n.prevNode)
             n.prevNode->nextNode = n.nextNode;
 
@@ -83,6 +116,7 @@ private:
 
         if (i == hash.end()) {
             farMiss++;
+            totalFarMiss++;
             return PVideoFrame();
         }
 
@@ -90,6 +124,7 @@ private:
 
         if (!n.frame) {
             nearMiss++;
+            totalNearMiss++;
             try {
                 n.frame = PVideoFrame(n.weakFrame);
             } catch (std::bad_weak_ptr &) {
@@ -98,13 +133,11 @@ private:
 
             currentSize++;
             historySize--;
+        } else {
+            totalHits++;
         }
 
         hits++;
-        Node *origWeakPoint = weakpoint;
-
-        if (&n == origWeakPoint)
-            weakpoint = weakpoint->nextNode;
 
         if (first != &n) {
             if (n.prevNode)
@@ -122,32 +155,21 @@ private:
             first = &n;
         }
 
-        if (!weakpoint) {
-            if (currentSize > maxSize) {
-                weakpoint = last;
-                weakpoint->frame.reset();
-            }
-        } else if (&n == origWeakPoint || historySize > maxHistorySize) {
-            weakpoint = weakpoint->prevNode;
-            weakpoint->frame.reset();
-        }
-
-        assert(historySize <= maxHistorySize);
+        n.priority = inflation + getValue(n.frame, n.cost);
 
-        return n.frame;
+        PVideoFrame frame = n.frame;
+        trim(maxSize, maxHistorySize);
+        return frame;
     }
 
 public:
-    enum CacheAction {
-        caGrow,
-        caNoChange,
-        caShrink,
-        caClear
-    };
+    static const int minHistory = 20;
 
     VSCache(int maxSize, int maxHistorySize, bool fixedSize);
     ~VSCache() {
         clear();
+        if (spill)
+            spill->removeAll(this);
     }
 
     inline int getMaxFrames() const {
@@ -173,9 +195,9 @@ public:
         hash.clear();
         first = nullptr;
         last = nullptr;
-        weakpoint = nullptr;
         currentSize = 0;
         historySize = 0;
+        inflation = 0;
         clearStats();
     }
 
@@ -183,9 +205,11 @@ public:
         hits = 0;
         nearMiss = 0;
         farMiss = 0;
+        insertedCost = 0;
+        inserts = 0;
     }
 
-    bool insert(const int key, const PVideoFrame &object);
+    bool insert(const int key, const PVideoFrame &object, int64_t cost = 0);
     PVideoFrame object(const int key);
     inline bool contains(const int key) const {
         return hash.count(key) > 0;
@@ -194,11 +218,23 @@ public:
 
     bool remove(const int key);
 
+    void collectStats(VSCacheStats &stats);
 
+    inline void getTotals(int64_t &totalHits, int64_t &totalNearMiss, int64_t &totalFarMiss) const {
+        totalHits = this->totalHits;
+        totalNearMiss = this->totalNearMiss;
+        totalFarMiss = this->totalFarMiss;
+    }
+    inline void clearTotals() {
+        totalHits = 0;
+        totalNearMiss = 0;
+        totalFarMiss = 0;
+    }
 
-    CacheAction recommendSize();
-
-    void adjustSize(bool needMemory);
+    inline void setSpillStore(VSSpillStore *store, VSCore *c) {
+        spill = store;
+        core = c;
+    }
 private:
     void trim(int max, int maxHistory);
 
@@ -227,6 +263,9 @@ public:
     }
 };
 
+// splits the memory limit between all caches, must be called with the core's cacheLock held
+void balanceCaches(const std::set<VSNode *> &caches, MemoryUse *memory, bool needMemory);
+
 void VS_CC cacheInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin);
 
 #endif // CACHEFILTER_H
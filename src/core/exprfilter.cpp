@@ -20,11 +20,13 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstdlib>
 #include <functional>
 #include <iostream>
 #include <locale>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
 #include <stdexcept>
@@ -36,6 +38,7 @@
 #include "VSHelper.h"
 #include "cpufeatures.h"
 #include "internalfilters.h"
+#include "vscore.h"
 #include "vslog.h"
 #include "kernel/cpulevel.h"
 
@@ -51,6 +54,7 @@
 namespace {
 
 #define MAX_EXPR_INPUTS 26
+#define MAX_EXPR_SLOTS 64
 
 enum class ExprOpType {
     // Terminals.
@@ -123,6 +127,14 @@ struct ExprOp {
 bool operator==(const ExprOp &lhs, const ExprOp &rhs) { return lhs.type == rhs.type && lhs.imm.u == rhs.imm.u; }
 bool operator!=(const ExprOp &lhs, const ExprOp &rhs) { return !(lhs == rhs); }
 
+// a load's immediate holds the input, the offset of the sample it reads and the edge handling,
+// once the rows are assigned the input is replaced by the slot of the row and only the horizontal offset remains
+uint32_t packLoad(int index, int dx, int dy, bool mirror) { return index | static_cast<uint8_t>(dx) << 8 | static_cast<uint8_t>(dy) << 16 | (mirror ? 1U : 0U) << 24; }
+int loadIndex(const ExprOp &op) { return op.imm.u & 0xFF; }
+int loadDx(const ExprOp &op) { return static_cast<int8_t>((op.imm.u >> 8) & 0xFF); }
+int loadDy(const ExprOp &op) { return static_cast<int8_t>((op.imm.u >> 16) & 0xFF); }
+bool loadMirror(const ExprOp &op) { return !!(op.imm.u >> 24); }
+
 struct ExprInstruction {
     ExprOp op;
     int dst;
@@ -137,30 +149,136 @@ enum PlaneOp {
     poProcess, poCopy, poUndefined
 };
 
-struct ExprData {
-    VSNodeRef *node[MAX_EXPR_INPUTS];
-    VSVideoInfo vi;
+// a row read by the loads, the first numInputs slots are the inputs at the current row and the
+// rows of the inputs above and below it or with another edge handling get slots of their own
+struct ExprSlot {
+    int input;
+    int dy;
+    bool mirror;
+    // bytes of extended edge on both sides, rows read with horizontal offsets are copied into a buffer first
+    int padding;
+    int bytesPerSample;
+};
+
+// the compiled code of a plane, every Expr on a core with the same bytecode uses the same kernel
+struct ExprKernel {
+    typedef void (*ProcessLineProc)(void *rwptrs, intptr_t ptroff[MAX_EXPR_SLOTS + 1], intptr_t niter);
+    ProcessLineProc proc;
+    size_t size;
+    // the cache entry, removed again together with the kernel
+    const VSCore *core;
+    std::string key;
+
+    ExprKernel(ProcessLineProc proc, size_t size) : proc(proc), size(size), core() {}
+    ~ExprKernel();
+};
+
+// the compiled expressions of a single Expr, shared with the filters it gets fused into
+struct ExprProgram {
     std::vector<ExprInstruction> bytecode[3];
     int plane[3];
     int numInputs;
-    typedef void (*ProcessLineProc)(void *rwptrs, intptr_t ptroff[MAX_EXPR_INPUTS + 1], intptr_t niter);
-    ProcessLineProc proc[3];
+    std::vector<ExprSlot> slots;
+    // sample sizes in bits of the output followed by the slots, used by the compiled code to advance its pointers
+    intptr_t ptroffsets[((MAX_EXPR_SLOTS + 1) + 7) & ~7];
+    std::shared_ptr<const ExprKernel> kernel[3];
+
+    ExprProgram() : plane(), numInputs(), ptroffsets() {}
+};
 
-    ExprData() : node(), vi(), plane(), numInputs(), proc() {}
+static std::mutex exprKernelsLock;
+static std::map<std::pair<const VSCore *, std::string>, std::weak_ptr<const ExprKernel>> exprKernels;
 
-    ~ExprData() {
+ExprKernel::~ExprKernel() {
+    if (core) {
+        std::lock_guard<std::mutex> lock(exprKernelsLock);
+        // the same code may have been compiled again in the meantime
+        auto iter = exprKernels.find(std::make_pair(core, key));
+        if (iter != exprKernels.end() && iter->second.expired())
+            exprKernels.erase(iter);
+    }
 #ifdef VS_TARGET_CPU_X86
-        for (int i = 0; i < 3; i++) {
-            if (proc[i]) {
 #ifdef VS_TARGET_OS_WINDOWS
-                VirtualFree((LPVOID)proc[i], 0, MEM_RELEASE);
+    VirtualFree((LPVOID)proc, 0, MEM_RELEASE);
 #else
-                munmap((void *)proc[i], 0);
+    munmap((void *)proc, size);
 #endif
-            }
-        }
 #endif
+}
+
+// identifies the compiled code of a plane, the loads and stores already carry the formats of the inputs and output
+static std::string exprKernelKey(const std::vector<ExprInstruction> &bytecode, int numSlots, int cpulevel) {
+    std::string key;
+    auto append = [&key](int32_t value) { key.append(reinterpret_cast<const char *>(&value), sizeof(value)); };
+    append(cpulevel);
+    append(numSlots);
+    for (const ExprInstruction &insn : bytecode) {
+        append(static_cast<int32_t>(insn.op.type));
+        append(insn.op.imm.i);
+        append(insn.dst);
+        append(insn.src1);
+        append(insn.src2);
+        append(insn.src3);
+    }
+    return key;
+}
+
+// returns the kernel another Expr already compiled for the key or compiles it, the lock isn't held while
+// compiling so two filters may both compile the same code and the later one then uses the earlier one's
+template <typename Compile>
+static std::shared_ptr<const ExprKernel> getExprKernel(const VSCore *core, const std::string &key, Compile compile, bool &found) {
+    auto cacheKey = std::make_pair(core, key);
+    {
+        std::lock_guard<std::mutex> lock(exprKernelsLock);
+        auto iter = exprKernels.find(cacheKey);
+        std::shared_ptr<const ExprKernel> kernel;
+        if (iter != exprKernels.end())
+            kernel = iter->second.lock();
+        found = !!kernel;
+        if (found)
+            return kernel;
     }
+
+    std::shared_ptr<ExprKernel> compiled(compile());
+    if (!compiled)
+        return nullptr;
+    compiled->core = core;
+    compiled->key = key;
+
+    std::shared_ptr<const ExprKernel> existing;
+    {
+        std::lock_guard<std::mutex> lock(exprKernelsLock);
+        std::weak_ptr<const ExprKernel> &entry = exprKernels[cacheKey];
+        existing = entry.lock();
+        if (!existing)
+            entry = compiled;
+    }
+    // the unused copy is freed here since it erases its own entry
+    return existing ? existing : compiled;
+}
+
+// an input of a stage is either one of the clips of the filter (>= 0) or the output of an earlier stage (~stage)
+struct ExprStage {
+    std::shared_ptr<const ExprProgram> program;
+    int input[MAX_EXPR_INPUTS];
+};
+
+// the Expr filters whose input is another Expr take over its stages and run them row by row so the
+// intermediate frames never have to be created, the last stage is the one producing the output
+static const size_t maxFusedStages = 16;
+
+struct ExprData {
+    std::vector<VSNodeRef *> node;
+    VSVideoInfo vi;
+    std::vector<ExprStage> stages;
+    // the clip the frame properties come from, the first input of the first unfused Expr
+    int propSource;
+    VSNode *self;
+    // planes whose compiled code was already there or had to be compiled
+    int codeCacheHits;
+    int codeCacheMisses;
+
+    ExprData() : vi(), propSource(), self(), codeCacheHits(), codeCacheMisses() {}
 };
 
 #ifdef VS_TARGET_CPU_X86
@@ -229,7 +347,7 @@ public:
         }
     }
 
-    virtual ExprData::ProcessLineProc getCode() = 0;
+    virtual ExprKernel *getCode() = 0;
 };
 
 class ExprCompiler128 : public ExprCompiler, private jitasm::function<void, ExprCompiler128, uint8_t *, const intptr_t *, intptr_t> {
@@ -390,8 +508,8 @@ do { \
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            VEX1(movq, t1.first, mmword_ptr[a]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            VEX1(movq, t1.first, mmword_ptr[a + loadDx(insn.op)]);
             VEX2(punpcklbw, t1.first, t1.first, zero);
             VEX2(punpckhwd, t1.second, t1.first, zero);
             VEX2(punpcklwd, t1.first, t1.first, zero);
@@ -406,8 +524,13 @@ do { \
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            VEX1(movdqa, t1.first, xmmword_ptr[a]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            // only the samples at the current position are aligned
+            int offset = loadDx(insn.op) * 2;
+            if (offset)
+                VEX1(movdqu, t1.first, xmmword_ptr[a + offset]);
+            else
+                VEX1(movdqa, t1.first, xmmword_ptr[a]);
             VEX2(punpckhwd, t1.second, t1.first, zero);
             VEX2(punpcklwd, t1.first, t1.first, zero);
             VEX1(cvtdq2ps, t1.first, t1.first);
@@ -421,9 +544,10 @@ do { \
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            vcvtph2ps(t1.first, qword_ptr[a]);
-            vcvtph2ps(t1.second, qword_ptr[a + 8]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            int offset = loadDx(insn.op) * 2;
+            vcvtph2ps(t1.first, qword_ptr[a + offset]);
+            vcvtph2ps(t1.second, qword_ptr[a + offset + 8]);
         });
     }
 
@@ -433,9 +557,15 @@ do { \
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            VEX1(movdqa, t1.first, xmmword_ptr[a]);
-            VEX1(movdqa, t1.second, xmmword_ptr[a + 16]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            int offset = loadDx(insn.op) * 4;
+            if (offset) {
+                VEX1(movdqu, t1.first, xmmword_ptr[a + offset]);
+                VEX1(movdqu, t1.second, xmmword_ptr[a + offset + 16]);
+            } else {
+                VEX1(movdqa, t1.first, xmmword_ptr[a]);
+                VEX1(movdqa, t1.second, xmmword_ptr[a + 16]);
+            }
         });
     }
 
@@ -1014,7 +1144,7 @@ do { \
 public:
     explicit ExprCompiler128(int numInputs) : cpuFeatures(*getCPUFeatures()), numInputs(numInputs), curLabel() {}
 
-    ExprData::ProcessLineProc getCode() override
+    ExprKernel *getCode() override
     {
         if (jit::GetCode() && GetCodeSize()) {
 #ifdef VS_TARGET_OS_WINDOWS
@@ -1023,7 +1153,7 @@ public:
             void *ptr = mmap(nullptr, GetCodeSize(), PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, 0, 0);
 #endif
             memcpy(ptr, jit::GetCode(), GetCodeSize());
-            return reinterpret_cast<ExprData::ProcessLineProc>(ptr);
+            return new ExprKernel(reinterpret_cast<ExprKernel::ProcessLineProc>(ptr), GetCodeSize());
         }
         return nullptr;
     }
@@ -1144,8 +1274,8 @@ class ExprCompiler256 : public ExprCompiler, private jitasm::function<void, Expr
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            vpmovzxbd(t1, mmword_ptr[a]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            vpmovzxbd(t1, mmword_ptr[a + loadDx(insn.op)]);
             vcvtdq2ps(t1, t1);
         });
     }
@@ -1156,8 +1286,8 @@ class ExprCompiler256 : public ExprCompiler, private jitasm::function<void, Expr
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            vpmovzxwd(t1, xmmword_ptr[a]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            vpmovzxwd(t1, xmmword_ptr[a + loadDx(insn.op) * 2]);
             vcvtdq2ps(t1, t1);
         });
     }
@@ -1168,8 +1298,8 @@ class ExprCompiler256 : public ExprCompiler, private jitasm::function<void, Expr
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            vcvtph2ps(t1, xmmword_ptr[a]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            vcvtph2ps(t1, xmmword_ptr[a + loadDx(insn.op) * 2]);
         });
     }
 
@@ -1179,8 +1309,11 @@ class ExprCompiler256 : public ExprCompiler, private jitasm::function<void, Expr
         {
             auto t1 = bytecodeRegs[insn.dst];
             Reg a;
-            mov(a, ptr[regptrs + sizeof(void *) * (insn.op.imm.u + 1)]);
-            vmovaps(t1, ymmword_ptr[a]);
+            mov(a, ptr[regptrs + sizeof(void *) * (loadIndex(insn.op) + 1)]);
+            if (loadDx(insn.op))
+                vmovups(t1, ymmword_ptr[a + loadDx(insn.op) * 4]);
+            else
+                vmovaps(t1, ymmword_ptr[a]);
         });
     }
 
@@ -1606,7 +1739,7 @@ do { \
 public:
     explicit ExprCompiler256(int numInputs) : cpuFeatures(*getCPUFeatures()), numInputs(numInputs) {}
 
-    ExprData::ProcessLineProc getCode() override
+    ExprKernel *getCode() override
     {
         if (jit::GetCode(true) && GetCodeSize()) {
 #ifdef VS_TARGET_OS_WINDOWS
@@ -1615,7 +1748,7 @@ public:
             void *ptr = mmap(nullptr, GetCodeSize(), PROT_READ | PROT_WRITE | PROT_EXEC, MAP_ANON | MAP_PRIVATE, 0, 0);
 #endif
             memcpy(ptr, jit::GetCode(true), GetCodeSize());
-            return reinterpret_cast<ExprData::ProcessLineProc>(ptr);
+            return new ExprKernel(reinterpret_cast<ExprKernel::ProcessLineProc>(ptr), GetCodeSize());
         }
         return nullptr;
     }
@@ -1633,92 +1766,123 @@ std::unique_ptr<ExprCompiler> make_compiler(int numInputs, int cpulevel)
 }
 #endif
 
+// evaluates every instruction for a block of samples before moving on to the next one so the dispatch
+// only happens once per block and the loops over the block can be vectorised by the compiler
 class ExprInterpreter {
+    static constexpr int blockSize = 64;
+
     const ExprInstruction *bytecode;
     size_t numInsns;
+    // blockSize values for every register
     std::vector<float> registers;
 
+    static float bool2float(bool x) { return x ? 1.0f : 0.0f; }
+    static bool float2bool(float x) { return x > 0.0f; }
+
+    float *reg(int r) { return r >= 0 ? registers.data() + static_cast<size_t>(r) * blockSize : nullptr; }
+
     template <class T>
-    static T clamp_int(float x, int depth = std::numeric_limits<T>::digits)
+    static void load(float *dst, const uint8_t *srcp, int x, int n)
     {
-        float maxval = static_cast<float>((1U << depth) - 1);
-        return static_cast<T>(std::lrint(std::min(std::max(x, static_cast<float>(std::numeric_limits<T>::min())), maxval)));
+        const T *src = reinterpret_cast<const T *>(srcp) + x;
+        for (int i = 0; i < n; i++)
+            dst[i] = src[i];
     }
 
-    static float bool2float(bool x) { return x ? 1.0f : 0.0f; }
-    static bool float2bool(float x) { return x > 0.0f; }
-public:
-    ExprInterpreter(const ExprInstruction *bytecode, size_t numInsns) : bytecode(bytecode), numInsns(numInsns)
+    // adding 2^23 rounds to the nearest even integer like lrint() does in the clamped range but without
+    // a library call so the loop can be vectorised, NaN becomes 0 just like in the compiled code
+    template <class T>
+    static void storeInt(uint8_t *dstp, const float *src, int x, int n, int depth)
     {
-        int maxreg = 0;
-        for (size_t i = 0; i < numInsns; ++i) {
-            maxreg = std::max(maxreg, bytecode[i].dst);
+        T *dst = reinterpret_cast<T *>(dstp) + x;
+        float maxval = static_cast<float>((1U << depth) - 1);
+        for (int i = 0; i < n; i++) {
+            float v = std::min(src[i] > 0.0f ? src[i] : 0.0f, maxval);
+            dst[i] = static_cast<T>(static_cast<int>((v + 8388608.0f) - 8388608.0f));
         }
-        registers.resize(maxreg + 1);
     }
 
-    void eval(const uint8_t * const *srcp, uint8_t *dstp, int x)
+    // the registers past n hold what the previous block left there, all operations but the loads and
+    // stores are done on whole blocks anyway so the loops have a constant trip count
+    void evalBlock(const uint8_t * const *srcp, uint8_t *dstp, int x, int n)
     {
         for (size_t i = 0; i < numInsns; ++i) {
             const ExprInstruction &insn = bytecode[i];
-
-#define SRC1 registers[insn.src1]
-#define SRC2 registers[insn.src2]
-#define SRC3 registers[insn.src3]
-#define DST registers[insn.dst]
+            float *dst = reg(insn.dst);
+            const float *src1 = reg(insn.src1);
+            const float *src2 = reg(insn.src2);
+            const float *src3 = reg(insn.src3);
+
+#define UNARY(expr) for (int j = 0; j < blockSize; j++) { float a = src1[j]; dst[j] = (expr); } break
+#define BINARY(expr) for (int j = 0; j < blockSize; j++) { float a = src1[j], b = src2[j]; dst[j] = (expr); } break
+#define TERNARY(expr) for (int j = 0; j < blockSize; j++) { float a = src1[j], b = src2[j], c = src3[j]; dst[j] = (expr); } break
             switch (insn.op.type) {
-            case ExprOpType::MEM_LOAD_U8: DST = reinterpret_cast<const uint8_t *>(srcp[insn.op.imm.u])[x]; break;
-            case ExprOpType::MEM_LOAD_U16: DST = reinterpret_cast<const uint16_t *>(srcp[insn.op.imm.u])[x]; break;
-            case ExprOpType::MEM_LOAD_F16: DST = 0; break;
-            case ExprOpType::MEM_LOAD_F32: DST = reinterpret_cast<const float *>(srcp[insn.op.imm.u])[x]; break;
-            case ExprOpType::CONSTANT: DST = insn.op.imm.f; break;
-            case ExprOpType::ADD: DST = SRC1 + SRC2; break;
-            case ExprOpType::SUB: DST = SRC1 - SRC2; break;
-            case ExprOpType::MUL: DST = SRC1 * SRC2; break;
-            case ExprOpType::DIV: DST = SRC1 / SRC2; break;
+            case ExprOpType::MEM_LOAD_U8: load<uint8_t>(dst, srcp[loadIndex(insn.op)], x + loadDx(insn.op), n); break;
+            case ExprOpType::MEM_LOAD_U16: load<uint16_t>(dst, srcp[loadIndex(insn.op)], x + loadDx(insn.op), n); break;
+            case ExprOpType::MEM_LOAD_F16: std::fill_n(dst, blockSize, 0.0f); break;
+            case ExprOpType::MEM_LOAD_F32: load<float>(dst, srcp[loadIndex(insn.op)], x + loadDx(insn.op), n); break;
+            case ExprOpType::CONSTANT: std::fill_n(dst, blockSize, insn.op.imm.f); break;
+            case ExprOpType::ADD: BINARY(a + b);
+            case ExprOpType::SUB: BINARY(a - b);
+            case ExprOpType::MUL: BINARY(a * b);
+            case ExprOpType::DIV: BINARY(a / b);
             case ExprOpType::FMA:
                 switch (static_cast<FMAType>(insn.op.imm.u)) {
-                case FMAType::FMADD: DST = SRC2 * SRC3 + SRC1; break;
-                case FMAType::FMSUB: DST = SRC2 * SRC3 - SRC1; break;
-                case FMAType::FNMADD: DST = -(SRC2 * SRC3) + SRC1; break;
-                case FMAType::FNMSUB: DST = -(SRC2 * SRC3) - SRC1; break;
+                case FMAType::FMADD: TERNARY(b * c + a);
+                case FMAType::FMSUB: TERNARY(b * c - a);
+                case FMAType::FNMADD: TERNARY(-(b * c) + a);
+                case FMAType::FNMSUB: TERNARY(-(b * c) - a);
                 };
                 break;
-            case ExprOpType::MAX: DST = std::max(SRC1, SRC2); break;
-            case ExprOpType::MIN: DST = std::min(SRC1, SRC2); break;
-            case ExprOpType::EXP: DST = std::exp(SRC1); break;
-            case ExprOpType::LOG: DST = std::log(SRC1); break;
-            case ExprOpType::POW: DST = std::pow(SRC1, SRC2); break;
-            case ExprOpType::SQRT: DST = std::sqrt(SRC1); break;
-            case ExprOpType::ABS: DST = std::fabs(SRC1); break;
-            case ExprOpType::NEG: DST = -SRC1; break;
+            case ExprOpType::MAX: BINARY(std::max(a, b));
+            case ExprOpType::MIN: BINARY(std::min(a, b));
+            case ExprOpType::EXP: UNARY(std::exp(a));
+            case ExprOpType::LOG: UNARY(std::log(a));
+            case ExprOpType::POW: BINARY(std::pow(a, b));
+            case ExprOpType::SQRT: UNARY(std::sqrt(a));
+            case ExprOpType::ABS: UNARY(std::fabs(a));
+            case ExprOpType::NEG: UNARY(-a);
             case ExprOpType::CMP:
                 switch (static_cast<ComparisonType>(insn.op.imm.u)) {
-                case ComparisonType::EQ: DST = bool2float(SRC1 == SRC2); break;
-                case ComparisonType::LT: DST = bool2float(SRC1 < SRC2); break;
-                case ComparisonType::LE: DST = bool2float(SRC1 <= SRC2); break;
-                case ComparisonType::NEQ: DST = bool2float(SRC1 != SRC2); break;
-                case ComparisonType::NLT: DST = bool2float(SRC1 >= SRC2); break;
-                case ComparisonType::NLE: DST = bool2float(SRC1 > SRC2); break;
+                case ComparisonType::EQ: BINARY(bool2float(a == b));
+                case ComparisonType::LT: BINARY(bool2float(a < b));
+                case ComparisonType::LE: BINARY(bool2float(a <= b));
+                case ComparisonType::NEQ: BINARY(bool2float(a != b));
+                case ComparisonType::NLT: BINARY(bool2float(a >= b));
+                case ComparisonType::NLE: BINARY(bool2float(a > b));
                 }
                 break;
-            case ExprOpType::TERNARY: DST = float2bool(SRC1) ? SRC2 : SRC3; break;
-            case ExprOpType::AND: DST = bool2float((float2bool(SRC1) && float2bool(SRC2))); break;
-            case ExprOpType::OR:  DST = bool2float((float2bool(SRC1) || float2bool(SRC2))); break;
-            case ExprOpType::XOR: DST = bool2float((float2bool(SRC1) != float2bool(SRC2))); break;
-            case ExprOpType::NOT: DST = bool2float(!float2bool(SRC1)); break;
-            case ExprOpType::MEM_STORE_U8:  reinterpret_cast<uint8_t *>(dstp)[x] = clamp_int<uint8_t>(SRC1); return;
-            case ExprOpType::MEM_STORE_U16: reinterpret_cast<uint16_t *>(dstp)[x] = clamp_int<uint16_t>(SRC1, insn.op.imm.u); return;
-            case ExprOpType::MEM_STORE_F16: reinterpret_cast<uint16_t *>(dstp)[x] = 0; return;
-            case ExprOpType::MEM_STORE_F32: reinterpret_cast<float *>(dstp)[x] = SRC1; return;
+            case ExprOpType::TERNARY: TERNARY(float2bool(a) ? b : c);
+            case ExprOpType::AND: BINARY(bool2float(float2bool(a) && float2bool(b)));
+            case ExprOpType::OR: BINARY(bool2float(float2bool(a) || float2bool(b)));
+            case ExprOpType::XOR: BINARY(bool2float(float2bool(a) != float2bool(b)));
+            case ExprOpType::NOT: UNARY(bool2float(!float2bool(a)));
+            case ExprOpType::MEM_STORE_U8: storeInt<uint8_t>(dstp, src1, x, n, 8); return;
+            case ExprOpType::MEM_STORE_U16: storeInt<uint16_t>(dstp, src1, x, n, insn.op.imm.u); return;
+            case ExprOpType::MEM_STORE_F16: std::fill_n(reinterpret_cast<uint16_t *>(dstp) + x, n, 0); return;
+            case ExprOpType::MEM_STORE_F32: std::copy_n(src1, n, reinterpret_cast<float *>(dstp) + x); return;
             default: vsFatal("illegal opcode"); return;
             }
-#undef DST
-#undef SRC3
-#undef SRC2
-#undef SRC1
+#undef TERNARY
+#undef BINARY
+#undef UNARY
         }
     }
+public:
+    ExprInterpreter(const ExprInstruction *bytecode, size_t numInsns) : bytecode(bytecode), numInsns(numInsns)
+    {
+        int maxreg = 0;
+        for (size_t i = 0; i < numInsns; ++i) {
+            maxreg = std::max(maxreg, bytecode[i].dst);
+        }
+        registers.resize(static_cast<size_t>(maxreg + 1) * blockSize);
+    }
+
+    void eval(const uint8_t * const *srcp, uint8_t *dstp, int width)
+    {
+        for (int x = 0; x < width; x += blockSize)
+            evalBlock(srcp, dstp, x, std::min(width - x, static_cast<int>(blockSize)));
+    }
 };
 
 struct ExpressionTreeNode {
@@ -1846,7 +2010,46 @@ std::vector<std::string> tokenize(const std::string &expr)
     return tokens;
 }
 
-ExprOp decodeToken(const std::string &token)
+// x[dx,dy] reads the sample dx columns to the right of and dy rows below the current one, outside the
+// frame the edge is either repeated or mirrored, a :c or :m suffix overrides the filter's default
+ExprOp decodeRelativeLoad(const std::string &token, bool mirror)
+{
+    int offset[2] = {};
+    size_t pos = 2;
+
+    for (int i = 0; i < 2; i++) {
+        size_t count = 0;
+
+        try {
+            offset[i] = std::stoi(token.substr(pos), &count);
+        } catch (...) {
+            throw std::runtime_error("illegal token: " + token);
+        }
+
+        pos += count;
+        if (pos >= token.size() || token[pos] != (i ? ']' : ','))
+            throw std::runtime_error("illegal token: " + token);
+        pos++;
+
+        if (offset[i] < -128 || offset[i] > 127)
+            throw std::runtime_error("pixel offset out of range: " + token);
+    }
+
+    std::string suffix = token.substr(pos);
+    if (suffix == ":m")
+        mirror = true;
+    else if (suffix == ":c")
+        mirror = false;
+    else if (!suffix.empty())
+        throw std::runtime_error("illegal token: " + token);
+
+    int index = token[0] >= 'x' ? token[0] - 'x' : token[0] - 'a' + 3;
+    if (!offset[0] && !offset[1])
+        mirror = false;
+    return{ ExprOpType::MEM_LOAD_U8, packLoad(index, offset[0], offset[1], mirror) };
+}
+
+ExprOp decodeToken(const std::string &token, bool mirror)
 {
     static const std::unordered_map<std::string, ExprOp> simple{
         { "+",    { ExprOpType::ADD } },
@@ -1879,6 +2082,8 @@ ExprOp decodeToken(const std::string &token)
         return it->second;
     } else if (token.size() == 1 && token[0] >= 'a' && token[0] <= 'z') {
         return{ ExprOpType::MEM_LOAD_U8, token[0] >= 'x' ? token[0] - 'x' : token[0] - 'a' + 3 };
+    } else if (token.size() > 1 && token[0] >= 'a' && token[0] <= 'z' && token[1] == '[') {
+        return decodeRelativeLoad(token, mirror);
     } else if (token.substr(0, 3) == "dup" || token.substr(0, 4) == "swap") {
         size_t prefix = token[0] == 'd' ? 3 : 4;
         size_t count = 0;
@@ -1906,7 +2111,7 @@ ExprOp decodeToken(const std::string &token)
     }
 }
 
-ExpressionTree parseExpr(const std::string &expr, const VSVideoInfo * const *vi, int numInputs)
+ExpressionTree parseExpr(const std::string &expr, const VSVideoInfo * const *vi, int numInputs, bool mirror)
 {
     constexpr unsigned char numOperands[] = {
         0, // MEM_LOAD_U8
@@ -1949,10 +2154,10 @@ ExpressionTree parseExpr(const std::string &expr, const VSVideoInfo * const *vi,
     std::vector<ExpressionTreeNode *> stack;
 
     for (const std::string &tok : tokens) {
-        ExprOp op = decodeToken(tok);
+        ExprOp op = decodeToken(tok, mirror);
 
         // Check validity.
-        if (op.type == ExprOpType::MEM_LOAD_U8 && op.imm.i >= numInputs)
+        if (op.type == ExprOpType::MEM_LOAD_U8 && loadIndex(op) >= numInputs)
             throw std::runtime_error("reference to undefined clip: " + tok);
         if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
             throw std::runtime_error("insufficient values on stack: " + tok);
@@ -1961,7 +2166,7 @@ ExpressionTree parseExpr(const std::string &expr, const VSVideoInfo * const *vi,
 
         // Rename load operations with the correct data type.
         if (op.type == ExprOpType::MEM_LOAD_U8) {
-            const VSFormat *format = vi[op.imm.i]->format;
+            const VSFormat *format = vi[loadIndex(op)]->format;
 
             if (format->sampleType == stInteger && format->bytesPerSample == 1)
                 op.type = ExprOpType::MEM_LOAD_U8;
@@ -3132,84 +3337,220 @@ std::vector<ExprInstruction> compile(ExpressionTree &tree, const VSFormat *forma
     return code;
 }
 
+// gives every row read by the loads of a plane a slot, the slots are shared by all planes of a program
+void assignSlots(ExprProgram &program, std::vector<ExprInstruction> &bytecode)
+{
+    for (ExprInstruction &insn : bytecode) {
+        if (insn.op.type != ExprOpType::MEM_LOAD_U8 && insn.op.type != ExprOpType::MEM_LOAD_U16 && insn.op.type != ExprOpType::MEM_LOAD_F16 && insn.op.type != ExprOpType::MEM_LOAD_F32)
+            continue;
+
+        int input = loadIndex(insn.op);
+        int dx = loadDx(insn.op);
+        int dy = loadDy(insn.op);
+        bool mirror = loadMirror(insn.op);
+        size_t slot = input;
+
+        if (dy || mirror) {
+            for (slot = program.numInputs; slot < program.slots.size(); slot++) {
+                if (program.slots[slot].input == input && program.slots[slot].dy == dy && program.slots[slot].mirror == mirror)
+                    break;
+            }
+            if (slot == program.slots.size()) {
+                if (slot == MAX_EXPR_SLOTS)
+                    throw std::runtime_error("too many different rows read, at most " + std::to_string(MAX_EXPR_SLOTS) + " are possible");
+                ExprSlot added = { input, dy, mirror, 0, program.slots[input].bytesPerSample };
+                program.slots.push_back(added);
+                program.ptroffsets[slot + 1] = added.bytesPerSample * 8;
+            }
+        }
+
+        // whole cache lines of padding keep the samples at the current position aligned
+        ExprSlot &target = program.slots[slot];
+        target.padding = std::max(target.padding, (std::abs(dx) * target.bytesPerSample + 63) & ~63);
+        insn.op.imm.u = packLoad(static_cast<int>(slot), dx, 0, false);
+    }
+}
+
+static std::mutex exprNodesLock;
+static std::unordered_map<const VSNode *, const ExprData *> exprNodes;
+
+// looks through caches since every Expr gets one when it's created from Python
+static const ExprData *findExpr(const VSNodeRef *ref) {
+    while (const VSNodeRef *source = ref->clip->getCacheSource())
+        ref = source;
+    std::lock_guard<std::mutex> lock(exprNodesLock);
+    auto iter = exprNodes.find(ref->clip.get());
+    return iter != exprNodes.end() ? iter->second : nullptr;
+}
+
 static void VS_CC exprInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(*instanceData);
     vsapi->setVideoInfo(&d->vi, 1, node);
+    d->self = node;
+    if (core->isProfiling())
+        node->addCodeCacheProfile(d->codeCacheHits, d->codeCacheMisses);
+    std::lock_guard<std::mutex> lock(exprNodesLock);
+    exprNodes[node] = d;
+}
+
+struct ExprRows {
+    const ExprData *d;
+    int plane;
+    const uint8_t * const *srcp;
+    const int *src_stride;
+    uint8_t *dstp;
+    int dst_stride;
+    int width;
+    int height;
+};
+
+static inline int edgeIndex(int i, int n, bool mirror) {
+    if (mirror) {
+        if (i < 0)
+            i = -i;
+        if (i >= n)
+            i = 2 * (n - 1) - i;
+    }
+    return std::min(std::max(i, 0), n - 1);
+}
+
+// copies a row and extends it on both sides, on the right as far as the compiled code reads
+template <typename T>
+static void extendRow(T *dst, const T *src, int w, int pad, bool mirror) {
+    memcpy(dst, src, w * sizeof(T));
+    for (int x = -pad; x < 0; x++)
+        dst[x] = src[edgeIndex(x, w, mirror)];
+    for (int x = w; x < (w + 7) / 8 * 8 + pad; x++)
+        dst[x] = src[edgeIndex(x, w, mirror)];
+}
+
+// evaluates rows [top, bottom) of a plane with all the stages, every band of rows gets its own row buffers
+static void VS_CC exprProcessRows(int top, int bottom, void *userData) {
+    const ExprRows &r = *static_cast<const ExprRows *>(userData);
+    const ExprData *d = r.d;
+    const VSFormat *fi = d->vi.format;
+    int plane = r.plane;
+    int w = r.width;
+
+    // one row for every stage but the last, with room for the compiled code to write a few samples past the end
+    size_t numStages = d->stages.size();
+    size_t rowSize = ((static_cast<size_t>(w) + 7) / 8 * 8 * sizeof(float) + 63) & ~static_cast<size_t>(63);
+    uint8_t *rowBuffer = numStages > 1 ? vs_aligned_malloc<uint8_t>(rowSize * (numStages - 1), 64) : nullptr;
+    std::vector<const uint8_t *> rows(numStages);
+
+    // and one for every slot read with horizontal offsets
+    std::vector<std::vector<size_t>> edgeOffset(numStages);
+    size_t edgeSize = 0;
+    for (size_t s = 0; s < numStages; s++) {
+        for (const ExprSlot &slot : d->stages[s].program->slots) {
+            edgeOffset[s].push_back(edgeSize + slot.padding);
+            if (slot.padding)
+                edgeSize += (static_cast<size_t>(w + 7) / 8 * 8 * slot.bytesPerSample + slot.padding * 2 + 63) & ~static_cast<size_t>(63);
+        }
+    }
+    uint8_t *edgeBuffer = edgeSize ? vs_aligned_malloc<uint8_t>(edgeSize, 64) : nullptr;
+
+    std::vector<std::unique_ptr<ExprInterpreter>> interpreters(numStages);
+    for (size_t s = 0; s < numStages; s++) {
+        const ExprProgram &program = *d->stages[s].program;
+        if (program.plane[plane] == poProcess && !program.kernel[plane])
+            interpreters[s].reset(new ExprInterpreter(program.bytecode[plane].data(), program.bytecode[plane].size()));
+    }
+
+    for (int y = top; y < bottom; y++) {
+        for (size_t s = 0; s < numStages; s++) {
+            const ExprStage &stage = d->stages[s];
+            const ExprProgram &program = *stage.program;
+            uint8_t *out = (s == numStages - 1) ? r.dstp + r.dst_stride * y : rowBuffer + rowSize * s;
+
+            if (program.plane[plane] == poCopy) {
+                const uint8_t *srcp = stage.input[0] >= 0 ? r.srcp[stage.input[0]] + r.src_stride[stage.input[0]] * y : rows[~stage.input[0]];
+                // only the last stage has to actually copy anything
+                if (s == numStages - 1)
+                    memcpy(out, srcp, w * fi->bytesPerSample);
+                else
+                    out = const_cast<uint8_t *>(srcp);
+            } else if (program.plane[plane] == poProcess) {
+                // the rows of earlier stages are only ever read at the current row, fusing is skipped otherwise
+                const uint8_t *stageSrcp[MAX_EXPR_SLOTS] = {};
+                for (size_t k = 0; k < program.slots.size(); k++) {
+                    const ExprSlot &slot = program.slots[k];
+                    int input = stage.input[slot.input];
+                    const uint8_t *row = input >= 0 ? r.srcp[input] + r.src_stride[input] * edgeIndex(y + slot.dy, r.height, slot.mirror) : rows[~input];
+
+                    if (slot.padding) {
+                        uint8_t *edgeRow = edgeBuffer + edgeOffset[s][k];
+                        int pad = slot.padding / slot.bytesPerSample;
+                        if (slot.bytesPerSample == 1)
+                            extendRow(edgeRow, row, w, pad, slot.mirror);
+                        else if (slot.bytesPerSample == 2)
+                            extendRow(reinterpret_cast<uint16_t *>(edgeRow), reinterpret_cast<const uint16_t *>(row), w, pad, slot.mirror);
+                        else
+                            extendRow(reinterpret_cast<float *>(edgeRow), reinterpret_cast<const float *>(row), w, pad, slot.mirror);
+                        row = edgeRow;
+                    }
+                    stageSrcp[k] = row;
+                }
+
+                if (program.kernel[plane]) {
+                    alignas(32) uint8_t *rwptrs[((MAX_EXPR_SLOTS + 1) + 7) & ~7] = { out };
+                    for (size_t k = 0; k < program.slots.size(); k++)
+                        rwptrs[k + 1] = const_cast<uint8_t *>(stageSrcp[k]);
+                    program.kernel[plane]->proc(rwptrs, const_cast<intptr_t *>(program.ptroffsets), (w + 7) / 8);
+                } else {
+                    interpreters[s]->eval(stageSrcp, out, w);
+                }
+            }
+            rows[s] = out;
+        }
+    }
+
+    vs_aligned_free(rowBuffer);
+    vs_aligned_free(edgeBuffer);
 }
 
 static const VSFrameRef *VS_CC exprGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(*instanceData);
-    int numInputs = d->numInputs;
+    size_t numInputs = d->node.size();
 
     if (activationReason == arInitial) {
-        for (int i = 0; i < numInputs; i++)
+        for (size_t i = 0; i < numInputs; i++)
             vsapi->requestFrameFilter(n, d->node[i], frameCtx);
     } else if (activationReason == arAllFramesReady) {
-        const VSFrameRef *src[MAX_EXPR_INPUTS] = {};
-        for (int i = 0; i < numInputs; i++)
+        std::vector<const VSFrameRef *> src(numInputs);
+        for (size_t i = 0; i < numInputs; i++)
             src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
 
+        const ExprStage &last = d->stages.back();
         const VSFormat *fi = d->vi.format;
         int height = vsapi->getFrameHeight(src[0], 0);
         int width = vsapi->getFrameWidth(src[0], 0);
         int planes[3] = { 0, 1, 2 };
-        const VSFrameRef *srcf[3] = { d->plane[0] != poCopy ? nullptr : src[0], d->plane[1] != poCopy ? nullptr : src[0], d->plane[2] != poCopy ? nullptr : src[0] };
-        VSFrameRef *dst = vsapi->newVideoFrame2(fi, width, height, srcf, planes, src[0], core);
+        const VSFrameRef *srcf[3] = {};
+        for (int plane = 0; plane < 3; plane++) {
+            if (last.program->plane[plane] == poCopy && last.input[0] >= 0)
+                srcf[plane] = src[last.input[0]];
+        }
+        VSFrameRef *dst = vsapi->newVideoFrame2(fi, width, height, srcf, planes, src[d->propSource], core);
 
-        const uint8_t *srcp[MAX_EXPR_INPUTS] = {};
-        int src_stride[MAX_EXPR_INPUTS] = {};
-        alignas(32) intptr_t ptroffsets[((MAX_EXPR_INPUTS + 1) + 7) & ~7] = { d->vi.format->bytesPerSample * 8 };
+        std::vector<const uint8_t *> srcp(numInputs);
+        std::vector<int> src_stride(numInputs);
 
         for (int plane = 0; plane < d->vi.format->numPlanes; plane++) {
-            if (d->plane[plane] != poProcess)
+            if (last.program->plane[plane] == poUndefined || (last.program->plane[plane] == poCopy && last.input[0] >= 0))
                 continue;
 
-            for (int i = 0; i < numInputs; i++) {
-                if (d->node[i]) {
-                    srcp[i] = vsapi->getReadPtr(src[i], plane);
-                    src_stride[i] = vsapi->getStride(src[i], plane);
-                    ptroffsets[i + 1] = vsapi->getFrameFormat(src[i])->bytesPerSample * 8;
-                }
+            for (size_t i = 0; i < numInputs; i++) {
+                srcp[i] = vsapi->getReadPtr(src[i], plane);
+                src_stride[i] = vsapi->getStride(src[i], plane);
             }
 
-            uint8_t *dstp = vsapi->getWritePtr(dst, plane);
-            int dst_stride = vsapi->getStride(dst, plane);
-            int h = vsapi->getFrameHeight(dst, plane);
-            int w = vsapi->getFrameWidth(dst, plane);
-
-            if (d->proc[plane]) {
-                ExprData::ProcessLineProc proc = d->proc[plane];
-                int niterations = (w + 7) / 8;
-
-                for (int i = 0; i < numInputs; i++) {
-                    if (d->node[i])
-                        ptroffsets[i + 1] = vsapi->getFrameFormat(src[i])->bytesPerSample * 8;
-                }
-
-                for (int y = 0; y < h; y++) {
-                    alignas(32) uint8_t *rwptrs[((MAX_EXPR_INPUTS + 1) + 7) & ~7] = { dstp + dst_stride * y };
-                    for (int i = 0; i < numInputs; i++) {
-                        rwptrs[i + 1] = const_cast<uint8_t *>(srcp[i] + src_stride[i] * y);
-                    }
-                    proc(rwptrs, ptroffsets, niterations);
-                }
-            } else {
-                ExprInterpreter interpreter(d->bytecode[plane].data(), d->bytecode[plane].size());
-
-                for (int y = 0; y < h; y++) {
-                    for (int x = 0; x < w; x++) {
-                        interpreter.eval(srcp, dstp, x);
-                    }
-
-                    for (int i = 0; i < numInputs; i++) {
-                        srcp[i] += src_stride[i];
-                    }
-                    dstp += dst_stride;
-                }
-            }
+            ExprRows rows = { d, plane, srcp.data(), src_stride.data(), vsapi->getWritePtr(dst, plane), vsapi->getStride(dst, plane), vsapi->getFrameWidth(dst, plane), vsapi->getFrameHeight(dst, plane) };
+            // idle worker threads help with bands of at least 64k samples
+            vsapi->parallelFor(exprProcessRows, &rows, rows.height, (65536 + rows.width - 1) / rows.width, core);
         }
 
-        for (int i = 0; i < MAX_EXPR_INPUTS; i++) {
+        for (size_t i = 0; i < numInputs; i++) {
             vsapi->freeFrame(src[i]);
         }
         return dst;
@@ -3220,13 +3561,19 @@ static const VSFrameRef *VS_CC exprGetFrame(int n, int activationReason, void **
 
 static void VS_CC exprFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(instanceData);
-    for (int i = 0; i < MAX_EXPR_INPUTS; i++)
-        vsapi->freeNode(d->node[i]);
+    {
+        std::lock_guard<std::mutex> lock(exprNodesLock);
+        exprNodes.erase(d->self);
+    }
+    for (auto node : d->node)
+        vsapi->freeNode(node);
     delete d;
 }
 
 static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<ExprData> d(new ExprData);
+    std::shared_ptr<ExprProgram> program(new ExprProgram);
+    VSNodeRef *inputs[MAX_EXPR_INPUTS] = {};
     int err;
 
 #ifdef VS_TARGET_CPU_X86
@@ -3237,21 +3584,21 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
 #endif
 
     try {
-        d->numInputs = vsapi->propNumElements(in, "clips");
-        if (d->numInputs > 26)
+        program->numInputs = vsapi->propNumElements(in, "clips");
+        if (program->numInputs > 26)
             throw std::runtime_error("More than 26 input clips provided");
 
-        for (int i = 0; i < d->numInputs; i++) {
-            d->node[i] = vsapi->propGetNode(in, "clips", i, &err);
+        for (int i = 0; i < program->numInputs; i++) {
+            inputs[i] = vsapi->propGetNode(in, "clips", i, &err);
         }
 
         const VSVideoInfo *vi[MAX_EXPR_INPUTS] = {};
-        for (int i = 0; i < d->numInputs; i++) {
-            if (d->node[i])
-                vi[i] = vsapi->getVideoInfo(d->node[i]);
+        for (int i = 0; i < program->numInputs; i++) {
+            if (inputs[i])
+                vi[i] = vsapi->getVideoInfo(inputs[i]);
         }
 
-        for (int i = 0; i < d->numInputs; i++) {
+        for (int i = 0; i < program->numInputs; i++) {
             if (!isConstantFormat(vi[i]))
                 throw std::runtime_error("Only clips with constant format and dimensions allowed");
             if (vi[0]->format->numPlanes != vi[i]->format->numPlanes
@@ -3299,36 +3646,49 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             expr[i] = expr[nexpr - 1];
         }
 
+        int boundary = int64ToIntS(vsapi->propGetInt(in, "boundary", 0, &err));
+        if (boundary < 0 || boundary > 1)
+            throw std::runtime_error("boundary must be 0 (repeat the edge) or 1 (mirror)");
+
+        program->ptroffsets[0] = d->vi.format->bytesPerSample * 8;
+        for (int i = 0; i < program->numInputs; i++) {
+            program->slots.push_back({ i, 0, false, 0, vi[i]->format->bytesPerSample });
+            program->ptroffsets[i + 1] = vi[i]->format->bytesPerSample * 8;
+        }
+
         for (int i = 0; i < 3; i++) {
             if (!expr[i].empty()) {
-                d->plane[i] = poProcess;
+                program->plane[i] = poProcess;
             } else {
                 if (d->vi.format->bitsPerSample == vi[0]->format->bitsPerSample && d->vi.format->sampleType == vi[0]->format->sampleType)
-                    d->plane[i] = poCopy;
+                    program->plane[i] = poCopy;
                 else
-                    d->plane[i] = poUndefined;
+                    program->plane[i] = poUndefined;
             }
 
-            if (d->plane[i] != poProcess)
+            if (program->plane[i] != poProcess)
                 continue;
 
-            auto tree = parseExpr(expr[i], vi, d->numInputs);
-            d->bytecode[i] = compile(tree, d->vi.format);
+            auto tree = parseExpr(expr[i], vi, program->numInputs, !!boundary);
+            program->bytecode[i] = compile(tree, d->vi.format);
+            assignSlots(*program, program->bytecode[i]);
 
             int cpulevel = vs_get_cpulevel(core);
             if (cpulevel > VS_CPU_LEVEL_NONE) {
-                for (int i = 0; i < d->vi.format->numPlanes; i++) {
-                    if (d->plane[i] == poProcess) {
 #ifdef VS_TARGET_CPU_X86
-                        std::unique_ptr<ExprCompiler> compiler = make_compiler(d->numInputs, cpulevel);
-                        for (auto op : d->bytecode[i]) {
-                            compiler->addInstruction(op);
-                        }
+                int numSlots = static_cast<int>(program->slots.size());
+                const std::vector<ExprInstruction> &bytecode = program->bytecode[i];
+                bool found;
+                program->kernel[i] = getExprKernel(core, exprKernelKey(bytecode, numSlots, cpulevel), [&]() {
+                    std::unique_ptr<ExprCompiler> compiler = make_compiler(numSlots, cpulevel);
+                    for (auto op : bytecode) {
+                        compiler->addInstruction(op);
+                    }
 
-                        d->proc[i] = compiler->getCode();
+                    return compiler->getCode();
+                }, found);
+                (found ? d->codeCacheHits : d->codeCacheMisses)++;
 #endif
-                    }
-                }
             }
         }
 #ifdef VS_TARGET_OS_WINDOWS
@@ -3336,12 +3696,59 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
 #endif
     } catch (std::runtime_error &e) {
         for (int i = 0; i < MAX_EXPR_INPUTS; i++) {
-            vsapi->freeNode(d->node[i]);
+            vsapi->freeNode(inputs[i]);
         }
         vsapi->setError(out, (std::string{ "Expr: " } + e.what()).c_str());
         return;
     }
 
+    // inputs that are the output of another Expr are computed here as well, the same clips and stages are only used once
+    std::map<std::pair<const VSNode *, int>, int> clipIndex;
+    auto addClip = [&](VSNodeRef *ref) {
+        auto key = std::make_pair(ref->clip.get(), ref->index);
+        auto iter = clipIndex.find(key);
+        if (iter != clipIndex.end())
+            return iter->second;
+        d->node.push_back(vsapi->cloneNodeRef(ref));
+        return clipIndex[key] = static_cast<int>(d->node.size() - 1);
+    };
+
+    auto addStage = [&](const ExprStage &stage) {
+        for (size_t s = 0; s < d->stages.size(); s++) {
+            if (d->stages[s].program == stage.program && std::equal(stage.input, stage.input + stage.program->numInputs, d->stages[s].input))
+                return static_cast<int>(s);
+        }
+        d->stages.push_back(stage);
+        return static_cast<int>(d->stages.size() - 1);
+    };
+
+    ExprStage stage = { program, {} };
+    for (int i = 0; i < program->numInputs; i++) {
+        const ExprData *upstream = findExpr(inputs[i]);
+        // only the current row of an earlier stage exists when this one is evaluated
+        bool readsOtherRows = std::any_of(program->slots.begin(), program->slots.end(), [i](const ExprSlot &slot) { return slot.input == i && slot.dy; });
+        if (upstream && !readsOtherRows && d->stages.size() + upstream->stages.size() < maxFusedStages) {
+            std::vector<int> stageIndex(upstream->stages.size());
+            for (size_t s = 0; s < upstream->stages.size(); s++) {
+                ExprStage fused = upstream->stages[s];
+                for (int j = 0; j < fused.program->numInputs; j++)
+                    fused.input[j] = fused.input[j] >= 0 ? addClip(upstream->node[fused.input[j]]) : ~stageIndex[~fused.input[j]];
+                stageIndex[s] = addStage(fused);
+            }
+            stage.input[i] = ~stageIndex.back();
+        } else {
+            stage.input[i] = addClip(inputs[i]);
+        }
+        vsapi->freeNode(inputs[i]);
+    }
+    d->stages.push_back(stage);
+
+    // the properties are always copied from the first input so follow it until a clip is reached
+    int propSource = stage.input[0];
+    while (propSource < 0)
+        propSource = d->stages[~propSource].input[0];
+    d->propSource = propSource;
+
     vsapi->createFilter(in, out, "Expr", exprInit, exprGetFrame, exprFree, fmParallel, 0, d.release(), core);
 }
 
@@ -3353,5 +3760,5 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
 
 void VS_CC exprInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
     //configFunc("com.vapoursynth.expr", "expr", "VapourSynth Expr Filter", VAPOURSYNTH_API_VERSION, 1, plugin);
-    registerFunc("Expr", "clips:clip[];expr:data[];format:int:opt;", exprCreate, nullptr, plugin);
+    registerFunc("Expr", "clips:clip[];expr:data[];format:int:opt;boundary:int:opt;", exprCreate, nullptr, plugin);
 }
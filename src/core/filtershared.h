@@ -23,6 +23,7 @@
 
 #include "VapourSynth.h"
 #include "VSHelper.h"
+#include <stddef.h>
 #include <string.h>
 
 #define RETERROR(x) do { vsapi->setError(out, (x)); return; } while (0)
@@ -73,6 +74,50 @@ static inline void setBlack(uint32_t color[3], const VSFormat *format) {
         color[1] = color[2] = 128;
 }
 
+// copies rows [top, bottom) of a plane a region capable filter doesn't process
+static inline void copyRegionRows(const uint8_t *srcp, int srcStride, uint8_t *dstp, int dstStride, int rowSize, int top, int bottom) {
+    vs_bitblt(dstp + (ptrdiff_t)top * dstStride, dstStride, srcp + (ptrdiff_t)top * srcStride, srcStride, rowSize, bottom - top);
+}
+
+typedef struct {
+    VSFilterGetRegion getRegion;
+    const uint8_t *srcp[3];
+    int srcStride[3];
+    uint8_t *dstp;
+    int dstStride;
+    int plane;
+    int width;
+    int height;
+    void *instanceData;
+} RegionBands;
+
+static void VS_CC processRegionBand(int begin, int end, void *userData) {
+    const RegionBands *b = (const RegionBands *)userData;
+    b->getRegion(b->srcp, b->srcStride, b->dstp, b->dstStride, b->plane, b->width, b->height, begin, end, b->instanceData);
+}
+
+// rows in the smallest band worth handing to another thread
+static inline int bandGrain(int width) {
+    return (65536 + width - 1) / width;
+}
+
+// produces a whole plane with a region function, idle worker threads help by taking bands of rows
+static inline void processPlaneBands(VSFilterGetRegion getRegion, const VSFrameRef * const *src, int numSrc, VSFrameRef *dst, int plane, void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    RegionBands b;
+    b.getRegion = getRegion;
+    for (int i = 0; i < numSrc; i++) {
+        b.srcp[i] = vsapi->getReadPtr(src[i], plane);
+        b.srcStride[i] = vsapi->getStride(src[i], plane);
+    }
+    b.dstp = vsapi->getWritePtr(dst, plane);
+    b.dstStride = vsapi->getStride(dst, plane);
+    b.plane = plane;
+    b.width = vsapi->getFrameWidth(dst, plane);
+    b.height = vsapi->getFrameHeight(dst, plane);
+    b.instanceData = instanceData;
+    vsapi->parallelFor(processRegionBand, &b, b.height, bandGrain(b.width), core);
+}
+
 typedef struct {
     VSNodeRef *node;
     const VSVideoInfo *vi;
@@ -23,6 +23,7 @@
 
 #include "VapourSynth.h"
 #include "VSHelper.h"
+#include "filtershared.h"
 #include <stdexcept>
 #include <string>
 
@@ -123,6 +124,14 @@ static void VS_CC templateNodeInit(VSMap *in, VSMap *out, void **instanceData, V
     vsapi->setVideoInfo(vsapi->getVideoInfo(d->node), 1, node);
 }
 
+// calls f(top, bottom) for bands of rows covering the whole height, idle worker threads help with the bands
+template<typename F>
+static void parallelRows(int width, int height, const F &f, VSCore *core, const VSAPI *vsapi) {
+    vsapi->parallelFor([](int begin, int end, void *userData) {
+        (*static_cast<const F *>(userData))(begin, end);
+    }, const_cast<F *>(&f), height, bandGrain(width), core);
+}
+
 template<typename T>
 static void VS_CC templateNodeCustomViInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     T *d = reinterpret_cast<T *>(* instanceData);
@@ -97,6 +97,20 @@ struct GenericData {
     int cpulevel;
 };
 
+template<typename OP>
+static void singlePixelProcessRows(const uint8_t * VS_RESTRICT srcp, ptrdiff_t src_stride, uint8_t * VS_RESTRICT dstp, ptrdiff_t dst_stride, int width, int height, const VSFormat *fi, const OP &opts) {
+    for (int h = 0; h < height; h++) {
+        if (fi->bytesPerSample == 1)
+            OP::template processPlane<uint8_t>(srcp, dstp, width, opts);
+        else if (fi->bytesPerSample == 2)
+            OP::template processPlane<uint16_t>(reinterpret_cast<const uint16_t *>(srcp), reinterpret_cast<uint16_t *>(dstp), width, opts);
+        else if (fi->bytesPerSample == 4)
+            OP::template processPlaneF<float>(reinterpret_cast<const float *>(srcp), reinterpret_cast<float *>(dstp), width, opts);
+        srcp += src_stride;
+        dstp += dst_stride;
+    }
+}
+
 template<typename T, typename OP>
 static const VSFrameRef *VS_CC singlePixelGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     T *d = reinterpret_cast<T *>(* instanceData);
@@ -127,22 +141,14 @@ static const VSFrameRef *VS_CC singlePixelGetFrame(int n, int activationReason,
         for (int plane = 0; plane < fi->numPlanes; plane++) {
             if (d->process[plane]) {
                 OP opts(d, fi, plane);
-                uint8_t * VS_RESTRICT dstp = vsapi->getWritePtr(dst, plane);
-                const uint8_t * VS_RESTRICT srcp = vsapi->getReadPtr(src, plane);
-                int width = vsapi->getFrameWidth(src, plane);
-                int height = vsapi->getFrameHeight(src, plane);
+                const uint8_t *srcp = vsapi->getReadPtr(src, plane);
+                uint8_t *dstp = vsapi->getWritePtr(dst, plane);
                 ptrdiff_t stride = vsapi->getStride(src, plane);
+                int width = vsapi->getFrameWidth(src, plane);
 
-                for (int h = 0; h < height; h++) {
-                    if (fi->bytesPerSample == 1)
-                        OP::template processPlane<uint8_t>(srcp, dstp, width, opts);
-                    else if (fi->bytesPerSample == 2)
-                        OP::template processPlane<uint16_t>(reinterpret_cast<const uint16_t *>(srcp), reinterpret_cast<uint16_t *>(dstp), width, opts);
-                    else if (fi->bytesPerSample == 4)
-                        OP::template processPlaneF<float>(reinterpret_cast<const float *>(srcp), reinterpret_cast<float *>(dstp), width, opts);
-                    srcp += stride;
-                    dstp += stride;
-                }
+                parallelRows(width, vsapi->getFrameHeight(src, plane), [&](int top, int bottom) {
+                    singlePixelProcessRows<OP>(srcp + top * stride, stride, dstp + top * stride, stride, width, bottom - top, fi, opts);
+                }, core, vsapi);
             }
         }
 
@@ -154,6 +160,25 @@ static const VSFrameRef *VS_CC singlePixelGetFrame(int n, int activationReason,
     return nullptr;
 }
 
+template<typename T, typename OP>
+static void VS_CC singlePixelGetRegion(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData) {
+    T *d = reinterpret_cast<T *>(instanceData);
+    const VSFormat *fi = d->vi->format;
+
+    if (d->process[plane])
+        singlePixelProcessRows<OP>(srcp[0] + static_cast<ptrdiff_t>(top) * srcStride[0], srcStride[0], dstp + static_cast<ptrdiff_t>(top) * dstStride, dstStride, width, bottom - top, fi, OP(d, fi, plane));
+    else
+        copyRegionRows(srcp[0], srcStride[0], dstp, dstStride, width * fi->bytesPerSample, top, bottom);
+}
+
+template<typename T, typename OP>
+static void VS_CC singlePixelInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    T *d = reinterpret_cast<T *>(*instanceData);
+    vsapi->setVideoInfo(d->vi, 1, node);
+    if (d->vi->format)
+        vsapi->setRegionSupport(singlePixelGetRegion<T, OP>, &d->node, 1, 0, 0, node);
+}
+
 template<typename T>
 static void templateInit(T& d, const char *name, bool allowVariableFormat, const VSMap *in, VSMap *out, const VSAPI *vsapi) {
     *d = {};
@@ -354,6 +379,22 @@ static decltype(&vs_generic_3x3_conv_byte_c) genericSelectC(const VSFormat *fi,
     return nullptr;
 }
 
+template <GenericOperations op>
+static decltype(&vs_generic_3x3_conv_byte_c) genericSelect(const VSFormat *fi, GenericData *d) {
+    decltype(&vs_generic_3x3_conv_byte_c) func = nullptr;
+
+#ifdef VS_TARGET_CPU_X86
+    if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2)
+        func = genericSelectAVX2<op>(fi, d);
+    if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2)
+        func = genericSelectSSE2<op>(fi, d);
+#endif
+    if (!func)
+        func = genericSelectC<op>(fi, d);
+
+    return func;
+}
+
 template <GenericOperations op>
 static const VSFrameRef *VS_CC genericGetframe(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     GenericData *d = static_cast<GenericData *>(*instanceData);
@@ -384,16 +425,7 @@ static const VSFrameRef *VS_CC genericGetframe(int n, int activationReason, void
 
         VSFrameRef *dst = vsapi->newVideoFrame2(fi, vsapi->getFrameWidth(src, 0), vsapi->getFrameHeight(src, 0), fr, pl, src, core);
 
-        void (*func)(const void *, ptrdiff_t, void *, ptrdiff_t, const vs_generic_params *, unsigned, unsigned) = nullptr;
-
-#ifdef VS_TARGET_CPU_X86
-        if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2)
-            func = genericSelectAVX2<op>(fi, d);
-        if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2)
-            func = genericSelectSSE2<op>(fi, d);
-#endif
-        if (!func)
-            func = genericSelectC<op>(fi, d);
+        decltype(&vs_generic_3x3_conv_byte_c) func = genericSelect<op>(fi, d);
 
         for (int plane = 0; plane < fi->numPlanes; plane++) {
             if (func && d->process[plane]) {
@@ -405,7 +437,12 @@ static const VSFrameRef *VS_CC genericGetframe(int n, int activationReason, void
                 int dst_stride = vsapi->getStride(dst, plane);
 
                 vs_generic_params params = make_generic_params(d, fi, plane);
-                func(srcp, src_stride, dstp, dst_stride, &params, width, height);
+                parallelRows(width, height, [&](int top, int bottom) {
+                    vs_generic_params band = params;
+                    band.row_begin = top;
+                    band.row_end = bottom;
+                    func(srcp, src_stride, dstp, dst_stride, &band, width, height);
+                }, core, vsapi);
             }
         }
 
@@ -416,6 +453,42 @@ static const VSFrameRef *VS_CC genericGetframe(int n, int activationReason, void
     return nullptr;
 }
 
+template <GenericOperations op>
+static void VS_CC genericGetRegion(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData) {
+    GenericData *d = static_cast<GenericData *>(instanceData);
+    const VSFormat *fi = d->vi->format;
+
+    if (!d->process[plane]) {
+        copyRegionRows(srcp[0], srcStride[0], dstp, dstStride, width * fi->bytesPerSample, top, bottom);
+        return;
+    }
+
+    vs_generic_params params = make_generic_params(d, fi, plane);
+    params.row_begin = top;
+    params.row_end = bottom;
+    genericSelect<op>(fi, d)(srcp[0], srcStride[0], dstp, dstStride, &params, width, height);
+}
+
+template <GenericOperations op>
+static void VS_CC genericInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    GenericData *d = static_cast<GenericData *>(*instanceData);
+    vsapi->setVideoInfo(d->vi, 1, node);
+
+    if (!d->vi->format || !genericSelect<op>(d->vi->format, d))
+        return;
+
+    // the number of rows above and below that are used to calculate a row
+    int apron = 1;
+    if (op == GenericConvolution && d->convolution_type == ConvolutionSquare)
+        apron = d->matrix_elements == 25 ? 2 : 1;
+    else if (op == GenericConvolution && d->convolution_type == ConvolutionHorizontal)
+        apron = 0;
+    else if (op == GenericConvolution && d->convolution_type == ConvolutionVertical)
+        apron = d->matrix_elements / 2;
+
+    vsapi->setRegionSupport(genericGetRegion<op>, &d->node, 1, apron, 0, node);
+}
+
 template <GenericOperations op>
 static void VS_CC genericCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<GenericData> d(new GenericData{});
@@ -594,7 +667,7 @@ static void VS_CC genericCreate(const VSMap *in, VSMap *out, void *userData, VSC
         return;
     }
 
-    vsapi->createFilter(in, out, d->filter_name, templateNodeInit<GenericData>, genericGetframe<op>, templateNodeFree<GenericData>, fmParallel, 0, d.get(), core);
+    vsapi->createFilter(in, out, d->filter_name, genericInit<op>, genericGetframe<op>, templateNodeFree<GenericData>, fmParallel, 0, d.get(), core);
     d.release();
 }
 
@@ -646,7 +719,7 @@ static void VS_CC invertCreate(const VSMap *in, VSMap *out, void *userData, VSCo
         return;
     }
 
-    vsapi->createFilter(in, out, d->name, templateNodeInit<InvertData>, singlePixelGetFrame<InvertData, InvertOp>, templateNodeFree<InvertData>, fmParallel, 0, d.get(), core);
+    vsapi->createFilter(in, out, d->name, singlePixelInit<InvertData, InvertOp>, singlePixelGetFrame<InvertData, InvertOp>, templateNodeFree<InvertData>, fmParallel, 0, d.get(), core);
     d.release();
 }
 
@@ -701,7 +774,7 @@ static void VS_CC limitCreate(const VSMap *in, VSMap *out, void *userData, VSCor
         return;
     }
 
-    vsapi->createFilter(in, out, d->name, templateNodeInit<LimitData>, singlePixelGetFrame<LimitData, LimitOp>, templateNodeFree<LimitData>, fmParallel, 0, d.get(), core);
+    vsapi->createFilter(in, out, d->name, singlePixelInit<LimitData, LimitOp>, singlePixelGetFrame<LimitData, LimitOp>, templateNodeFree<LimitData>, fmParallel, 0, d.get(), core);
     d.release();
 }
 
@@ -762,7 +835,7 @@ static void VS_CC binarizeCreate(const VSMap *in, VSMap *out, void *userData, VS
         return;
     }
 
-    vsapi->createFilter(in, out, d->name, templateNodeInit<BinarizeData>, singlePixelGetFrame<BinarizeData, BinarizeOp>, templateNodeFree<BinarizeData>, fmParallel, 0, d.get(), core);
+    vsapi->createFilter(in, out, d->name, singlePixelInit<BinarizeData, BinarizeOp>, singlePixelGetFrame<BinarizeData, BinarizeOp>, templateNodeFree<BinarizeData>, fmParallel, 0, d.get(), core);
     d.release();
 }
 
@@ -778,6 +851,55 @@ struct LevelsData {
     std::vector<uint8_t> lut;
 };
 
+template<typename T>
+static void levelsProcessRows(const LevelsData *d, const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int w, int h) {
+    const T * VS_RESTRICT srcp = reinterpret_cast<const T *>(src);
+    T * VS_RESTRICT dstp = reinterpret_cast<T *>(dst);
+
+    T maxval = static_cast<T>((static_cast<int64_t>(1) << d->vi->format->bitsPerSample) - 1);
+    const T * VS_RESTRICT lut = reinterpret_cast<const T *>(d->lut.data());
+
+    for (int hl = 0; hl < h; hl++) {
+        for (int x = 0; x < w; x++)
+            dstp[x] = lut[std::min(srcp[x], maxval)];
+
+        dstp += dst_stride / sizeof(T);
+        srcp += src_stride / sizeof(T);
+    }
+}
+
+template<typename T>
+static void levelsProcessRowsF(const LevelsData *d, const uint8_t *src, int src_stride, uint8_t *dst, int dst_stride, int w, int h) {
+    const T * VS_RESTRICT srcp = reinterpret_cast<const T *>(src);
+    T * VS_RESTRICT dstp = reinterpret_cast<T *>(dst);
+
+    T gamma = d->gamma;
+    T range_in = 1.f / (d->max_in - d->min_in);
+    T range_out = d->max_out - d->min_out;
+    T min_in = d->min_in;
+    T min_out = d->min_out;
+    T max_in = d->max_in;
+
+    if (std::abs(d->gamma - static_cast<T>(1.0)) < std::numeric_limits<T>::epsilon()) {
+        T range_scale = range_out / (d->max_in - d->min_in);
+        for (int hl = 0; hl < h; hl++) {
+            for (int x = 0; x < w; x++)
+                dstp[x] = (std::max(std::min(srcp[x], max_in) - min_in, 0.f)) * range_scale + min_out;
+
+            dstp += dst_stride / sizeof(T);
+            srcp += src_stride / sizeof(T);
+        }
+    } else {
+        for (int hl = 0; hl < h; hl++) {
+            for (int x = 0; x < w; x++)
+                dstp[x] = std::pow((std::max(std::min(srcp[x], max_in) - min_in, 0.f)) * range_in, gamma) * range_out + min_out;
+
+            dstp += dst_stride / sizeof(T);
+            srcp += src_stride / sizeof(T);
+        }
+    }
+}
+
 template<typename T>
 static const VSFrameRef *VS_CC levelsGetframe(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     LevelsData *d = reinterpret_cast<LevelsData *>(*instanceData);
@@ -793,23 +915,15 @@ static const VSFrameRef *VS_CC levelsGetframe(int n, int activationReason, void
 
         for (int plane = 0; plane < fi->numPlanes; plane++) {
             if (d->process[plane]) {
-                const T * VS_RESTRICT srcp = reinterpret_cast<const T *>(vsapi->getReadPtr(src, plane));
+                const uint8_t *srcp = vsapi->getReadPtr(src, plane);
+                uint8_t *dstp = vsapi->getWritePtr(dst, plane);
                 int src_stride = vsapi->getStride(src, plane);
-                T * VS_RESTRICT dstp = reinterpret_cast<T *>(vsapi->getWritePtr(dst, plane));
                 int dst_stride = vsapi->getStride(dst, plane);
-                int h = vsapi->getFrameHeight(src, plane);
-                int w = vsapi->getFrameWidth(src, plane);
-
-                T maxval = static_cast<T>((static_cast<int64_t>(1) << fi->bitsPerSample) - 1);
-                const T * VS_RESTRICT lut = reinterpret_cast<const T *>(d->lut.data());
-
-                for (int hl = 0; hl < h; hl++) {
-                    for (int x = 0; x < w; x++)
-                        dstp[x] = lut[std::min(srcp[x], maxval)];
+                int width = vsapi->getFrameWidth(src, plane);
 
-                    dstp += dst_stride / sizeof(T);
-                    srcp += src_stride / sizeof(T);
-                }
+                parallelRows(width, vsapi->getFrameHeight(src, plane), [&](int top, int bottom) {
+                    levelsProcessRows<T>(d, srcp + static_cast<ptrdiff_t>(top) * src_stride, src_stride, dstp + static_cast<ptrdiff_t>(top) * dst_stride, dst_stride, width, bottom - top);
+                }, core, vsapi);
             }
         }
 
@@ -835,38 +949,15 @@ static const VSFrameRef *VS_CC levelsGetframeF(int n, int activationReason, void
 
         for (int plane = 0; plane < fi->numPlanes; plane++) {
             if (d->process[plane]) {
-                const T * VS_RESTRICT srcp = reinterpret_cast<const T *>(vsapi->getReadPtr(src, plane));
+                const uint8_t *srcp = vsapi->getReadPtr(src, plane);
+                uint8_t *dstp = vsapi->getWritePtr(dst, plane);
                 int src_stride = vsapi->getStride(src, plane);
-                T * VS_RESTRICT dstp = reinterpret_cast<T *>(vsapi->getWritePtr(dst, plane));
                 int dst_stride = vsapi->getStride(dst, plane);
-                int h = vsapi->getFrameHeight(src, plane);
-                int w = vsapi->getFrameWidth(src, plane);
-
-                T gamma = d->gamma;
-                T range_in = 1.f / (d->max_in - d->min_in);
-                T range_out = d->max_out - d->min_out;
-                T min_in = d->min_in;
-                T min_out = d->min_out;
-                T max_in = d->max_in;
-
-                if (std::abs(d->gamma - static_cast<T>(1.0)) < std::numeric_limits<T>::epsilon()) {
-                    T range_scale = range_out / (d->max_in - d->min_in);
-                    for (int hl = 0; hl < h; hl++) {
-                        for (int x = 0; x < w; x++)
-                            dstp[x] = (std::max(std::min(srcp[x], max_in) - min_in, 0.f)) * range_scale + min_out;
-
-                        dstp += dst_stride / sizeof(T);
-                        srcp += src_stride / sizeof(T);
-                    }
-                } else {
-                    for (int hl = 0; hl < h; hl++) {
-                        for (int x = 0; x < w; x++)
-                            dstp[x] = std::pow((std::max(std::min(srcp[x], max_in) - min_in, 0.f)) * range_in, gamma) * range_out + min_out;
+                int width = vsapi->getFrameWidth(src, plane);
 
-                        dstp += dst_stride / sizeof(T);
-                        srcp += src_stride / sizeof(T);
-                    }
-                }
+                parallelRows(width, vsapi->getFrameHeight(src, plane), [&](int top, int bottom) {
+                    levelsProcessRowsF<T>(d, srcp + static_cast<ptrdiff_t>(top) * src_stride, src_stride, dstp + static_cast<ptrdiff_t>(top) * dst_stride, dst_stride, width, bottom - top);
+                }, core, vsapi);
             }
         }
 
@@ -877,6 +968,23 @@ static const VSFrameRef *VS_CC levelsGetframeF(int n, int activationReason, void
     return nullptr;
 }
 
+template<typename T, void (*process)(const LevelsData *, const uint8_t *, int, uint8_t *, int, int, int)>
+static void VS_CC levelsGetRegion(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData) {
+    LevelsData *d = reinterpret_cast<LevelsData *>(instanceData);
+
+    if (d->process[plane])
+        process(d, srcp[0] + static_cast<ptrdiff_t>(top) * srcStride[0], srcStride[0], dstp + static_cast<ptrdiff_t>(top) * dstStride, dstStride, width, bottom - top);
+    else
+        copyRegionRows(srcp[0], srcStride[0], dstp, dstStride, width * sizeof(T), top, bottom);
+}
+
+template<typename T, void (*process)(const LevelsData *, const uint8_t *, int, uint8_t *, int, int, int)>
+static void VS_CC levelsInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    LevelsData *d = reinterpret_cast<LevelsData *>(*instanceData);
+    vsapi->setVideoInfo(d->vi, 1, node);
+    vsapi->setRegionSupport(levelsGetRegion<T, process>, &d->node, 1, 0, 0, node);
+}
+
 static void VS_CC levelsCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<LevelsData> d(new LevelsData);
 
@@ -928,11 +1036,11 @@ static void VS_CC levelsCreate(const VSMap *in, VSMap *out, void *userData, VSCo
     }
 
     if (d->vi->format->bytesPerSample == 1)
-        vsapi->createFilter(in, out, d->name, templateNodeInit<LevelsData>, levelsGetframe<uint8_t>, templateNodeFree<LevelsData>, fmParallel, 0, d.get(), core);
+        vsapi->createFilter(in, out, d->name, levelsInit<uint8_t, levelsProcessRows<uint8_t>>, levelsGetframe<uint8_t>, templateNodeFree<LevelsData>, fmParallel, 0, d.get(), core);
     else if (d->vi->format->bytesPerSample == 2)
-        vsapi->createFilter(in, out, d->name, templateNodeInit<LevelsData>, levelsGetframe<uint16_t>, templateNodeFree<LevelsData>, fmParallel, 0, d.get(), core);
+        vsapi->createFilter(in, out, d->name, levelsInit<uint16_t, levelsProcessRows<uint16_t>>, levelsGetframe<uint16_t>, templateNodeFree<LevelsData>, fmParallel, 0, d.get(), core);
     else
-        vsapi->createFilter(in, out, d->name, templateNodeInit<LevelsData>, levelsGetframeF<float>, templateNodeFree<LevelsData>, fmParallel, 0, d.get(), core);
+        vsapi->createFilter(in, out, d->name, levelsInit<float, levelsProcessRowsF<float>>, levelsGetframeF<float>, templateNodeFree<LevelsData>, fmParallel, 0, d.get(), core);
     d.release();
 }
 
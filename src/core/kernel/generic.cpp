@@ -244,7 +244,9 @@ void filter_plane_3x3(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_
     Traits traits{ params };
     uint16_t maxval = params.maxval;
 
-    for (unsigned i = 0; i < height; ++i) {
+    unsigned row_end = params.row_end ? params.row_end : height;
+
+    for (unsigned i = params.row_begin; i < row_end; ++i) {
         unsigned above_idx = i == 0 ? std::min(1U, height - 1) : i - 1;
         unsigned below_idx = i == height - 1 ? height - std::min(2U, height) : i + 1;
 
@@ -293,7 +295,9 @@ void conv_plane_5x5(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t
     float bias = params.bias;
     bool saturate = params.saturate;
 
-    for (unsigned i = 0; i < height; ++i) {
+    unsigned row_end = params.row_end ? params.row_end : height;
+
+    for (unsigned i = params.row_begin; i < row_end; ++i) {
         unsigned dist_from_bottom = height - 1 - i;
 
         unsigned above2_idx = i < 2 ? std::min(2 - i, height - 1) : i - 2;
@@ -309,7 +313,7 @@ void conv_plane_5x5(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t
         T *dst_p = static_cast<T *>(line_ptr(dst, i, dst_stride));
 
         for (unsigned j = 0; j < std::min(width, 2U); ++j) {
-            unsigned dist_from_right = width - 1 - i;
+            unsigned dist_from_right = width - 1 - j;
             unsigned idx[5];
 
             idx[0] = j < 2 ? std::min(2 - j, width - 1) : j - 2;
@@ -350,7 +354,7 @@ void conv_plane_5x5(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t
         }
 
         for (unsigned j = std::max(2U, width - std::min(width, 2U)); j < width; ++j) {
-            unsigned dist_from_right = width - 1 - i;
+            unsigned dist_from_right = width - 1 - j;
             unsigned idx[5];
 
             idx[0] = j < 2 ? std::min(2 - j, width - 1) : j - 2;
@@ -391,12 +395,14 @@ void conv_plane_h(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t ds
     float bias = params.bias;
     bool saturate = params.saturate;
 
-    for (unsigned i = 0; i < height; ++i) {
+    unsigned row_end = params.row_end ? params.row_end : height;
+
+    for (unsigned i = params.row_begin; i < row_end; ++i) {
         const T *srcp = static_cast<const T * >(line_ptr(src, i, src_stride));
         T *dstp = static_cast<T *>(line_ptr(dst, i, dst_stride));
 
         for (unsigned j = 0; j < std::min(width, support); ++j) {
-            unsigned dist_from_right = width - 1 - i;
+            unsigned dist_from_right = width - 1 - j;
 
             Accum accum = 0;
 
@@ -428,7 +434,7 @@ void conv_plane_h(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t ds
         }
 
         for (unsigned j = std::max(support, width - std::min(width, support)); j < width; ++j) {
-            unsigned dist_from_right = width - 1 - i;
+            unsigned dist_from_right = width - 1 - j;
 
             Accum accum = 0;
 
@@ -463,7 +469,9 @@ void conv_plane_v(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t ds
     float bias = params.bias;
     bool saturate = params.saturate;
 
-    for (unsigned i = 0; i < std::min(height, support); ++i) {
+    unsigned row_end = params.row_end ? params.row_end : height;
+
+    for (unsigned i = params.row_begin; i < std::min({ height, support, row_end }); ++i) {
         T *dstp = static_cast<T *>(line_ptr(dst, i, dst_stride));
 
         unsigned dist_from_bottom = height - 1 - i;
@@ -488,7 +496,7 @@ void conv_plane_v(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t ds
             dstp[j] = limit(xrint<T>(tmp), maxval);
         }
     }
-    for (unsigned i = support; i < height - std::min(height, support); ++i) {
+    for (unsigned i = std::max(support, params.row_begin); i < std::min(height - std::min(height, support), row_end); ++i) {
         T *dstp = static_cast<T *>(line_ptr(dst, i, dst_stride));
 
         for (unsigned j = 0; j < width; ++j) {
@@ -503,7 +511,7 @@ void conv_plane_v(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t ds
             dstp[j] = limit(xrint<T>(tmp), maxval);
         }
     }
-    for (unsigned i = std::max(support, height - std::min(height, support)); i < height; ++i) {
+    for (unsigned i = std::max({ support, height - std::min(height, support), params.row_begin }); i < row_end; ++i) {
         T *dstp = static_cast<T *>(line_ptr(dst, i, dst_stride));
 
         unsigned dist_from_bottom = height - 1 - i;
@@ -48,6 +48,10 @@ struct vs_generic_params {
 	float div;
 	float bias;
 	uint8_t saturate;
+
+	/* Rows to process, the whole plane when both are 0. */
+	unsigned row_begin;
+	unsigned row_end;
 };
 
 #define DECL(kernel, pixel, isa) void vs_generic_##kernel##_##pixel##_##isa(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t dst_stride, const struct vs_generic_params *params, unsigned width, unsigned height);
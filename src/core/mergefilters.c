@@ -230,9 +230,67 @@ typedef struct {
 
 const unsigned MergeShift = 15;
 
+static void mergePlane(const MergeData *d, int plane, const uint8_t *srcp1, int stride1, const uint8_t *srcp2, int stride2, uint8_t * VS_RESTRICT dstp, int dstStride, int w, int h) {
+    void (*func)(const void *, const void *, void *, union vs_merge_weight, unsigned) = 0;
+    union vs_merge_weight weight;
+
+#ifdef VS_TARGET_CPU_X86
+    if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_merge_byte_avx2;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_merge_word_avx2;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_merge_float_avx2;
+    }
+    if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_merge_byte_sse2;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_merge_word_sse2;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_merge_float_sse2;
+    }
+#endif
+    if (!func) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_merge_byte_c;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_merge_word_c;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_merge_float_c;
+    }
+
+    if (!func)
+        return;
+
+    if (d->vi->format->sampleType == stInteger)
+        weight.u = d->weight[plane];
+    else
+        weight.f = d->fweight[plane];
+
+    for (int y = 0; y < h; ++y) {
+        func(srcp1, srcp2, dstp, weight, w);
+        srcp1 += stride1;
+        srcp2 += stride2;
+        dstp += dstStride;
+    }
+}
+
+static void VS_CC mergeGetRegion(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData) {
+    MergeData *d = (MergeData *)instanceData;
+
+    if (d->process[plane] == 0)
+        mergePlane(d, plane, srcp[0] + (ptrdiff_t)top * srcStride[0], srcStride[0], srcp[1] + (ptrdiff_t)top * srcStride[1], srcStride[1], dstp + (ptrdiff_t)top * dstStride, dstStride, width, bottom - top);
+    else
+        copyRegionRows(srcp[d->process[plane] - 1], srcStride[d->process[plane] - 1], dstp, dstStride, width * d->vi->format->bytesPerSample, top, bottom);
+}
+
 static void VS_CC mergeInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     MergeData *d = (MergeData *)*instanceData;
+    VSNodeRef *inputs[] = { d->node1, d->node2 };
     vsapi->setVideoInfo(d->vi, 1, node);
+    vsapi->setRegionSupport(mergeGetRegion, inputs, 2, 0, 0, node);
 }
 
 static const VSFrameRef *VS_CC mergeGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
@@ -244,64 +302,14 @@ static const VSFrameRef *VS_CC mergeGetFrame(int n, int activationReason, void *
     } else if (activationReason == arAllFramesReady) {
         const VSFrameRef *src1 = vsapi->getFrameFilter(n, d->node1, frameCtx);
         const VSFrameRef *src2 = vsapi->getFrameFilter(n, d->node2, frameCtx);
+        const VSFrameRef *src[] = { src1, src2 };
         const int pl[] = {0, 1, 2};
         const VSFrameRef *fs[] = { 0, src1, src2 };
         const VSFrameRef *fr[] = {fs[d->process[0]], fs[d->process[1]], fs[d->process[2]]};
         VSFrameRef *dst = vsapi->newVideoFrame2(d->vi->format, d->vi->width, d->vi->height, fr, pl, src1, core);
         for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
-            if (d->process[plane] == 0) {
-                int h = vsapi->getFrameHeight(src1, plane);
-                int w = vsapi->getFrameWidth(src2, plane);
-                int stride = vsapi->getStride(src1, plane);
-                const uint8_t *srcp1 = vsapi->getReadPtr(src1, plane);
-                const uint8_t *srcp2 = vsapi->getReadPtr(src2, plane);
-                uint8_t * VS_RESTRICT dstp = vsapi->getWritePtr(dst, plane);
-
-                void (*func)(const void *, const void *, void *, union vs_merge_weight, unsigned) = 0;
-                union vs_merge_weight weight;
-
-#ifdef VS_TARGET_CPU_X86
-                if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_merge_byte_avx2;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_merge_word_avx2;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_merge_float_avx2;
-                }
-                if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_merge_byte_sse2;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_merge_word_sse2;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_merge_float_sse2;
-                }
-#endif
-                if (!func) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_merge_byte_c;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_merge_word_c;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_merge_float_c;
-                }
-
-                if (!func)
-                    continue;
-
-                if (d->vi->format->sampleType == stInteger)
-                    weight.u = d->weight[plane];
-                else
-                    weight.f = d->fweight[plane];
-
-                for (int y = 0; y < h; ++y) {
-                    func(srcp1, srcp2, dstp, weight, w);
-                    srcp1 += stride;
-                    srcp2 += stride;
-                    dstp += stride;
-                }
-            }
+            if (d->process[plane] == 0)
+                processPlaneBands(mergeGetRegion, src, 2, dst, plane, d, core, vsapi);
         }
 
         vsapi->freeFrame(src1);
@@ -642,9 +650,63 @@ typedef struct {
     int cpulevel;
 } MakeDiffData;
 
+static void makeDiffPlane(const MakeDiffData *d, const uint8_t *srcp1, int stride1, const uint8_t *srcp2, int stride2, uint8_t * VS_RESTRICT dstp, int dstStride, int w, int h) {
+    void (*func)(const void *, const void *, void *, unsigned, unsigned) = 0;
+
+#ifdef VS_TARGET_CPU_X86
+    if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_makediff_byte_avx2;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_makediff_word_avx2;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_makediff_float_avx2;
+    }
+    if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_makediff_byte_sse2;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_makediff_word_sse2;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_makediff_float_sse2;
+    }
+#endif
+    if (!func) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_makediff_byte_c;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_makediff_word_c;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_makediff_float_c;
+    }
+
+    if (!func)
+        return;
+
+    int depth = d->vi->format->bitsPerSample;
+
+    for (int y = 0; y < h; ++y) {
+        func(srcp1, srcp2, dstp, depth, w);
+        srcp1 += stride1;
+        srcp2 += stride2;
+        dstp += dstStride;
+    }
+}
+
+static void VS_CC makeDiffGetRegion(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData) {
+    MakeDiffData *d = (MakeDiffData *)instanceData;
+
+    if (d->process[plane])
+        makeDiffPlane(d, srcp[0] + (ptrdiff_t)top * srcStride[0], srcStride[0], srcp[1] + (ptrdiff_t)top * srcStride[1], srcStride[1], dstp + (ptrdiff_t)top * dstStride, dstStride, width, bottom - top);
+    else
+        copyRegionRows(srcp[0], srcStride[0], dstp, dstStride, width * d->vi->format->bytesPerSample, top, bottom);
+}
+
 static void VS_CC makeDiffInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     MakeDiffData *d = (MakeDiffData *)*instanceData;
+    VSNodeRef *inputs[] = { d->node1, d->node2 };
     vsapi->setVideoInfo(d->vi, 1, node);
+    vsapi->setRegionSupport(makeDiffGetRegion, inputs, 2, 0, 0, node);
 }
 
 static const VSFrameRef *VS_CC makeDiffGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
@@ -656,59 +718,13 @@ static const VSFrameRef *VS_CC makeDiffGetFrame(int n, int activationReason, voi
     } else if (activationReason == arAllFramesReady) {
         const VSFrameRef *src1 = vsapi->getFrameFilter(n, d->node1, frameCtx);
         const VSFrameRef *src2 = vsapi->getFrameFilter(n, d->node2, frameCtx);
+        const VSFrameRef *src[] = { src1, src2 };
         const int pl[] = { 0, 1, 2 };
         const VSFrameRef *fr[] = { d->process[0] ? 0 : src1, d->process[1] ? 0 : src1, d->process[2] ? 0 : src1 };
         VSFrameRef *dst = vsapi->newVideoFrame2(d->vi->format, d->vi->width, d->vi->height, fr, pl, src1, core);
         for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
-            if (d->process[plane]) {
-                int h = vsapi->getFrameHeight(src1, plane);
-                int w = vsapi->getFrameWidth(src2, plane);
-                int stride = vsapi->getStride(src1, plane);
-                const uint8_t *srcp1 = vsapi->getReadPtr(src1, plane);
-                const uint8_t *srcp2 = vsapi->getReadPtr(src2, plane);
-                uint8_t * VS_RESTRICT dstp = vsapi->getWritePtr(dst, plane);
-
-                void (*func)(const void *, const void *, void *, unsigned, unsigned) = 0;
-
-#ifdef VS_TARGET_CPU_X86
-                if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_makediff_byte_avx2;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_makediff_word_avx2;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_makediff_float_avx2;
-                }
-                if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_makediff_byte_sse2;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_makediff_word_sse2;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_makediff_float_sse2;
-                }
-#endif
-                if (!func) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_makediff_byte_c;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_makediff_word_c;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_makediff_float_c;
-                }
-
-                if (!func)
-                    continue;
-
-                int depth = d->vi->format->bitsPerSample;
-
-                for (int y = 0; y < h; ++y) {
-                    func(srcp1, srcp2, dstp, depth, w);
-                    srcp1 += stride;
-                    srcp2 += stride;
-                    dstp += stride;
-                }
-            }
+            if (d->process[plane])
+                processPlaneBands(makeDiffGetRegion, src, 2, dst, plane, d, core, vsapi);
         }
 
         vsapi->freeFrame(src1);
@@ -797,9 +813,63 @@ typedef struct {
     int cpulevel;
 } MergeDiffData;
 
+static void mergeDiffPlane(const MergeDiffData *d, const uint8_t *srcp1, int stride1, const uint8_t *srcp2, int stride2, uint8_t * VS_RESTRICT dstp, int dstStride, int w, int h) {
+    void (*func)(const void *, const void *, void *, unsigned, unsigned) = 0;
+
+#ifdef VS_TARGET_CPU_X86
+    if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_mergediff_byte_avx2;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_mergediff_word_avx2;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_mergediff_float_avx2;
+    }
+    if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_mergediff_byte_sse2;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_mergediff_word_sse2;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_mergediff_float_sse2;
+    }
+#endif
+    if (!func) {
+        if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
+            func = vs_mergediff_byte_c;
+        else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
+            func = vs_mergediff_word_c;
+        else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
+            func = vs_mergediff_float_c;
+    }
+
+    if (!func)
+        return;
+
+    int depth = d->vi->format->bitsPerSample;
+
+    for (int y = 0; y < h; ++y) {
+        func(srcp1, srcp2, dstp, depth, w);
+        srcp1 += stride1;
+        srcp2 += stride2;
+        dstp += dstStride;
+    }
+}
+
+static void VS_CC mergeDiffGetRegion(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData) {
+    MergeDiffData *d = (MergeDiffData *)instanceData;
+
+    if (d->process[plane])
+        mergeDiffPlane(d, srcp[0] + (ptrdiff_t)top * srcStride[0], srcStride[0], srcp[1] + (ptrdiff_t)top * srcStride[1], srcStride[1], dstp + (ptrdiff_t)top * dstStride, dstStride, width, bottom - top);
+    else
+        copyRegionRows(srcp[0], srcStride[0], dstp, dstStride, width * d->vi->format->bytesPerSample, top, bottom);
+}
+
 static void VS_CC mergeDiffInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
     MergeDiffData *d = (MergeDiffData *)*instanceData;
+    VSNodeRef *inputs[] = { d->node1, d->node2 };
     vsapi->setVideoInfo(d->vi, 1, node);
+    vsapi->setRegionSupport(mergeDiffGetRegion, inputs, 2, 0, 0, node);
 }
 
 static const VSFrameRef *VS_CC mergeDiffGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
@@ -811,59 +881,13 @@ static const VSFrameRef *VS_CC mergeDiffGetFrame(int n, int activationReason, vo
     } else if (activationReason == arAllFramesReady) {
         const VSFrameRef *src1 = vsapi->getFrameFilter(n, d->node1, frameCtx);
         const VSFrameRef *src2 = vsapi->getFrameFilter(n, d->node2, frameCtx);
+        const VSFrameRef *src[] = { src1, src2 };
         const int pl[] = { 0, 1, 2 };
         const VSFrameRef *fr[] = { d->process[0] ? 0 : src1, d->process[1] ? 0 : src1, d->process[2] ? 0 : src1 };
         VSFrameRef *dst = vsapi->newVideoFrame2(d->vi->format, d->vi->width, d->vi->height, fr, pl, src1, core);
         for (int plane = 0; plane < d->vi->format->numPlanes; plane++) {
-            if (d->process[plane]) {
-                int h = vsapi->getFrameHeight(src1, plane);
-                int w = vsapi->getFrameWidth(src1, plane);
-                int stride = vsapi->getStride(src1, plane);
-                const uint8_t *srcp1 = vsapi->getReadPtr(src1, plane);
-                const uint8_t *srcp2 = vsapi->getReadPtr(src2, plane);
-                uint8_t * VS_RESTRICT dstp = vsapi->getWritePtr(dst, plane);
-
-                void (*func)(const void *, const void *, void *, unsigned, unsigned) = 0;
-
-#ifdef VS_TARGET_CPU_X86
-                if (getCPUFeatures()->avx2 && d->cpulevel >= VS_CPU_LEVEL_AVX2) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_mergediff_byte_avx2;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_mergediff_word_avx2;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_mergediff_float_avx2;
-                }
-                if (!func && d->cpulevel >= VS_CPU_LEVEL_SSE2) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_mergediff_byte_sse2;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_mergediff_word_sse2;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_mergediff_float_sse2;
-                }
-#endif
-                if (!func) {
-                    if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 1)
-                        func = vs_mergediff_byte_c;
-                    else if (d->vi->format->sampleType == stInteger && d->vi->format->bytesPerSample == 2)
-                        func = vs_mergediff_word_c;
-                    else if (d->vi->format->sampleType == stFloat && d->vi->format->bytesPerSample == 4)
-                        func = vs_mergediff_float_c;
-                }
-
-                if (!func)
-                    continue;
-
-                int depth = d->vi->format->bitsPerSample;
-
-                for (int y = 0; y < h; ++y) {
-                    func(srcp1, srcp2, dstp, depth, w);
-                    srcp1 += stride;
-                    srcp2 += stride;
-                    dstp += stride;
-                }
-            }
+            if (d->process[plane])
+                processPlaneBands(mergeDiffGetRegion, src, 2, dst, plane, d, core, vsapi);
         }
 
         vsapi->freeFrame(src1);
@@ -0,0 +1,428 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "internalfilters.h"
+#include "vscore.h"
+#include "VSHelper.h"
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef VS_TARGET_OS_WINDOWS
+#include <winioctl.h>
+#include "../common/vsutf16.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//////////////////////////////////////////
+// PersistentCache
+
+// The file is named after the graph hash of the clip so every script that creates the clip the same way
+// finds it again. It starts with a header page followed by one state word per frame and then a slot
+// for every frame holding its serialized properties followed by the planes without padding. The file
+// is sparse so only the frames that were actually stored take up space.
+
+namespace {
+
+static const uint32_t fileVersion = 1;
+static const uint64_t pageSize = 4096;
+static const uint64_t propsSize = pageSize;
+
+enum FrameState : uint32_t {
+    fsEmpty = 0,
+    fsStored = 1
+};
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t numFrames;
+    uint64_t graphHash;
+    int32_t colorFamily;
+    int32_t sampleType;
+    int32_t bitsPerSample;
+    int32_t subSamplingW;
+    int32_t subSamplingH;
+    int32_t width;
+    int32_t height;
+    int32_t reserved;
+    uint64_t slotSize;
+};
+
+static const char fileMagic[8] = { 'V', 'S', 'P', 'C', 'A', 'C', 'H', 'E' };
+
+static uint64_t alignPage(uint64_t size) {
+    return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+class PropertyWriter {
+private:
+    uint8_t *dst;
+    size_t size;
+    size_t pos;
+public:
+    PropertyWriter(uint8_t *dst, size_t size) : dst(dst), size(size), pos(0) {}
+
+    bool writeBytes(const void *data, size_t bytes) {
+        if (bytes > size - pos)
+            return false;
+        memcpy(dst + pos, data, bytes);
+        pos += bytes;
+        return true;
+    }
+
+    template<typename T>
+    bool write(T value) {
+        return writeBytes(&value, sizeof(value));
+    }
+
+    size_t getSize() const {
+        return pos;
+    }
+};
+
+class PropertyReader {
+private:
+    const uint8_t *src;
+    size_t size;
+    size_t pos;
+public:
+    PropertyReader(const uint8_t *src, size_t size) : src(src), size(size), pos(0) {}
+
+    const uint8_t *readBytes(size_t bytes) {
+        if (bytes > size - pos)
+            return nullptr;
+        pos += bytes;
+        return src + pos - bytes;
+    }
+
+    template<typename T>
+    bool read(T &value) {
+        const uint8_t *p = readBytes(sizeof(value));
+        if (p)
+            memcpy(&value, p, sizeof(value));
+        return !!p;
+    }
+};
+
+struct PersistentCacheData {
+    VSNodeRef *node;
+    const VSVideoInfo *vi;
+    uint8_t *base;
+    uint64_t fileSize;
+    uint64_t slotOffset;
+    uint64_t slotSize;
+#ifdef VS_TARGET_OS_WINDOWS
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    std::atomic<uint32_t> *getState(int n) {
+        return reinterpret_cast<std::atomic<uint32_t> *>(base + pageSize) + n;
+    }
+
+    uint8_t *getSlot(int n) {
+        return base + slotOffset + slotSize * n;
+    }
+};
+
+} // namespace
+
+// the properties are stored as a byte count followed by (key, type, count, values) for every key
+static bool writeProperties(const VSMap *props, uint8_t *dst, const VSAPI *vsapi) {
+    PropertyWriter w(dst + sizeof(uint32_t), propsSize - sizeof(uint32_t));
+    int numKeys = vsapi->propNumKeys(props);
+    for (int i = 0; i < numKeys; i++) {
+        const char *key = vsapi->propGetKey(props, i);
+        char type = vsapi->propGetType(props, key);
+        int numElements = vsapi->propNumElements(props, key);
+        uint32_t keyLength = static_cast<uint32_t>(strlen(key));
+        if (!w.write(keyLength) || !w.writeBytes(key, keyLength) || !w.write(type) || !w.write(numElements))
+            return false;
+
+        for (int j = 0; j < numElements; j++) {
+            if (type == ptInt) {
+                if (!w.write(vsapi->propGetInt(props, key, j, nullptr)))
+                    return false;
+            } else if (type == ptFloat) {
+                if (!w.write(vsapi->propGetFloat(props, key, j, nullptr)))
+                    return false;
+            } else if (type == ptData) {
+                uint32_t length = static_cast<uint32_t>(vsapi->propGetDataSize(props, key, j, nullptr));
+                if (!w.write(length) || !w.writeBytes(vsapi->propGetData(props, key, j, nullptr), length))
+                    return false;
+            } else {
+                // clips, frames and functions only exist in the process that created them
+                return false;
+            }
+        }
+    }
+    uint32_t size = static_cast<uint32_t>(w.getSize());
+    memcpy(dst, &size, sizeof(size));
+    return true;
+}
+
+static bool readProperties(VSMap *props, const uint8_t *src, const VSAPI *vsapi) {
+    uint32_t size;
+    memcpy(&size, src, sizeof(size));
+    if (size > propsSize - sizeof(uint32_t))
+        return false;
+    PropertyReader r(src + sizeof(uint32_t), size);
+
+    uint32_t keyLength;
+    while (r.read(keyLength)) {
+        const uint8_t *keyData = r.readBytes(keyLength);
+        char type;
+        int numElements;
+        if (!keyData || !r.read(type) || !r.read(numElements))
+            return false;
+        std::string key(reinterpret_cast<const char *>(keyData), keyLength);
+
+        for (int j = 0; j < numElements; j++) {
+            if (type == ptInt) {
+                int64_t v;
+                if (!r.read(v))
+                    return false;
+                vsapi->propSetInt(props, key.c_str(), v, paAppend);
+            } else if (type == ptFloat) {
+                double v;
+                if (!r.read(v))
+                    return false;
+                vsapi->propSetFloat(props, key.c_str(), v, paAppend);
+            } else if (type == ptData) {
+                uint32_t length;
+                const uint8_t *data;
+                if (!r.read(length) || !(data = r.readBytes(length)))
+                    return false;
+                vsapi->propSetData(props, key.c_str(), reinterpret_cast<const char *>(data), static_cast<int>(length), paAppend);
+            } else {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool isSameFormat(const VSFrameRef *frame, const VSVideoInfo *vi, const VSAPI *vsapi) {
+    return vsapi->getFrameFormat(frame) == vi->format && vsapi->getFrameWidth(frame, 0) == vi->width && vsapi->getFrameHeight(frame, 0) == vi->height;
+}
+
+static void storeFrame(PersistentCacheData *d, int n, const VSFrameRef *frame, const VSAPI *vsapi) {
+    if (!isSameFormat(frame, d->vi, vsapi))
+        return;
+
+    uint8_t *dst = d->getSlot(n);
+    if (!writeProperties(vsapi->getFramePropsRO(frame), dst, vsapi))
+        return;
+    dst += propsSize;
+
+    const VSFormat *fi = d->vi->format;
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        int rowSize = vsapi->getFrameWidth(frame, plane) * fi->bytesPerSample;
+        int height = vsapi->getFrameHeight(frame, plane);
+        vs_bitblt(dst, rowSize, vsapi->getReadPtr(frame, plane), vsapi->getStride(frame, plane), rowSize, height);
+        dst += static_cast<size_t>(rowSize) * height;
+    }
+
+    // other processes may be reading the file at the same time so the frame is only marked as stored once it's complete
+    d->getState(n)->store(fsStored, std::memory_order_release);
+}
+
+static const VSFrameRef *loadFrame(PersistentCacheData *d, int n, VSCore *core, const VSAPI *vsapi) {
+    if (d->getState(n)->load(std::memory_order_acquire) != fsStored)
+        return nullptr;
+
+    const uint8_t *src = d->getSlot(n);
+    VSFrameRef *frame = vsapi->newVideoFrame(d->vi->format, d->vi->width, d->vi->height, nullptr, core);
+    if (!readProperties(vsapi->getFramePropsRW(frame), src, vsapi)) {
+        vsapi->freeFrame(frame);
+        return nullptr;
+    }
+    src += propsSize;
+
+    const VSFormat *fi = d->vi->format;
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        int rowSize = vsapi->getFrameWidth(frame, plane) * fi->bytesPerSample;
+        int height = vsapi->getFrameHeight(frame, plane);
+        vs_bitblt(vsapi->getWritePtr(frame, plane), vsapi->getStride(frame, plane), src, rowSize, rowSize, height);
+        src += static_cast<size_t>(rowSize) * height;
+    }
+    return frame;
+}
+
+static void unmapFile(PersistentCacheData *d) {
+#ifdef VS_TARGET_OS_WINDOWS
+    if (d->base)
+        UnmapViewOfFile(d->base);
+    if (d->mapping)
+        CloseHandle(d->mapping);
+    if (d->file != INVALID_HANDLE_VALUE)
+        CloseHandle(d->file);
+#else
+    if (d->base)
+        munmap(d->base, static_cast<size_t>(d->fileSize));
+#endif
+}
+
+static bool mapFile(PersistentCacheData *d, const std::string &filename) {
+#ifdef VS_TARGET_OS_WINDOWS
+    d->file = CreateFileW(utf16_from_utf8(filename).c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (d->file == INVALID_HANDLE_VALUE)
+        return false;
+    // mapping the file extends it to the full size so it has to be sparse to not allocate space for every frame
+    DWORD bytesReturned;
+    DeviceIoControl(d->file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &bytesReturned, nullptr);
+    d->mapping = CreateFileMappingW(d->file, nullptr, PAGE_READWRITE, static_cast<DWORD>(d->fileSize >> 32), static_cast<DWORD>(d->fileSize & 0xFFFFFFFF), nullptr);
+    if (!d->mapping)
+        return false;
+    d->base = static_cast<uint8_t *>(MapViewOfFile(d->mapping, FILE_MAP_ALL_ACCESS, 0, 0, static_cast<size_t>(d->fileSize)));
+    return !!d->base;
+#else
+    int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) || (static_cast<uint64_t>(st.st_size) < d->fileSize && ftruncate(fd, static_cast<off_t>(d->fileSize)))) {
+        close(fd);
+        return false;
+    }
+    void *ptr = mmap(nullptr, static_cast<size_t>(d->fileSize), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return false;
+    d->base = static_cast<uint8_t *>(ptr);
+    return true;
+#endif
+}
+
+static void VS_CC persistentCacheInit(VSMap *in, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi) {
+    PersistentCacheData *d = static_cast<PersistentCacheData *>(*instanceData);
+    vsapi->setVideoInfo(d->vi, 1, node);
+}
+
+static const VSFrameRef *VS_CC persistentCacheGetFrame(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    PersistentCacheData *d = static_cast<PersistentCacheData *>(*instanceData);
+
+    if (activationReason == arInitial) {
+        const VSFrameRef *frame = loadFrame(d, n, core, vsapi);
+        if (frame)
+            return frame;
+        vsapi->requestFrameFilter(n, d->node, frameCtx);
+    } else if (activationReason == arAllFramesReady) {
+        const VSFrameRef *frame = vsapi->getFrameFilter(n, d->node, frameCtx);
+        storeFrame(d, n, frame, vsapi);
+        return frame;
+    }
+
+    return nullptr;
+}
+
+static void VS_CC persistentCacheFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    PersistentCacheData *d = static_cast<PersistentCacheData *>(instanceData);
+    unmapFile(d);
+    vsapi->freeNode(d->node);
+    delete d;
+}
+
+static void VS_CC persistentCacheCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<PersistentCacheData> d(new PersistentCacheData());
+    d->node = vsapi->propGetNode(in, "clip", 0, nullptr);
+    d->vi = vsapi->getVideoInfo(d->node);
+#ifdef VS_TARGET_OS_WINDOWS
+    d->file = INVALID_HANDLE_VALUE;
+#endif
+
+    uint64_t graphHash = d->node->clip->getGraphHash(d->node->index);
+
+    try {
+        if (!isConstantFormat(d->vi))
+            throw std::runtime_error("only clips with constant format and dimensions are supported");
+        if (!graphHash)
+            throw std::runtime_error("the clip can't be identified between runs, this happens when a filter upstream takes a function or a frame as an argument");
+
+        const VSFormat *fi = d->vi->format;
+        uint64_t frameSize = 0;
+        for (int plane = 0; plane < fi->numPlanes; plane++) {
+            int w = d->vi->width >> (plane ? fi->subSamplingW : 0);
+            int h = d->vi->height >> (plane ? fi->subSamplingH : 0);
+            frameSize += static_cast<uint64_t>(w) * h * fi->bytesPerSample;
+        }
+        d->slotSize = alignPage(propsSize + frameSize);
+        d->slotOffset = pageSize + alignPage(static_cast<uint64_t>(d->vi->numFrames) * sizeof(uint32_t));
+        d->fileSize = d->slotOffset + d->slotSize * d->vi->numFrames;
+        if (d->fileSize > std::numeric_limits<size_t>::max())
+            throw std::runtime_error("the clip is too big to be mapped into memory");
+
+        const char *path = vsapi->propGetData(in, "path", 0, nullptr);
+        char name[32];
+        snprintf(name, sizeof(name), "/%016" PRIx64 ".vspc", graphHash);
+        std::string filename = std::string(path) + name;
+
+        if (!mapFile(d.get(), filename)) {
+            unmapFile(d.get());
+            throw std::runtime_error("failed to open " + filename);
+        }
+
+        FileHeader expected = {};
+        memcpy(expected.magic, fileMagic, sizeof(fileMagic));
+        expected.version = fileVersion;
+        expected.numFrames = d->vi->numFrames;
+        expected.graphHash = graphHash;
+        expected.colorFamily = fi->colorFamily;
+        expected.sampleType = fi->sampleType;
+        expected.bitsPerSample = fi->bitsPerSample;
+        expected.subSamplingW = fi->subSamplingW;
+        expected.subSamplingH = fi->subSamplingH;
+        expected.width = d->vi->width;
+        expected.height = d->vi->height;
+        expected.slotSize = d->slotSize;
+
+        // a new file is all zero, several processes may create it at the same time but they all write the same header
+        FileHeader *header = reinterpret_cast<FileHeader *>(d->base);
+        if (!memcmp(header->magic, "\0\0\0\0\0\0\0\0", sizeof(header->magic))) {
+            *header = expected;
+        } else if (memcmp(header, &expected, sizeof(expected))) {
+            unmapFile(d.get());
+            throw std::runtime_error(filename + " was created by a different version or doesn't belong to this clip, delete it to continue");
+        }
+    } catch (std::runtime_error &e) {
+        vsapi->freeNode(d->node);
+        vsapi->setError(out, (std::string("PersistentCache: ") + e.what()).c_str());
+        return;
+    }
+
+    vsapi->createFilter(in, out, "PersistentCache", persistentCacheInit, persistentCacheGetFrame, persistentCacheFree, fmParallel, 0, d.release(), core);
+}
+
+//////////////////////////////////////////
+// Init
+
+void VS_CC persistentCacheInitialize(VSConfigPlugin configFunc, VSRegisterFunction registerFunc, VSPlugin *plugin) {
+    registerFunc("PersistentCache", "clip:clip;path:data;", persistentCacheCreate, nullptr, plugin);
+}
@@ -0,0 +1,209 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "pluginmanifest.h"
+#include "VapourSynth.h"
+#include "version.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#ifdef VS_TARGET_OS_WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "../common/vsutf16.h"
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// bump when the layout below changes
+static const int manifestFormat = 1;
+
+// The file consists of tab separated lines:
+//   VapourSynthPluginManifest <format> <core version> <api version>
+//   file <key> <stamp> <is plugin>
+//   plugin <filename> <id> <namespace> <full name> <api major> <api minor> <read only>
+//   function <name> <arguments>
+// where the plugin and function lines belong to the file line before them.
+
+static std::vector<std::string> splitFields(const std::string &line) {
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while (true) {
+        size_t end = line.find('\t', start);
+        fields.push_back(line.substr(start, end == std::string::npos ? std::string::npos : end - start));
+        if (end == std::string::npos)
+            return fields;
+        start = end + 1;
+    }
+}
+
+static bool isStorable(const std::string &s) {
+    return s.find_first_of("\t\r\n") == std::string::npos;
+}
+
+static bool isStorable(const std::string &key, const VSPluginManifestEntry &entry) {
+    if (!isStorable(key) || !isStorable(entry.filename) || !isStorable(entry.id) || !isStorable(entry.fnamespace) || !isStorable(entry.fullname))
+        return false;
+    for (const auto &iter : entry.functions)
+        if (!isStorable(iter.first) || !isStorable(iter.second))
+            return false;
+    return true;
+}
+
+static FILE *openFile(const std::string &path, bool write) {
+#ifdef VS_TARGET_OS_WINDOWS
+    return _wfopen(utf16_from_utf8(path).c_str(), write ? L"wb" : L"rb");
+#else
+    return fopen(path.c_str(), write ? "wb" : "rb");
+#endif
+}
+
+static void createParentDirs(const std::string &path) {
+    for (size_t pos = path.find_first_of("/\\", 1); pos != std::string::npos; pos = path.find_first_of("/\\", pos + 1)) {
+        std::string dir = path.substr(0, pos);
+#ifdef VS_TARGET_OS_WINDOWS
+        if (dir.size() > 2 || dir.back() != ':')
+            CreateDirectory(utf16_from_utf8(dir).c_str(), nullptr);
+#else
+        mkdir(dir.c_str(), 0755);
+#endif
+    }
+}
+
+VSPluginManifest::VSPluginManifest(const std::string &path) : path(path), changed(false) {
+    read();
+}
+
+void VSPluginManifest::read() {
+    FILE *f = openFile(path, false);
+    if (!f)
+        return;
+
+    std::string data;
+    char buf[4096];
+    size_t bytes;
+    while ((bytes = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, bytes);
+    fclose(f);
+
+    std::map<std::string, VSPluginManifestEntry> entries;
+    VSPluginManifestEntry *current = nullptr;
+    bool headerSeen = false;
+    size_t start = 0;
+
+    while (start < data.size()) {
+        size_t end = data.find('\n', start);
+        if (end == std::string::npos)
+            return; // truncated, the last line is always terminated
+        std::vector<std::string> fields = splitFields(data.substr(start, end - start));
+        start = end + 1;
+
+        const std::string &type = fields[0];
+        if (!headerSeen) {
+            if (type != "VapourSynthPluginManifest" || fields.size() != 4 || fields[1] != std::to_string(manifestFormat)
+                || fields[2] != std::to_string(VAPOURSYNTH_CORE_VERSION) || fields[3] != std::to_string(VAPOURSYNTH_API_VERSION))
+                return;
+            headerSeen = true;
+        } else if (type == "file" && fields.size() == 4) {
+            VSPluginManifestEntry &entry = entries[fields[1]];
+            entry = VSPluginManifestEntry();
+            entry.stamp = strtoull(fields[2].c_str(), nullptr, 16);
+            entry.isPlugin = (fields[3] == "1");
+            current = &entry;
+        } else if (type == "plugin" && fields.size() == 8 && current && current->isPlugin) {
+            current->filename = fields[1];
+            current->id = fields[2];
+            current->fnamespace = fields[3];
+            current->fullname = fields[4];
+            current->apiMajor = atoi(fields[5].c_str());
+            current->apiMinor = atoi(fields[6].c_str());
+            current->readOnly = (fields[7] == "1");
+        } else if (type == "function" && fields.size() == 3 && current && current->isPlugin) {
+            current->functions.push_back(std::make_pair(fields[1], fields[2]));
+        } else {
+            // something else wrote this, better to start over than to trust any of it
+            return;
+        }
+    }
+
+    // a plugin line is required for every plugin so a partially written entry can't be used
+    for (const auto &iter : entries)
+        if (iter.second.isPlugin && iter.second.id.empty())
+            return;
+
+    cached.swap(entries);
+}
+
+const VSPluginManifestEntry *VSPluginManifest::find(const std::string &key, uint64_t stamp) {
+    auto iter = cached.find(key);
+    if (iter == cached.end() || iter->second.stamp != stamp)
+        return nullptr;
+    return &(found[key] = iter->second);
+}
+
+void VSPluginManifest::add(const std::string &key, const VSPluginManifestEntry &entry) {
+    found[key] = entry;
+    changed = true;
+}
+
+void VSPluginManifest::save() {
+    if (path.empty() || (!changed && found.size() == cached.size()))
+        return;
+
+    std::string data = "VapourSynthPluginManifest\t" + std::to_string(manifestFormat) + "\t" + std::to_string(VAPOURSYNTH_CORE_VERSION) + "\t" + std::to_string(VAPOURSYNTH_API_VERSION) + "\n";
+    for (const auto &iter : found) {
+        const VSPluginManifestEntry &entry = iter.second;
+        if (!isStorable(iter.first, entry))
+            continue;
+        char stamp[17];
+        snprintf(stamp, sizeof(stamp), "%016llx", static_cast<unsigned long long>(entry.stamp));
+        data += "file\t" + iter.first + "\t" + stamp + "\t" + (entry.isPlugin ? "1" : "0") + "\n";
+        if (!entry.isPlugin)
+            continue;
+        data += "plugin\t" + entry.filename + "\t" + entry.id + "\t" + entry.fnamespace + "\t" + entry.fullname + "\t"
+            + std::to_string(entry.apiMajor) + "\t" + std::to_string(entry.apiMinor) + "\t" + (entry.readOnly ? "1" : "0") + "\n";
+        for (const auto &func : entry.functions)
+            data += "function\t" + func.first + "\t" + func.second + "\n";
+    }
+
+    // several processes may start at the same time so the new manifest only replaces the old one once it's complete
+    static std::atomic<unsigned> counter(0);
+#ifdef VS_TARGET_OS_WINDOWS
+    std::string tempPath = path + "." + std::to_string(GetCurrentProcessId()) + "." + std::to_string(counter++) + ".tmp";
+#else
+    std::string tempPath = path + "." + std::to_string(getpid()) + "." + std::to_string(counter++) + ".tmp";
+#endif
+
+    createParentDirs(path);
+    FILE *f = openFile(tempPath, true);
+    if (!f)
+        return;
+    bool ok = (fwrite(data.data(), 1, data.size(), f) == data.size());
+    ok = !fclose(f) && ok;
+
+#ifdef VS_TARGET_OS_WINDOWS
+    if (!ok || !MoveFileEx(utf16_from_utf8(tempPath).c_str(), utf16_from_utf8(path).c_str(), MOVEFILE_REPLACE_EXISTING))
+        _wremove(utf16_from_utf8(tempPath).c_str());
+#else
+    if (!ok || rename(tempPath.c_str(), path.c_str()))
+        remove(tempPath.c_str());
+#endif
+}
@@ -0,0 +1,64 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef PLUGINMANIFEST_H
+#define PLUGINMANIFEST_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What autoloading found out about a file in a plugin directory the last time it was loaded
+struct VSPluginManifestEntry {
+    uint64_t stamp; // size and modification time of the file, the entry is only used while it matches
+    bool isPlugin; // files that failed to load are remembered too so they aren't retried every time
+    std::string filename; // the resolved path the plugin gets loaded from
+    std::string id;
+    std::string fnamespace;
+    std::string fullname;
+    int apiMajor;
+    int apiMinor;
+    bool readOnly;
+    std::vector<std::pair<std::string, std::string>> functions; // name and argument string
+    VSPluginManifestEntry() : stamp(0), isPlugin(false), apiMajor(0), apiMinor(0), readOnly(false) {}
+};
+
+// The manifest is a text file in the user's cache directory keyed by the path autoloading found
+// each file at. Everything from a different core version is discarded and the file is only written
+// back when something was added or went away.
+class VSPluginManifest {
+private:
+    std::string path;
+    std::map<std::string, VSPluginManifestEntry> cached;
+    std::map<std::string, VSPluginManifestEntry> found;
+    bool changed;
+    void read();
+public:
+    explicit VSPluginManifest(const std::string &path);
+    // returns the cached entry if the file hasn't changed since and marks it as still present
+    const VSPluginManifestEntry *find(const std::string &key, uint64_t stamp);
+    void add(const std::string &key, const VSPluginManifestEntry &entry);
+    // failures are ignored, the plugins simply get loaded the slow way next time as well
+    void save();
+};
+
+#endif // PLUGINMANIFEST_H
@@ -199,18 +199,8 @@ static const VSFrameRef *VS_CC cropGetframe(int n, int activationReason, void **
             return NULL;
         }
 
-        VSFrameRef *dst = vsapi->newVideoFrame(fi, d->width, d->height, src, core);
-
-        for (int plane = 0; plane < fi->numPlanes; plane++) {
-            int srcstride = vsapi->getStride(src, plane);
-            int dststride = vsapi->getStride(dst, plane);
-            const uint8_t *srcdata = vsapi->getReadPtr(src, plane);
-            uint8_t *dstdata = vsapi->getWritePtr(dst, plane);
-            srcdata += srcstride * (y >> (plane ? fi->subSamplingH : 0));
-            srcdata += (d->x >> (plane ? fi->subSamplingW : 0)) * fi->bytesPerSample;
-            vs_bitblt(dstdata, dststride, srcdata, srcstride, (d->width >> (plane ? fi->subSamplingW : 0)) * fi->bytesPerSample, vsapi->getFrameHeight(dst, plane));
-        }
-
+        // usually shares the pixels with src
+        VSFrameRef *dst = vsapi->cropFrame(src, d->x, y, d->width, d->height, core);
         vsapi->freeFrame(src);
 
         if (d->y & 1) {
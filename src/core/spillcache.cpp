@@ -0,0 +1,216 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "spillcache.h"
+#include "VSHelper.h"
+#include <cstring>
+#include <climits>
+#include <iterator>
+#include <atomic>
+#ifdef VS_TARGET_OS_WINDOWS
+#include "../common/vsutf16.h"
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
+#endif
+
+// keeps every frame page aligned in the file
+static const size_t spillAlignment = 4096;
+
+VSSpillStore::VSSpillStore(const std::string &path, size_t maxBytes) : tick(0), usedBytes(0), maxBytes((maxBytes / spillAlignment) * spillAlignment), base(nullptr) {
+    if (this->maxBytes == 0)
+        throw VSException("Spill cache size must be at least 4096 bytes");
+
+#ifdef VS_TARGET_OS_WINDOWS
+    static std::atomic<unsigned> fileCounter(0);
+    std::wstring filename = utf16_from_utf8(path) + L"\\vsspill-" + std::to_wstring(GetCurrentProcessId()) + L"-" + std::to_wstring(fileCounter++) + L".tmp";
+    file = CreateFileW(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw VSException("Failed to create spill file in " + path);
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(this->maxBytes) >> 32), static_cast<DWORD>(this->maxBytes & 0xFFFFFFFF), nullptr);
+    if (mapping)
+        base = static_cast<uint8_t *>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, this->maxBytes));
+    if (!base) {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        throw VSException("Failed to map spill file in " + path);
+    }
+#else
+    std::string templ = path + "/vsspill-XXXXXX";
+    std::vector<char> filename(templ.begin(), templ.end());
+    filename.push_back(0);
+    int fd = mkstemp(filename.data());
+    if (fd < 0)
+        throw VSException("Failed to create spill file in " + path);
+    // the file is only reachable through the mapping so nothing is left behind, even after a crash
+    unlink(filename.data());
+    if (ftruncate(fd, this->maxBytes)) {
+        close(fd);
+        throw VSException("Failed to resize spill file in " + path);
+    }
+    void *ptr = mmap(nullptr, this->maxBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw VSException("Failed to map spill file in " + path);
+    base = static_cast<uint8_t *>(ptr);
+#endif
+
+    freeSpace.insert(std::make_pair(0, this->maxBytes));
+}
+
+VSSpillStore::~VSSpillStore() {
+#ifdef VS_TARGET_OS_WINDOWS
+    UnmapViewOfFile(base);
+    CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    munmap(base, maxBytes);
+#endif
+}
+
+size_t VSSpillStore::getPackedSize(const VSFrame *frame) {
+    const VSFormat *fi = frame->getFormat();
+    size_t bytes = 0;
+    for (int plane = 0; plane < fi->numPlanes; plane++)
+        bytes += static_cast<size_t>(frame->getWidth(plane)) * fi->bytesPerSample * frame->getHeight(plane);
+    return bytes;
+}
+
+bool VSSpillStore::allocate(size_t bytes, size_t &offset) {
+    bytes = (bytes + spillAlignment - 1) & ~(spillAlignment - 1);
+    if (bytes > maxBytes)
+        return false;
+
+    while (true) {
+        for (auto iter = freeSpace.begin(); iter != freeSpace.end(); ++iter) {
+            if (iter->second >= bytes) {
+                offset = iter->first;
+                if (iter->second > bytes)
+                    freeSpace.insert(std::make_pair(iter->first + bytes, iter->second - bytes));
+                freeSpace.erase(iter);
+                usedBytes += bytes;
+                return true;
+            }
+        }
+
+        if (index.empty())
+            return false;
+
+        // drop the least recently used frame and try again, the freed range is merged with its neighbors
+        auto victim = index.begin();
+        for (auto iter = index.begin(); iter != index.end(); ++iter)
+            if (iter->second.tick < victim->second.tick)
+                victim = iter;
+        release(victim->second.offset, victim->second.bytes);
+        index.erase(victim);
+    }
+}
+
+void VSSpillStore::release(size_t offset, size_t bytes) {
+    bytes = (bytes + spillAlignment - 1) & ~(spillAlignment - 1);
+    usedBytes -= bytes;
+    auto next = freeSpace.lower_bound(offset);
+    if (next != freeSpace.end() && offset + bytes == next->first) {
+        bytes += next->second;
+        next = freeSpace.erase(next);
+    }
+    if (next != freeSpace.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            prev->second += bytes;
+            return;
+        }
+    }
+    freeSpace.insert(std::make_pair(offset, bytes));
+}
+
+bool VSSpillStore::store(const void *owner, int n, const PVideoFrame &frame, int64_t cost) {
+    // frames with clips or functions attached would keep the filter graph alive
+    const VSMap &props = frame->getConstProperties();
+    for (int i = 0; i < vs_internal_vsapi.propNumKeys(&props); i++) {
+        char t = vs_internal_vsapi.propGetType(&props, vs_internal_vsapi.propGetKey(&props, i));
+        if (t == ptNode || t == ptFunction)
+            return false;
+    }
+
+    Key key(owner, n);
+    size_t bytes = getPackedSize(frame.get());
+    size_t offset;
+
+    {
+        std::lock_guard<std::mutex> l(lock);
+        auto iter = index.find(key);
+        if (iter != index.end()) {
+            // frames are always the same for the same number so it only has to be marked as used
+            iter->second.tick = ++tick;
+            return true;
+        }
+        if (!allocate(bytes, offset))
+            return false;
+    }
+
+    // the range isn't reachable by anything else until it's added to the index so it can be written without the lock
+    const VSFormat *fi = frame->getFormat();
+    uint8_t *dst = base + offset;
+    for (int plane = 0; plane < fi->numPlanes; plane++) {
+        size_t rowSize = static_cast<size_t>(frame->getWidth(plane)) * fi->bytesPerSample;
+        int height = frame->getHeight(plane);
+        vs_bitblt(dst, static_cast<int>(rowSize), frame->getReadPtr(plane), frame->getStride(plane), rowSize, height);
+        dst += rowSize * height;
+    }
+
+    std::lock_guard<std::mutex> l(lock);
+    if (!index.insert(std::make_pair(key, Entry{ offset, bytes, fi, frame->getWidth(0), frame->getHeight(0), props, cost, ++tick })).second)
+        release(offset, bytes);
+    return true;
+}
+
+PVideoFrame VSSpillStore::load(const void *owner, int n, VSCore *core, int64_t &cost) {
+    std::lock_guard<std::mutex> l(lock);
+    auto iter = index.find(Key(owner, n));
+    if (iter == index.end())
+        return PVideoFrame();
+
+    Entry &e = iter->second;
+    e.tick = ++tick;
+    cost = e.cost;
+
+    PVideoFrame frame = core->newVideoFrame(e.format, e.width, e.height, nullptr);
+    const uint8_t *src = base + e.offset;
+    for (int plane = 0; plane < e.format->numPlanes; plane++) {
+        size_t rowSize = static_cast<size_t>(frame->getWidth(plane)) * e.format->bytesPerSample;
+        int height = frame->getHeight(plane);
+        vs_bitblt(frame->getWritePtr(plane), frame->getStride(plane), src, static_cast<int>(rowSize), rowSize, height);
+        src += rowSize * height;
+    }
+    frame->setProperties(e.properties);
+    return frame;
+}
+
+void VSSpillStore::removeAll(const void *owner) {
+    std::lock_guard<std::mutex> l(lock);
+    auto iter = index.lower_bound(Key(owner, INT_MIN));
+    while (iter != index.end() && iter->first.first == owner) {
+        release(iter->second.offset, iter->second.bytes);
+        iter = index.erase(iter);
+    }
+}
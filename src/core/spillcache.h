@@ -0,0 +1,76 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef SPILLCACHE_H
+#define SPILLCACHE_H
+
+#include "vscore.h"
+#include <map>
+#include <mutex>
+
+// A second cache tier for frames dropped by the caches that opted in. The frames are stored
+// without padding in a memory mapped temporary file so the OS takes care of writing them out
+// when memory is needed. The file has a fixed size and the least recently used frames are
+// dropped when it's full.
+class VSSpillStore {
+private:
+    typedef std::pair<const void *, int> Key;
+
+    struct Entry {
+        size_t offset;
+        size_t bytes;
+        const VSFormat *format;
+        int width;
+        int height;
+        VSMap properties;
+        int64_t cost;
+        uint64_t tick;
+    };
+
+    std::mutex lock;
+    std::map<Key, Entry> index;
+    std::map<size_t, size_t> freeSpace; // offset -> size of the unused ranges in the file
+    uint64_t tick;
+    size_t usedBytes;
+    size_t maxBytes;
+    uint8_t *base;
+#ifdef VS_TARGET_OS_WINDOWS
+    HANDLE file;
+    HANDLE mapping;
+#endif
+
+    static size_t getPackedSize(const VSFrame *frame);
+    bool allocate(size_t bytes, size_t &offset);
+    void release(size_t offset, size_t bytes);
+public:
+    VSSpillStore(const std::string &path, size_t maxBytes);
+    ~VSSpillStore();
+
+    // owner is only used to tell the frames of different caches apart
+    bool store(const void *owner, int n, const PVideoFrame &frame, int64_t cost);
+    PVideoFrame load(const void *owner, int n, VSCore *core, int64_t &cost);
+    void removeAll(const void *owner);
+
+    size_t getMaxBytes() const {
+        return maxBytes;
+    }
+};
+
+#endif // SPILLCACHE_H
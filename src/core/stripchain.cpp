@@ -0,0 +1,215 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "stripchain.h"
+#include "VSHelper.h"
+#include <climits>
+#include <cstring>
+
+static const size_t maxStripSteps = 16;
+// the rows of every filter and input frame touched while processing a strip should fit in this
+static const size_t stripCacheSize = 256 * 1024;
+static const int minStripHeight = 16;
+static const int stripsPerRange = 2;
+
+int VSStripChain::addInput(VSNodeRef *ref) {
+    // caches are looked through, the rows of a filter in the chain never have to leave the cpu cache
+    const VSNodeRef *source = ref;
+    while (const VSNodeRef *cached = source->clip->getCacheSource())
+        source = cached;
+
+    VSNode *node = source->clip.get();
+    if (node->getRegion && (stepIndex.count(node) || stepIndex.size() < maxStripSteps))
+        return ~addStep(node);
+
+    for (size_t i = 0; i < leaves.size(); i++)
+        if (leaves[i]->clip == ref->clip && leaves[i]->index == ref->index)
+            return static_cast<int>(i);
+    leaves.push_back(ref);
+    return static_cast<int>(leaves.size() - 1);
+}
+
+int VSStripChain::addStep(VSNode *node) {
+    auto iter = stepIndex.find(node);
+    if (iter != stepIndex.end())
+        return iter->second;
+
+    // reserved before the inputs are added so the limit also counts the steps in progress
+    stepIndex[node] = -1;
+    Step step = {};
+    step.node = node;
+    for (VSNodeRef *ref : node->regionInputs)
+        step.inputs.push_back(addInput(ref));
+    steps.push_back(step);
+    return stepIndex[node] = static_cast<int>(steps.size() - 1);
+}
+
+VSStripChain *VSStripChain::create(VSNode *node) {
+    std::unique_ptr<VSStripChain> chain(new VSStripChain());
+    chain->addStep(node);
+    if (chain->steps.size() < 2)
+        return nullptr;
+
+    const VSVideoInfo &vi = node->vi[0];
+
+    int input = chain->steps.back().inputs[node->regionPropSource];
+    while (input < 0) {
+        const Step &step = chain->steps[~input];
+        input = step.inputs[step.node->regionPropSource];
+    }
+    chain->propLeaf = input;
+
+    // every step may need the rows around the strip that all the steps after it need
+    int apron = 0;
+    size_t rowSize = 0;
+    for (const Step &step : chain->steps) {
+        apron += step.node->regionApron;
+        rowSize += static_cast<size_t>(vi.width) * step.node->vi[0].format->bytesPerSample;
+    }
+    for (const VSNodeRef *ref : chain->leaves)
+        rowSize += static_cast<size_t>(vi.width) * ref->clip->getVideoInfo(ref->index).format->bytesPerSample;
+
+    chain->stripHeight = std::min(vi.height, std::max(static_cast<int>(stripCacheSize / rowSize), minStripHeight));
+
+    for (size_t i = 0; i < chain->steps.size() - 1; i++) {
+        Step &step = chain->steps[i];
+        step.stride = (vi.width * step.node->vi[0].format->bytesPerSample + 63) & ~63;
+        step.bufferOffset = chain->bufferSize;
+        chain->bufferSize += static_cast<size_t>(step.stride) * (chain->stripHeight + 2 * apron);
+    }
+
+    return chain.release();
+}
+
+// the buffer of a step only holds the rows that are needed but is addressed as if it was the whole plane
+uint8_t *VSStripChain::rowZero(uint8_t *buffer, const Step &step, int first) {
+    return buffer + step.bufferOffset - static_cast<ptrdiff_t>(first) * step.stride;
+}
+
+struct VSStripChain::StripJob {
+    VSStripChain *chain;
+    const std::vector<const VSFrameRef *> *src;
+    VSFrameRef *dst;
+    int plane;
+};
+
+void VS_CC VSStripChain::processStripRange(int begin, int end, void *userData) {
+    const StripJob *job = static_cast<const StripJob *>(userData);
+    job->chain->processStrips(*job->src, job->dst, job->plane, begin, end);
+}
+
+// produces strips [begin, end) of a plane, every range of strips gets its own buffer
+void VSStripChain::processStrips(const std::vector<const VSFrameRef *> &src, VSFrameRef *dst, int plane, int begin, int end) {
+    int width = vs_internal_vsapi.getFrameWidth(dst, plane);
+    int height = vs_internal_vsapi.getFrameHeight(dst, plane);
+    uint8_t *buffer = vs_aligned_malloc<uint8_t>(bufferSize, 64);
+
+    // rows [first, second) of each step that have to be in its buffer for the current strip
+    std::vector<std::pair<int, int>> rows(steps.size());
+    // the rows already in the buffer, what's left over from the previous strip doesn't have to be made again
+    std::vector<std::pair<int, int>> done(steps.size());
+    std::vector<const uint8_t *> srcp;
+    std::vector<int> srcStride;
+
+    for (int strip = begin; strip < end; strip++) {
+        int top = strip * stripHeight;
+
+        // work out which rows each step has to produce, starting from the end
+        std::fill(rows.begin(), rows.end(), std::make_pair(INT_MAX, INT_MIN));
+        rows.back() = std::make_pair(top, std::min(top + stripHeight, height));
+        for (size_t i = steps.size(); i-- > 0;) {
+            if (rows[i].first < done[i].first || rows[i].first > done[i].second)
+                done[i] = std::make_pair(rows[i].first, rows[i].first);
+            int apron = steps[i].node->regionApron;
+            int first = std::max(done[i].second - apron, 0);
+            int last = std::min(rows[i].second + apron, height);
+            for (int input : steps[i].inputs) {
+                if (input < 0) {
+                    rows[~input].first = std::min(rows[~input].first, first);
+                    rows[~input].second = std::max(rows[~input].second, last);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < steps.size(); i++) {
+            const Step &step = steps[i];
+            srcp.clear();
+            srcStride.clear();
+            for (int input : step.inputs) {
+                if (input >= 0) {
+                    srcp.push_back(vs_internal_vsapi.getReadPtr(src[input], plane));
+                    srcStride.push_back(vs_internal_vsapi.getStride(src[input], plane));
+                } else {
+                    srcp.push_back(rowZero(buffer, steps[~input], rows[~input].first));
+                    srcStride.push_back(steps[~input].stride);
+                }
+            }
+
+            uint8_t *dstp;
+            int dstStride;
+            if (i == steps.size() - 1) {
+                dstp = vs_internal_vsapi.getWritePtr(dst, plane);
+                dstStride = vs_internal_vsapi.getStride(dst, plane);
+            } else {
+                // the rows still needed are moved to the start of the buffer
+                uint8_t *start = buffer + step.bufferOffset;
+                if (rows[i].first > done[i].first)
+                    memmove(start, start + static_cast<ptrdiff_t>(rows[i].first - done[i].first) * step.stride, static_cast<size_t>(done[i].second - rows[i].first) * step.stride);
+                dstp = rowZero(buffer, step, rows[i].first);
+                dstStride = step.stride;
+            }
+
+            if (done[i].second < rows[i].second)
+                step.node->getRegion(srcp.data(), srcStride.data(), dstp, dstStride, plane, width, height, done[i].second, rows[i].second, step.node->instanceData);
+            done[i] = rows[i];
+        }
+    }
+
+    vs_aligned_free(buffer);
+}
+
+const VSFrameRef *VSStripChain::getFrame(int n, int activationReason, VSFrameContext &frameCtx) {
+    if (activationReason == arInitial) {
+        for (VSNodeRef *ref : leaves)
+            vs_internal_vsapi.requestFrameFilter(n, ref, &frameCtx);
+        return nullptr;
+    } else if (activationReason != arAllFramesReady) {
+        return nullptr;
+    }
+
+    std::vector<const VSFrameRef *> src;
+    for (VSNodeRef *ref : leaves)
+        src.push_back(vs_internal_vsapi.getFrameFilter(n, ref, &frameCtx));
+
+    VSNode *root = steps.back().node;
+    const VSVideoInfo &vi = root->vi[0];
+    VSFrameRef *dst = vs_internal_vsapi.newVideoFrame(vi.format, vi.width, vi.height, src[propLeaf], root->core);
+
+    for (int plane = 0; plane < vi.format->numPlanes; plane++) {
+        int height = vs_internal_vsapi.getFrameHeight(dst, plane);
+        StripJob job = { this, &src, dst, plane };
+        // the apron rows are made twice where two ranges meet so a range should be a few strips
+        root->core->threadPool->parallelFor(processStripRange, &job, (height + stripHeight - 1) / stripHeight, stripsPerRange);
+    }
+
+    for (const VSFrameRef *f : src)
+        vs_internal_vsapi.freeFrame(f);
+    return dst;
+}
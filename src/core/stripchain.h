@@ -0,0 +1,60 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef STRIPCHAIN_H
+#define STRIPCHAIN_H
+
+#include "vscore.h"
+
+// Produces the frames of a region capable filter together with the region capable filters it
+// gets its input from, one horizontal strip at a time. Only the frames of the other filters are
+// requested, the rows of the filters in between are kept in buffers small enough to stay in the
+// cache until the next filter has used them. Idle worker threads help by taking ranges of strips.
+class VSStripChain {
+private:
+    struct Step {
+        VSNode *node;
+        std::vector<int> inputs; // index into leaves when >= 0, ~index into steps otherwise
+        size_t bufferOffset;
+        int stride;
+    };
+
+    std::vector<VSNodeRef *> leaves;
+    std::vector<Step> steps; // ordered so inputs come first, the last one is the filter the chain belongs to
+    std::map<VSNode *, int> stepIndex;
+    int propLeaf;
+    int stripHeight;
+    size_t bufferSize;
+
+    VSStripChain() : propLeaf(0), stripHeight(0), bufferSize(0) {}
+    int addInput(VSNodeRef *ref);
+    int addStep(VSNode *node);
+    struct StripJob;
+
+    static uint8_t *rowZero(uint8_t *buffer, const Step &step, int first);
+    static void VS_CC processStripRange(int begin, int end, void *userData);
+    void processStrips(const std::vector<const VSFrameRef *> &src, VSFrameRef *dst, int plane, int begin, int end);
+public:
+    // returns null when no other filter can be processed together with node
+    static VSStripChain *create(VSNode *node);
+    const VSFrameRef *getFrame(int n, int activationReason, VSFrameContext &frameCtx);
+};
+
+#endif // STRIPCHAIN_H
@@ -21,7 +21,9 @@
 #include "vscore.h"
 #include "cpufeatures.h"
 #include "vslog.h"
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <string>
 
@@ -70,16 +72,41 @@ static uint8_t *VS_CC getWritePtr(VSFrameRef *frame, int plane) VS_NOEXCEPT {
     return frame->frame->getWritePtr(plane);
 }
 
-static void VS_CC getFrameAsync(int n, VSNodeRef *clip, VSFrameDoneCallback fdc, void *userData) VS_NOEXCEPT {
+static void VS_CC getFrameAsyncCancellable(int n, VSNodeRef *clip, VSFrameDoneCallback fdc, void *userData, int priority, int64_t deadline, VSCancelToken *token) VS_NOEXCEPT {
     assert(clip && fdc);
+    priority = std::max<int>(rpSpeculative, std::min<int>(priority, rpInteractive));
+    // the deadline is given in milliseconds from now
+    int64_t deadlineTime = INT64_MAX;
+    if (deadline > 0)
+        deadlineTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() + std::min<int64_t>(deadline, INT64_MAX / 4000000) * 1000000;
+    PFrameContext ctx(std::make_shared<FrameContext>(n, clip->index, clip, fdc, userData, true, priority, deadlineTime, token ? token->cancelled : PCancelFlag()));
     int numFrames = clip->clip->getVideoInfo(clip->index).numFrames;
-    if (n < 0 || (numFrames && n >= numFrames)) {
-        PFrameContext ctx(std::make_shared<FrameContext>(n, clip->index, clip, fdc, userData));
+    if (n < 0 || (numFrames && n >= numFrames))
         ctx->setError("Invalid frame number " + std::to_string(n) + " requested, clip only has " + std::to_string(numFrames) + " frames");
-        clip->clip->getFrame(ctx);
-    } else {
-        clip->clip->getFrame(std::make_shared<FrameContext>(n, clip->index, clip, fdc, userData));
-    }
+    clip->clip->getFrame(ctx);
+}
+
+static void VS_CC getFrameAsyncPriority(int n, VSNodeRef *clip, VSFrameDoneCallback fdc, void *userData, int priority, int64_t deadline) VS_NOEXCEPT {
+    getFrameAsyncCancellable(n, clip, fdc, userData, priority, deadline, nullptr);
+}
+
+static void VS_CC getFrameAsync(int n, VSNodeRef *clip, VSFrameDoneCallback fdc, void *userData) VS_NOEXCEPT {
+    getFrameAsyncCancellable(n, clip, fdc, userData, rpNormal, 0, nullptr);
+}
+
+static VSCancelToken *VS_CC createCancelToken(VSCore *core) VS_NOEXCEPT {
+    assert(core);
+    return new VSCancelToken(core);
+}
+
+static void VS_CC cancelRequests(VSCancelToken *token) VS_NOEXCEPT {
+    assert(token);
+    *token->cancelled = true;
+    token->core->threadPool->cancelQueued();
+}
+
+static void VS_CC freeCancelToken(VSCancelToken *token) VS_NOEXCEPT {
+    delete token;
 }
 
 struct GetFrameWaiter {
@@ -166,6 +193,11 @@ static VSFrameRef *VS_CC copyFrame(const VSFrameRef *frame, VSCore *core) VS_NOE
     return new VSFrameRef(core->copyFrame(frame->frame));
 }
 
+static VSFrameRef *VS_CC cropFrame(const VSFrameRef *f, int left, int top, int width, int height, VSCore *core) VS_NOEXCEPT {
+    assert(f && core);
+    return new VSFrameRef(core->cropFrame(f->frame, left, top, width, height));
+}
+
 static void VS_CC copyFrameProps(const VSFrameRef *src, VSFrameRef *dst, VSCore *core) VS_NOEXCEPT {
     assert(src && dst && core);
     core->copyFrameProps(src->frame, dst->frame);
@@ -426,6 +458,26 @@ static VSMap *VS_CC getPlugins(VSCore *core) VS_NOEXCEPT {
     return new VSMap(core->getPlugins());
 }
 
+static int VS_CC setProfiling(int enable, VSCore *core) VS_NOEXCEPT {
+    assert(core);
+    return core->setProfiling(enable);
+}
+
+static VSMap *VS_CC getProfile(VSCore *core) VS_NOEXCEPT {
+    assert(core);
+    return new VSMap(core->getProfile());
+}
+
+static int VS_CC setTracing(int enable, VSCore *core) VS_NOEXCEPT {
+    assert(core);
+    return core->threadPool->setTracing(enable);
+}
+
+static int VS_CC saveTrace(const char *filename, VSCore *core) VS_NOEXCEPT {
+    assert(filename && core);
+    return core->threadPool->saveTrace(filename);
+}
+
 static VSMap *VS_CC getFunctions(VSPlugin *plugin) VS_NOEXCEPT {
     assert(plugin);
     return new VSMap(plugin->getFunctions());
@@ -556,6 +608,26 @@ static void VS_CC getCoreInfo2(VSCore *core, VSCoreInfo *info) VS_NOEXCEPT {
     core->getCoreInfo2(*info);
 }
 
+static int VS_CC setLargePages(int enable, VSCore *core) VS_NOEXCEPT {
+    assert(core);
+    return core->memory->setLargePages(enable);
+}
+
+static int64_t VS_CC getLargePageMemory(VSCore *core) VS_NOEXCEPT {
+    assert(core);
+    return core->memory->getLargePageMemory();
+}
+
+static void VS_CC setRegionSupport(VSFilterGetRegion getRegion, VSNodeRef **inputs, int numInputs, int apron, int propSource, VSNode *node) VS_NOEXCEPT {
+    assert(getRegion && (inputs || numInputs == 0) && node);
+    node->setRegionSupport(getRegion, inputs, numInputs, apron, propSource);
+}
+
+static void VS_CC parallelFor(VSParallelFunc func, void *userData, int count, int grain, VSCore *core) VS_NOEXCEPT {
+    assert(func && core);
+    core->threadPool->parallelFor(func, userData, count, grain);
+}
+
 
 
 const VSAPI vs_internal_vsapi = {
@@ -648,7 +720,22 @@ const VSAPI vs_internal_vsapi = {
     &logMessage,
     &addMessageHandler,
     &removeMessageHandler,
-    &getCoreInfo2
+    &getCoreInfo2,
+
+    &setLargePages,
+    &getLargePageMemory,
+    &setRegionSupport,
+    &parallelFor,
+    &cropFrame,
+    &setProfiling,
+    &getProfile,
+    &setTracing,
+    &saveTrace,
+    &getFrameAsyncPriority,
+    &createCancelToken,
+    &cancelRequests,
+    &freeCancelToken,
+    &getFrameAsyncCancellable
 };
 
 ///////////////////////////////
@@ -25,11 +25,15 @@
 #ifndef VS_TARGET_OS_WINDOWS
 #include <dirent.h>
 #include <cstddef>
+#include <cstdio>
 #include <unistd.h>
+#include <sys/mman.h>
 #include "settings.h"
 #endif
 #include <cassert>
+#include <sys/stat.h>
 #include <queue>
+#include <fstream>
 
 #ifdef VS_TARGET_CPU_X86
 #include "x86utils.h"
@@ -44,6 +48,9 @@
 // Internal filter headers
 #include "internalfilters.h"
 #include "cachefilter.h"
+#include "spillcache.h"
+#include "pluginmanifest.h"
+#include "stripchain.h"
 
 #ifdef VS_TARGET_OS_DARWIN
 #define thread_local __thread
@@ -70,6 +77,64 @@ static bool isValidIdentifier(const std::string &s) {
     return true;
 }
 
+static const uint64_t hashSeed = 14695981039346656037ULL;
+
+// FNV-1a, it's only used to tell filter graphs apart so speed doesn't matter much
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash;
+}
+
+template<typename T>
+static uint64_t hashValue(uint64_t hash, const T &value) {
+    return hashBytes(hash, &value, sizeof(value));
+}
+
+static uint64_t hashString(uint64_t hash, const std::string &s) {
+    hash = hashValue(hash, s.size());
+    return hashBytes(hash, s.data(), s.size());
+}
+
+// strings that name a file also include the size, identity and change times of it so a changed file isn't mistaken for the old one,
+// the times have sub-second precision since a plugin can easily be rebuilt within the same second
+static uint64_t hashFileStamp(uint64_t hash, const std::string &path) {
+    if (path.empty() || path.size() > 32767 || path.find('\0') != std::string::npos)
+        return hash;
+#ifdef VS_TARGET_OS_WINDOWS
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(utf16_from_utf8(path).c_str(), GetFileExInfoStandard, &data) || (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        return hash;
+    hash = hashValue(hash, data.nFileSizeHigh);
+    hash = hashValue(hash, data.nFileSizeLow);
+    hash = hashValue(hash, data.ftLastWriteTime);
+    return hashValue(hash, data.ftCreationTime);
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) || !S_ISREG(st.st_mode))
+        return hash;
+    hash = hashValue(hash, static_cast<int64_t>(st.st_size));
+    hash = hashValue(hash, static_cast<uint64_t>(st.st_dev));
+    hash = hashValue(hash, static_cast<uint64_t>(st.st_ino));
+#ifdef VS_TARGET_OS_DARWIN
+    const struct timespec &mtime = st.st_mtimespec;
+    const struct timespec &ctime = st.st_ctimespec;
+#else
+    const struct timespec &mtime = st.st_mtim;
+    const struct timespec &ctime = st.st_ctim;
+#endif
+    hash = hashValue(hash, static_cast<int64_t>(mtime.tv_sec));
+    hash = hashValue(hash, static_cast<int64_t>(mtime.tv_nsec));
+    hash = hashValue(hash, static_cast<int64_t>(ctime.tv_sec));
+    return hashValue(hash, static_cast<int64_t>(ctime.tv_nsec));
+#endif
+}
+
+// identifies the function call that's currently creating filters on this thread, see VSPlugin::invoke()
+static thread_local uint64_t invokeHash = 0;
+static thread_local unsigned invokeSequence = 0;
+
 #ifdef VS_TARGET_OS_WINDOWS
 static std::wstring readRegistryValue(const wchar_t *keyName, const wchar_t *valueName) {
     HKEY hKey;
@@ -91,11 +156,24 @@ static std::wstring readRegistryValue(const wchar_t *keyName, const wchar_t *val
 #endif
 
 FrameContext::FrameContext(int n, int index, VSNode *clip, const PFrameContext &upstreamContext) :
-    reqOrder(upstreamContext->reqOrder), numFrameRequests(0), n(n), clip(clip), upstreamContext(upstreamContext), userData(nullptr), frameDone(nullptr), error(false), lockOnOutput(true), node(nullptr), lastCompletedN(-1), index(index), lastCompletedNode(nullptr), frameContext(nullptr) {
+    reqOrder(upstreamContext->reqOrder.load()), priority(upstreamContext->priority.load()), deadline(upstreamContext->deadline.load()), cancelFlag(upstreamContext->cancelFlag), cancellable(!!cancelFlag), numFrameRequests(0), n(n), clip(clip), upstreamContext(upstreamContext), userData(nullptr), frameDone(nullptr), error(false), abandoned(false), lockOnOutput(true), node(nullptr), lastCompletedN(-1), index(index), lastCompletedNode(nullptr), cost(0), frameContext(nullptr) {
 }
 
-FrameContext::FrameContext(int n, int index, VSNodeRef *node, VSFrameDoneCallback frameDone, void *userData, bool lockOnOutput) :
-    reqOrder(0), numFrameRequests(0), n(n), clip(node->clip.get()), userData(userData), frameDone(frameDone), error(false), lockOnOutput(lockOnOutput), node(node), lastCompletedN(-1), index(index), lastCompletedNode(nullptr), frameContext(nullptr) {
+FrameContext::FrameContext(int n, int index, VSNodeRef *node, VSFrameDoneCallback frameDone, void *userData, bool lockOnOutput, int priority, int64_t deadline, const PCancelFlag &cancelFlag) :
+    reqOrder(0), priority(priority), deadline(deadline), cancelFlag(cancelFlag), cancellable(!!cancelFlag), numFrameRequests(0), n(n), clip(node->clip.get()), userData(userData), frameDone(frameDone), error(false), abandoned(false), lockOnOutput(lockOnOutput), node(node), lastCompletedN(-1), index(index), lastCompletedNode(nullptr), cost(0), frameContext(nullptr) {
+}
+
+// a frame is only abandoned when nobody else waits for it, every context it's produced for has to be
+// cancellable all the way up to the request, merging a request with a different flag clears it on the way
+bool FrameContext::isCancellable() const {
+    for (const FrameContext *ctx = this; ctx; ctx = ctx->upstreamContext.get())
+        if (!ctx->cancellable)
+            return false;
+    return true;
+}
+
+bool FrameContext::isCancelled() const {
+    return cancelFlag && *cancelFlag && isCancellable();
 }
 
 bool FrameContext::setError(const std::string &errorMsg) {
@@ -124,53 +202,69 @@ void ExtFunction::call(const VSMap *in, VSMap *out) {
 
 ///////////////
 
-VSVariant::VSVariant(VSVType vtype) : vtype(vtype), internalSize(0), storage(nullptr) {
-}
-
-VSVariant::VSVariant(const VSVariant &v) : vtype(v.vtype), internalSize(v.internalSize), storage(nullptr) {
-    if (internalSize) {
-        switch (vtype) {
-        case VSVariant::vInt:
-            storage = new IntList(*reinterpret_cast<IntList *>(v.storage)); break;
-        case VSVariant::vFloat:
-            storage = new FloatList(*reinterpret_cast<FloatList *>(v.storage)); break;
-        case VSVariant::vData:
-            storage = new DataList(*reinterpret_cast<DataList *>(v.storage)); break;
-        case VSVariant::vNode:
-            storage = new NodeList(*reinterpret_cast<NodeList *>(v.storage)); break;
-        case VSVariant::vFrame:
-            storage = new FrameList(*reinterpret_cast<FrameList *>(v.storage)); break;
-        case VSVariant::vMethod:
-            storage = new FuncList(*reinterpret_cast<FuncList *>(v.storage)); break;
-        default:;
-        }
-    }
+VSVariant::VSVariant(VSVType vtype) : vtype(vtype), internalSize(0), outOfLine(nullptr) {
+    value.storage = nullptr;
 }
 
-VSVariant::VSVariant(VSVariant &&v) : vtype(v.vtype), internalSize(v.internalSize), storage(v.storage) {
+VSVariant::VSVariant(const VSVariant &v) : vtype(v.vtype), internalSize(v.internalSize), value(v.value), outOfLine(v.outOfLine.load(std::memory_order_acquire)) {
+    if (VSArrayBase *storage = sharedStorage())
+        storage->addRef();
+    if (VSArrayBase *a = outOfLine.load(std::memory_order_relaxed))
+        a->addRef();
+}
+
+VSVariant::VSVariant(VSVariant &&v) : vtype(v.vtype), internalSize(v.internalSize), value(v.value), outOfLine(v.outOfLine.load(std::memory_order_relaxed)) {
+    v.outOfLine.store(nullptr, std::memory_order_relaxed);
     v.vtype = vUnset;
-    v.storage = nullptr;
+    v.value.storage = nullptr;
     v.internalSize = 0;
 }
 
 VSVariant::~VSVariant() {
-    if (storage) {
-        switch (vtype) {
-        case VSVariant::vInt:
-            delete reinterpret_cast<IntList *>(storage); break;
-        case VSVariant::vFloat:
-            delete reinterpret_cast<FloatList *>(storage); break;
-        case VSVariant::vData:
-            delete reinterpret_cast<DataList *>(storage); break;
-        case VSVariant::vNode:
-            delete reinterpret_cast<NodeList *>(storage); break;
-        case VSVariant::vFrame:
-            delete reinterpret_cast<FrameList *>(storage); break;
-        case VSVariant::vMethod:
-            delete reinterpret_cast<FuncList *>(storage); break;
-        default:;
-        }
+    if (VSArrayBase *storage = sharedStorage())
+        storage->release();
+    releaseOutOfLine();
+}
+
+// only called when nothing else can be using the variant so no other thread can be creating the array
+void VSVariant::releaseOutOfLine() {
+    if (VSArrayBase *a = outOfLine.load(std::memory_order_relaxed)) {
+        outOfLine.store(nullptr, std::memory_order_relaxed);
+        a->release();
+    }
+}
+
+VSVariant &VSVariant::operator=(const VSVariant &v) {
+    if (VSArrayBase *storage = v.sharedStorage())
+        storage->addRef();
+    VSArrayBase *a = v.outOfLine.load(std::memory_order_acquire);
+    if (a)
+        a->addRef();
+    if (VSArrayBase *storage = sharedStorage())
+        storage->release();
+    releaseOutOfLine();
+    vtype = v.vtype;
+    internalSize = v.internalSize;
+    value = v.value;
+    outOfLine.store(a, std::memory_order_relaxed);
+    return *this;
+}
+
+VSVariant &VSVariant::operator=(VSVariant &&v) {
+    if (this != &v) {
+        if (VSArrayBase *storage = sharedStorage())
+            storage->release();
+        releaseOutOfLine();
+        vtype = v.vtype;
+        internalSize = v.internalSize;
+        value = v.value;
+        outOfLine.store(v.outOfLine.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        v.outOfLine.store(nullptr, std::memory_order_relaxed);
+        v.vtype = vUnset;
+        v.value.storage = nullptr;
+        v.internalSize = 0;
     }
+    return *this;
 }
 
 size_t VSVariant::size() const {
@@ -181,62 +275,80 @@ VSVariant::VSVType VSVariant::getType() const {
     return vtype;
 }
 
-void VSVariant::append(int64_t val) {
-    initStorage(vInt);
-    reinterpret_cast<IntList *>(storage)->push_back(val);
+template<typename T>
+bool VSVariant::appendInline(const T &val, std::true_type) {
+    if (internalSize == 0) {
+        *inlineValue(static_cast<T *>(nullptr)) = val;
+        internalSize++;
+        return true;
+    }
+    // the second value moves both of them to an array
+    VSArray<T> *a = new VSArray<T>();
+    a->data.push_back(*inlineValue(static_cast<T *>(nullptr)));
+    value.storage = a;
+    return false;
+}
+
+template<typename T>
+void VSVariant::appendValue(VSVType t, const T &val) {
+    assert(vtype == vUnset || vtype == t);
+    vtype = t;
+    releaseOutOfLine();
+    if (isInline()) {
+        if (appendInline(val, VSInlineType<T>()))
+            return;
+    } else if (!value.storage) {
+        value.storage = new VSArray<T>();
+    } else if (!value.storage->unique()) {
+        VSArrayBase *copy = value.storage->clone();
+        value.storage->release();
+        value.storage = copy;
+    }
+    static_cast<VSArray<T> *>(value.storage)->data.push_back(val);
     internalSize++;
 }
 
+void VSVariant::append(int64_t val) {
+    appendValue(vInt, val);
+}
+
 void VSVariant::append(double val) {
-    initStorage(vFloat);
-    reinterpret_cast<FloatList *>(storage)->push_back(val);
-    internalSize++;
+    appendValue(vFloat, val);
 }
 
 void VSVariant::append(const std::string &val) {
-    initStorage(vData);
-    reinterpret_cast<DataList *>(storage)->push_back(std::make_shared<std::string>(val));
-    internalSize++;
+    appendValue(vData, std::make_shared<std::string>(val));
 }
 
 void VSVariant::append(const VSNodeRef &val) {
-    initStorage(vNode);
-    reinterpret_cast<NodeList *>(storage)->push_back(val);
-    internalSize++;
+    appendValue(vNode, val);
 }
 
 void VSVariant::append(const PVideoFrame &val) {
-    initStorage(vFrame);
-    reinterpret_cast<FrameList *>(storage)->push_back(val);
-    internalSize++;
+    appendValue(vFrame, val);
 }
 
 void VSVariant::append(const PExtFunction &val) {
-    initStorage(vMethod);
-    reinterpret_cast<FuncList *>(storage)->push_back(val);
-    internalSize++;
+    appendValue(vMethod, val);
 }
 
-void VSVariant::initStorage(VSVType t) {
-    assert(vtype == vUnset || vtype == t);
-    vtype = t;
-    if (!storage) {
-        switch (t) {
-        case VSVariant::vInt:
-            storage = new IntList(); break;
-        case VSVariant::vFloat:
-            storage = new FloatList(); break;
-        case VSVariant::vData:
-            storage = new DataList(); break;
-        case VSVariant::vNode:
-            storage = new NodeList(); break;
-        case VSVariant::vFrame:
-            storage = new FrameList(); break;
-        case VSVariant::vMethod:
-            storage = new FuncList(); break;
-        default:;
-        }
-    }
+///////////////
+
+static const std::string *internKey(const std::string &key) {
+    static const std::vector<std::string> atoms = {
+        "_AbsoluteTime", "_Alpha", "_ChromaLocation", "_ColorRange", "_Combed", "_DurationDen", "_DurationNum", "_Error",
+        "_Field", "_FieldBased", "_Matrix", "_PictType", "_Primaries", "_SARDen", "_SARNum", "_SceneChangeNext",
+        "_SceneChangePrev", "_Transfer"
+    };
+    if (key.empty() || key[0] != '_')
+        return nullptr;
+    auto iter = std::lower_bound(atoms.begin(), atoms.end(), key);
+    return (iter != atoms.end() && *iter == key) ? &*iter : nullptr;
+}
+
+VSMapKey::VSMapKey(const std::string &key) : atom(internKey(key)) {
+    if (!atom)
+        name = std::make_shared<const std::string>(key);
 }
 
 ///////////////
@@ -304,6 +416,17 @@ static bool isWindowsLargePageBroken() {
 
         CloseHandle(token);
         return true;
+#elif defined(VS_TARGET_OS_LINUX) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+        // explicit huge pages need to be reserved by the administrator so transparent huge pages are the fallback,
+        // only when they're completely disabled is there nothing that can be done
+        std::ifstream f("/sys/kernel/mm/transparent_hugepage/enabled");
+        std::string mode;
+        if (std::getline(f, mode) && mode.find("[never]") != std::string::npos) {
+            std::ifstream h("/proc/sys/vm/nr_hugepages");
+            long reserved = 0;
+            return (h >> reserved) && reserved > 0;
+        }
+        return true;
 #else
         return false;
 #endif // VS_TARGET_OS_WINDOWS
@@ -322,7 +445,7 @@ static bool isWindowsLargePageBroken() {
     return size;
 }
 
-void *MemoryUse::allocateLargePage(size_t bytes) const {
+void *MemoryUse::allocateLargePage(size_t bytes) {
     if (!largePageEnabled)
         return nullptr;
 
@@ -336,29 +459,66 @@ void *MemoryUse::allocateLargePage(size_t bytes) const {
         return nullptr;
 
     void *ptr = nullptr;
+    bool advised = false;
 #ifdef VS_TARGET_OS_WINDOWS
     ptr = VirtualAlloc(nullptr, allocBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
-#else
-    ptr = vs_aligned_malloc(allocBytes, VSFrame::alignment);
+#elif defined(VS_TARGET_OS_LINUX) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+    // use the explicitly reserved huge pages first, they're guaranteed to be backed by huge pages
+    ptr = mmap(nullptr, allocBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr == MAP_FAILED) {
+        // map some extra so the start can be aligned to a huge page boundary and the whole range is eligible for transparent huge pages
+        size_t mapBytes = allocBytes + granularity;
+        uint8_t *base = static_cast<uint8_t *>(mmap(nullptr, mapBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (base == MAP_FAILED)
+            return nullptr;
+        uint8_t *aligned = reinterpret_cast<uint8_t *>((reinterpret_cast<uintptr_t>(base) + granularity - 1) & ~(granularity - 1));
+        if (aligned > base)
+            munmap(base, aligned - base);
+        if (base + mapBytes > aligned + allocBytes)
+            munmap(aligned + allocBytes, (base + mapBytes) - (aligned + allocBytes));
+        if (madvise(aligned, allocBytes, MADV_HUGEPAGE)) {
+            munmap(aligned, allocBytes);
+            return nullptr;
+        }
+        ptr = aligned;
+        advised = true;
+    }
 #endif
     if (!ptr)
         return nullptr;
 
     BlockHeader *header = new (ptr) BlockHeader;
-    header->size = allocBytes - VSFrame::alignment;
+    header->size = bytes;
     header->large = true;
+    header->advised = advised;
+    header->numaNode = -1;
+    if (advised) {
+        std::lock_guard<std::mutex> lock(advisedLock);
+        advisedRanges[reinterpret_cast<uintptr_t>(ptr)] = allocBytes;
+    } else {
+        largePageMemory += allocBytes;
+    }
     return ptr;
 }
 
-void MemoryUse::freeLargePage(void *ptr) const {
+void MemoryUse::freeLargePage(void *ptr) {
+    const BlockHeader *header = static_cast<const BlockHeader *>(ptr);
+    size_t granularity = largePageSize();
+    size_t allocBytes = (VSFrame::alignment + header->size + (granularity - 1)) & ~(granularity - 1);
+    if (header->advised) {
+        std::lock_guard<std::mutex> lock(advisedLock);
+        advisedRanges.erase(reinterpret_cast<uintptr_t>(ptr));
+    } else {
+        largePageMemory -= allocBytes;
+    }
 #ifdef VS_TARGET_OS_WINDOWS
     VirtualFree(ptr, 0, MEM_RELEASE);
-#else
-    vs_aligned_free(ptr);
+#elif defined(VS_TARGET_OS_LINUX) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+    munmap(ptr, allocBytes);
 #endif
 }
 
-void *MemoryUse::allocateMemory(size_t bytes) const {
+void *MemoryUse::allocateMemory(size_t bytes) {
     void *ptr = allocateLargePage(bytes);
     if (ptr)
         return ptr;
@@ -370,10 +530,11 @@ void *MemoryUse::allocateMemory(size_t bytes) const {
     BlockHeader *header = new (ptr) BlockHeader;
     header->size = bytes;
     header->large = false;
+    header->numaNode = -1;
     return ptr;
 }
 
-void MemoryUse::freeMemory(void *ptr) const {
+void MemoryUse::freeMemory(void *ptr) {
     const BlockHeader *header = static_cast<const BlockHeader *>(ptr);
     if (header->large)
         freeLargePage(ptr);
@@ -385,8 +546,15 @@ bool MemoryUse::isGoodFit(size_t requested, size_t actual) const {
     return actual <= requested + requested / 8;
 }
 
+static thread_local size_t threadBytesAllocated = 0;
+
 void MemoryUse::add(size_t bytes) {
     used.fetch_add(bytes);
+    threadBytesAllocated += bytes;
+}
+
+size_t MemoryUse::allocatedByThread() {
+    return threadBytesAllocated;
 }
 
 void MemoryUse::subtract(size_t bytes) {
@@ -395,49 +563,213 @@ void MemoryUse::subtract(size_t bytes) {
         delete this;
 }
 
-uint8_t *MemoryUse::allocBuffer(size_t bytes) {
+/* static */ size_t MemoryUse::sizeClass(size_t bytes) {
+    // eight classes per power of two so no more than 1/8 of a buffer is ever wasted, the same as the good fit rule
+    size_t step = VSFrame::alignment;
+    while (step * 16 <= bytes)
+        step *= 2;
+    return (bytes + step - 1) & ~(step - 1);
+}
+
+// protects the owner pointers of the thread caches and keeps the maps from going away while an instance retires its caches
+static std::mutex threadCacheMapLock;
+
+void MemoryUse::ThreadCacheMap::prune() {
+    std::lock_guard<std::mutex> guard(lock);
+    for (uint64_t id : retired)
+        caches.erase(id);
+    retired.clear();
+    hasRetired = false;
+}
+
+MemoryUse::ThreadCacheMap *&MemoryUse::currentThreadCacheMap() {
+    static thread_local ThreadCacheMap *map = nullptr;
+    return map;
+}
+
+MemoryUse::ThreadCacheMapReleaser::~ThreadCacheMapReleaser() {
+    ThreadCacheMap *&map = currentThreadCacheMap();
+    std::lock_guard<std::mutex> guard(threadCacheMapLock);
+    map->prune();
+    for (auto &iter : map->caches) {
+        ThreadCache *cache = iter.second;
+        std::vector<uint8_t *> buffers;
+        {
+            std::lock_guard<std::mutex> lock(cache->mem->mutex);
+            buffers.swap(cache->buffers);
+            cache->orphaned = true;
+        }
+        for (uint8_t *buf : buffers)
+            cache->mem->addToDepot(buf);
+    }
+    delete map;
+    map = nullptr;
+}
+
+MemoryUse::ThreadCache *MemoryUse::getThreadCache() {
+    ThreadCacheMap *map = currentThreadCacheMap();
+    if (map) {
+        if (map->hasRetired)
+            map->prune();
+        auto iter = map->caches.find(id);
+        if (iter != map->caches.end())
+            return iter->second;
+    }
+    return addThreadCache();
+}
+
+MemoryUse::ThreadCache *MemoryUse::addThreadCache() {
+    ThreadCacheMap *&map = currentThreadCacheMap();
+    std::lock_guard<std::mutex> guard(threadCacheMapLock);
+    if (!map) {
+        map = new ThreadCacheMap();
+#ifndef VS_TARGET_OS_DARWIN
+        // the map of a thread is leaked when it exits with the __thread fallback
+        static thread_local ThreadCacheMapReleaser releaser;
+        (void)releaser;
+#endif
+    }
+
+    ThreadCache *cache = new ThreadCache(this, map);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // the buffers of exited threads are already in the depot
+        threadCaches.erase(std::remove_if(threadCaches.begin(), threadCaches.end(), [](const std::unique_ptr<ThreadCache> &c) { return c->orphaned; }), threadCaches.end());
+        threadCaches.emplace_back(cache);
+    }
+    map->caches[id] = cache;
+    return cache;
+}
+
+void MemoryUse::flushThreadCache(ThreadCache *cache) {
+    cache->flush = false;
+    for (uint8_t *buf : cache->buffers)
+        addToDepot(buf);
+    cache->buffers.clear();
+    trim();
+}
+
+void MemoryUse::addToDepot(uint8_t *buf) {
     std::lock_guard<std::mutex> lock(mutex);
-    auto iter = buffers.lower_bound(bytes);
-    if (iter != buffers.end()) {
-        if (isGoodFit(bytes, iter->first)) {
-            unusedBufferSize -= iter->first;
-            uint8_t *buf = iter->second;
-            buffers.erase(iter);
-            return buf + VSFrame::alignment;
+    const BlockHeader *header = reinterpret_cast<const BlockHeader *>(buf);
+    depot[std::make_pair(header->numaNode, header->size)].push_back({ buf, ++tick });
+}
+
+void MemoryUse::trim() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    size_t memoryUsed = used;
+    if (memoryUsed + unusedBufferSize <= maxMemoryUse)
+        return;
+
+    if (!memoryWarningIssued) {
+        vsWarning("Script exceeded memory limit. Consider raising cache size.");
+        memoryWarningIssued = true;
+    }
+
+    // free the buffers that have been unused the longest first but weigh in the size
+    // so a big buffer is released before many small ones that were returned at almost the same time
+    while (memoryUsed + unusedBufferSize > maxMemoryUse && !depot.empty()) {
+        auto victim = depot.begin();
+        uint64_t victimScore = 0;
+        for (auto iter = depot.begin(); iter != depot.end(); ++iter) {
+            uint64_t score = (tick - iter->second.front().tick + 1) * (iter->first.second / VSFrame::alignment);
+            if (score >= victimScore) {
+                victim = iter;
+                victimScore = score;
+            }
+        }
+
+        unusedBufferSize -= victim->first.second;
+        freeMemory(victim->second.front().buf);
+        victim->second.pop_front();
+        if (victim->second.empty())
+            depot.erase(victim);
+    }
+
+    // buffers sitting in the thread caches are the last resort since they're the most likely to be reused soon,
+    // the threads move them to the depot the next time they allocate or free a buffer
+    if (memoryUsed + unusedBufferSize > maxMemoryUse)
+        for (auto &cache : threadCaches)
+            cache->flush = true;
+}
+
+uint8_t *MemoryUse::allocBuffer(size_t bytes) {
+    size_t classSize = sizeClass(bytes);
+    int numaNode = VSThreadPool::getCurrentNumaNode();
+    uint8_t *buf = nullptr;
+
+    ThreadCache *cache = getThreadCache();
+    if (cache->flush)
+        flushThreadCache(cache);
+    for (size_t i = cache->buffers.size(); i > 0; i--) {
+        if (reinterpret_cast<const BlockHeader *>(cache->buffers[i - 1])->size == classSize) {
+            buf = cache->buffers[i - 1];
+            cache->buffers.erase(cache->buffers.begin() + (i - 1));
+            break;
+        }
+    }
+
+    if (!buf) {
+        std::lock_guard<std::mutex> lock(mutex);
+        // only buffers already on the current thread's numa node are reused
+        auto iter = depot.find(std::make_pair(numaNode, classSize));
+        if (iter != depot.end()) {
+            buf = iter->second.back().buf;
+            iter->second.pop_back();
+            if (iter->second.empty())
+                depot.erase(iter);
+        }
+    }
+
+    if (buf) {
+        unusedBufferSize -= classSize;
+    } else {
+        buf = static_cast<uint8_t *>(allocateMemory(classSize));
+        // recycled buffers keep their placement so only new memory has to be bound
+        if (numaNode >= 0) {
+            VSThreadPool::bindToCurrentNumaNode(buf, VSFrame::alignment + classSize);
+            reinterpret_cast<BlockHeader *>(buf)->numaNode = numaNode;
         }
     }
 
-    uint8_t *buf = static_cast<uint8_t *>(allocateMemory(bytes));
     return buf + VSFrame::alignment;
 }
 
 void MemoryUse::freeBuffer(uint8_t *buf) {
     assert(buf);
 
-    std::lock_guard<std::mutex> lock(mutex);
     buf -= VSFrame::alignment;
 
     const BlockHeader *header = reinterpret_cast<const BlockHeader *>(buf);
     if (!header->size)
         vsFatal("Memory corruption detected. Windows bug?");
 
-    buffers.emplace(std::make_pair(header->size, buf));
     unusedBufferSize += header->size;
 
-    size_t memoryUsed = used;
-    while (memoryUsed + unusedBufferSize > maxMemoryUse && !buffers.empty()) {
-        if (!memoryWarningIssued) {
-            vsWarning("Script exceeded memory limit. Consider raising cache size.");
-            memoryWarningIssued = true;
+    // a buffer from another numa node is only useful to the threads on that node
+    uint8_t *overflow = buf;
+    if (header->numaNode == VSThreadPool::getCurrentNumaNode()) {
+        ThreadCache *cache = getThreadCache();
+        if (cache->flush)
+            flushThreadCache(cache);
+        cache->buffers.push_back(buf);
+        overflow = nullptr;
+        if (cache->buffers.size() > threadCacheSize) {
+            overflow = cache->buffers.front();
+            cache->buffers.erase(cache->buffers.begin());
         }
-        std::uniform_int_distribution<size_t> randSrc(0, buffers.size() - 1);
-        auto iter = buffers.begin();
-        std::advance(iter, randSrc(generator));
-        assert(unusedBufferSize >= iter->first);
-        unusedBufferSize -= iter->first;
-        freeMemory(iter->second);
-        buffers.erase(iter);
     }
+
+    if (overflow)
+        addToDepot(overflow);
+
+    if (used + unusedBufferSize > maxMemoryUse)
+        trim();
+}
+
+/* static */ int MemoryUse::getNumaNode(const uint8_t *buf) {
+    return reinterpret_cast<const BlockHeader *>(buf - VSFrame::alignment)->numaNode;
 }
 
 size_t MemoryUse::memoryUse() {
@@ -456,6 +788,58 @@ int64_t MemoryUse::setMaxMemoryUse(int64_t bytes) {
     return maxMemoryUse;
 }
 
+bool MemoryUse::setLargePages(int enable) {
+    // buffers that are already allocated keep their type, only new allocations are affected
+    if (enable >= 0)
+        largePageEnabled = enable && largePageSupported();
+    return largePageEnabled;
+}
+
+size_t MemoryUse::getTransparentHugePageMemory() {
+    // the kernel decides on its own which parts of advised memory get huge pages so ask it how much of the advised ranges it backed
+    size_t total = 0;
+#if defined(VS_TARGET_OS_LINUX) && defined(MAP_HUGETLB) && defined(MADV_HUGEPAGE)
+    std::lock_guard<std::mutex> lock(advisedLock);
+    if (advisedRanges.empty())
+        return 0;
+
+    std::ifstream smaps("/proc/self/smaps");
+    std::string line;
+    unsigned long start = 0;
+    unsigned long end = 0;
+    size_t overlap = 0;
+    while (std::getline(smaps, line)) {
+        unsigned long s, e;
+        char sep;
+        if (sscanf(line.c_str(), "%lx-%lx%c", &s, &e, &sep) == 3 && sep == ' ') {
+            // a new mapping, work out how much of it is advised memory
+            start = s;
+            end = e;
+            overlap = 0;
+            auto iter = advisedRanges.upper_bound(start);
+            if (iter != advisedRanges.begin())
+                --iter;
+            for (; iter != advisedRanges.end() && iter->first < end; ++iter) {
+                uintptr_t rangeEnd = iter->first + iter->second;
+                if (rangeEnd > start)
+                    overlap += std::min<uintptr_t>(rangeEnd, end) - std::max<uintptr_t>(iter->first, start);
+            }
+        } else if (overlap && !line.compare(0, 14, "AnonHugePages:")) {
+            // a mapping can only partially be ours if the kernel merged it with a neighbour, assume the huge pages are spread evenly
+            size_t hugeBytes = static_cast<size_t>(strtoull(line.c_str() + 14, nullptr, 10) * 1024);
+            if (overlap < end - start)
+                hugeBytes = static_cast<size_t>(static_cast<double>(hugeBytes) * overlap / (end - start));
+            total += hugeBytes;
+        }
+    }
+#endif
+    return total;
+}
+
+size_t MemoryUse::getLargePageMemory() {
+    return largePageMemory + getTransparentHugePageMemory();
+}
+
 bool MemoryUse::isOverLimit() {
     return used > maxMemoryUse;
 }
@@ -466,7 +850,9 @@ void MemoryUse::signalFree() {
         delete this;
 }
 
-MemoryUse::MemoryUse() : used(0), freeOnZero(false), largePageEnabled(largePageSupported()), memoryWarningIssued(false), unusedBufferSize(0) {
+static std::atomic<uint64_t> memoryUseCounter(0);
+
+MemoryUse::MemoryUse() : id(++memoryUseCounter), used(0), freeOnZero(false), largePageEnabled(largePageSupported()), largePageMemory(0), memoryWarningIssued(false), unusedBufferSize(0), tick(0) {
     assert(VSFrame::alignment >= sizeof(BlockHeader));
 
     // If the Windows VirtualAlloc bug is present, it is not safe to use large pages by default,
@@ -474,7 +860,7 @@ MemoryUse::MemoryUse() : used(0), freeOnZero(false), largePageEnabled(largePageS
     //if (isWindowsLargePageBroken())
     //    largePageEnabled = false;
 
-    // Always disable large pages at the moment
+    // Large pages are opt-in at the moment, see setLargePages()
     largePageEnabled = false;
 
     // 1GB
@@ -486,22 +872,35 @@ MemoryUse::MemoryUse() : used(0), freeOnZero(false), largePageEnabled(largePageS
 }
 
 MemoryUse::~MemoryUse() {
-    for (auto &iter : buffers)
-        freeMemory(iter.second);
+    {
+        // the threads drop their map entries the next time they look one up
+        std::lock_guard<std::mutex> guard(threadCacheMapLock);
+        for (auto &cache : threadCaches) {
+            if (cache->orphaned)
+                continue;
+            std::lock_guard<std::mutex> mapLock(cache->owner->lock);
+            cache->owner->retired.push_back(id);
+            cache->owner->hasRetired = true;
+        }
+    }
+
+    for (auto &cache : threadCaches)
+        for (uint8_t *buf : cache->buffers)
+            freeMemory(buf);
+    for (auto &iter : depot)
+        for (auto &entry : iter.second)
+            freeMemory(entry.buf);
 }
 
 ///////////////
 
 VSPlaneData::VSPlaneData(size_t dataSize, MemoryUse &mem) : refCount(1), mem(mem), size(dataSize + 2 * VSFrame::guardSpace) {
-#ifdef VS_FRAME_POOL
     data = mem.allocBuffer(size + 2 * VSFrame::guardSpace);
-#else
-    data = vs_aligned_malloc<uint8_t>(size + 2 * VSFrame::guardSpace, VSFrame::alignment);
-#endif
     assert(data);
     if (!data)
         vsFatal("Failed to allocate memory for planes. Out of memory.");
     mem.add(size);
+    numaNode = MemoryUse::getNumaNode(data);
 #ifdef VS_FRAME_GUARD
     for (size_t i = 0; i < VSFrame::guardSpace / sizeof(VS_FRAME_GUARD_PATTERN); i++) {
         reinterpret_cast<uint32_t *>(data)[i] = VS_FRAME_GUARD_PATTERN;
@@ -510,25 +909,13 @@ VSPlaneData::VSPlaneData(size_t dataSize, MemoryUse &mem) : refCount(1), mem(mem
 #endif
 }
 
-VSPlaneData::VSPlaneData(const VSPlaneData &d) : refCount(1), mem(d.mem), size(d.size) {
-#ifdef VS_FRAME_POOL
-    data = mem.allocBuffer(size);
-#else
-    data = vs_aligned_malloc<uint8_t>(size, VSFrame::alignment);
-#endif
-    assert(data);
-    if (!data)
-        vsFatal("Failed to allocate memory for plane in copy constructor. Out of memory.");
-    mem.add(size);
-    memcpy(data, d.data, size);
+VSPlaneData::VSPlaneData(const VSPlaneData &d, size_t offset, size_t dataSize) : VSPlaneData(dataSize, d.mem) {
+    assert(offset + dataSize <= d.size - 2 * VSFrame::guardSpace);
+    memcpy(data + VSFrame::guardSpace, d.data + VSFrame::guardSpace + offset, dataSize);
 }
 
 VSPlaneData::~VSPlaneData() {
-#ifdef VS_FRAME_POOL
     mem.freeBuffer(data);
-#else
-    vs_aligned_free(data);
-#endif
     mem.subtract(size);
 }
 
@@ -557,15 +944,9 @@ VSFrame::VSFrame(const VSFormat *f, int width, int height, const VSFrame *propSr
     if (propSrc)
         properties = propSrc->properties;
 
-    stride[0] = (width * (f->bytesPerSample) + (alignment - 1)) & ~(alignment - 1);
-
-    if (f->numPlanes == 3) {
-        int plane23 = ((width >> f->subSamplingW) * (f->bytesPerSample) + (alignment - 1)) & ~(alignment - 1);
-        stride[1] = plane23;
-        stride[2] = plane23;
-    } else {
-        stride[1] = 0;
-        stride[2] = 0;
+    for (int i = 0; i < 3; i++) {
+        stride[i] = (i < f->numPlanes) ? planeStride(getWidth(i)) : 0;
+        offset[i] = 0;
     }
 
     data[0] = new VSPlaneData(stride[0] * height, *core->memory);
@@ -586,15 +967,9 @@ VSFrame::VSFrame(const VSFormat *f, int width, int height, const VSFrame * const
     if (propSrc)
         properties = propSrc->properties;
 
-    stride[0] = (width * (f->bytesPerSample) + (alignment - 1)) & ~(alignment - 1);
-
-    if (f->numPlanes == 3) {
-        int plane23 = ((width >> f->subSamplingW) * (f->bytesPerSample) + (alignment - 1)) & ~(alignment - 1);
-        stride[1] = plane23;
-        stride[2] = plane23;
-    } else {
-        stride[1] = 0;
-        stride[2] = 0;
+    for (int i = 0; i < 3; i++) {
+        stride[i] = (i < f->numPlanes) ? planeStride(getWidth(i)) : 0;
+        offset[i] = 0;
     }
 
     for (int i = 0; i < format->numPlanes; i++) {
@@ -605,6 +980,8 @@ VSFrame::VSFrame(const VSFormat *f, int width, int height, const VSFrame * const
                 vsFatal("Error in frame creation: dimensions of plane %d do not match. Source: %dx%d; destination: %dx%d", plane[i], planeSrc[i]->getWidth(plane[i]), planeSrc[i]->getHeight(plane[i]), getWidth(i), getHeight(i));
             data[i] = planeSrc[i]->data[plane[i]];
             data[i]->addRef();
+            // frames with the same width always have the same stride so only the offset of a cropped plane has to be kept
+            offset[i] = planeSrc[i]->offset[plane[i]];
         } else {
             if (i == 0) {
                 data[i] = new VSPlaneData(stride[i] * height, *core->memory);
@@ -630,9 +1007,40 @@ VSFrame::VSFrame(const VSFrame &f) {
     stride[0] = f.stride[0];
     stride[1] = f.stride[1];
     stride[2] = f.stride[2];
+    offset[0] = f.offset[0];
+    offset[1] = f.offset[1];
+    offset[2] = f.offset[2];
     properties = f.properties;
 }
 
+VSFrame::VSFrame(const VSFrame &f, int left, int top, int width, int height, VSCore *core) : format(f.format), data(), width(width), height(height), properties(f.properties) {
+    if (left < 0 || top < 0 || width <= 0 || height <= 0 || left + width > f.width || top + height > f.height)
+        vsFatal("Error in frame cropping: the area %dx%d at %d,%d is outside the %dx%d frame", width, height, left, top, f.width, f.height);
+    if ((left | width) & ((1 << format->subSamplingW) - 1) || (top | height) & ((1 << format->subSamplingH) - 1))
+        vsFatal("Error in frame cropping: the area %dx%d at %d,%d doesn't match the subsampling", width, height, left, top);
+
+    for (int i = 0; i < format->numPlanes; i++) {
+        int ssw = i ? format->subSamplingW : 0;
+        int ssh = i ? format->subSamplingH : 0;
+        size_t leftBytes = static_cast<size_t>(left >> ssw) * format->bytesPerSample;
+        size_t start = f.offset[i] + static_cast<size_t>(top >> ssh) * f.stride[i] + leftBytes;
+        stride[i] = planeStride(getWidth(i));
+
+        // the plane is shared when all the rows stay aligned, the stride is what a new frame of this
+        // width would get and the last row still has its padding, otherwise only the area is copied
+        if (stride[i] == f.stride[i] && leftBytes % alignment == 0 && start + static_cast<size_t>(stride[i]) * getHeight(i) <= f.data[i]->size - 2 * guardSpace) {
+            data[i] = f.data[i];
+            data[i]->addRef();
+            offset[i] = start;
+        } else {
+            size_t rowSize = static_cast<size_t>(getWidth(i)) * format->bytesPerSample;
+            data[i] = new VSPlaneData(static_cast<size_t>(stride[i]) * getHeight(i), *core->memory);
+            offset[i] = 0;
+            vs_bitblt(data[i]->data + guardSpace, stride[i], f.data[i]->data + guardSpace + start, f.stride[i], rowSize, getHeight(i));
+        }
+    }
+}
+
 VSFrame::~VSFrame() {
     data[0]->release();
     if (data[1]) {
@@ -641,6 +1049,10 @@ VSFrame::~VSFrame() {
     }
 }
 
+int VSFrame::planeStride(int planeWidth) const {
+    return (planeWidth * format->bytesPerSample + (alignment - 1)) & ~(alignment - 1);
+}
+
 int VSFrame::getStride(int plane) const {
     assert(plane >= 0 && plane < 3);
     if (plane < 0 || plane >= format->numPlanes)
@@ -652,21 +1064,22 @@ const uint8_t *VSFrame::getReadPtr(int plane) const {
     if (plane < 0 || plane >= format->numPlanes)
         vsFatal("Requested read pointer for nonexistent plane %d", plane);
 
-    return data[plane]->data + guardSpace;
+    return data[plane]->data + guardSpace + offset[plane];
 }
 
 uint8_t *VSFrame::getWritePtr(int plane) {
     if (plane < 0 || plane >= format->numPlanes)
         vsFatal("Requested write pointer for nonexistent plane %d", plane);
 
-    // copy the plane data if this isn't the only reference
+    // copy the plane data if this isn't the only reference, a cropped plane only copies the rows it uses
     if (!data[plane]->unique()) {
         VSPlaneData *old = data[plane];
-        data[plane] = new VSPlaneData(*data[plane]);
+        data[plane] = new VSPlaneData(*old, offset[plane], static_cast<size_t>(stride[plane]) * getHeight(plane));
+        offset[plane] = 0;
         old->release();
     }
 
-    return data[plane]->data + guardSpace;
+    return data[plane]->data + guardSpace + offset[plane];
 }
 
 #ifdef VS_FRAME_GUARD
@@ -786,7 +1199,7 @@ VSFunction::VSFunction(const std::string &argString, VSPublicFunction func, void
 }
 
 VSNode::VSNode(const VSMap *in, VSMap *out, const std::string &name, VSFilterInit init, VSFilterGetFrame getFrame, VSFilterFree free, VSFilterMode filterMode, int flags, void *instanceData, int apiMajor, VSCore *core) :
-instanceData(instanceData), name(name), init(init), filterGetFrame(getFrame), free(free), filterMode(filterMode), apiMajor(apiMajor), core(core), flags(flags), hasVi(false), serialFrame(-1) {
+instanceData(instanceData), name(name), init(init), filterGetFrame(getFrame), free(free), filterMode(filterMode), apiMajor(apiMajor), core(core), flags(flags), hasVi(false), graphHash(0), serialFrame(-1), serialBusy(false), getRegion(nullptr), regionApron(0), regionPropSource(0) {
 
     if (flags & ~(nfNoCache | nfIsCache | nfMakeLinear))
         throw VSException("Filter " + name  + " specified unknown flags");
@@ -814,12 +1227,22 @@ instanceData(instanceData), name(name), init(init), filterGetFrame(getFrame), fr
             throw VSException("Filter " + name + " returned zero or negative frame count");
         }
     }
+
+    if (getRegion)
+        stripChain.reset(VSStripChain::create(this));
+
+    core->addNode(this);
 }
 
 VSNode::~VSNode() {
+    core->removeNode(this);
     core->destroyFilterInstance(this);
 }
 
+uint64_t VSNode::getGraphHash(int index) const {
+    return graphHash ? hashValue(graphHash, index) : 0;
+}
+
 void VSNode::getFrame(const PFrameContext &ct) {
     core->threadPool->start(ct);
 }
@@ -850,8 +1273,36 @@ void VSNode::setVideoInfo(const VSVideoInfo *vi, int numOutputs) {
     hasVi = true;
 }
 
+void VSNode::setRegionSupport(VSFilterGetRegion getRegion, VSNodeRef **inputs, int numInputs, int apron, int propSource) {
+    if (!hasVi)
+        vsFatal("setRegionSupport: Filter %s must set its video info first.", name.c_str());
+    if (numInputs < 1 || propSource < 0 || propSource >= numInputs || apron < 0)
+        vsFatal("setRegionSupport: Invalid input list, apron or property source passed by %s.", name.c_str());
+
+    // the rows of the inputs and the output can only be lined up when they all have the same dimensions and subsampling,
+    // anything else is simply processed a frame at a time
+    const VSVideoInfo &ovi = vi[0];
+    if (filterMode != fmParallel || vi.size() != 1 || !isConstantFormat(&ovi) || ovi.format->colorFamily == cmCompat)
+        return;
+    for (int i = 0; i < numInputs; i++) {
+        const VSVideoInfo &ivi = inputs[i]->clip->getVideoInfo(inputs[i]->index);
+        if (!isConstantFormat(&ivi) || ivi.width != ovi.width || ivi.height != ovi.height || ivi.format->numPlanes != ovi.format->numPlanes
+            || ivi.format->subSamplingW != ovi.format->subSamplingW || ivi.format->subSamplingH != ovi.format->subSamplingH || ivi.format->colorFamily == cmCompat)
+            return;
+    }
+
+    this->getRegion = getRegion;
+    regionInputs.assign(inputs, inputs + numInputs);
+    regionApron = apron;
+    regionPropSource = propSource;
+}
+
 PVideoFrame VSNode::getFrameInternal(int n, int activationReason, VSFrameContext &frameCtx) {
-    const VSFrameRef *r = filterGetFrame(n, activationReason, &instanceData, &frameCtx.ctx->frameContext, &frameCtx, core, &vs_internal_vsapi);
+    const VSFrameRef *r;
+    if (stripChain)
+        r = stripChain->getFrame(n, activationReason, frameCtx);
+    else
+        r = filterGetFrame(n, activationReason, &instanceData, &frameCtx.ctx->frameContext, &frameCtx, core, &vs_internal_vsapi);
 
 #ifdef VS_TARGET_OS_WINDOWS
     if (!vs_isSSEStateOk())
@@ -895,10 +1346,72 @@ bool VSNode::isWorkerThread() {
     return core->threadPool->isWorkerThread();
 }
 
-void VSNode::notifyCache(bool needMemory) {
+void VSNode::getCacheStats(VSCacheStats &stats) {
+    std::lock_guard<std::mutex> lock(serialMutex);
+    CacheInstance *cache = (CacheInstance *)instanceData;
+    cache->cache.collectStats(stats);
+}
+
+void VSNode::addProfile(int activationReason, int64_t wallTime, int64_t cpuTime, int64_t bytes) {
+    profile.calls++;
+    profile.wallTime += wallTime;
+    profile.cpuTime += cpuTime;
+    profile.bytes += bytes;
+    profile.reasons[activationReason - arError]++;
+}
+
+void VSNode::addCodeCacheProfile(int64_t hits, int64_t misses) {
+    profile.codeCacheHits += hits;
+    profile.codeCacheMisses += misses;
+}
+
+void VSNode::getProfile(VSProfileEntry &entry) {
+    entry.name = name;
+    entry.calls = profile.calls;
+    entry.wallTime = profile.wallTime;
+    entry.cpuTime = profile.cpuTime;
+    entry.bytes = profile.bytes;
+    for (int i = 0; i < 4; i++)
+        entry.reasons[i] = profile.reasons[i];
+    entry.codeCacheHits = profile.codeCacheHits;
+    entry.codeCacheMisses = profile.codeCacheMisses;
+    entry.cacheHits = 0;
+    entry.cacheNearMisses = 0;
+    entry.cacheFarMisses = 0;
+    if (flags & nfIsCache) {
+        std::lock_guard<std::mutex> lock(serialMutex);
+        static_cast<CacheInstance *>(instanceData)->cache.getTotals(entry.cacheHits, entry.cacheNearMisses, entry.cacheFarMisses);
+    }
+}
+
+void VSNode::clearProfile() {
+    profile.calls = 0;
+    profile.wallTime = 0;
+    profile.cpuTime = 0;
+    profile.bytes = 0;
+    for (int i = 0; i < 4; i++)
+        profile.reasons[i] = 0;
+    profile.codeCacheHits = 0;
+    profile.codeCacheMisses = 0;
+    if (flags & nfIsCache) {
+        std::lock_guard<std::mutex> lock(serialMutex);
+        static_cast<CacheInstance *>(instanceData)->cache.clearTotals();
+    }
+}
+
+void VSNode::setCacheSize(int frames, bool clear) {
     std::lock_guard<std::mutex> lock(serialMutex);
     CacheInstance *cache = (CacheInstance *)instanceData;
-    cache->cache.adjustSize(needMemory);
+    if (clear)
+        cache->cache.clear();
+    cache->cache.setMaxFrames(frames);
+    cache->cache.setMaxHistory(std::max(frames, VSCache::minHistory));
+}
+
+const VSNodeRef *VSNode::getCacheSource() const {
+    if (!(flags & nfIsCache))
+        return nullptr;
+    return static_cast<const CacheInstance *>(instanceData)->clip;
 }
 
 PVideoFrame VSCore::newVideoFrame(const VSFormat *f, int width, int height, const VSFrame *propSrc) {
@@ -913,6 +1426,10 @@ PVideoFrame VSCore::copyFrame(const PVideoFrame &srcf) {
     return std::make_shared<VSFrame>(*srcf.get());
 }
 
+PVideoFrame VSCore::cropFrame(const PVideoFrame &srcf, int left, int top, int width, int height) {
+    return std::make_shared<VSFrame>(*srcf.get(), left, top, width, height, this);
+}
+
 void VSCore::copyFrameProps(const PVideoFrame &src, PVideoFrame &dst) {
     dst->setProperties(src->getProperties());
 }
@@ -1121,10 +1638,46 @@ void VSCore::registerFormats() {
 }
 
 
+// thrown for libraries that load but have no entry point, autoloading remembers them so they aren't opened every time
+class VSNotAPluginException : public VSException {
+public:
+    using VSException::VSException;
+};
+
+void VSCore::autoloadPlugin(const std::string &filename, VSPluginManifest *manifest) {
+    uint64_t stamp = hashFileStamp(hashSeed, filename);
+    // the stamp only stays the same as the seed when the file can't be examined
+    if (!manifest || stamp == hashSeed) {
+        loadPlugin(filename);
+        return;
+    }
+
+    // unchanged plugins are only loaded once something in them is used
+    const VSPluginManifestEntry *cached = manifest->find(filename, stamp);
+    if (cached) {
+        if (cached->isPlugin)
+            addPlugin(new VSPlugin(*cached, this));
+        return;
+    }
+
+    VSPluginManifestEntry entry;
+    entry.stamp = stamp;
+    VSPlugin *p;
+    try {
+        p = new VSPlugin(filename, std::string(), std::string(), false, this);
+    } catch (VSNotAPluginException &) {
+        manifest->add(filename, entry);
+        throw;
+    }
+    p->getManifestEntry(entry);
+    manifest->add(filename, entry);
+    addPlugin(p);
+}
+
 #ifdef VS_TARGET_OS_WINDOWS
-bool VSCore::loadAllPluginsInPath(const std::wstring &path, const std::wstring &filter) {
+bool VSCore::loadAllPluginsInPath(const std::wstring &path, const std::wstring &filter, VSPluginManifest *manifest) {
 #else
-bool VSCore::loadAllPluginsInPath(const std::string &path, const std::string &filter) {
+bool VSCore::loadAllPluginsInPath(const std::string &path, const std::string &filter, VSPluginManifest *manifest) {
 #endif
     if (path.empty())
         return false;
@@ -1137,7 +1690,7 @@ bool VSCore::loadAllPluginsInPath(const std::string &path, const std::string &fi
         return false;
     do {
         try {
-            loadPlugin(utf16_to_utf8(path + L"\\" + findData.cFileName));
+            autoloadPlugin(utf16_to_utf8(path + L"\\" + findData.cFileName), manifest);
         } catch (VSException &) {
             // Ignore any errors
         }
@@ -1164,7 +1717,7 @@ bool VSCore::loadAllPluginsInPath(const std::string &path, const std::string &fi
             try {
                 std::string fullname;
                 fullname.append(path).append("/").append(name);
-                loadPlugin(fullname);
+                autoloadPlugin(fullname, manifest);
             } catch (VSException &) {
                 // Ignore any errors
             }
@@ -1229,13 +1782,77 @@ void VSCore::destroyFilterInstance(VSNode *node) {
     freeDepth--;
 }
 
+void VSCore::addNode(VSNode *node) {
+    std::lock_guard<std::mutex> lock(nodeLock);
+    nodes.insert(node);
+}
+
+void VSCore::removeNode(VSNode *node) {
+    VSProfileEntry entry;
+    if (profiling)
+        node->getProfile(entry);
+    std::lock_guard<std::mutex> lock(nodeLock);
+    nodes.erase(node);
+    if (profiling && entry.calls > 0)
+        freedProfiles.push_back(entry);
+}
+
+bool VSCore::setProfiling(int enable) {
+    std::lock_guard<std::mutex> lock(nodeLock);
+    if (enable > 0 && !profiling) {
+        freedProfiles.clear();
+        for (VSNode *node : nodes)
+            node->clearProfile();
+    }
+    if (enable >= 0)
+        profiling = !!enable;
+    return profiling;
+}
+
+VSMap VSCore::getProfile() {
+    std::vector<VSProfileEntry> entries;
+    {
+        std::lock_guard<std::mutex> lock(nodeLock);
+        entries = freedProfiles;
+        for (VSNode *node : nodes) {
+            VSProfileEntry entry;
+            node->getProfile(entry);
+            if (entry.calls > 0)
+                entries.push_back(entry);
+        }
+    }
+
+    // the slowest filters first
+    std::stable_sort(entries.begin(), entries.end(), [](const VSProfileEntry &a, const VSProfileEntry &b) { return a.wallTime > b.wallTime; });
+
+    VSMap m;
+    static const char *reasonKeys[] = { "ar_error", "ar_initial", "ar_frame_ready", "ar_all_frames_ready" };
+    for (const VSProfileEntry &e : entries) {
+        vs_internal_vsapi.propSetData(&m, "name", e.name.c_str(), static_cast<int>(e.name.size()), paAppend);
+        vs_internal_vsapi.propSetInt(&m, "calls", e.calls, paAppend);
+        vs_internal_vsapi.propSetFloat(&m, "wall_time", e.wallTime / 1e9, paAppend);
+        vs_internal_vsapi.propSetFloat(&m, "cpu_time", e.cpuTime / 1e9, paAppend);
+        vs_internal_vsapi.propSetInt(&m, "bytes", e.bytes, paAppend);
+        for (int i = 0; i < 4; i++)
+            vs_internal_vsapi.propSetInt(&m, reasonKeys[i], e.reasons[i], paAppend);
+        vs_internal_vsapi.propSetInt(&m, "cache_hits", e.cacheHits, paAppend);
+        vs_internal_vsapi.propSetInt(&m, "cache_near_misses", e.cacheNearMisses, paAppend);
+        vs_internal_vsapi.propSetInt(&m, "cache_far_misses", e.cacheFarMisses, paAppend);
+        vs_internal_vsapi.propSetInt(&m, "code_cache_hits", e.codeCacheHits, paAppend);
+        vs_internal_vsapi.propSetInt(&m, "code_cache_misses", e.codeCacheMisses, paAppend);
+    }
+    return m;
+}
+
 VSCore::VSCore(int threads) :
     coreFreed(false),
     numFilterInstances(1),
     numFunctionInstances(0),
     formatIdOffset(1000),
+    profiling(false),
     cpuLevel(INT_MAX),
-    memory(new MemoryUse()) {
+    memory(new MemoryUse()),
+    spillStore(nullptr) {
 #ifdef VS_TARGET_OS_WINDOWS
     if (!vs_isSSEStateOk())
         vsFatal("Bad SSE state detected when creating new core");
@@ -1253,6 +1870,7 @@ VSCore::VSCore(int threads) :
     ::vs_internal_configPlugin("com.vapoursynth.std", "std", "VapourSynth Core Functions", VAPOURSYNTH_API_VERSION, 0, p);
     loadPluginInitialize(::vs_internal_configPlugin, ::vs_internal_registerFunction, p);
     cacheInitialize(::vs_internal_configPlugin, ::vs_internal_registerFunction, p);
+    persistentCacheInitialize(::vs_internal_configPlugin, ::vs_internal_registerFunction, p);
     exprInitialize(::vs_internal_configPlugin, ::vs_internal_registerFunction, p);
     genericInitialize(::vs_internal_configPlugin, ::vs_internal_registerFunction, p);
     lutInitialize(::vs_internal_configPlugin, ::vs_internal_registerFunction, p);
@@ -1302,15 +1920,20 @@ VSCore::VSCore(int threads) :
     if (isPortable) {
         // Use alternative search strategy relative to dll path
 
+        // The manifest stays with the portable installation
+        VSPluginManifest manifest(utf16_to_utf8(dllPath + L"vapoursynth" + bits + L"\\plugins.manifest"));
+
         // Autoload bundled plugins
         std::wstring corePluginPath = dllPath + L"vapoursynth" + bits + L"\\coreplugins";
-        if (!loadAllPluginsInPath(corePluginPath, filter))
+        if (!loadAllPluginsInPath(corePluginPath, filter, &manifest))
             vsCritical("Core plugin autoloading failed. Installation is broken?");
 
         // Autoload global plugins last, this is so the bundled plugins cannot be overridden easily
         // and accidentally block updated bundled versions
         std::wstring globalPluginPath = dllPath + L"vapoursynth" + bits + L"\\plugins";
-        loadAllPluginsInPath(globalPluginPath, filter);
+        loadAllPluginsInPath(globalPluginPath, filter, &manifest);
+
+        manifest.save();
     } else {
         // Autoload user specific plugins first so a user can always override
         std::vector<wchar_t> appDataBuffer(MAX_PATH + 1);
@@ -1319,27 +1942,39 @@ VSCore::VSCore(int threads) :
 
         std::wstring appDataPath = std::wstring(appDataBuffer.data()) + L"\\VapourSynth\\plugins" + bits;
 
+        // The manifest is a cache so it goes in the local part of the profile
+        std::vector<wchar_t> localAppDataBuffer(MAX_PATH + 1);
+        if (SHGetFolderPath(nullptr, CSIDL_LOCAL_APPDATA, nullptr, SHGFP_TYPE_CURRENT, localAppDataBuffer.data()) != S_OK)
+            SHGetFolderPath(nullptr, CSIDL_LOCAL_APPDATA, nullptr, SHGFP_TYPE_DEFAULT, localAppDataBuffer.data());
+
+        std::wstring localAppDataPath(localAppDataBuffer.data());
+        VSPluginManifest manifest(localAppDataPath.empty() ? std::string() : utf16_to_utf8(localAppDataPath + L"\\VapourSynth\\plugins" + bits + L".manifest"));
+
         // Autoload per user plugins
-        loadAllPluginsInPath(appDataPath, filter);
+        loadAllPluginsInPath(appDataPath, filter, &manifest);
 
         // Autoload bundled plugins
         std::wstring corePluginPath = readRegistryValue(VS_INSTALL_REGKEY, L"CorePlugins");
-        if (!loadAllPluginsInPath(corePluginPath, filter))
+        if (!loadAllPluginsInPath(corePluginPath, filter, &manifest))
             vsCritical("Core plugin autoloading failed. Installation is broken?");
 
         // Autoload global plugins last, this is so the bundled plugins cannot be overridden easily
         // and accidentally block updated bundled versions
         std::wstring globalPluginPath = readRegistryValue(VS_INSTALL_REGKEY, L"Plugins");
-        loadAllPluginsInPath(globalPluginPath, filter);
+        loadAllPluginsInPath(globalPluginPath, filter, &manifest);
+
+        manifest.save();
     }
 
 #else
     std::string configFile;
+    std::string defaultManifestFile;
     const char *home = getenv("HOME");
 #ifdef VS_TARGET_OS_DARWIN
     std::string filter = ".dylib";
     if (home) {
         configFile.append(home).append("/Library/Application Support/VapourSynth/vapoursynth.conf");
+        defaultManifestFile.append(home).append("/Library/Caches/VapourSynth/plugins.manifest");
     }
 #else
     std::string filter = ".so";
@@ -1349,6 +1984,12 @@ VSCore::VSCore(int threads) :
     } else if (home) {
         configFile.append(home).append("/.config/vapoursynth/vapoursynth.conf");
     } // If neither exists, an empty string will do.
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    if (xdg_cache_home) {
+        defaultManifestFile.append(xdg_cache_home).append("/vapoursynth/plugins.manifest");
+    } else if (home) {
+        defaultManifestFile.append(home).append("/.cache/vapoursynth/plugins.manifest");
+    }
 #endif
 
     VSMap *settings = readSettings(configFile);
@@ -1371,17 +2012,39 @@ VSCore::VSCore(int threads) :
         tmp = vs_internal_vsapi.propGetData(settings, "AutoloadSystemPluginDir", 0, &err);
         bool autoloadSystemPluginDir = tmp ? std::string(tmp) == "true" : true;
 
+        tmp = vs_internal_vsapi.propGetData(settings, "NumaAware", 0, &err);
+        bool numaAware = tmp ? std::string(tmp) == "true" : false;
+
+        tmp = vs_internal_vsapi.propGetData(settings, "NumaNodes", 0, &err);
+        std::string numaNodes(tmp ? tmp : "");
+
+        tmp = vs_internal_vsapi.propGetData(settings, "LazyPluginLoading", 0, &err);
+        bool lazyPluginLoading = tmp ? std::string(tmp) == "true" : true;
+
+        tmp = vs_internal_vsapi.propGetData(settings, "PluginManifest", 0, &err);
+        std::string manifestFile(tmp ? tmp : defaultManifestFile);
+
+        if (numaAware)
+            threadPool->enableNuma(numaNodes);
+
+        std::unique_ptr<VSPluginManifest> manifest;
+        if (lazyPluginLoading && !manifestFile.empty())
+            manifest.reset(new VSPluginManifest(manifestFile));
+
         if (autoloadUserPluginDir && !userPluginDir.empty()) {
-            if (!loadAllPluginsInPath(userPluginDir, filter)) {
+            if (!loadAllPluginsInPath(userPluginDir, filter, manifest.get())) {
                 vsWarning("Autoloading the user plugin dir '%s' failed. Directory doesn't exist?", userPluginDir.c_str());
             }
         }
 
         if (autoloadSystemPluginDir) {
-            if (!loadAllPluginsInPath(systemPluginDir, filter)) {
+            if (!loadAllPluginsInPath(systemPluginDir, filter, manifest.get())) {
                 vsCritical("Autoloading the system plugin dir '%s' failed. Directory doesn't exist?", systemPluginDir.c_str());
             }
         }
+
+        if (manifest)
+            manifest->save();
     }
 
     vs_internal_vsapi.freeMap(settings);
@@ -1404,6 +2067,7 @@ void VSCore::freeCore() {
 }
 
 VSCore::~VSCore() {
+    delete spillStore;
     memory->signalFree();
     delete threadPool;
     for(const auto &iter : plugins)
@@ -1443,13 +2107,15 @@ VSPlugin *VSCore::getPluginByNs(const std::string &ns) {
 }
 
 void VSCore::loadPlugin(const std::string &filename, const std::string &forcedNamespace, const std::string &forcedId, bool altSearchPath) {
-    VSPlugin *p = new VSPlugin(filename, forcedNamespace, forcedId, altSearchPath, this);
+    addPlugin(new VSPlugin(filename, forcedNamespace, forcedId, altSearchPath, this));
+}
 
+void VSCore::addPlugin(VSPlugin *p) {
     std::lock_guard<std::recursive_mutex> lock(pluginLock);
 
     VSPlugin *already_loaded_plugin = getPluginById(p->id);
     if (already_loaded_plugin) {
-        std::string error = "Plugin " + filename + " already loaded (" + p->id + ")";
+        std::string error = "Plugin " + p->filename + " already loaded (" + p->id + ")";
         if (already_loaded_plugin->filename.size())
             error += " from " + already_loaded_plugin->filename;
         delete p;
@@ -1458,7 +2124,7 @@ void VSCore::loadPlugin(const std::string &filename, const std::string &forcedNa
 
     already_loaded_plugin = getPluginByNs(p->fnamespace);
     if (already_loaded_plugin) {
-        std::string error = "Plugin load of " + filename + " failed, namespace " + p->fnamespace + " already populated";
+        std::string error = "Plugin load of " + p->filename + " failed, namespace " + p->fnamespace + " already populated";
         if (already_loaded_plugin->filename.size())
             error += " by " + already_loaded_plugin->filename;
         delete p;
@@ -1475,6 +2141,9 @@ void VSCore::loadPlugin(const std::string &filename, const std::string &forcedNa
 void VSCore::createFilter(const VSMap *in, VSMap *out, const std::string &name, VSFilterInit init, VSFilterGetFrame getFrame, VSFilterFree free, VSFilterMode filterMode, int flags, void *instanceData, int apiMajor) {
     try {
         PVideoNode node(std::make_shared<VSNode>(in, out, name, init, getFrame, free, filterMode, flags, instanceData, apiMajor, this));
+        // a function may create several filters so they're numbered in the order they're created
+        if (invokeHash)
+            node->graphHash = hashValue(invokeHash, invokeSequence++);
         for (size_t i = 0; i < node->getNumOutputs(); i++) {
             // fixme, not that elegant but saves more variant poking code
             VSNodeRef *ref = new VSNodeRef(node, static_cast<int>(i));
@@ -1495,11 +2164,22 @@ int VSCore::setCpuLevel(int cpu) {
 }
 
 VSPlugin::VSPlugin(VSCore *core)
-    : apiMajor(0), apiMinor(0), hasConfig(false), readOnly(false), compat(false), libHandle(0), core(core) {
+    : apiMajor(0), apiMinor(0), hasConfig(false), readOnly(false), readOnlySet(false), compat(false), libHandle(0), core(core), versionHash(0), deferred(false), initializing(false) {
 }
 
 VSPlugin::VSPlugin(const std::string &relFilename, const std::string &forcedNamespace, const std::string &forcedId, bool altSearchPath, VSCore *core)
-    : apiMajor(0), apiMinor(0), hasConfig(false), readOnly(false), compat(false), libHandle(0), core(core), fnamespace(forcedNamespace), id(forcedId) {
+    : apiMajor(0), apiMinor(0), hasConfig(false), readOnly(false), readOnlySet(false), compat(false), libHandle(0), core(core), versionHash(0), deferred(false), initializing(false), fnamespace(forcedNamespace), id(forcedId) {
+    loadLibrary(relFilename, altSearchPath);
+}
+
+// only the identity and function list is known until the library is loaded, the id and namespace stay
+// the same since configPlugin() doesn't replace ones that are already set
+VSPlugin::VSPlugin(const VSPluginManifestEntry &entry, VSCore *core)
+    : apiMajor(entry.apiMajor), apiMinor(entry.apiMinor), hasConfig(false), readOnly(false), readOnlySet(entry.readOnly), compat(false), libHandle(0), core(core), versionHash(0), deferred(true), initializing(false),
+    manifestFunctions(entry.functions), filename(entry.filename), fullname(entry.fullname), fnamespace(entry.fnamespace), id(entry.id) {
+}
+
+void VSPlugin::loadLibrary(const std::string &relFilename, bool altSearchPath) {
 #ifdef VS_TARGET_OS_WINDOWS
     std::wstring wPath = utf16_from_utf8(relFilename);
     std::vector<wchar_t> fullPathBuffer(32767 + 1); // add 1 since msdn sucks at mentioning whether or not it includes the final null
@@ -1531,7 +2211,8 @@ VSPlugin::VSPlugin(const std::string &relFilename, const std::string &forcedName
 
     if (!pluginInit) {
         FreeLibrary(libHandle);
-        throw VSException("No entry point found in " + relFilename);
+        libHandle = nullptr;
+        throw VSNotAPluginException("No entry point found in " + relFilename);
     }
 #else
     std::vector<char> fullPathBuffer(PATH_MAX + 1);
@@ -1554,7 +2235,8 @@ VSPlugin::VSPlugin(const std::string &relFilename, const std::string &forcedName
 
     if (!pluginInit) {
         dlclose(libHandle);
-        throw VSException("No entry point found in " + relFilename);
+        libHandle = nullptr;
+        throw VSNotAPluginException("No entry point found in " + relFilename);
     }
 
 
@@ -1575,10 +2257,32 @@ VSPlugin::VSPlugin(const std::string &relFilename, const std::string &forcedName
 #else
         dlclose(libHandle);
 #endif
+        libHandle = nullptr;
         throw VSException("Core only supports API R" + std::to_string(VAPOURSYNTH_API_MAJOR) + "." + std::to_string(VAPOURSYNTH_API_MINOR) + " but the loaded plugin requires API R" + std::to_string(apiMajor) + "." + std::to_string(apiMinor) + "; Filename: " + relFilename + "; Name: " + fullname);
     }
 }
 
+// loads a plugin created from the manifest, a failure is reported every time one of its functions is invoked
+bool VSPlugin::ensureLoaded() {
+    if (deferred) {
+        std::lock_guard<std::recursive_mutex> lock(core->pluginLock);
+        // the plugin's own registerFunction() calls end up here while it's being initialized
+        if (deferred && !initializing) {
+            initializing = true;
+            try {
+                loadLibrary(filename, false);
+            } catch (VSException &e) {
+                loadError = e.what();
+                std::lock_guard<std::mutex> funcLock(registerFunctionLock);
+                funcs.clear();
+            }
+            initializing = false;
+            deferred = false;
+        }
+    }
+    return loadError.empty();
+}
+
 VSPlugin::~VSPlugin() {
 #ifdef VS_TARGET_OS_WINDOWS
     if (libHandle)
@@ -1609,9 +2313,18 @@ void VSPlugin::configPlugin(const std::string &identifier, const std::string &de
 
     readOnlySet = readOnly;
     hasConfig = true;
+
+    // plugins don't have a version number so the library file itself is used, the internal ones change with the core
+    versionHash = hashString(hashSeed, id);
+    if (filename.empty())
+        versionHash = hashValue(versionHash, VAPOURSYNTH_CORE_VERSION);
+    else
+        versionHash = hashFileStamp(hashString(versionHash, filename), filename);
 }
 
 void VSPlugin::registerFunction(const std::string &name, const std::string &args, VSPublicFunction argsFunc, void *functionData) {
+    ensureLoaded();
+
     if (readOnly)
         vsFatal("Plugin %s tried to modify read only namespace.", filename.c_str());
 
@@ -1659,10 +2372,52 @@ static bool hasForeignNodes(const VSMap &m, const VSCore *core) {
     return false;
 }
 
+// 0 if one of the arguments can't be identified, functions and frames are never the same between runs
+static uint64_t hashInvocation(uint64_t versionHash, const std::string &funcName, const VSMap &args) {
+    uint64_t hash = hashString(versionHash, funcName);
+    for (const auto &iter : args.getStorage()) {
+        const VSVariant &v = iter.second;
+        hash = hashString(hash, iter.first.str());
+        hash = hashValue(hash, static_cast<int>(v.getType()));
+        hash = hashValue(hash, v.size());
+        for (size_t i = 0; i < v.size(); i++) {
+            switch (v.getType()) {
+            case VSVariant::vInt:
+                hash = hashValue(hash, v.getValue<int64_t>(i));
+                break;
+            case VSVariant::vFloat:
+                hash = hashValue(hash, v.getValue<double>(i));
+                break;
+            case VSVariant::vData: {
+                const std::string &s = *v.getValue<VSMapData>(i);
+                hash = hashFileStamp(hashString(hash, s), s);
+                break;
+            }
+            case VSVariant::vNode: {
+                const VSNodeRef &ref = v.getValue<VSNodeRef>(i);
+                uint64_t nodeHash = ref.clip->getGraphHash(ref.index);
+                if (!nodeHash)
+                    return 0;
+                hash = hashValue(hash, nodeHash);
+                break;
+            }
+            default:
+                return 0;
+            }
+        }
+    }
+    return hash ? hash : 1;
+}
+
 VSMap VSPlugin::invoke(const std::string &funcName, const VSMap &args) {
     const char lookup[] = { 'i', 'f', 's', 'c', 'v', 'm' };
     VSMap v;
 
+    if (!ensureLoaded()) {
+        vs_internal_vsapi.setError(&v, loadError.c_str());
+        return v;
+    }
+
     try {
         if (funcs.count(funcName)) {
             const VSFunction &f = funcs[funcName];
@@ -1673,7 +2428,7 @@ VSMap VSPlugin::invoke(const std::string &funcName, const VSMap &args) {
 
             std::set<std::string> remainingArgs;
             for (const auto &key : args.getStorage())
-                remainingArgs.insert(key.first);
+                remainingArgs.insert(key.first.str());
 
             for (const FilterArgument &fa : f.args) {
                 char c = vs_internal_vsapi.propGetType(&args, fa.name.c_str());
@@ -1704,6 +2459,19 @@ VSMap VSPlugin::invoke(const std::string &funcName, const VSMap &args) {
                 throw VSException(funcName + ": no argument(s) named " + s);
             }
 
+            struct InvokeHashScope {
+                uint64_t hash;
+                unsigned sequence;
+                InvokeHashScope(uint64_t newHash) : hash(invokeHash), sequence(invokeSequence) {
+                    invokeHash = newHash;
+                    invokeSequence = 0;
+                }
+                ~InvokeHashScope() {
+                    invokeHash = hash;
+                    invokeSequence = sequence;
+                }
+            } hashScope(hashInvocation(versionHash, funcName, args));
+
             f.func(&args, &v, f.functionData, core, getVSAPIInternal(apiMajor));
 
             if (!compat && hasCompatNodes(v))
@@ -1722,6 +2490,13 @@ VSMap VSPlugin::invoke(const std::string &funcName, const VSMap &args) {
 
 VSMap VSPlugin::getFunctions() {
     VSMap m;
+    if (deferred) {
+        for (const auto &f : manifestFunctions) {
+            std::string b = f.first + ";" + f.second;
+            vs_internal_vsapi.propSetData(&m, f.first.c_str(), b.c_str(), static_cast<int>(b.size()), paReplace);
+        }
+        return m;
+    }
     for (const auto & f : funcs) {
         std::string b = f.first + ";" + f.second.argString;
         vs_internal_vsapi.propSetData(&m, f.first.c_str(), b.c_str(), static_cast<int>(b.size()), paReplace);
@@ -1729,6 +2504,20 @@ VSMap VSPlugin::getFunctions() {
     return m;
 }
 
+void VSPlugin::getManifestEntry(VSPluginManifestEntry &entry) {
+    entry.isPlugin = true;
+    entry.filename = filename;
+    entry.id = id;
+    entry.fnamespace = fnamespace;
+    entry.fullname = fullname;
+    entry.apiMajor = apiMajor;
+    entry.apiMinor = apiMinor;
+    entry.readOnly = readOnlySet;
+    entry.functions.clear();
+    for (const auto &f : funcs)
+        entry.functions.push_back(std::make_pair(f.first, f.second.argString));
+}
+
 #ifdef VS_TARGET_CPU_X86
 static int alignmentHelper() {
     return getCPUFeatures()->avx512_f ? 64 : 32;
@@ -30,8 +30,10 @@
 #include <cassert>
 #include <vector>
 #include <list>
+#include <deque>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <memory>
 #include <atomic>
 #include <mutex>
@@ -39,13 +41,13 @@
 #include <condition_variable>
 #include <random>
 #include <algorithm>
+#include <type_traits>
 #ifdef VS_TARGET_OS_WINDOWS
 #    define WIN32_LEAN_AND_MEAN
 #    ifndef NOMINMAX
 #        define NOMINMAX
 #    endif
 #    include <windows.h>
-#    define VS_FRAME_POOL
 #else
 #    include <dlfcn.h>
 #endif
@@ -60,8 +62,12 @@ const int fmUnorderedLinear = fmUnordered + 13;
 class VSFrame;
 struct VSCore;
 class VSCache;
+class VSSpillStore;
+class VSStripChain;
+struct VSCacheStats;
 struct VSNode;
 class VSThreadPool;
+struct VSTraceBuffer;
 class FrameContext;
 class ExtFunction;
 
@@ -70,6 +76,7 @@ typedef std::weak_ptr<VSFrame> WVideoFrame;
 typedef std::shared_ptr<VSNode> PVideoNode;
 typedef std::shared_ptr<ExtFunction> PExtFunction;
 typedef std::shared_ptr<FrameContext> PFrameContext;
+typedef std::shared_ptr<std::atomic<bool>> PCancelFlag;
 
 extern const VSAPI vs_internal_vsapi;
 const VSAPI *getVSAPIInternal(int apiMajor);
@@ -92,16 +99,19 @@ public:
     inline bool operator<(const NodeOutputKey &v) const {
         return (node < v.node) || (node == v.node && n < v.n) || (node == v.node && n == v.n && index < v.index);
     }
+    inline size_t hash() const {
+        return (reinterpret_cast<uintptr_t>(node) >> 4) ^ (static_cast<size_t>(n) * 2654435761U) ^ (static_cast<size_t>(index) << 24);
+    }
+};
+
+struct NodeOutputKeyHash {
+    inline size_t operator()(const NodeOutputKey &v) const {
+        return v.hash();
+    }
 };
 
 // variant types
 typedef std::shared_ptr<std::string> VSMapData;
-typedef std::vector<int64_t> IntList;
-typedef std::vector<double> FloatList;
-typedef std::vector<VSMapData> DataList;
-typedef std::vector<VSNodeRef> NodeList;
-typedef std::vector<PVideoFrame> FrameList;
-typedef std::vector<PExtFunction> FuncList;
 
 class ExtFunction {
 private:
@@ -116,6 +126,54 @@ public:
     void call(const VSMap *in, VSMap *out);
 };
 
+// only single ints and floats are stored in the variant itself
+template<typename T>
+struct VSInlineType : std::false_type {};
+
+template<>
+struct VSInlineType<int64_t> : std::true_type {};
+
+template<>
+struct VSInlineType<double> : std::true_type {};
+
+// the values of one key, shared by the copies of a map until one of them modifies it
+class VSArrayBase {
+private:
+    std::atomic<int> refCount;
+public:
+    VSArrayBase() : refCount(1) {}
+    virtual ~VSArrayBase() {}
+    virtual VSArrayBase *clone() const = 0;
+
+    bool unique() const {
+        return (refCount == 1);
+    }
+
+    void addRef() {
+        ++refCount;
+    }
+
+    void release() {
+        if (!--refCount)
+            delete this;
+    }
+};
+
+template<typename T>
+class VSArray : public VSArrayBase {
+public:
+    std::vector<T> data;
+
+    VSArrayBase *clone() const override {
+        VSArray *a = new VSArray();
+        a->data = data;
+        return a;
+    }
+};
+
+// A single int or float, which is what nearly all frame properties are, is stored in the variant itself.
+// Everything else goes in an array that's shared between copies. Asking for a pointer to an inline value
+// creates an array for it on the side since the variant itself moves when other keys are added or removed.
 class VSVariant {
 public:
     enum VSVType { vUnset, vInt, vFloat, vData, vNode, vFrame, vMethod };
@@ -123,6 +181,8 @@ public:
     VSVariant(const VSVariant &v);
     VSVariant(VSVariant &&v);
     ~VSVariant();
+    VSVariant &operator=(const VSVariant &v);
+    VSVariant &operator=(VSVariant &&v);
 
     size_t size() const;
     VSVType getType() const;
@@ -136,37 +196,152 @@ public:
 
     template<typename T>
     const T &getValue(size_t index) const {
-        return reinterpret_cast<std::vector<T>*>(storage)->at(index);
+        return getValue<T>(index, VSInlineType<T>());
     }
 
     template<typename T>
     const T *getArray() const {
-        return reinterpret_cast<std::vector<T>*>(storage)->data();
+        return getArray<T>(VSInlineType<T>());
     }
 
     template<typename T>
     void setArray(const T *val, size_t size) {
-        assert(val && !storage);
-        std::vector<T> *vect = new std::vector<T>(size);
-        if (size)
-            memcpy(vect->data(), val, size * sizeof(T));
-        internalSize = size;
-        storage = vect;
+        setArray(val, size, VSInlineType<T>());
     }
 
 private:
     VSVType vtype;
-    size_t internalSize;
-    void *storage;
+    unsigned internalSize; // the api limits the number of elements to an int anyway and it keeps the variant small
+    union {
+        int64_t i;
+        double f;
+        VSArrayBase *storage;
+    } value;
+    mutable std::atomic<VSArrayBase *> outOfLine; // the inline value as an array once getArray() has been used
+
+    void releaseOutOfLine();
+
+    bool isInline() const {
+        return (vtype == vInt || vtype == vFloat) && internalSize <= 1;
+    }
+
+    VSArrayBase *sharedStorage() const {
+        return isInline() ? nullptr : value.storage;
+    }
+
+    // the argument only selects the type
+    int64_t *inlineValue(int64_t *) {
+        return &value.i;
+    }
+
+    double *inlineValue(double *) {
+        return &value.f;
+    }
+
+    const int64_t *inlineValue(int64_t *) const {
+        return &value.i;
+    }
+
+    const double *inlineValue(double *) const {
+        return &value.f;
+    }
+
+    // the std::true_type overloads are only instantiated for the types that can be stored inline
+    template<typename T>
+    const T &getValue(size_t index, std::true_type) const {
+        if (isInline()) {
+            assert(index == 0);
+            return *inlineValue(static_cast<T *>(nullptr));
+        }
+        return getValue<T>(index, std::false_type());
+    }
+
+    template<typename T>
+    const T &getValue(size_t index, std::false_type) const {
+        return static_cast<const VSArray<T> *>(value.storage)->data.at(index);
+    }
+
+    template<typename T>
+    const T *getArray(std::true_type) const {
+        if (isInline()) {
+            // several threads may read the same map so the first one to get here wins
+            VSArrayBase *a = outOfLine.load(std::memory_order_acquire);
+            if (!a) {
+                VSArray<T> *copy = new VSArray<T>();
+                copy->data.push_back(*inlineValue(static_cast<T *>(nullptr)));
+                if (outOfLine.compare_exchange_strong(a, copy, std::memory_order_acq_rel))
+                    a = copy;
+                else
+                    delete copy;
+            }
+            return static_cast<const VSArray<T> *>(a)->data.data();
+        }
+        return getArray<T>(std::false_type());
+    }
+
+    template<typename T>
+    const T *getArray(std::false_type) const {
+        return static_cast<const VSArray<T> *>(value.storage)->data.data();
+    }
 
-    void initStorage(VSVType t);
+    template<typename T>
+    void setArray(const T *val, size_t size, std::true_type) {
+        if (size == 1 && (vtype == vInt || vtype == vFloat)) {
+            assert(val && !internalSize);
+            *inlineValue(static_cast<T *>(nullptr)) = *val;
+            internalSize = 1;
+        } else {
+            setArray(val, size, std::false_type());
+        }
+    }
+
+    template<typename T>
+    void setArray(const T *val, size_t size, std::false_type) {
+        assert(val && !internalSize);
+        if (size) {
+            VSArray<T> *a = new VSArray<T>();
+            a->data.assign(val, val + size);
+            value.storage = a;
+        }
+        internalSize = static_cast<unsigned>(size);
+    }
+
+    // returns false if the value still has to be appended to the array
+    template<typename T>
+    bool appendInline(const T &val, std::true_type);
+
+    template<typename T>
+    bool appendInline(const T &val, std::false_type) {
+        return false;
+    }
+
+    template<typename T>
+    void appendValue(VSVType t, const T &val);
+};
+
+// The standard frame property names are interned so they don't have to be allocated and copied
+// for every frame, other keys share one string between the copies of a map. Either way the string
+// stays where it is while the entries move around so propGetKey() can return a pointer to it.
+class VSMapKey {
+private:
+    const std::string *atom;
+    std::shared_ptr<const std::string> name;
+public:
+    explicit VSMapKey(const std::string &key);
+
+    const std::string &str() const {
+        return atom ? *atom : *name;
+    }
 };
 
+typedef std::vector<std::pair<VSMapKey, VSVariant>> VSMapEntries;
+
 class VSMapStorage {
 private:
     std::atomic<int> refCount;
 public:
-    std::map<std::string, VSVariant> data;
+    // sorted by key, maps are small enough that a flat array beats a tree for both lookups and copies
+    VSMapEntries data;
     bool error;
 
     VSMapStorage() : refCount(1), error(false) {}
@@ -185,6 +360,10 @@ public:
         if (!--refCount)
             delete this;
     }
+
+    VSMapEntries::iterator lowerBound(const std::string &key) {
+        return std::lower_bound(data.begin(), data.end(), key, [](const VSMapEntries::value_type &e, const std::string &k) { return e.first.str() < k; });
+    }
 };
 
 struct VSMap {
@@ -206,12 +385,13 @@ public:
     }
 
     VSMap &operator=(const VSMap &map) {
+        map.data->addRef();
         data->release();
         data = map.data;
-        data->addRef();
         return *this;
     }
 
+    // only copies the entries, their values stay shared until they're modified
     void detach() {
         if (!data->unique()) {
             VSMapStorage *old = data;
@@ -221,32 +401,42 @@ public:
     }
 
     bool contains(const std::string &key) const {
-        return !!data->data.count(key);
+        return !!find(key);
     }
 
     VSVariant &at(const std::string &key) const {
-        return data->data.at(key);
+        VSVariant *v = find(key);
+        if (!v)
+            throw std::out_of_range("VSMap::at");
+        return *v;
     }
 
     VSVariant &operator[](const std::string &key) const {
         // implicit creation is unwanted so make sure it doesn't happen by wrapping at() instead
-        return data->data.at(key);
+        return at(key);
     }
 
     VSVariant *find(const std::string &key) const {
-        auto it = data->data.find(key);
-        return it == data->data.end() ? nullptr : &it->second;
+        auto it = data->lowerBound(key);
+        return (it == data->data.end() || it->first.str() != key) ? nullptr : &it->second;
     }
 
     bool erase(const std::string &key) {
         detach();
-        return data->data.erase(key) > 0;
+        auto it = data->lowerBound(key);
+        if (it == data->data.end() || it->first.str() != key)
+            return false;
+        data->data.erase(it);
+        return true;
     }
 
     bool insert(const std::string &key, VSVariant &&v) {
         detach();
-        data->data.erase(key);
-        data->data.insert(std::make_pair(key, v));
+        auto it = data->lowerBound(key);
+        if (it != data->data.end() && it->first.str() == key)
+            it->second = std::move(v);
+        else
+            data->data.insert(it, std::make_pair(VSMapKey(key), std::move(v)));
         return true;
     }
 
@@ -262,12 +452,10 @@ public:
     const char *key(int n) const {
         if (n >= static_cast<int>(size()))
             return nullptr;
-        auto iter = data->data.cbegin();
-        std::advance(iter, n);
-        return iter->first.c_str();
+        return data->data[n].first.str().c_str();
     }
 
-    const std::map<std::string, VSVariant> &getStorage() const {
+    const VSMapEntries &getStorage() const {
         return data->data;
     }
 
@@ -303,6 +491,13 @@ struct VSNodeRef {
     VSNodeRef(PVideoNode &&clip, int index) : clip(clip), index(index) {}
 };
 
+// the flag is shared with the frame contexts of the requests so the token can be freed while they're in progress
+struct VSCancelToken {
+    PCancelFlag cancelled;
+    VSCore *core;
+    VSCancelToken(VSCore *core) : cancelled(std::make_shared<std::atomic<bool>>(false)), core(core) {}
+};
+
 struct VSFuncRef {
     PExtFunction func;
     VSFuncRef(const PExtFunction &func) : func(func) {}
@@ -335,38 +530,94 @@ private:
     struct BlockHeader {
         size_t size; // Size of memory allocation, minus header and padding.
         bool large : 1; // Memory is allocated with large pages.
+        bool advised : 1; // Large page memory that's only advised to use transparent huge pages, the kernel may not back it with them.
+        int numaNode; // The node the memory was bound to when it was allocated or -1.
     };
     static_assert(sizeof(BlockHeader) <= 16, "block header too large");
 
+    struct ThreadCacheMap;
+
+    // a small per thread stack of recently freed buffers so most allocations don't have to touch the depot,
+    // only the thread it belongs to touches the buffers and trim() asks it to hand them over with flush
+    struct ThreadCache {
+        std::vector<uint8_t *> buffers; // most recently freed last
+        std::atomic<bool> flush;
+        bool orphaned; // the thread exited and moved its buffers to the depot, protected by mutex
+        MemoryUse *mem;
+        ThreadCacheMap *owner;
+        ThreadCache(MemoryUse *mem, ThreadCacheMap *owner) : flush(false), orphaned(false), mem(mem), owner(owner) {}
+    };
+
+    // the caches of one thread by instance id, destroyed instances are only erased by the thread itself
+    struct ThreadCacheMap {
+        std::map<uint64_t, ThreadCache *> caches;
+        std::atomic<bool> hasRetired;
+        std::mutex lock;
+        std::vector<uint64_t> retired;
+        ThreadCacheMap() : hasRetired(false) {}
+        void prune();
+    };
+
+    // frees the map of a thread when it exits, only possible where thread_local supports destructors
+    struct ThreadCacheMapReleaser {
+        ~ThreadCacheMapReleaser();
+    };
+
+    struct DepotEntry {
+        uint8_t *buf;
+        uint64_t tick; // when it was returned, used to find the least recently used buffers
+    };
+
+    static const size_t threadCacheSize = 4;
+
+    const uint64_t id; // unique for every instance so a stale thread cache is never looked up
     std::atomic<size_t> used;
     size_t maxMemoryUse;
     bool freeOnZero;
-    bool largePageEnabled;
+    std::atomic<bool> largePageEnabled;
+    std::atomic<size_t> largePageMemory; // only memory that's guaranteed to be backed by large pages
+    std::map<uintptr_t, size_t> advisedRanges; // start and size of the memory advised to use transparent huge pages
+    std::mutex advisedLock;
     bool memoryWarningIssued;
-    std::multimap<size_t, uint8_t *> buffers;
-    size_t unusedBufferSize;
-    std::minstd_rand generator;
+    std::map<std::pair<int, size_t>, std::deque<DepotEntry>> depot; // buffers by numa node and size class, oldest first
+    std::atomic<size_t> unusedBufferSize;
+    uint64_t tick;
+    std::vector<std::unique_ptr<ThreadCache>> threadCaches;
     std::mutex mutex;
 
     static bool largePageSupported();
     static size_t largePageSize();
+    static size_t sizeClass(size_t bytes);
 
     // May allocate more than the requested amount.
-    void *allocateLargePage(size_t bytes) const;
-    void freeLargePage(void *ptr) const;
-    void *allocateMemory(size_t bytes) const;
-    void freeMemory(void *ptr) const;
+    void *allocateLargePage(size_t bytes);
+    void freeLargePage(void *ptr);
+    void *allocateMemory(size_t bytes);
+    void freeMemory(void *ptr);
     bool isGoodFit(size_t requested, size_t actual) const;
+    size_t getTransparentHugePageMemory();
+    static ThreadCacheMap *&currentThreadCacheMap();
+    ThreadCache *getThreadCache();
+    ThreadCache *addThreadCache();
+    void flushThreadCache(ThreadCache *cache);
+    void addToDepot(uint8_t *buf);
+    void trim();
 public:
     void add(size_t bytes);
     void subtract(size_t bytes);
     uint8_t *allocBuffer(size_t bytes);
     void freeBuffer(uint8_t *buf);
+    // the numa node a buffer from allocBuffer() is bound to or -1
+    static int getNumaNode(const uint8_t *buf);
     size_t memoryUse();
     size_t getLimit();
     int64_t setMaxMemoryUse(int64_t bytes);
+    bool setLargePages(int enable);
+    size_t getLargePageMemory();
     bool isOverLimit();
     void signalFree();
+    // frame buffer bytes allocated by the current thread so far, for all cores together
+    static size_t allocatedByThread();
     MemoryUse();
     ~MemoryUse();
 };
@@ -378,8 +629,10 @@ private:
 public:
     uint8_t *data;
     const size_t size;
+    int numaNode; // the numa node the memory is bound to or -1 when not known
     VSPlaneData(size_t dataSize, MemoryUse &mem);
-    VSPlaneData(const VSPlaneData &d);
+    // a copy of dataSize bytes of d starting at offset
+    VSPlaneData(const VSPlaneData &d, size_t offset, size_t dataSize);
     ~VSPlaneData();
     bool unique();
     void addRef();
@@ -393,7 +646,10 @@ private:
     int width;
     int height;
     int stride[3];
+    size_t offset[3]; // where the first row starts in data, only frames cropped from another frame have one
     VSMap properties;
+
+    int planeStride(int planeWidth) const;
 public:
     static int alignment;
 
@@ -406,6 +662,7 @@ public:
     VSFrame(const VSFormat *f, int width, int height, const VSFrame *propSrc, VSCore *core);
     VSFrame(const VSFormat *f, int width, int height, const VSFrame * const *planeSrc, const int *plane, const VSFrame *propSrc, VSCore *core);
     VSFrame(const VSFrame &f);
+    VSFrame(const VSFrame &f, int left, int top, int width, int height, VSCore *core);
     ~VSFrame();
 
     VSMap &getProperties() {
@@ -427,6 +684,9 @@ public:
         return height >> (plane ? format->subSamplingH : 0);
     }
     int getStride(int plane) const;
+    int getNumaNode() const {
+        return data[0]->numaNode;
+    }
     const uint8_t *getReadPtr(int plane) const;
     uint8_t *getWritePtr(int plane);
 
@@ -438,8 +698,12 @@ public:
 class FrameContext {
     friend class VSThreadPool;
 private:
-    uintptr_t reqOrder;
-    unsigned numFrameRequests;
+    std::atomic<uintptr_t> reqOrder;
+    std::atomic<int> priority; // a VSRequestPriority, frames requested to produce this one inherit it
+    std::atomic<int64_t> deadline; // steady clock nanoseconds, INT64_MAX when there is none
+    PCancelFlag cancelFlag; // inherited from the upstream context, null when the request can't be cancelled
+    std::atomic<bool> cancellable; // cleared when a request that doesn't share the flag is merged into this one
+    std::atomic<unsigned> numFrameRequests;
     int n;
     VSNode *clip;
     PVideoFrame returnedFrame;
@@ -449,6 +713,7 @@ private:
     VSFrameDoneCallback frameDone;
     std::string errorMessage;
     bool error;
+    bool abandoned; // the error is that the request was cancelled
     bool lockOnOutput;
 public:
     VSNodeRef *node;
@@ -456,6 +721,7 @@ public:
     int lastCompletedN;
     int index;
     VSNodeRef *lastCompletedNode;
+    int64_t cost; // nanoseconds spent in filters to produce the frame, including the requested frames that weren't cached
 
     void *frameContext;
     bool setError(const std::string &errorMsg);
@@ -466,12 +732,30 @@ public:
         return errorMessage;
     }
     FrameContext(int n, int index, VSNode *clip, const PFrameContext &upstreamContext);
-    FrameContext(int n, int index, VSNodeRef *node, VSFrameDoneCallback frameDone, void *userData, bool lockOnOutput = true);
+    bool isCancellable() const;
+    bool isCancelled() const;
+    FrameContext(int n, int index, VSNodeRef *node, VSFrameDoneCallback frameDone, void *userData, bool lockOnOutput = true, int priority = rpNormal, int64_t deadline = INT64_MAX, const PCancelFlag &cancelFlag = PCancelFlag());
+};
+
+// what a filter did while profiling was enabled, the times are in nanoseconds
+struct VSProfileEntry {
+    std::string name;
+    int64_t calls;
+    int64_t wallTime;
+    int64_t cpuTime;
+    int64_t bytes; // frame buffer memory allocated during the calls
+    int64_t reasons[4]; // the number of calls with each activation reason, arError first
+    int64_t cacheHits;
+    int64_t cacheNearMisses;
+    int64_t cacheFarMisses;
+    int64_t codeCacheHits; // compiled code the filter found already compiled by another instance
+    int64_t codeCacheMisses;
 };
 
 struct VSNode {
     friend class VSThreadPool;
     friend struct VSCore;
+    friend class VSStripChain;
 private:
     void *instanceData;
     std::string name;
@@ -485,6 +769,8 @@ private:
     int flags;
     bool hasVi;
     std::vector<VSVideoInfo> vi;
+    // identifies the filter, its arguments and everything upstream of it, 0 if it can't be identified
+    uint64_t graphHash;
 
     // for keeping track of when a filter is busy in the exclusive section and with which frame
     // used for fmSerial and fmParallel (mutex only)
@@ -495,6 +781,31 @@ private:
     // fmParallelRequests use this in combination with serialMutex to signal when all its frames are ready
     std::mutex concurrentFramesMutex;
     std::set<int> concurrentFrames;
+    // the scheduling side of serialMutex, set while a worker owns the exclusive section
+    // and protected by concurrentFramesMutex just like the tasks below
+    bool serialBusy;
+    // tasks that were dequeued while the filter was busy, they're put back in the queues once it's released
+    std::vector<PFrameContext> blockedTasks;
+
+    // set by filters that can produce a range of rows at a time, the input references are owned by the filter
+    VSFilterGetRegion getRegion;
+    std::vector<VSNodeRef *> regionInputs;
+    int regionApron;
+    int regionPropSource;
+    // runs this filter and the region capable filters it gets its input from a strip at a time, null if there are none
+    std::unique_ptr<VSStripChain> stripChain;
+
+    // updated by every call to the filter while profiling is enabled
+    struct Profile {
+        std::atomic<int64_t> calls;
+        std::atomic<int64_t> wallTime;
+        std::atomic<int64_t> cpuTime;
+        std::atomic<int64_t> bytes;
+        std::atomic<int64_t> reasons[4];
+        std::atomic<int64_t> codeCacheHits;
+        std::atomic<int64_t> codeCacheMisses;
+        Profile() : calls(0), wallTime(0), cpuTime(0), bytes(0), reasons(), codeCacheHits(0), codeCacheMisses(0) {}
+    } profile;
 
     PVideoFrame getFrameInternal(int n, int activationReason, VSFrameContext &frameCtx);
 public:
@@ -511,6 +822,7 @@ public:
     const VSVideoInfo &getVideoInfo(int index);
 
     void setVideoInfo(const VSVideoInfo *vi, int numOutputs);
+    void setRegionSupport(VSFilterGetRegion getRegion, VSNodeRef **inputs, int numInputs, int apron, int propSource);
 
     size_t getNumOutputs() const {
         return vi.size();
@@ -520,12 +832,24 @@ public:
         return name;
     }
 
+    // the same for every run of a script that creates the output the same way, 0 if unknown
+    uint64_t getGraphHash(int index) const;
+
     // to get around encapsulation a bit, more elegant than making everything friends in this case
     void reserveThread();
     void releaseThread();
     bool isWorkerThread();
 
-    void notifyCache(bool needMemory);
+    void getCacheStats(VSCacheStats &stats);
+    void setCacheSize(int frames, bool clear);
+
+    void addProfile(int activationReason, int64_t wallTime, int64_t cpuTime, int64_t bytes);
+    // for filters that compile code when they're created, called from their init function
+    void addCodeCacheProfile(int64_t hits, int64_t misses);
+    void getProfile(VSProfileEntry &entry);
+    void clearProfile();
+    // the clip a cache filter was created for, nullptr for other filters
+    const VSNodeRef *getCacheSource() const;
 };
 
 struct VSFrameContext {
@@ -537,27 +861,105 @@ struct VSFrameContext {
 class VSThreadPool {
     friend struct VSCore;
 private:
+    // the sort key is copied when queued since a duplicate request may lower reqOrder or raise the priority later
+    struct QueuedTask {
+        int priority;
+        int64_t deadline;
+        uintptr_t reqOrder;
+        int n;
+        PFrameContext context;
+        QueuedTask(const PFrameContext &context) : priority(context->priority), deadline(context->deadline), reqOrder(context->reqOrder), n(context->n), context(context) {}
+        // urgent tasks are taken from any queue before a thread looks at its own, they always sort before the others
+        bool isUrgent() const {
+            return priority > rpNormal || (priority == rpNormal && deadline != INT64_MAX);
+        }
+    };
+
+    // every worker has its own priority queue, idle workers steal the oldest request from the others
+    struct TaskQueue {
+        std::mutex lock;
+        std::vector<QueuedTask> heap;
+    };
+
+    struct NumaNode {
+        int id;
+        std::vector<int> cpus;
+    };
+
+    // all frame contexts that are in progress, split into separately locked shards
+    // so merging duplicate requests doesn't need a pool wide lock
+    struct ContextShard {
+        std::mutex lock;
+        std::unordered_map<NodeOutputKey, PFrameContext, NodeOutputKeyHash> contexts;
+    };
+    static const size_t numContextShards = 64;
+
     VSCore *core;
-    std::mutex lock;
+    std::mutex lock; // protects the thread bookkeeping, frame requests are handled without it
     std::mutex callbackLock;
     std::map<std::thread::id, std::thread *> allThreads;
-    std::list<PFrameContext> tasks;
-    std::map<NodeOutputKey, PFrameContext> allContexts;
+    std::vector<std::unique_ptr<TaskQueue>> queues;
+    std::vector<std::vector<size_t>> stealOrder; // the order other queues are searched in for each queue
+    std::vector<NumaNode> numaNodes; // empty unless numa mode is enabled
+    std::vector<int> queueNumaNode; // index into numaNodes for each queue
+    std::vector<std::vector<size_t>> numaNodeQueues;
+    ContextShard contextShards[numContextShards];
+
+    // a parallelFor() in progress, idle workers help the thread that started it with the remaining ranges
+    struct ParallelJob {
+        VSParallelFunc func;
+        void *userData;
+        int count;
+        int rangeSize;
+        std::atomic<int> next; // start of the next range nobody has claimed yet
+        std::atomic<int> done; // number of items processed so far
+        std::mutex lock;
+        std::condition_variable finished;
+    };
+    std::vector<std::shared_ptr<ParallelJob>> parallelJobs; // protected by lock
+    std::atomic<size_t> numParallelJobs;
     std::condition_variable newWork;
     std::condition_variable allIdle;
     std::atomic<unsigned> activeThreads;
     std::atomic<unsigned> idleThreads;
     std::atomic<uintptr_t> reqCounter;
-    unsigned maxThreads;
+    std::atomic<unsigned> maxThreads;
     std::atomic<bool> stopThreads;
     std::atomic<unsigned> ticks;
+    std::atomic<size_t> queuedTasks;
+    std::atomic<size_t> urgentTasks;
+    std::atomic<unsigned> nextQueue;
+
+    // a timeline of what each thread did, every thread records into its own ring buffer
+    std::atomic<bool> tracing;
+    std::atomic<int64_t> traceStart;
+    std::mutex traceLock;
+    std::map<std::thread::id, std::unique_ptr<VSTraceBuffer>> traceBuffers;
+    uint64_t traceId; // tells the thread local buffer pointer which pool it belongs to
+    VSTraceBuffer *getTraceBuffer();
+    int64_t traceTime() const;
+    void addTraceEvent(int type, int64_t start, const char *name, int n, int reason);
+    void lockPool(std::unique_lock<std::mutex> &l);
+
     int getNumAvailableThreads();
+    void createQueues(size_t numQueues);
     void wakeThread();
     void notifyCaches(bool needMemory);
     void startInternal(const PFrameContext &context);
+    void queueTask(const PFrameContext &context);
+    PFrameContext popTask(TaskQueue &q);
+    PFrameContext dequeueTask(size_t queueIndex);
+    ContextShard &getContextShard(const NodeOutputKey &key);
+    void runTask(const PFrameContext &task);
+    bool helpParallelJob();
+    static void runParallelRanges(ParallelJob &job);
+    bool tryAcquireNode(VSNode *clip, const PFrameContext &task, FrameContext *mainContext, bool &parallelRequestsNeedsUnlock);
+    void releaseNode(VSNode *clip, FrameContext *mainContext, bool frameProcessingDone, bool parallelRequestsNeedsUnlock);
     void spawnThread();
-    static void runTasks(VSThreadPool *owner, std::atomic<bool> &stop);
-    static bool taskCmp(const PFrameContext &a, const PFrameContext &b);
+    static void runTasks(VSThreadPool *owner, std::atomic<bool> &stop, size_t queueIndex);
+    static std::vector<NumaNode> detectNumaTopology(const std::string &nodeList);
+    static bool taskCmp(const QueuedTask &a, const QueuedTask &b);
+    static bool heapCmp(const QueuedTask &a, const QueuedTask &b);
 public:
     VSThreadPool(VSCore *core, int threads);
     ~VSThreadPool();
@@ -569,7 +971,14 @@ public:
     void releaseThread();
     void reserveThread();
     bool isWorkerThread();
+    void parallelFor(VSParallelFunc func, void *userData, int count, int grain);
     void waitForDone();
+    bool enableNuma(const std::string &nodeList);
+    void cancelQueued();
+    bool setTracing(int enable);
+    bool saveTrace(const std::string &filename);
+    static int getCurrentNumaNode();
+    static void bindToCurrentNumaNode(void *ptr, size_t bytes);
 };
 
 class VSFunction {
@@ -583,6 +992,9 @@ public:
 };
 
 
+struct VSPluginManifestEntry;
+class VSPluginManifest;
+
 struct VSPlugin {
 private:
     int apiMajor;
@@ -599,6 +1011,15 @@ private:
     std::map<std::string, VSFunction> funcs;
     std::mutex registerFunctionLock;
     VSCore *core;
+    // changes when the plugin is rebuilt or updated
+    uint64_t versionHash;
+    // plugins created from the manifest aren't loaded until one of their functions is used
+    std::atomic<bool> deferred;
+    bool initializing;
+    std::string loadError;
+    std::vector<std::pair<std::string, std::string>> manifestFunctions;
+    void loadLibrary(const std::string &relFilename, bool altSearchPath);
+    bool ensureLoaded();
 public:
     std::string filename;
     std::string fullname;
@@ -606,6 +1027,7 @@ public:
     std::string id;
     explicit VSPlugin(VSCore *core);
     VSPlugin(const std::string &relFilename, const std::string &forcedNamespace, const std::string &forcedId, bool altSearchPath, VSCore *core);
+    VSPlugin(const VSPluginManifestEntry &entry, VSCore *core);
     ~VSPlugin();
     void lock() {
         readOnly = true;
@@ -617,12 +1039,14 @@ public:
     void registerFunction(const std::string &name, const std::string &args, VSPublicFunction argsFunc, void *functionData);
     VSMap invoke(const std::string &funcName, const VSMap &args);
     VSMap getFunctions();
+    void getManifestEntry(VSPluginManifestEntry &entry);
 };
 
 struct VSCore {
     friend class VSFrame;
     friend class VSThreadPool;
     friend class CacheInstance;
+    friend struct VSPlugin;
 private:
     //number of filter instances plus one, freeing the core reduces it by one
     // the core will be freed once it reaches 0
@@ -639,23 +1063,32 @@ private:
     std::set<VSNode *> caches;
     std::mutex cacheLock;
 
+    std::atomic<bool> profiling;
+    std::set<VSNode *> nodes; // every filter instance so they can all be profiled
+    std::vector<VSProfileEntry> freedProfiles; // what filters freed while profiling did
+    std::mutex nodeLock;
+
     std::atomic_int cpuLevel;
 
     ~VSCore();
 
     void registerFormats();
 #ifdef VS_TARGET_OS_WINDOWS
-    bool loadAllPluginsInPath(const std::wstring &path, const std::wstring &filter);
+    bool loadAllPluginsInPath(const std::wstring &path, const std::wstring &filter, VSPluginManifest *manifest);
 #else
-    bool loadAllPluginsInPath(const std::string &path, const std::string &filter);
+    bool loadAllPluginsInPath(const std::string &path, const std::string &filter, VSPluginManifest *manifest);
 #endif
+    void autoloadPlugin(const std::string &filename, VSPluginManifest *manifest);
+    void addPlugin(VSPlugin *p);
 public:
     VSThreadPool *threadPool;
     MemoryUse *memory;
+    std::atomic<VSSpillStore *> spillStore; // only set once, by SetCacheSpill
 
     PVideoFrame newVideoFrame(const VSFormat *f, int width, int height, const VSFrame *propSrc);
     PVideoFrame newVideoFrame(const VSFormat *f, int width, int height, const VSFrame * const *planeSrc, const int *planes, const VSFrame *propSrc);
     PVideoFrame copyFrame(const PVideoFrame &srcf);
+    PVideoFrame cropFrame(const PVideoFrame &srcf, int left, int top, int width, int height);
     void copyFrameProps(const PVideoFrame &src, PVideoFrame &dst);
 
     const VSFormat *getFormatPreset(int id);
@@ -680,6 +1113,15 @@ public:
     void filterInstanceCreated();
     void filterInstanceDestroyed();
     void destroyFilterInstance(VSNode *node);
+    void addNode(VSNode *node);
+    void removeNode(VSNode *node);
+
+    bool isProfiling() const {
+        return profiling;
+    }
+    // a negative value only queries the state, enabling clears what was recorded before
+    bool setProfiling(int enable);
+    VSMap getProfile();
 
     explicit VSCore(int threads);
     void freeCore();
@@ -19,20 +19,39 @@
 */
 
 #include "vscore.h"
+#include "cachefilter.h"
 #include <cassert>
+#include <climits>
 #include <bitset>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <locale>
 #ifdef VS_TARGET_CPU_X86
 #include "x86utils.h"
 #endif
 
+#ifdef VS_TARGET_OS_WINDOWS
+#include "../common/vsutf16.h"
+#endif
+
 #if defined(HAVE_SCHED_GETAFFINITY)
 #include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/syscall.h>
 #elif defined(HAVE_CPUSET_GETAFFINITY)
 #include <sys/param.h>
 #include <sys/_cpuset.h>
 #include <sys/cpuset.h>
 #endif
 
+#ifdef VS_TARGET_OS_DARWIN
+#define thread_local __thread
+#endif
+
 int VSThreadPool::getNumAvailableThreads() {
     int nthreads = std::thread::hardware_concurrency();
 #ifdef _WIN32
@@ -58,241 +77,570 @@ int VSThreadPool::getNumAvailableThreads() {
     return nthreads;
 }
 
-bool VSThreadPool::taskCmp(const PFrameContext &a, const PFrameContext &b) {
-    return (a->reqOrder < b->reqOrder) || (a->reqOrder == b->reqOrder && a->n < b->n);
+// the cpu time used by the current thread in nanoseconds
+static int64_t getThreadCpuTime() {
+#ifdef _WIN32
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    if (!GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime))
+        return 0;
+    ULARGE_INTEGER kernel = { { kernelTime.dwLowDateTime, kernelTime.dwHighDateTime } };
+    ULARGE_INTEGER user = { { userTime.dwLowDateTime, userTime.dwHighDateTime } };
+    return static_cast<int64_t>(kernel.QuadPart + user.QuadPart) * 100;
+#else
+    timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return 0;
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
 }
 
-void VSThreadPool::runTasks(VSThreadPool *owner, std::atomic<bool> &stop) {
-#ifdef VS_TARGET_OS_WINDOWS
-    if (!vs_isSSEStateOk())
-        vsFatal("Bad SSE state detected after creating new thread");
+// above every VSRequestPriority, the tasks of cancelled requests only need to be cleaned up
+static const int cancelledPriority = INT_MAX;
+
+// higher priorities go first, then the earliest deadline and then the oldest request
+bool VSThreadPool::taskCmp(const QueuedTask &a, const QueuedTask &b) {
+    if (a.priority != b.priority)
+        return a.priority > b.priority;
+    if (a.deadline != b.deadline)
+        return a.deadline < b.deadline;
+    return (a.reqOrder < b.reqOrder) || (a.reqOrder == b.reqOrder && a.n < b.n);
+}
+
+// the heap functions put the largest element first so the comparison is reversed to get the most urgent request on top
+bool VSThreadPool::heapCmp(const QueuedTask &a, const QueuedTask &b) {
+    return taskCmp(b, a);
+}
+
+// which pool and queue the current thread belongs to, used to queue new work locally
+static thread_local VSThreadPool *currentPool = nullptr;
+static thread_local size_t currentQueue = 0;
+// the numa node the current thread is pinned to as an index into numaNodes and as the system's node number
+static thread_local int currentNumaNode = -1;
+static thread_local int currentNumaNodeId = -1;
+
+enum VSTraceEventType {
+    teFilter,
+    teLockWait,
+    teIdle,
+    teCallback,
+    teParallelFor
+};
+
+struct VSTraceEvent {
+    int64_t start; // nanoseconds since tracing was enabled
+    int64_t duration;
+    int type;
+    int n;
+    int reason;
+    char name[32]; // copied since the filter may be gone by the time the trace is saved
+};
+
+// the oldest events are overwritten once a thread has recorded this many
+static const uint64_t traceBufferSize = 16384;
+
+// only the thread it belongs to writes events, written is updated after the event so a reader never sees a partial one
+struct VSTraceBuffer {
+    std::vector<VSTraceEvent> events;
+    std::atomic<uint64_t> written;
+    uint64_t first; // the events before it were recorded before tracing was last enabled
+    int index;
+    std::string threadName;
+    VSTraceBuffer(int index, const std::string &threadName) : events(traceBufferSize), written(0), first(0), index(index), threadName(threadName) {}
+};
+
+static std::atomic<uint64_t> nextTraceId(1);
+static thread_local VSTraceBuffer *currentTraceBuffer = nullptr;
+static thread_local uint64_t currentTraceId = 0;
+
+// parses the kernel's cpu list format, for example 0-3,8-11
+static std::vector<int> parseCpuList(const std::string &list) {
+    std::vector<int> cpus;
+    std::istringstream ss(list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+            for (int i = first; i <= last; i++)
+                cpus.push_back(i);
+        } catch (std::logic_error &) {
+            return std::vector<int>();
+        }
+    }
+    return cpus;
+}
+
+std::vector<VSThreadPool::NumaNode> VSThreadPool::detectNumaTopology(const std::string &nodeList) {
+    std::vector<NumaNode> nodes;
+#if defined(HAVE_SCHED_GETAFFINITY)
+    if (!nodeList.empty()) {
+        // an explicit topology, nodes are separated by semicolons and numbered in order
+        std::istringstream ss(nodeList);
+        std::string cpus;
+        while (std::getline(ss, cpus, ';'))
+            nodes.push_back({ static_cast<int>(nodes.size()), parseCpuList(cpus) });
+    } else {
+        // this also picks up topologies created with the numa=fake kernel option
+        const char *nodePath = "/sys/devices/system/node";
+        DIR *dir = opendir(nodePath);
+        if (dir) {
+            while (dirent *entry = readdir(dir)) {
+                std::string name = entry->d_name;
+                if (name.length() <= 4 || name.compare(0, 4, "node") || name.find_first_not_of("0123456789", 4) != std::string::npos)
+                    continue;
+                std::ifstream f(std::string(nodePath) + "/" + name + "/cpulist");
+                std::string cpus;
+                if (std::getline(f, cpus))
+                    nodes.push_back({ std::stoi(name.substr(4)), parseCpuList(cpus) });
+            }
+            closedir(dir);
+        }
+        std::sort(nodes.begin(), nodes.end(), [](const NumaNode &a, const NumaNode &b) { return a.id < b.id; });
+    }
+
+    // only keep the cpus the process is allowed to run on and drop the nodes that have none left
+    cpu_set_t affinity;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &affinity) == 0) {
+        for (auto &node : nodes)
+            node.cpus.erase(std::remove_if(node.cpus.begin(), node.cpus.end(), [&affinity](int cpu) { return cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &affinity); }), node.cpus.end());
+    }
+    nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const NumaNode &node) { return node.cpus.empty(); }), nodes.end());
 #endif
+    return nodes;
+}
 
-    std::unique_lock<std::mutex> lock(owner->lock);
+void VSThreadPool::createQueues(size_t numQueues) {
+    queues.clear();
+    stealOrder.clear();
+    queueNumaNode.clear();
+    numaNodeQueues.clear();
+    numaNodeQueues.resize(numaNodes.size());
+
+    for (size_t i = 0; i < numQueues; i++) {
+        queues.emplace_back(new TaskQueue());
+        queueNumaNode.push_back(numaNodes.empty() ? -1 : static_cast<int>(i % numaNodes.size()));
+        if (!numaNodes.empty())
+            numaNodeQueues[i % numaNodes.size()].push_back(i);
+    }
 
-    while (true) {
-        bool ranTask = false;
+    // look at the queues on the same node first when stealing, the stable sort keeps the round robin order otherwise
+    for (size_t i = 0; i < numQueues; i++) {
+        std::vector<size_t> order;
+        for (size_t j = 1; j < numQueues; j++)
+            order.push_back((i + j) % numQueues);
+        std::stable_sort(order.begin(), order.end(), [this, i](size_t a, size_t b) {
+            return (queueNumaNode[a] == queueNumaNode[i]) > (queueNumaNode[b] == queueNumaNode[i]);
+        });
+        stealOrder.push_back(std::move(order));
+    }
+}
 
-/////////////////////////////////////////////////////////////////////////////////////////////
-// Go through all tasks from the top (oldest) and process the first one possible
-        owner->tasks.sort(taskCmp);
+void VSThreadPool::queueTask(const PFrameContext &context) {
+    size_t queueIndex = (currentPool == this) ? currentQueue : (nextQueue++ % queues.size());
+    // a finished frame is best consumed on the node its memory was allocated on
+    if (!numaNodes.empty() && context->returnedFrame) {
+        int node = context->returnedFrame->getNumaNode();
+        if (node >= 0 && node < static_cast<int>(numaNodes.size()) && node != queueNumaNode[queueIndex]) {
+            const std::vector<size_t> &nodeQueues = numaNodeQueues[node];
+            queueIndex = nodeQueues[nextQueue++ % nodeQueues.size()];
+        }
+    }
+    TaskQueue &q = *queues[queueIndex];
+    std::lock_guard<std::mutex> l(q.lock);
+    q.heap.emplace_back(context);
+    if (q.heap.back().isUrgent())
+        ++urgentTasks;
+    std::push_heap(q.heap.begin(), q.heap.end(), heapCmp);
+    ++queuedTasks;
+}
 
-        for (auto iter = owner->tasks.begin(); iter != owner->tasks.end(); ++iter) {
-            FrameContext *mainContext = iter->get();
-            FrameContext *leafContext = nullptr;
+PFrameContext VSThreadPool::popTask(TaskQueue &q) {
+    std::pop_heap(q.heap.begin(), q.heap.end(), heapCmp);
+    if (q.heap.back().isUrgent())
+        --urgentTasks;
+    PFrameContext task(std::move(q.heap.back().context));
+    q.heap.pop_back();
+    --queuedTasks;
+    return task;
+}
 
-/////////////////////////////////////////////////////////////////////////////////////////////
-// Handle the output tasks
-            if (mainContext->frameDone && mainContext->returnedFrame) {
-                PFrameContext mainContextRef(*iter);
-                owner->tasks.erase(iter);
-                owner->returnFrame(mainContextRef, mainContext->returnedFrame);
-                ranTask = true;
-                break;
+PFrameContext VSThreadPool::dequeueTask(size_t queueIndex) {
+    // an interactive request or one with a deadline shouldn't wait behind the other work queued for this thread
+    // so the queue with the most urgent task on top is searched for first, this is rare enough to lock them all
+    if (urgentTasks) {
+        TaskQueue *best = nullptr;
+        std::unique_ptr<QueuedTask> bestTop;
+        for (auto &q : queues) {
+            std::lock_guard<std::mutex> l(q->lock);
+            if (!q->heap.empty() && q->heap.front().isUrgent() && (!bestTop || taskCmp(q->heap.front(), *bestTop))) {
+                best = q.get();
+                bestTop.reset(new QueuedTask(q->heap.front()));
             }
+        }
+        if (best) {
+            // another thread may have taken it in the meantime, the queue's new top is fine then too
+            std::lock_guard<std::mutex> l(best->lock);
+            if (!best->heap.empty())
+                return popTask(*best);
+        }
+    }
 
-            if (mainContext->frameDone && mainContext->hasError()) {
-                PFrameContext mainContextRef(*iter);
-                owner->tasks.erase(iter);
-                owner->returnFrame(mainContextRef, mainContext->getErrorMessage());
-                ranTask = true;
-                break;
+    // first look in the thread's own queue, then try to steal from the others without blocking
+    // and only if that fails wait for the queue locks since another thread may simply have been busy inserting
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < queues.size(); i++) {
+            if (!queuedTasks)
+                return PFrameContext();
+            TaskQueue &q = *queues[i ? stealOrder[queueIndex][i - 1] : queueIndex];
+            std::unique_lock<std::mutex> l(q.lock, std::defer_lock);
+            if (pass == 0 && i > 0) {
+                if (!l.try_lock())
+                    continue;
+            } else {
+                l.lock();
             }
+            if (!q.heap.empty())
+                return popTask(q);
+        }
+    }
+    return PFrameContext();
+}
 
-            bool hasLeafContext = mainContext->returnedFrame || mainContext->hasError();
-            if (hasLeafContext) {
-                leafContext = mainContext;
-                mainContext = mainContext->upstreamContext.get();
+bool VSThreadPool::tryAcquireNode(VSNode *clip, const PFrameContext &task, FrameContext *mainContext, bool &parallelRequestsNeedsUnlock) {
+    // the check and the parking of the task has to happen under the same lock as releaseNode() to not lose any tasks
+    std::lock_guard<std::mutex> l(clip->concurrentFramesMutex);
+    int filterMode = clip->filterMode;
+    bool acquired = false;
+
+    if (filterMode == fmUnordered || filterMode == fmUnorderedLinear) {
+        // already busy?
+        if (!clip->serialBusy)
+            acquired = clip->serialBusy = true;
+    } else if (filterMode == fmSerial) {
+        // already busy?
+        if (!clip->serialBusy) {
+            // no frame in progress?
+            if (clip->serialFrame == -1)
+                clip->serialFrame = mainContext->n;
+            // continue processing the already started frame, another frame in progress has to wait
+            if (clip->serialFrame == mainContext->n)
+                acquired = clip->serialBusy = true;
+        }
+    } else if (filterMode == fmParallel) {
+        // is the filter already processing another call for this frame? if so move along
+        acquired = clip->concurrentFrames.insert(mainContext->n).second;
+    } else if (filterMode == fmParallelRequests) {
+        // is the filter already processing another call for this frame? if so move along
+        // the frame context is only ever touched by one thread at a time this way
+        if (!clip->concurrentFrames.count(mainContext->n)) {
+            // do we need the serial lock since all frames will be ready this time?
+            // check if we're in the arAllFramesReady state so we need additional locking
+            if (mainContext->numFrameRequests == 1) {
+                if (!clip->serialBusy)
+                    acquired = parallelRequestsNeedsUnlock = clip->serialBusy = true;
+            } else {
+                acquired = true;
             }
+            if (acquired)
+                clip->concurrentFrames.insert(mainContext->n);
+        }
+    }
 
-            VSNode *clip = mainContext->clip;
-            int filterMode = clip->filterMode;
+    if (!acquired)
+        clip->blockedTasks.push_back(task);
+    return acquired;
+}
 
-/////////////////////////////////////////////////////////////////////////////////////////////
-// This part handles the locking for the different filter modes
+void VSThreadPool::releaseNode(VSNode *clip, FrameContext *mainContext, bool frameProcessingDone, bool parallelRequestsNeedsUnlock) {
+    std::vector<PFrameContext> unblocked;
 
-            bool parallelRequestsNeedsUnlock = false;
-            if (filterMode == fmUnordered || filterMode == fmUnorderedLinear) {
-                // already busy?
-                if (!clip->serialMutex.try_lock())
-                    continue;
-            } else if (filterMode == fmSerial) {
-                // already busy?
-                if (!clip->serialMutex.try_lock())
-                    continue;
-                // no frame in progress?
-                if (clip->serialFrame == -1) {
-                    clip->serialFrame = mainContext->n;
-                // another frame already in progress?
-                } else if (clip->serialFrame != mainContext->n) {
-                    clip->serialMutex.unlock();
-                    continue;
-                }
-                // continue processing the already started frame
-            } else if (filterMode == fmParallel) {
-                std::lock_guard<std::mutex> lock(clip->concurrentFramesMutex);
-                // is the filter already processing another call for this frame? if so move along
-                if (!clip->concurrentFrames.insert(mainContext->n).second)
-                    continue;
-            } else if (filterMode == fmParallelRequests) {
-                std::lock_guard<std::mutex> lock(clip->concurrentFramesMutex);
-                // do we need the serial lock since all frames will be ready this time?
-                // check if we're in the arAllFramesReady state so we need additional locking
-                if (mainContext->numFrameRequests == 1) {
-                    if (!clip->serialMutex.try_lock())
-                        continue;
-                    parallelRequestsNeedsUnlock = true;
-                } else {
-                    // is the filter already processing another call for this frame? if so move along
-                    if (!clip->concurrentFrames.insert(mainContext->n).second)
-                        continue;
-                }
-            }
+    {
+        std::lock_guard<std::mutex> l(clip->concurrentFramesMutex);
+        int filterMode = clip->filterMode;
+
+        if (filterMode == fmUnordered || filterMode == fmUnorderedLinear) {
+            clip->serialBusy = false;
+        } else if (filterMode == fmSerial) {
+            if (frameProcessingDone)
+                clip->serialFrame = -1;
+            clip->serialBusy = false;
+        } else if (filterMode == fmParallel) {
+            clip->concurrentFrames.erase(mainContext->n);
+        } else if (filterMode == fmParallelRequests) {
+            clip->concurrentFrames.erase(mainContext->n);
+            if (parallelRequestsNeedsUnlock)
+                clip->serialBusy = false;
+        }
+
+        if (filterMode == fmSerial && clip->serialFrame != -1) {
+            // only the tasks belonging to the frame in progress can run next
+            auto iter = std::partition(clip->blockedTasks.begin(), clip->blockedTasks.end(), [clip](const PFrameContext &t) {
+                const FrameContext *target = (t->returnedFrame || t->hasError()) ? t->upstreamContext.get() : t.get();
+                return target->n != clip->serialFrame;
+            });
+            unblocked.assign(std::make_move_iterator(iter), std::make_move_iterator(clip->blockedTasks.end()));
+            clip->blockedTasks.erase(iter, clip->blockedTasks.end());
+        } else {
+            unblocked.swap(clip->blockedTasks);
+        }
+    }
+
+    if (!unblocked.empty()) {
+        for (auto &iter : unblocked)
+            queueTask(iter);
+        std::unique_lock<std::mutex> l(lock, std::defer_lock);
+        lockPool(l);
+        for (size_t i = 0; i < unblocked.size(); i++)
+            wakeThread();
+    }
+}
+
+VSThreadPool::ContextShard &VSThreadPool::getContextShard(const NodeOutputKey &key) {
+    return contextShards[key.hash() % numContextShards];
+}
+
+void VSThreadPool::runTask(const PFrameContext &task) {
+    FrameContext *mainContext = task.get();
+    FrameContext *leafContext = nullptr;
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// Remove the context from the task list
+// Handle the output tasks
+    if (mainContext->frameDone && mainContext->returnedFrame) {
+        returnFrame(task, mainContext->returnedFrame);
+        return;
+    }
 
-            PFrameContext mainContextRef;
-            PFrameContext leafContextRef;
-            if (hasLeafContext) {
-                leafContextRef = *iter;
-                mainContextRef = leafContextRef->upstreamContext;
-            } else {
-                mainContextRef = *iter;
-            }
+    if (mainContext->frameDone && mainContext->hasError()) {
+        returnFrame(task, mainContext->getErrorMessage());
+        return;
+    }
 
-            owner->tasks.erase(iter);
+    bool hasLeafContext = mainContext->returnedFrame || mainContext->hasError();
+    if (hasLeafContext) {
+        leafContext = mainContext;
+        mainContext = mainContext->upstreamContext.get();
+    }
+
+    // a frame that was abandoned because of a cancellation is still needed by a request merged into it
+    // later on, it's simply requested again which doesn't require the node to be acquired
+    if (hasLeafContext && leafContext->abandoned && !mainContext->isCancelled()) {
+        startInternal(std::make_shared<FrameContext>(leafContext->n, leafContext->index, leafContext->clip, leafContext->upstreamContext));
+        --mainContext->numFrameRequests;
+        return;
+    }
+
+    VSNode *clip = mainContext->clip;
+    int filterMode = clip->filterMode;
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// This part handles the locking for the different filter modes, if the filter is busy the task
+// is set aside until the node is released. Once acquired no other thread will touch mainContext.
+
+    bool parallelRequestsNeedsUnlock = false;
+    if (!tryAcquireNode(clip, task, mainContext, parallelRequestsNeedsUnlock))
+        return;
+
+    PFrameContext mainContextRef;
+    PFrameContext leafContextRef;
+    if (hasLeafContext) {
+        leafContextRef = task;
+        mainContextRef = leafContextRef->upstreamContext;
+    } else {
+        mainContextRef = task;
+    }
+
+    bool needsSerialMutex = (filterMode == fmUnordered || filterMode == fmUnorderedLinear || filterMode == fmSerial || parallelRequestsNeedsUnlock);
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Figure out the activation reason
 
-            VSActivationReason ar = arInitial;
-            bool skipCall = false; // Used to avoid multiple error calls for the same frame request going into a filter
-            if ((hasLeafContext && leafContext->hasError()) || mainContext->hasError()) {
-                ar = arError;
-                skipCall = mainContext->setError(leafContext->getErrorMessage());
-                --mainContext->numFrameRequests;
-            } else if (hasLeafContext && leafContext->returnedFrame) {
-                if (--mainContext->numFrameRequests > 0)
-                    ar = arFrameReady;
-                else
-                    ar = arAllFramesReady;
-
-                mainContext->availableFrames.insert(std::make_pair(NodeOutputKey(leafContext->clip, leafContext->n, leafContext->index), leafContext->returnedFrame));
-                mainContext->lastCompletedN = leafContext->n;
-                mainContext->lastCompletedNode = leafContext->node;
-            }
+    VSActivationReason ar = arInitial;
+    bool skipCall = false; // Used to avoid multiple error calls for the same frame request going into a filter
+    if ((hasLeafContext && leafContext->hasError()) || mainContext->hasError()) {
+        ar = arError;
+        skipCall = mainContext->setError(leafContext->getErrorMessage());
+        if (!skipCall)
+            mainContext->abandoned = leafContext->abandoned;
+        --mainContext->numFrameRequests;
+    } else if (mainContext->isCancelled()) {
+        // filters that haven't been entered yet are skipped, the others get arError to free their frame data
+        ar = arError;
+        skipCall = !hasLeafContext;
+        mainContext->setError("Frame request cancelled");
+        mainContext->abandoned = true;
+        if (hasLeafContext)
+            --mainContext->numFrameRequests;
+    } else if (hasLeafContext && leafContext->returnedFrame) {
+        if (--mainContext->numFrameRequests > 0)
+            ar = arFrameReady;
+        else
+            ar = arAllFramesReady;
+
+        mainContext->availableFrames.insert(std::make_pair(NodeOutputKey(leafContext->clip, leafContext->n, leafContext->index), leafContext->returnedFrame));
+        mainContext->cost += leafContext->cost;
+        mainContext->lastCompletedN = leafContext->n;
+        mainContext->lastCompletedNode = leafContext->node;
+    }
 
-            bool hasExistingRequests = !!mainContext->numFrameRequests;
-            bool isLinear = (filterMode == fmUnorderedLinear);
+    bool hasExistingRequests = !!mainContext->numFrameRequests;
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Do the actual processing
 
-            if (!isLinear)
-                lock.unlock();
-
-            VSFrameContext externalFrameCtx(mainContextRef);
-            assert(ar == arError || !mainContext->hasError());
+    VSFrameContext externalFrameCtx(mainContextRef);
+    assert(ar == arError || !mainContext->hasError());
 #ifdef VS_FRAME_REQ_DEBUG
-            vsWarning("Entering: %s Frame: %d Index: %d AR: %d Req: %d", mainContext->clip->name.c_str(), mainContext->n, mainContext->index, (int)ar, (int)mainContext->reqOrder);
+    vsWarning("Entering: %s Frame: %d Index: %d AR: %d Req: %d", mainContext->clip->name.c_str(), mainContext->n, mainContext->index, (int)ar, (int)mainContext->reqOrder);
 #endif
-            PVideoFrame f;
-            if (!skipCall)
-                f = clip->getFrameInternal(mainContext->n, ar, externalFrameCtx);
-            ranTask = true;
+    PVideoFrame f;
+    if (!skipCall) {
+        // the serial mutex is only held for the duration of the call so caches can still be resized safely
+        if (needsSerialMutex)
+            clip->serialMutex.lock();
+        bool profiling = core->isProfiling();
+        bool traced = tracing;
+        int64_t traceStartTime = traced ? traceTime() : 0;
+        int64_t cpuStart = profiling ? getThreadCpuTime() : 0;
+        size_t bytesStart = profiling ? MemoryUse::allocatedByThread() : 0;
+        auto startTime = std::chrono::steady_clock::now();
+        f = clip->getFrameInternal(mainContext->n, ar, externalFrameCtx);
+        int64_t wallTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+        mainContext->cost += wallTime;
+        if (profiling)
+            clip->addProfile(ar, wallTime, getThreadCpuTime() - cpuStart, MemoryUse::allocatedByThread() - bytesStart);
+        if (traced)
+            addTraceEvent(teFilter, traceStartTime, clip->name.c_str(), mainContext->n, ar);
+        if (needsSerialMutex)
+            clip->serialMutex.unlock();
+    }
 #ifdef VS_FRAME_REQ_DEBUG
-            vsWarning("Exiting: %s Frame: %d Index: %d AR: %d Req: %d", mainContext->clip->name.c_str(), mainContext->n, mainContext->index, (int)ar, (int)mainContext->reqOrder);
+    vsWarning("Exiting: %s Frame: %d Index: %d AR: %d Req: %d", mainContext->clip->name.c_str(), mainContext->n, mainContext->index, (int)ar, (int)mainContext->reqOrder);
 #endif
-            bool frameProcessingDone = f || mainContext->hasError();
-            if (mainContext->hasError() && f)
-                vsFatal("A frame was returned by %s but an error was also set, this is not allowed", clip->name.c_str());
+    bool frameProcessingDone = f || mainContext->hasError();
+    if (mainContext->hasError() && f)
+        vsFatal("A frame was returned by %s but an error was also set, this is not allowed", clip->name.c_str());
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Handle frames that were requested, this is done before the node is released so the
+// request count is always up to date when the next task for the same frame is picked up
+    bool requestedFrames = !externalFrameCtx.reqList.empty() && !frameProcessingDone;
+
+    if (requestedFrames) {
+        for (auto &reqIter : externalFrameCtx.reqList)
+            startInternal(reqIter);
+        externalFrameCtx.reqList.clear();
+    }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Unlock so the next job can run on the context
-            if (filterMode == fmUnordered || filterMode == fmUnorderedLinear) {
-                clip->serialMutex.unlock();
-            } else if (filterMode == fmSerial) {
-                if (frameProcessingDone)
-                    clip->serialFrame = -1;
-                clip->serialMutex.unlock();
-            } else if (filterMode == fmParallel) {
-                std::lock_guard<std::mutex> lock(clip->concurrentFramesMutex);
-                clip->concurrentFrames.erase(mainContext->n);
-            } else if (filterMode == fmParallelRequests) {
-                std::lock_guard<std::mutex> lock(clip->concurrentFramesMutex);
-                clip->concurrentFrames.erase(mainContext->n);
-                if (parallelRequestsNeedsUnlock)
-                    clip->serialMutex.unlock();
-            }
+    releaseNode(clip, mainContext, frameProcessingDone, parallelRequestsNeedsUnlock);
+
+    // once removed no more requests can be added to the notification chain so it's safe to walk it below
+    if (frameProcessingDone) {
+        NodeOutputKey key(mainContext->clip, mainContext->n, mainContext->index);
+        ContextShard &shard = getContextShard(key);
+        std::lock_guard<std::mutex> l(shard.lock);
+        shard.contexts.erase(key);
+    }
 
 /////////////////////////////////////////////////////////////////////////////////////////////
-// Handle frames that were requested
-            bool requestedFrames = !externalFrameCtx.reqList.empty() && !frameProcessingDone;
+// Propagate status to other linked contexts
+// CHANGES mainContextRef!!!
 
-            if (!isLinear)
-                lock.lock();
+    if (mainContext->hasError() && !hasExistingRequests && !requestedFrames) {
+        PFrameContext n;
+        do {
+            n = mainContextRef->notificationChain;
 
-            if (requestedFrames) {
-                for (auto &reqIter : externalFrameCtx.reqList)
-                    owner->startInternal(reqIter);
-                externalFrameCtx.reqList.clear();
+            if (n) {
+                mainContextRef->notificationChain.reset();
+                n->setError(mainContextRef->getErrorMessage());
+                n->abandoned = mainContextRef->abandoned;
             }
 
-            if (frameProcessingDone)
-                owner->allContexts.erase(NodeOutputKey(mainContext->clip, mainContext->n, mainContext->index));
-
-/////////////////////////////////////////////////////////////////////////////////////////////
-// Propagate status to other linked contexts
-// CHANGES mainContextRef!!!
+            if (mainContextRef->upstreamContext) {
+                startInternal(mainContextRef);
+            }
 
-            if (mainContext->hasError() && !hasExistingRequests && !requestedFrames) {
-                PFrameContext n;
-                do {
-                    n = mainContextRef->notificationChain;
-
-                    if (n) {
-                        mainContextRef->notificationChain.reset();
-                        n->setError(mainContextRef->getErrorMessage());
-                    }
-
-                    if (mainContextRef->upstreamContext) {
-                        owner->startInternal(mainContextRef);
-                    }
-
-                    if (mainContextRef->frameDone) {
-                        owner->returnFrame(mainContextRef, mainContextRef->getErrorMessage());
-                    }
-                } while ((mainContextRef = n));
-            } else if (f) {
-                if (hasExistingRequests || requestedFrames)
-                    vsFatal("A frame was returned at the end of processing by %s but there are still outstanding requests", clip->name.c_str());
-                PFrameContext n;
-
-                do {
-                    n = mainContextRef->notificationChain;
-
-                    if (n)
-                        mainContextRef->notificationChain.reset();
-
-                    if (mainContextRef->upstreamContext) {
-                        mainContextRef->returnedFrame = f;
-                        owner->startInternal(mainContextRef);
-                    }
-
-                    if (mainContextRef->frameDone)
-                        owner->returnFrame(mainContextRef, f);
-                } while ((mainContextRef = n));
-            } else if (hasExistingRequests || requestedFrames) {
-                // already scheduled, do nothing
-            } else {
-                vsFatal("No frame returned at the end of processing by %s", clip->name.c_str());
+            if (mainContextRef->frameDone) {
+                returnFrame(mainContextRef, mainContextRef->getErrorMessage());
+            }
+        } while ((mainContextRef = n));
+    } else if (f) {
+        if (hasExistingRequests || requestedFrames)
+            vsFatal("A frame was returned at the end of processing by %s but there are still outstanding requests", clip->name.c_str());
+        PFrameContext n;
+
+        do {
+            n = mainContextRef->notificationChain;
+
+            if (n)
+                mainContextRef->notificationChain.reset();
+
+            if (mainContextRef->upstreamContext) {
+                mainContextRef->returnedFrame = f;
+                // merged requests are charged the full cost since it would have to be paid again if the frame is dropped
+                mainContextRef->cost = mainContext->cost;
+                startInternal(mainContextRef);
             }
-            break;
+
+            if (mainContextRef->frameDone)
+                returnFrame(mainContextRef, f);
+        } while ((mainContextRef = n));
+    } else if (hasExistingRequests || requestedFrames) {
+        // already scheduled, do nothing
+    } else {
+        vsFatal("No frame returned at the end of processing by %s", clip->name.c_str());
+    }
+}
+
+void VSThreadPool::runTasks(VSThreadPool *owner, std::atomic<bool> &stop, size_t queueIndex) {
+#ifdef VS_TARGET_OS_WINDOWS
+    if (!vs_isSSEStateOk())
+        vsFatal("Bad SSE state detected after creating new thread");
+#endif
+
+    currentPool = owner;
+    currentQueue = queueIndex;
+
+    if (!owner->numaNodes.empty()) {
+        currentNumaNode = owner->queueNumaNode[queueIndex];
+        const NumaNode &node = owner->numaNodes[currentNumaNode];
+        currentNumaNodeId = node.id;
+#if defined(HAVE_SCHED_GETAFFINITY)
+        cpu_set_t affinity;
+        CPU_ZERO(&affinity);
+        for (int cpu : node.cpus)
+            CPU_SET(cpu, &affinity);
+        if (sched_setaffinity(0, sizeof(cpu_set_t), &affinity))
+            vsWarning("Failed to set the thread affinity for numa node %d", node.id);
+#endif
+    }
+
+    std::unique_lock<std::mutex> lock(owner->lock, std::defer_lock);
+
+    while (true) {
+        // helping with a parallelFor() comes first since a frame is already being waited on
+        if (owner->numParallelJobs && owner->helpParallelJob())
+            continue;
+
+        PFrameContext task = owner->dequeueTask(queueIndex);
+        if (task) {
+            owner->runTask(task);
+            if (owner->activeThreads <= owner->maxThreads)
+                continue;
         }
 
+        owner->lockPool(lock);
 
-        if (!ranTask || owner->activeThreads > owner->maxThreads) {
+        // new work may have been queued since the queues were checked, threads are always woken with the lock held after queuing so this check is reliable
+        if (!task && (owner->queuedTasks > 0 || owner->numParallelJobs > 0)) {
+            lock.unlock();
+            continue;
+        }
+
+        if (!task || owner->activeThreads > owner->maxThreads) {
             --owner->activeThreads;
             if (stop) {
                 lock.unlock();
@@ -302,14 +650,26 @@ void VSThreadPool::runTasks(VSThreadPool *owner, std::atomic<bool> &stop) {
             if (owner->idleThreads == owner->allThreads.size())
                 owner->allIdle.notify_one();
 
-            owner->newWork.wait(lock);
+            if (owner->tracing) {
+                int64_t start = owner->traceTime();
+                owner->newWork.wait(lock);
+                owner->addTraceEvent(teIdle, start, "Idle", -1, -1);
+            } else {
+                owner->newWork.wait(lock);
+            }
             --owner->idleThreads;
             ++owner->activeThreads;
         }
+
+        lock.unlock();
     }
 }
 
-VSThreadPool::VSThreadPool(VSCore *core, int threads) : core(core), activeThreads(0), idleThreads(0), reqCounter(0), stopThreads(false), ticks(0) {
+VSThreadPool::VSThreadPool(VSCore *core, int threads) : core(core), numParallelJobs(0), activeThreads(0), idleThreads(0), reqCounter(0), maxThreads(0), stopThreads(false), ticks(0), queuedTasks(0), urgentTasks(0), nextQueue(0), tracing(false), traceStart(0), traceId(nextTraceId++) {
+    // the number of queues is fixed so they can be searched without locking, threads added
+    // later by raising the thread count simply share queues with the existing ones
+    size_t numQueues = std::max(std::max(threads, getNumAvailableThreads()), 1);
+    createQueues(numQueues);
     setThreadCount(threads);
 }
 
@@ -319,7 +679,7 @@ int VSThreadPool::threadCount() {
 }
 
 void VSThreadPool::spawnThread() {
-    std::thread *thread = new std::thread(runTasks, this, std::ref(stopThreads));
+    std::thread *thread = new std::thread(runTasks, this, std::ref(stopThreads), allThreads.size() % queues.size());
     allThreads.insert(std::make_pair(thread->get_id(), thread));
     ++activeThreads;
 }
@@ -353,44 +713,44 @@ void VSThreadPool::reserveThread() {
 
 void VSThreadPool::notifyCaches(bool needMemory) {
     std::lock_guard<std::mutex> lock(core->cacheLock);
-    for (auto &cache : core->caches)
-        cache->notifyCache(needMemory);
+    balanceCaches(core->caches, core->memory, needMemory);
 }
 
 void VSThreadPool::start(const PFrameContext &context) {
     assert(context);
-    std::lock_guard<std::mutex> l(lock);
     context->reqOrder = ++reqCounter;
     startInternal(context);
 }
 
+// no pool locks are held when the callbacks are invoked so they may request more frames without causing a deadlock
+// AND so that slow callbacks will only block operations in this thread, not all the others
 void VSThreadPool::returnFrame(const PFrameContext &rCtx, const PVideoFrame &f) {
     assert(rCtx->frameDone);
     bool outputLock = rCtx->lockOnOutput;
-    // we need to unlock here so the callback may request more frames without causing a deadlock
-    // AND so that slow callbacks will only block operations in this thread, not all the others
-    lock.unlock();
     VSFrameRef *ref = new VSFrameRef(f);
+    bool traced = tracing;
+    int64_t start = traced ? traceTime() : 0;
     if (outputLock)
         callbackLock.lock();
     rCtx->frameDone(rCtx->userData, ref, rCtx->n, rCtx->node, nullptr);
     if (outputLock)
         callbackLock.unlock();
-    lock.lock();
+    if (traced)
+        addTraceEvent(teCallback, start, "Frame done", rCtx->n, -1);
 }
 
 void VSThreadPool::returnFrame(const PFrameContext &rCtx, const std::string &errMsg) {
     assert(rCtx->frameDone);
     bool outputLock = rCtx->lockOnOutput;
-    // we need to unlock here so the callback may request more frames without causing a deadlock
-    // AND so that slow callbacks will only block operations in this thread, not all the others
-    lock.unlock();
+    bool traced = tracing;
+    int64_t start = traced ? traceTime() : 0;
     if (outputLock)
         callbackLock.lock();
     rCtx->frameDone(rCtx->userData, nullptr, rCtx->n, rCtx->node, errMsg.c_str());
     if (outputLock)
         callbackLock.unlock();
-    lock.lock();
+    if (traced)
+        addTraceEvent(teCallback, start, "Frame error", rCtx->n, -1);
 }
 
 void VSThreadPool::startInternal(const PFrameContext &context) {
@@ -414,39 +774,337 @@ void VSThreadPool::startInternal(const PFrameContext &context) {
 
     // add it immediately if the task is to return a completed frame or report an error since it never has an existing context
     if (context->returnedFrame || context->hasError()) {
-        tasks.push_back(context);
+        queueTask(context);
     } else {
         if (context->upstreamContext)
             ++context->upstreamContext->numFrameRequests;
 
         NodeOutputKey p(context->clip, context->n, context->index);
+        ContextShard &shard = getContextShard(p);
+        std::unique_lock<std::mutex> sl(shard.lock);
 
-        if (allContexts.count(p)) {
-            PFrameContext &ctx = allContexts[p];
+        auto iter = shard.contexts.find(p);
+        if (iter != shard.contexts.end()) {
+            PFrameContext &ctx = iter->second;
             assert(context->clip == ctx->clip && context->n == ctx->n && context->index == ctx->index);
 
             if (ctx->returnedFrame) {
                 // special case where the requested frame is encountered "by accident"
                 context->returnedFrame = ctx->returnedFrame;
-                tasks.push_back(context);
+                sl.unlock();
+                queueTask(context);
             } else {
                 // add it to the list of contexts to notify when it's available
                 context->notificationChain = ctx->notificationChain;
                 ctx->notificationChain = context;
-                ctx->reqOrder = std::min(ctx->reqOrder, context->reqOrder);
+                ctx->reqOrder = std::min(ctx->reqOrder.load(), context->reqOrder.load());
+                // the frames it requests from now on get the raised priority, the ones already queued keep theirs
+                ctx->priority = std::max(ctx->priority.load(), context->priority.load());
+                ctx->deadline = std::min(ctx->deadline.load(), context->deadline.load());
+                if (context->cancelFlag != ctx->cancelFlag || !context->isCancellable())
+                    ctx->cancellable = false;
+                return;
             }
         } else {
             // create a new context and append it to the tasks
-            allContexts[p] = context;
-            tasks.push_back(context);
+            shard.contexts.insert(std::make_pair(p, context));
+            sl.unlock();
+            queueTask(context);
         }
     }
+
+    std::unique_lock<std::mutex> l(lock, std::defer_lock);
+    lockPool(l);
     wakeThread();
 }
 
+void VSThreadPool::cancelQueued() {
+    // queued tasks of cancelled requests go first so the frames their contexts hold are freed right away
+    for (auto &q : queues) {
+        std::lock_guard<std::mutex> l(q->lock);
+        bool changed = false;
+        for (QueuedTask &t : q->heap) {
+            const FrameContext *target = (t.context->returnedFrame || t.context->hasError()) ? t.context->upstreamContext.get() : t.context.get();
+            if (target && t.priority != cancelledPriority && target->isCancelled()) {
+                if (!t.isUrgent())
+                    ++urgentTasks;
+                t.priority = cancelledPriority;
+                changed = true;
+            }
+        }
+        if (changed)
+            std::make_heap(q->heap.begin(), q->heap.end(), heapCmp);
+    }
+}
+
 bool VSThreadPool::isWorkerThread() {
-    std::lock_guard<std::mutex> m(lock);
-    return allThreads.count(std::this_thread::get_id()) > 0;
+    return currentPool == this;
+}
+
+void VSThreadPool::runParallelRanges(ParallelJob &job) {
+    int begin;
+    while ((begin = job.next.fetch_add(job.rangeSize)) < job.count) {
+        int end = (begin > job.count - job.rangeSize) ? job.count : begin + job.rangeSize;
+        job.func(begin, end, job.userData);
+        if ((job.done += end - begin) == job.count) {
+            std::lock_guard<std::mutex> l(job.lock);
+            job.finished.notify_all();
+        }
+    }
+}
+
+bool VSThreadPool::helpParallelJob() {
+    std::shared_ptr<ParallelJob> job;
+    {
+        std::unique_lock<std::mutex> l(lock, std::defer_lock);
+        lockPool(l);
+        // jobs with no ranges left are dropped, the thread that started them waits for the ranges still running
+        parallelJobs.erase(std::remove_if(parallelJobs.begin(), parallelJobs.end(), [](const std::shared_ptr<ParallelJob> &j) { return j->next >= j->count; }), parallelJobs.end());
+        numParallelJobs = parallelJobs.size();
+        if (parallelJobs.empty())
+            return false;
+        job = parallelJobs.back();
+    }
+    if (tracing) {
+        int64_t start = traceTime();
+        runParallelRanges(*job);
+        addTraceEvent(teParallelFor, start, "parallelFor", -1, -1);
+    } else {
+        runParallelRanges(*job);
+    }
+    return true;
+}
+
+void VSThreadPool::parallelFor(VSParallelFunc func, void *userData, int count, int grain) {
+    if (count <= 0)
+        return;
+
+    // a few more ranges than threads so they even out when some take longer than others
+    int64_t ranges = std::min<int64_t>((static_cast<int64_t>(count) + std::max(grain, 1) - 1) / std::max(grain, 1), static_cast<int64_t>(maxThreads) * 4);
+    // nothing to gain when every thread is already busy with other frames
+    if (ranges <= 1 || (idleThreads == 0 && activeThreads >= maxThreads)) {
+        func(0, count, userData);
+        return;
+    }
+
+    std::shared_ptr<ParallelJob> job = std::make_shared<ParallelJob>();
+    job->func = func;
+    job->userData = userData;
+    job->count = count;
+    job->rangeSize = static_cast<int>((count + ranges - 1) / ranges);
+    job->next = 0;
+    job->done = 0;
+
+    {
+        std::lock_guard<std::mutex> l(lock);
+        parallelJobs.push_back(job);
+        numParallelJobs = parallelJobs.size();
+
+        // only threads that would otherwise sit idle are used and they count as active while helping,
+        // the calling thread works on the ranges too so the job finishes even if nobody else shows up
+        unsigned helpers = static_cast<unsigned>((count + job->rangeSize - 1) / job->rangeSize) - 1;
+        unsigned available = (maxThreads > activeThreads) ? maxThreads - activeThreads : 0;
+        unsigned idle = idleThreads;
+        for (; helpers > 0 && available > 0; helpers--, available--) {
+            if (idle > 0) {
+                idle--;
+                newWork.notify_one();
+            } else {
+                spawnThread();
+            }
+        }
+    }
+
+    runParallelRanges(*job);
+
+    {
+        std::lock_guard<std::mutex> l(lock);
+        auto iter = std::find(parallelJobs.begin(), parallelJobs.end(), job);
+        if (iter != parallelJobs.end())
+            parallelJobs.erase(iter);
+        numParallelJobs = parallelJobs.size();
+    }
+
+    std::unique_lock<std::mutex> l(job->lock);
+    job->finished.wait(l, [&job]() { return job->done == job->count; });
+}
+
+bool VSThreadPool::enableNuma(const std::string &nodeList) {
+    std::lock_guard<std::mutex> l(lock);
+    // the queue layout can't change once threads are using it
+    if (!allThreads.empty()) {
+        vsWarning("Numa mode can only be enabled before any frames are requested");
+        return false;
+    }
+
+    std::vector<NumaNode> nodes = detectNumaTopology(nodeList);
+    if (nodes.empty()) {
+        vsWarning("No usable numa topology found, numa mode disabled");
+        return false;
+    }
+
+    size_t numCpus = 0;
+    for (const auto &node : nodes)
+        numCpus += node.cpus.size();
+    numaNodes.swap(nodes);
+    // at least one queue per node is needed to be able to place tasks on all of them
+    createQueues(std::max(std::max<size_t>(queues.size(), numCpus), numaNodes.size()));
+    return true;
+}
+
+int VSThreadPool::getCurrentNumaNode() {
+    return currentNumaNode;
+}
+
+void VSThreadPool::bindToCurrentNumaNode(void *ptr, size_t bytes) {
+#if defined(HAVE_SCHED_GETAFFINITY) && defined(SYS_mbind)
+    const int mpolPreferred = 1;
+    const unsigned mpolMfMove = 1 << 1;
+    unsigned long nodeMask[16] = {};
+    const int maxNode = sizeof(nodeMask) * 8;
+    if (currentNumaNodeId < 0 || currentNumaNodeId >= maxNode)
+        return;
+    nodeMask[currentNumaNodeId / (sizeof(unsigned long) * 8)] = 1UL << (currentNumaNodeId % (sizeof(unsigned long) * 8));
+
+    // only whole pages can be bound, pages partially used by other allocations are left where they are
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (reinterpret_cast<uintptr_t>(ptr) + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t end = (reinterpret_cast<uintptr_t>(ptr) + bytes) & ~(pageSize - 1);
+    // pages not touched yet are allocated on the node when first written to and reused memory
+    // is moved there, failure is harmless since it only affects performance
+    if (start < end)
+        syscall(SYS_mbind, start, end - start, mpolPreferred, nodeMask, maxNode + 1, mpolMfMove);
+#else
+    (void)ptr;
+    (void)bytes;
+#endif
+}
+
+VSTraceBuffer *VSThreadPool::getTraceBuffer() {
+    if (currentTraceId != traceId) {
+        std::lock_guard<std::mutex> l(traceLock);
+        std::unique_ptr<VSTraceBuffer> &buffer = traceBuffers[std::this_thread::get_id()];
+        if (!buffer) {
+            int index = static_cast<int>(traceBuffers.size());
+            buffer.reset(new VSTraceBuffer(index, (isWorkerThread() ? "Worker " : "Thread ") + std::to_string(index)));
+        }
+        currentTraceBuffer = buffer.get();
+        currentTraceId = traceId;
+    }
+    return currentTraceBuffer;
+}
+
+int64_t VSThreadPool::traceTime() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - traceStart;
+}
+
+void VSThreadPool::addTraceEvent(int type, int64_t start, const char *name, int n, int reason) {
+    int64_t end = traceTime();
+    VSTraceBuffer *buffer = getTraceBuffer();
+    uint64_t index = buffer->written.load(std::memory_order_relaxed);
+    VSTraceEvent &e = buffer->events[index % traceBufferSize];
+    e.start = start;
+    e.duration = end - start;
+    e.type = type;
+    e.n = n;
+    e.reason = reason;
+    strncpy(e.name, name, sizeof(e.name) - 1);
+    e.name[sizeof(e.name) - 1] = 0;
+    buffer->written.store(index + 1, std::memory_order_release);
+}
+
+// only waiting for the lock is recorded, taking it uncontended is too common to be worth an event
+void VSThreadPool::lockPool(std::unique_lock<std::mutex> &l) {
+    if (!tracing) {
+        l.lock();
+    } else if (!l.try_lock()) {
+        int64_t start = traceTime();
+        l.lock();
+        addTraceEvent(teLockWait, start, "Pool lock", -1, -1);
+    }
+}
+
+bool VSThreadPool::setTracing(int enable) {
+    std::lock_guard<std::mutex> l(traceLock);
+    if (enable > 0 && !tracing) {
+        for (auto &iter : traceBuffers)
+            iter.second->first = iter.second->written;
+        traceStart = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    if (enable >= 0)
+        tracing = !!enable;
+    return tracing;
+}
+
+static std::string jsonEscape(const char *str) {
+    std::string result;
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            result += '\\';
+            result += *str;
+        } else if (static_cast<unsigned char>(*str) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", *str);
+            result += buf;
+        } else {
+            result += *str;
+        }
+    }
+    return result;
+}
+
+// writes the events in the chrome trace event format which chrome://tracing and perfetto can open
+bool VSThreadPool::saveTrace(const std::string &filename) {
+    static const char *const categories[] = { "filter", "lock", "idle", "output", "parallel" };
+    std::vector<VSTraceBuffer *> buffers;
+    std::ostringstream out;
+    out.imbue(std::locale::classic());
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool firstEvent = true;
+
+    std::lock_guard<std::mutex> l(traceLock);
+    for (auto &iter : traceBuffers)
+        buffers.push_back(iter.second.get());
+    std::sort(buffers.begin(), buffers.end(), [](const VSTraceBuffer *a, const VSTraceBuffer *b) { return a->index < b->index; });
+
+    for (VSTraceBuffer *buffer : buffers) {
+        uint64_t written = buffer->written.load(std::memory_order_acquire);
+        uint64_t begin = std::max(buffer->first, (written > traceBufferSize) ? written - traceBufferSize : 0);
+        if (begin == written)
+            continue;
+
+        out << (firstEvent ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->index << ",\"args\":{\"name\":\"" << buffer->threadName << "\"}}";
+        out << ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << buffer->index << ",\"args\":{\"sort_index\":" << buffer->index << "}}";
+        firstEvent = false;
+
+        for (uint64_t i = begin; i < written; i++) {
+            const VSTraceEvent &e = buffer->events[i % traceBufferSize];
+            // started before tracing was enabled
+            if (e.start < 0)
+                continue;
+            out << ",\n{\"name\":\"" << jsonEscape(e.name) << "\",\"cat\":\"" << categories[e.type] << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << buffer->index;
+            out << ",\"ts\":" << e.start / 1000 << "." << std::to_string(1000 + e.start % 1000).substr(1) << ",\"dur\":" << e.duration / 1000 << "." << std::to_string(1000 + e.duration % 1000).substr(1);
+            if (e.type == teFilter) {
+                static const char *const reasons[] = { "error", "initial", "frame_ready", "all_frames_ready" };
+                out << ",\"args\":{\"frame\":" << e.n << ",\"reason\":\"" << reasons[e.reason + 1] << "\"}";
+            } else if (e.type == teCallback) {
+                out << ",\"args\":{\"frame\":" << e.n << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+
+#ifdef VS_TARGET_OS_WINDOWS
+    FILE *f = _wfopen(utf16_from_utf8(filename).c_str(), L"wb");
+#else
+    FILE *f = fopen(filename.c_str(), "wb");
+#endif
+    if (!f)
+        return false;
+    std::string data = out.str();
+    bool success = fwrite(data.data(), 1, data.size(), f) == data.size();
+    return !fclose(f) && success;
 }
 
 void VSThreadPool::waitForDone() {
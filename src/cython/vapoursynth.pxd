@@ -42,6 +42,8 @@ cdef extern from "include/VapourSynth.h" nogil:
         pass
     ctypedef struct VSFrameContext:
         pass
+    ctypedef struct VSCancelToken:
+        pass
 
     cpdef enum ColorFamily "VSColorFamily":
         GRAY "cmGray"
@@ -159,6 +161,12 @@ cdef extern from "include/VapourSynth.h" nogil:
         arAllFramesReady
         arError
 
+    cpdef enum RequestPriority "VSRequestPriority":
+        SPECULATIVE "rpSpeculative"
+        BACKGROUND "rpBackground"
+        NORMAL "rpNormal"
+        INTERACTIVE "rpInteractive"
+
     enum VSMessageType:
         mtDebug
         mtWarning
@@ -170,6 +178,8 @@ cdef extern from "include/VapourSynth.h" nogil:
     ctypedef void (__stdcall *VSFilterInit)(VSMap *input, VSMap *out, void **instanceData, VSNode *node, VSCore *core, const VSAPI *vsapi)
     ctypedef const VSFrameRef *(__stdcall *VSFilterGetFrame)(int n, int activationReason, void **instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi)
     ctypedef void (__stdcall *VSFilterFree)(void *instanceData, VSCore *core, const VSAPI *vsapi)
+    ctypedef void (__stdcall *VSFilterGetRegion)(const uint8_t * const *srcp, const int *srcStride, uint8_t *dstp, int dstStride, int plane, int width, int height, int top, int bottom, void *instanceData)
+    ctypedef void (__stdcall *VSParallelFunc)(int begin, int end, void *userData)
     ctypedef void (__stdcall *VSFreeFuncData)(void *userData)
     ctypedef void (__stdcall *VSMessageHandler)(int msgType, const char *msg, void *userData)
     ctypedef void (__stdcall *VSMessageHandlerFree)(void *userData)
@@ -264,4 +274,19 @@ cdef extern from "include/VapourSynth.h" nogil:
         int removeMessageHandler(int id) nogil
         void getCoreInfo2(VSCore *core, VSCoreInfo *info) nogil
 
+        int setLargePages(int enable, VSCore *core) nogil
+        int64_t getLargePageMemory(VSCore *core) nogil
+        void setRegionSupport(VSFilterGetRegion getRegion, VSNodeRef **inputs, int numInputs, int apron, int propSource, VSNode *node) nogil
+        void parallelFor(VSParallelFunc func, void *userData, int count, int grain, VSCore *core) nogil
+        VSFrameRef *cropFrame(const VSFrameRef *f, int left, int top, int width, int height, VSCore *core) nogil
+        int setProfiling(int enable, VSCore *core) nogil
+        VSMap *getProfile(VSCore *core) nogil
+        int setTracing(int enable, VSCore *core) nogil
+        int saveTrace(const char *filename, VSCore *core) nogil
+        void getFrameAsyncPriority(int n, VSNodeRef *node, VSFrameDoneCallback callback, void *userData, int priority, int64_t deadline) nogil
+        VSCancelToken *createCancelToken(VSCore *core) nogil
+        void cancelRequests(VSCancelToken *token) nogil
+        void freeCancelToken(VSCancelToken *token) nogil
+        void getFrameAsyncCancellable(int n, VSNodeRef *node, VSFrameDoneCallback callback, void *userData, int priority, int64_t deadline, VSCancelToken *token) nogil
+
     const VSAPI *getVapourSynthAPI(int version) nogil
@@ -63,6 +63,7 @@ __all__ = [
     'YUV444P9', 'YUV444PH', 'YUV444PS', 
   'NONE',
   'FLOAT', 'INTEGER',
+  'SPECULATIVE', 'BACKGROUND', 'NORMAL', 'INTERACTIVE',
   
   'get_output', 'get_outputs',
   'clear_output', 'clear_outputs',
@@ -656,6 +657,29 @@ cdef FramePtr createFramePtr(const VSFrameRef *f, const VSAPI *funcs):
     instance.funcs = funcs
     return instance
 
+cdef class CancelToken(object):
+    cdef const VSAPI *funcs
+    cdef VSCancelToken *token
+    cdef Core core
+
+    def __init__(self):
+        raise Error('Class cannot be instantiated directly')
+
+    def __dealloc__(self):
+        if self.funcs:
+            self.funcs.freeCancelToken(self.token)
+
+    def cancel(self):
+        with nogil:
+            self.funcs.cancelRequests(self.token)
+
+cdef CancelToken createCancelToken(Core core):
+    cdef CancelToken instance = CancelToken.__new__(CancelToken)
+    instance.token = core.funcs.createCancelToken(core.core)
+    instance.funcs = core.funcs
+    instance.core = core
+    return instance
+
 cdef void __stdcall frameDoneCallbackRaw(void *data, const VSFrameRef *f, int n, VSNodeRef *node, const char *errormsg) nogil:
     with gil:
         d = <RawCallbackData>data
@@ -1462,21 +1486,24 @@ cdef class VideoNode(object):
         else:
             return createConstVideoFrame(f, self.funcs, self.core.core)
 
-    def get_frame_async_raw(self, int n, object cb, object future_wrapper=None):
+    def get_frame_async_raw(self, int n, object cb, object future_wrapper=None, int priority=NORMAL, int64_t deadline=0, CancelToken token=None):
+        cdef VSCancelToken *t = NULL
         self.ensure_valid_frame_number(n)
+        if token is not None:
+            t = token.token
 
         data = createRawCallbackData(self.funcs, self, cb, future_wrapper)
         Py_INCREF(data)
         with nogil:
-            self.funcs.getFrameAsync(n, self.node, frameDoneCallbackRaw, <void *>data)
+            self.funcs.getFrameAsyncCancellable(n, self.node, frameDoneCallbackRaw, <void *>data, priority, deadline, t)
 
-    def get_frame_async(self, int n):
+    def get_frame_async(self, int n, int priority=NORMAL, int64_t deadline=0, CancelToken token=None):
         from concurrent.futures import Future
         fut = Future()
         fut.set_running_or_notify_cancel()
 
         try:
-            self.get_frame_async_raw(n, fut)
+            self.get_frame_async_raw(n, fut, None, priority, deadline, token)
         except Exception as e:
             fut.set_exception(e)
 
@@ -1753,6 +1780,59 @@ cdef class Core(object):
         else:
             raise AttributeError('No attribute with the name ' + name + ' exists. Did you mistype a plugin namespace?')
 
+    property large_pages:
+        def __get__(self):
+            return bool(self.funcs.setLargePages(-1, self.core))
+
+        def __set__(self, bint value):
+            self.funcs.setLargePages(value, self.core)
+
+    property large_page_memory:
+        def __get__(self):
+            return self.funcs.getLargePageMemory(self.core)
+
+    property profiling:
+        def __get__(self):
+            return bool(self.funcs.setProfiling(-1, self.core))
+
+        def __set__(self, bint value):
+            self.funcs.setProfiling(value, self.core)
+
+    def get_profile(self):
+        cdef VSMap *m = self.funcs.getProfile(self.core)
+        cdef const char *key
+        cdef char proptype
+        profile = [{} for i in range(self.funcs.propNumElements(m, 'name'))]
+
+        for i in range(self.funcs.propNumKeys(m)):
+            key = self.funcs.propGetKey(m, i)
+            proptype = self.funcs.propGetType(m, key)
+            name = key.decode('utf-8')
+            for j in range(len(profile)):
+                if proptype == 'i':
+                    profile[j][name] = self.funcs.propGetInt(m, key, j, NULL)
+                elif proptype == 'f':
+                    profile[j][name] = self.funcs.propGetFloat(m, key, j, NULL)
+                else:
+                    profile[j][name] = self.funcs.propGetData(m, key, j, NULL).decode('utf-8')
+
+        self.funcs.freeMap(m)
+        return profile
+
+    property tracing:
+        def __get__(self):
+            return bool(self.funcs.setTracing(-1, self.core))
+
+        def __set__(self, bint value):
+            self.funcs.setTracing(value, self.core)
+
+    def save_trace(self, str filename not None):
+        if not self.funcs.saveTrace(filename.encode('utf-8'), self.core):
+            raise Error('Failed to write the trace to ' + filename)
+
+    def create_cancel_token(self):
+        return createCancelToken(self)
+
     def set_max_cache_size(self, int mb):
         self.max_cache_size = mb
         return self.max_cache_size
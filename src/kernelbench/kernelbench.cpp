@@ -0,0 +1,429 @@
+/*
+* Copyright (c) 2012-2020 Fredrik Mellbin
+*
+* This file is part of VapourSynth.
+*
+* VapourSynth is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* VapourSynth is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with VapourSynth; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// Times the kernels in src/core/kernel for every pixel type and every instruction set the cpu supports.
+// The results can be saved and later runs compared against them to find regressions.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <locale>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "VSHelper.h"
+#include "../core/cpufeatures.h"
+#include "../core/kernel/generic.h"
+#include "../core/kernel/merge.h"
+#include "../core/kernel/planestats.h"
+#include "../core/kernel/transpose.h"
+
+#ifdef VS_TARGET_CPU_X86
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+enum PixelType {
+    pixelByte,
+    pixelWord,
+    pixelFloat
+};
+
+static int bytesPerSample(PixelType pixel) {
+    return (pixel == pixelByte) ? 1 : (pixel == pixelWord) ? 2 : 4;
+}
+
+// the planes a kernel is run on, all have the same stride except for a transposed destination
+struct BenchPlanes {
+    unsigned width;
+    unsigned height;
+    ptrdiff_t stride;
+    const uint8_t *src[3];
+    uint8_t *dst;
+    ptrdiff_t dstStride;
+};
+
+struct Kernel {
+    std::string name;
+    PixelType pixel;
+    int reads; // number of planes read
+    int writes; // number of planes written
+    bool transposed;
+    std::function<void(const BenchPlanes &)> run;
+};
+
+struct Size {
+    unsigned width;
+    unsigned height;
+};
+
+static const Size sizes[] = { { 320, 240 }, { 1920, 1080 }, { 3840, 2160 } };
+
+// every row starting on a new cache line or only at the 32 byte alignment frames are guaranteed to have
+static const char *const strideNames[] = { "aligned", "unaligned" };
+
+static ptrdiff_t makeStride(unsigned width, PixelType pixel, int strideType) {
+    ptrdiff_t rowSize = static_cast<ptrdiff_t>(width) * bytesPerSample(pixel);
+    ptrdiff_t stride = (rowSize + 63) & ~63;
+    return strideType ? stride + 32 : stride;
+}
+
+typedef void (*GenericFunc)(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t dst_stride, const struct vs_generic_params *params, unsigned width, unsigned height);
+typedef void (*MergeFunc)(const void *src1, const void *src2, void *dst, union vs_merge_weight weight, unsigned n);
+typedef void (*MaskMergeFunc)(const void *src1, const void *src2, const void *mask, void *dst, unsigned depth, unsigned offset, unsigned n);
+typedef void (*DiffFunc)(const void *src1, const void *src2, void *dst, unsigned depth, unsigned n);
+typedef void (*Stats1Func)(union vs_plane_stats *stats, const void *src, ptrdiff_t stride, unsigned width, unsigned height);
+typedef void (*Stats2Func)(union vs_plane_stats *stats, const void *src1, ptrdiff_t src1_stride, const void *src2, ptrdiff_t src2_stride, unsigned width, unsigned height);
+typedef void (*TransposeFunc)(const void *src, ptrdiff_t src_stride, void *dst, ptrdiff_t dst_stride, unsigned width, unsigned height);
+
+static unsigned depth(PixelType pixel) {
+    return (pixel == pixelByte) ? 8 : 16;
+}
+
+static Kernel genericKernel(const std::string &name, PixelType pixel, GenericFunc func, unsigned matrixSize) {
+    vs_generic_params params = {};
+    params.maxval = static_cast<uint16_t>((1 << depth(pixel)) - 1);
+    params.scale = 1.0f;
+    params.threshold = params.maxval;
+    params.thresholdf = 1.0f;
+    params.stencil = 0xFF;
+    params.matrixsize = matrixSize;
+    for (unsigned i = 0; i < matrixSize; i++) {
+        params.matrix[i] = 1;
+        params.matrixf[i] = 1.0f;
+    }
+    params.div = 1.0f / matrixSize;
+    params.saturate = 1;
+
+    return { "vs_generic_" + name, pixel, 1, 1, false, [func, params](const BenchPlanes &p) {
+        func(p.src[0], p.stride, p.dst, p.stride, &params, p.width, p.height);
+    } };
+}
+
+static Kernel mergeKernel(const std::string &name, PixelType pixel, MergeFunc func) {
+    vs_merge_weight weight;
+    if (pixel == pixelFloat)
+        weight.f = 0.5f;
+    else
+        weight.u = 1 << 14;
+
+    return { name, pixel, 2, 1, false, [func, weight](const BenchPlanes &p) {
+        for (unsigned y = 0; y < p.height; y++)
+            func(p.src[0] + y * p.stride, p.src[1] + y * p.stride, p.dst + y * p.stride, weight, p.width);
+    } };
+}
+
+static Kernel maskMergeKernel(const std::string &name, PixelType pixel, MaskMergeFunc func) {
+    unsigned bits = depth(pixel);
+    return { name, pixel, 3, 1, false, [func, bits](const BenchPlanes &p) {
+        for (unsigned y = 0; y < p.height; y++)
+            func(p.src[0] + y * p.stride, p.src[1] + y * p.stride, p.src[2] + y * p.stride, p.dst + y * p.stride, bits, 0, p.width);
+    } };
+}
+
+static Kernel diffKernel(const std::string &name, PixelType pixel, DiffFunc func) {
+    unsigned bits = depth(pixel);
+    return { name, pixel, 2, 1, false, [func, bits](const BenchPlanes &p) {
+        for (unsigned y = 0; y < p.height; y++)
+            func(p.src[0] + y * p.stride, p.src[1] + y * p.stride, p.dst + y * p.stride, bits, p.width);
+    } };
+}
+
+static Kernel stats1Kernel(const std::string &name, PixelType pixel, Stats1Func func) {
+    return { name, pixel, 1, 0, false, [func](const BenchPlanes &p) {
+        vs_plane_stats stats;
+        func(&stats, p.src[0], p.stride, p.width, p.height);
+    } };
+}
+
+static Kernel stats2Kernel(const std::string &name, PixelType pixel, Stats2Func func) {
+    return { name, pixel, 2, 0, false, [func](const BenchPlanes &p) {
+        vs_plane_stats stats;
+        func(&stats, p.src[0], p.stride, p.src[1], p.stride, p.width, p.height);
+    } };
+}
+
+static Kernel transposeKernel(const std::string &name, PixelType pixel, TransposeFunc func) {
+    return { name, pixel, 1, 1, true, [func](const BenchPlanes &p) {
+        func(p.src[0], p.stride, p.dst, p.dstStride, p.width, p.height);
+    } };
+}
+
+#define GENERIC(kernel, isa, size) \
+    kernels.push_back(genericKernel(#kernel "_byte_" #isa, pixelByte, vs_generic_##kernel##_byte_##isa, size)); \
+    kernels.push_back(genericKernel(#kernel "_word_" #isa, pixelWord, vs_generic_##kernel##_word_##isa, size)); \
+    kernels.push_back(genericKernel(#kernel "_float_" #isa, pixelFloat, vs_generic_##kernel##_float_##isa, size));
+
+#define ROWS(type, kernel, isa) \
+    kernels.push_back(type##Kernel("vs_" #kernel "_byte_" #isa, pixelByte, vs_##kernel##_byte_##isa)); \
+    kernels.push_back(type##Kernel("vs_" #kernel "_word_" #isa, pixelWord, vs_##kernel##_word_##isa)); \
+    kernels.push_back(type##Kernel("vs_" #kernel "_float_" #isa, pixelFloat, vs_##kernel##_float_##isa));
+
+#define KERNELS(isa) \
+    GENERIC(3x3_prewitt, isa, 9) \
+    GENERIC(3x3_sobel, isa, 9) \
+    GENERIC(3x3_min, isa, 9) \
+    GENERIC(3x3_max, isa, 9) \
+    GENERIC(3x3_median, isa, 9) \
+    GENERIC(3x3_deflate, isa, 9) \
+    GENERIC(3x3_inflate, isa, 9) \
+    GENERIC(3x3_conv, isa, 9) \
+    ROWS(merge, merge, isa) \
+    ROWS(maskMerge, mask_merge, isa) \
+    ROWS(maskMerge, mask_merge_premul, isa) \
+    ROWS(diff, makediff, isa) \
+    ROWS(diff, mergediff, isa) \
+    ROWS(stats1, plane_stats_1, isa) \
+    ROWS(stats2, plane_stats_2, isa)
+
+static std::vector<Kernel> getKernels() {
+    std::vector<Kernel> kernels;
+
+    KERNELS(c)
+    GENERIC(5x5_conv, c, 25)
+    GENERIC(1d_conv_h, c, 5)
+    GENERIC(1d_conv_v, c, 5)
+    kernels.push_back(transposeKernel("vs_transpose_plane_byte_c", pixelByte, vs_transpose_plane_byte_c));
+    kernels.push_back(transposeKernel("vs_transpose_plane_word_c", pixelWord, vs_transpose_plane_word_c));
+    kernels.push_back(transposeKernel("vs_transpose_plane_dword_c", pixelFloat, vs_transpose_plane_dword_c));
+
+#ifdef VS_TARGET_CPU_X86
+    KERNELS(sse2)
+    kernels.push_back(transposeKernel("vs_transpose_plane_byte_sse2", pixelByte, vs_transpose_plane_byte_sse2));
+    kernels.push_back(transposeKernel("vs_transpose_plane_word_sse2", pixelWord, vs_transpose_plane_word_sse2));
+    kernels.push_back(transposeKernel("vs_transpose_plane_dword_sse2", pixelFloat, vs_transpose_plane_dword_sse2));
+
+    if (getCPUFeatures()->avx2) {
+        KERNELS(avx2)
+    }
+#endif
+
+    return kernels;
+}
+
+#undef KERNELS
+#undef ROWS
+#undef GENERIC
+
+static uint64_t readCycleCounter() {
+#ifdef VS_TARGET_CPU_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+struct Result {
+    double nsPerPixel;
+    double cyclesPerPixel;
+    double gbPerSecond;
+};
+
+// the fastest of several runs is used since anything else happening on the machine only makes it slower
+static Result timeKernel(const Kernel &kernel, const BenchPlanes &planes, double minSeconds) {
+    const int trials = 5;
+    double pixels = static_cast<double>(planes.width) * planes.height;
+    double bestSeconds = 0;
+    double bestCycles = 0;
+    unsigned iterations = 1;
+
+    kernel.run(planes);
+    for (int trial = 0; trial < trials; trial++) {
+        double seconds;
+        uint64_t cycles;
+        while (true) {
+            auto start = std::chrono::steady_clock::now();
+            uint64_t startCycles = readCycleCounter();
+            for (unsigned i = 0; i < iterations; i++)
+                kernel.run(planes);
+            cycles = readCycleCounter() - startCycles;
+            seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (seconds >= minSeconds / trials || trial > 0)
+                break;
+            iterations *= 2;
+        }
+        if (trial == 0 || seconds / iterations < bestSeconds) {
+            bestSeconds = seconds / iterations;
+            bestCycles = static_cast<double>(cycles) / iterations;
+        }
+    }
+
+    double bytes = pixels * bytesPerSample(kernel.pixel) * (kernel.reads + kernel.writes);
+    return { bestSeconds * 1e9 / pixels, bestCycles / pixels, bytes / bestSeconds / 1e9 };
+}
+
+static void fillRandom(uint8_t *data, size_t size, PixelType pixel, std::mt19937 &generator) {
+    if (pixel == pixelFloat) {
+        std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+        float *p = reinterpret_cast<float *>(data);
+        for (size_t i = 0; i < size / sizeof(float); i++)
+            p[i] = dist(generator);
+    } else if (pixel == pixelWord) {
+        std::uniform_int_distribution<unsigned> dist(0, 65535);
+        uint16_t *p = reinterpret_cast<uint16_t *>(data);
+        for (size_t i = 0; i < size / sizeof(uint16_t); i++)
+            p[i] = static_cast<uint16_t>(dist(generator));
+    } else {
+        std::uniform_int_distribution<unsigned> dist(0, 255);
+        for (size_t i = 0; i < size; i++)
+            data[i] = static_cast<uint8_t>(dist(generator));
+    }
+}
+
+static bool readBaseline(const std::string &filename, std::map<std::string, double> &baseline) {
+    std::ifstream f(filename);
+    if (!f)
+        return false;
+    f.imbue(std::locale::classic());
+    std::string name;
+    double nsPerPixel;
+    while (f >> name >> nsPerPixel)
+        baseline[name] = nsPerPixel;
+    return true;
+}
+
+static void printHelp() {
+    fprintf(stderr,
+        "Usage: kernelbench [options]\n"
+        "\n"
+        "Available options:\n"
+        "  --filter TEXT       Only run the kernels with TEXT in their name\n"
+        "  --time SECONDS      Time to spend on each kernel, size and stride (default 0.05)\n"
+        "  --save FILE         Save the results as a baseline\n"
+        "  --compare FILE      Compare against a saved baseline, returns 2 if a kernel got slower\n"
+        "  --threshold PERCENT How much slower a kernel has to be to count as a regression (default 10)\n"
+        );
+}
+
+int main(int argc, char **argv) {
+    std::string filter;
+    std::string saveFilename;
+    std::string compareFilename;
+    double minSeconds = 0.05;
+    double threshold = 10;
+
+    for (int arg = 1; arg < argc; arg++) {
+        std::string argString = argv[arg];
+        bool hasValue = arg + 1 < argc;
+        if (argString == "--filter" && hasValue) {
+            filter = argv[++arg];
+        } else if (argString == "--time" && hasValue) {
+            minSeconds = atof(argv[++arg]);
+        } else if (argString == "--save" && hasValue) {
+            saveFilename = argv[++arg];
+        } else if (argString == "--compare" && hasValue) {
+            compareFilename = argv[++arg];
+        } else if (argString == "--threshold" && hasValue) {
+            threshold = atof(argv[++arg]);
+        } else {
+            printHelp();
+            return 1;
+        }
+    }
+
+    std::map<std::string, double> baseline;
+    if (!compareFilename.empty() && !readBaseline(compareFilename, baseline)) {
+        fprintf(stderr, "Failed to read the baseline %s\n", compareFilename.c_str());
+        return 1;
+    }
+
+    std::vector<Kernel> kernels = getKernels();
+    std::mt19937 generator;
+    std::ostringstream saved;
+    saved.imbue(std::locale::classic());
+    int regressions = 0;
+
+    printf("%-54s %10s %10s %10s%s\n", "Kernel", "ns/pixel", "cycles/px", "GB/s", baseline.empty() ? "" : "  baseline");
+
+    for (const Size &size : sizes) {
+        for (int strideType = 0; strideType < 2; strideType++) {
+            for (PixelType pixel : { pixelByte, pixelWord, pixelFloat }) {
+                BenchPlanes planes = {};
+                planes.width = size.width;
+                planes.height = size.height;
+                planes.stride = makeStride(size.width, pixel, strideType);
+                size_t planeSize = static_cast<size_t>(planes.stride) * size.height;
+                // a transposed destination is as large as the source but with the rows being the columns
+                planes.dstStride = makeStride(size.height, pixel, strideType);
+                size_t dstSize = std::max(planeSize, static_cast<size_t>(planes.dstStride) * size.width);
+
+                std::vector<uint8_t *> buffers;
+                for (int i = 0; i < 3; i++) {
+                    buffers.push_back(vs_aligned_malloc<uint8_t>(planeSize, 64));
+                    fillRandom(buffers.back(), planeSize, pixel, generator);
+                    planes.src[i] = buffers.back();
+                }
+                buffers.push_back(vs_aligned_malloc<uint8_t>(dstSize, 64));
+                memset(buffers.back(), 0, dstSize);
+                planes.dst = buffers.back();
+
+                for (const Kernel &kernel : kernels) {
+                    if (kernel.pixel != pixel || kernel.name.find(filter) == std::string::npos)
+                        continue;
+
+                    std::string name = kernel.name + "/" + std::to_string(size.width) + "x" + std::to_string(size.height) + "/" + strideNames[strideType];
+                    Result result = timeKernel(kernel, planes, minSeconds);
+                    saved << name << " " << result.nsPerPixel << "\n";
+
+                    std::string comparison;
+                    auto iter = baseline.find(name);
+                    if (iter != baseline.end()) {
+                        double change = (result.nsPerPixel / iter->second - 1) * 100;
+                        char buf[64];
+                        snprintf(buf, sizeof(buf), "  %+6.1f%%%s", change, (change > threshold) ? " REGRESSION" : "");
+                        comparison = buf;
+                        if (change > threshold)
+                            regressions++;
+                    }
+
+                    printf("%-54s %10.3f %10.2f %10.2f%s\n", name.c_str(), result.nsPerPixel, result.cyclesPerPixel, result.gbPerSecond, comparison.c_str());
+                    fflush(stdout);
+                }
+
+                for (uint8_t *buffer : buffers)
+                    vs_aligned_free(buffer);
+            }
+        }
+    }
+
+    if (!saveFilename.empty()) {
+        std::ofstream f(saveFilename);
+        f << saved.str();
+        if (!f) {
+            fprintf(stderr, "Failed to write the baseline %s\n", saveFilename.c_str());
+            return 1;
+        }
+    }
+
+    if (regressions) {
+        fprintf(stderr, "%d kernels are more than %.0f%% slower than the baseline\n", regressions, threshold);
+        return 2;
+    }
+    return 0;
+}
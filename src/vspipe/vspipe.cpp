@@ -27,14 +27,23 @@
 #include <vector>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <deque>
 #include <algorithm>
 #include <chrono>
 #include <locale>
 #include <sstream>
+#include <random>
+#include <cmath>
 #ifdef VS_TARGET_OS_WINDOWS
 #include <io.h>
 #include <fcntl.h>
 #include "../common/vsutf16.h"
+#else
+#include <sys/uio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
 #endif
 
 #define __STDC_FORMAT_MACROS
@@ -78,6 +87,8 @@ static VSNodeRef *node = nullptr;
 static VSNodeRef *alphaNode = nullptr;
 static FILE *outFile = nullptr;
 static FILE *timecodesFile = nullptr;
+// everything is requested with it so the frames still in progress can be abandoned after an error
+static VSCancelToken *cancelToken = nullptr;
 
 static int requests = 0;
 static int outputIndex = 0;
@@ -95,14 +106,44 @@ static bool showInfo = false;
 static bool preserveCwd = false;
 static bool showVersion = false;
 static bool printFrameNumber = false;
+static bool printProfile = false;
 static double fps = 0;
 static bool hasMeaningfulFps = false;
 static std::map<int, std::pair<const VSFrameRef *, const VSFrameRef *>> reorderMap;
 
+// frames are handed to the writer thread in output order, the number of frames that are requested but not
+// yet written is limited so a slow consumer doesn't make the queue grow without bounds
+static std::deque<std::pair<const VSFrameRef *, const VSFrameRef *>> writeQueue;
+static int writtenFrames = 0;
+static int deferredRequests = 0;
+
 static std::string errorMessage;
 static std::condition_variable condition;
 static std::mutex mutex;
-static std::vector<uint8_t> buffer;
+
+enum BenchmarkOrder {
+    boLinear,
+    boReverse,
+    boRandom
+};
+
+static bool benchmark = false;
+static int benchmarkWarmup = 0;
+static int benchmarkRepetitions = 1;
+static BenchmarkOrder benchmarkOrder = boLinear;
+
+// the frames of a benchmark pass in the order they're requested, a request is done once the alpha frame has arrived too
+struct BenchmarkPass {
+    std::vector<int> frames;
+    std::vector<std::chrono::time_point<std::chrono::high_resolution_clock>> requestTimes;
+    std::vector<int> pendingOutputs;
+    std::vector<double> latencies;
+    size_t nextRequest;
+    size_t completed;
+};
+
+static BenchmarkPass benchmarkPass;
+static int64_t peakMemoryUse = 0;
 
 static std::chrono::time_point<std::chrono::high_resolution_clock> start;
 static std::chrono::time_point<std::chrono::high_resolution_clock> lastFpsReportTime;
@@ -129,35 +170,162 @@ static bool isCompletedFrame(const std::pair<const VSFrameRef *, const VSFrameRe
     return (f.first && (!alphaNode || f.second));
 }
 
-static void outputFrame(const VSFrameRef *frame) {
-    if (!outputError && outFile) {
-        const VSFormat *fi = vsapi->getFrameFormat(frame);
-        const int rgbRemap[] = { 1, 2, 0 };
-        for (int rp = 0; rp < fi->numPlanes; rp++) {
-            int p = (fi->colorFamily == cmRGB) ? rgbRemap[rp] : rp;
-            int stride = vsapi->getStride(frame, p);
-            const uint8_t *readPtr = vsapi->getReadPtr(frame, p);
-            int rowSize = vsapi->getFrameWidth(frame, p) * fi->bytesPerSample;
-            int height = vsapi->getFrameHeight(frame, p);
-
-            if (rowSize != stride) {
-                vs_bitblt(buffer.data(), rowSize, readPtr, stride, rowSize, height);
-                readPtr = buffer.data();
-            }
+struct OutputChunk {
+    const uint8_t *data;
+    size_t size;
+};
+
+// planes without padding are written as a whole and the rest row by row, always straight from the frame
+static void addFrameChunks(std::vector<OutputChunk> &chunks, const VSFrameRef *frame) {
+    const VSFormat *fi = vsapi->getFrameFormat(frame);
+    const int rgbRemap[] = { 1, 2, 0 };
+    for (int rp = 0; rp < fi->numPlanes; rp++) {
+        int p = (fi->colorFamily == cmRGB) ? rgbRemap[rp] : rp;
+        int stride = vsapi->getStride(frame, p);
+        const uint8_t *readPtr = vsapi->getReadPtr(frame, p);
+        size_t rowSize = vsapi->getFrameWidth(frame, p) * fi->bytesPerSample;
+        int height = vsapi->getFrameHeight(frame, p);
+
+        if (rowSize == static_cast<size_t>(stride)) {
+            chunks.push_back({ readPtr, rowSize * height });
+        } else {
+            for (int y = 0; y < height; y++)
+                chunks.push_back({ readPtr + static_cast<ptrdiff_t>(stride) * y, rowSize });
+        }
+    }
+}
+
+static bool writeChunks(const std::vector<OutputChunk> &chunks) {
+#ifdef VS_TARGET_OS_WINDOWS
+    for (const auto &chunk : chunks)
+        if (fwrite(chunk.data, 1, chunk.size, outFile) != chunk.size)
+            return false;
+    return true;
+#else
+#ifdef IOV_MAX
+    const size_t maxVectors = IOV_MAX;
+#else
+    const size_t maxVectors = 1024;
+#endif
+    int fd = fileno(outFile);
+    std::vector<iovec> vectors;
+    size_t pos = 0;
+    size_t offset = 0;
+    while (pos < chunks.size()) {
+        vectors.clear();
+        for (size_t i = pos; i < chunks.size() && vectors.size() < maxVectors; i++) {
+            size_t skip = (i == pos) ? offset : 0;
+            vectors.push_back({ const_cast<uint8_t *>(chunks[i].data) + skip, chunks[i].size - skip });
+        }
+
+        ssize_t written = writev(fd, vectors.data(), static_cast<int>(vectors.size()));
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+
+        // pipes may accept less than everything so continue where it stopped
+        size_t left = static_cast<size_t>(written);
+        while (pos < chunks.size() && left >= chunks[pos].size - offset) {
+            left -= chunks[pos].size - offset;
+            pos++;
+            offset = 0;
+        }
+        offset += left;
+    }
+    return true;
+#endif
+}
+
+static void setOutputError(const std::string &message) {
+    if (errorMessage.empty())
+        errorMessage = message;
+    totalFrames = requestedFrames;
+    if (!outputError)
+        vsapi->cancelRequests(cancelToken);
+    outputError = true;
+}
+
+static bool isOutputDone() {
+    return totalFrames == completedFrames && totalFrames == completedAlphaFrames;
+}
+
+static void VS_CC frameDoneCallback(void *userData, const VSFrameRef *f, int n, VSNodeRef *rnode, const char *errorMsg);
+
+static void requestFrame() {
+    vsapi->getFrameAsyncCancellable(requestedFrames, node, frameDoneCallback, nullptr, rpNormal, 0, cancelToken);
+    if (alphaNode)
+        vsapi->getFrameAsyncCancellable(requestedFrames, alphaNode, frameDoneCallback, nullptr, rpNormal, 0, cancelToken);
+    requestedFrames++;
+}
+
+// runs in its own thread so a slow consumer never stalls the threads producing frames
+static void writerThread() {
+    std::vector<OutputChunk> chunks;
+    std::unique_lock<std::mutex> lock(mutex);
+
+    while (true) {
+        condition.wait(lock, [] { return !writeQueue.empty() || isOutputDone(); });
+        if (writeQueue.empty())
+            break;
+
+        const VSFrameRef *frame = writeQueue.front().first;
+        const VSFrameRef *alphaFrame = writeQueue.front().second;
+        writeQueue.pop_front();
+        int frameNumber = writtenFrames;
+        bool skip = outputError;
+        lock.unlock();
+
+        std::string error;
+        if (!skip && outFile) {
+            chunks.clear();
+            if (y4m)
+                chunks.push_back({ reinterpret_cast<const uint8_t *>("FRAME\n"), 6 });
+            addFrameChunks(chunks, frame);
+            if (alphaFrame)
+                addFrameChunks(chunks, alphaFrame);
+            if (!writeChunks(chunks))
+                error = "Error: failed to write frame: " + std::to_string(frameNumber) + ", errno: " + std::to_string(errno);
+        }
 
-            if (fwrite(readPtr, 1, rowSize * height, outFile) != static_cast<size_t>(rowSize * height)) {
-                if (errorMessage.empty())
-                    errorMessage = "Error: fwrite() call failed when writing frame: " + std::to_string(outputFrames) + ", plane: " + std::to_string(p) +
-                    ", errno: " + std::to_string(errno);
-                totalFrames = requestedFrames;
-                outputError = true;
-                break;
+        if (!skip && error.empty() && timecodesFile) {
+            std::ostringstream stream;
+            stream.imbue(std::locale("C"));
+            stream.setf(std::ios::fixed, std::ios::floatfield);
+            stream << (currentTimecodeNum * 1000 / static_cast<double>(currentTimecodeDen));
+            if (fprintf(timecodesFile, "%s\n", stream.str().c_str()) < 0) {
+                error = "Error: failed to write timecode for frame " + std::to_string(frameNumber) + ". errno: " + std::to_string(errno);
+            } else {
+                const VSMap *props = vsapi->getFramePropsRO(frame);
+                int err_num, err_den;
+                int64_t duration_num = vsapi->propGetInt(props, "_DurationNum", 0, &err_num);
+                int64_t duration_den = vsapi->propGetInt(props, "_DurationDen", 0, &err_den);
+
+                if (err_num || err_den)
+                    error = "Error: missing duration at frame " + std::to_string(frameNumber);
+                else if (!duration_den)
+                    error = "Error: duration denominator is zero at frame " + std::to_string(frameNumber);
+                else
+                    addRational(&currentTimecodeNum, &currentTimecodeDen, duration_num, duration_den);
             }
         }
+
+        vsapi->freeFrame(frame);
+        vsapi->freeFrame(alphaFrame);
+
+        lock.lock();
+        writtenFrames++;
+        if (!error.empty())
+            setOutputError(error);
+        if (deferredRequests > 0 && !outputError && requestedFrames < totalFrames) {
+            deferredRequests--;
+            requestFrame();
+        }
     }
 }
 
 static void VS_CC frameDoneCallback(void *userData, const VSFrameRef *f, int n, VSNodeRef *rnode, const char *errorMsg) {
+    std::lock_guard<std::mutex> lock(mutex);
 
     if (printFrameNumber) {
         std::chrono::time_point<std::chrono::high_resolution_clock> currentTime(std::chrono::high_resolution_clock::now());
@@ -187,77 +355,24 @@ static void VS_CC frameDoneCallback(void *userData, const VSFrameRef *f, int n,
 
         bool completed = isCompletedFrame(reorderMap[n]);
 
-        if (completed && requestedFrames < totalFrames) {
-            vsapi->getFrameAsync(requestedFrames, node, frameDoneCallback, nullptr);
-            if (alphaNode)
-                vsapi->getFrameAsync(requestedFrames, alphaNode, frameDoneCallback, nullptr);
-            requestedFrames++;
+        if (completed && requestedFrames < totalFrames && !outputError) {
+            // the writer thread makes the request once it has caught up
+            if (requestedFrames - writtenFrames < 2 * requests)
+                requestFrame();
+            else
+                deferredRequests++;
         }
 
         while (reorderMap.count(outputFrames) && isCompletedFrame(reorderMap[outputFrames])) {
-            const VSFrameRef *frame = reorderMap[outputFrames].first;
-            const VSFrameRef *alphaFrame = reorderMap[outputFrames].second;
+            writeQueue.push_back(reorderMap[outputFrames]);
             reorderMap.erase(outputFrames);
-            if (!outputError) {
-                if (y4m && outFile) {
-                    if (fwrite("FRAME\n", 1, 6, outFile) != 6) {
-                        if (errorMessage.empty())
-                            errorMessage = "Error: fwrite() call failed when writing header, errno: " + std::to_string(errno);
-                        totalFrames = requestedFrames;
-                        outputError = true;
-                    }
-                }
-
-                outputFrame(frame);
-                if (alphaFrame)
-                    outputFrame(alphaFrame);
-
-                if (timecodesFile && !outputError) {
-                    std::ostringstream stream;
-                    stream.imbue(std::locale("C"));
-                    stream.setf(std::ios::fixed, std::ios::floatfield);
-                    stream << (currentTimecodeNum * 1000 / static_cast<double>(currentTimecodeDen));
-                    if (fprintf(timecodesFile, "%s\n", stream.str().c_str()) < 0) {
-                        if (errorMessage.empty())
-                            errorMessage = "Error: failed to write timecode for frame " + std::to_string(outputFrames) + ". errno: " + std::to_string(errno);
-                        totalFrames = requestedFrames;
-                        outputError = true;
-                    } else {
-                        const VSMap *props = vsapi->getFramePropsRO(frame);
-                        int err_num, err_den;
-                        int64_t duration_num = vsapi->propGetInt(props, "_DurationNum", 0, &err_num);
-                        int64_t duration_den = vsapi->propGetInt(props, "_DurationDen", 0, &err_den);
-
-                        if (err_num || err_den || !duration_den) {
-                            if (errorMessage.empty()) {
-                                if (err_num || err_den)
-                                    errorMessage = "Error: missing duration at frame ";
-                                else if (!duration_den)
-                                    errorMessage = "Error: duration denominator is zero at frame ";
-                                errorMessage += std::to_string(outputFrames);
-                            }
-
-                            totalFrames = requestedFrames;
-                            outputError = true;
-                        } else {
-                            addRational(&currentTimecodeNum, &currentTimecodeDen, duration_num, duration_den);
-                        }
-                    }
-                }
-            }
-            vsapi->freeFrame(frame);
-            vsapi->freeFrame(alphaFrame);
             outputFrames++;
         }
     } else {
-        outputError = true;
-        totalFrames = requestedFrames;
-        if (errorMessage.empty()) {
-            if (errorMsg)
-                errorMessage = "Error: Failed to retrieve frame " + std::to_string(n) + " with error: " + errorMsg;
-            else
-                errorMessage = "Error: Failed to retrieve frame " + std::to_string(n);
-        }
+        if (errorMsg)
+            setOutputError("Error: Failed to retrieve frame " + std::to_string(n) + " with error: " + errorMsg);
+        else
+            setOutputError("Error: Failed to retrieve frame " + std::to_string(n));
     }
 
     if (printFrameNumber && !outputError) {
@@ -267,10 +382,7 @@ static void VS_CC frameDoneCallback(void *userData, const VSFrameRef *f, int n,
             fprintf(stderr, "Frame: %d/%d\r", completedFrames - startFrame, totalFrames - startFrame);
     }
 
-    if (totalFrames == completedFrames && totalFrames == completedAlphaFrames) {
-        std::lock_guard<std::mutex> lock(mutex);
-        condition.notify_one();
-    }
+    condition.notify_one();
 }
 
 static std::string floatBitsToLetter(int bits) {
@@ -287,6 +399,216 @@ static std::string floatBitsToLetter(int bits) {
     }
 }
 
+static void VS_CC benchmarkFrameDoneCallback(void *userData, const VSFrameRef *f, int n, VSNodeRef *rnode, const char *errorMsg);
+
+static void requestBenchmarkFrame() {
+    size_t index = benchmarkPass.nextRequest++;
+    void *userData = reinterpret_cast<void *>(static_cast<uintptr_t>(index));
+    benchmarkPass.requestTimes[index] = std::chrono::high_resolution_clock::now();
+    vsapi->getFrameAsyncCancellable(benchmarkPass.frames[index], node, benchmarkFrameDoneCallback, userData, rpNormal, 0, cancelToken);
+    if (alphaNode)
+        vsapi->getFrameAsyncCancellable(benchmarkPass.frames[index], alphaNode, benchmarkFrameDoneCallback, userData, rpNormal, 0, cancelToken);
+}
+
+static void VS_CC benchmarkFrameDoneCallback(void *userData, const VSFrameRef *f, int n, VSNodeRef *rnode, const char *errorMsg) {
+    std::chrono::time_point<std::chrono::high_resolution_clock> currentTime(std::chrono::high_resolution_clock::now());
+    size_t index = reinterpret_cast<uintptr_t>(userData);
+    // sampled while the frame is still referenced so it's included
+    VSCoreInfo info;
+    vsapi->getCoreInfo2(vsscript_getCore(se), &info);
+    vsapi->freeFrame(f);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    peakMemoryUse = std::max(peakMemoryUse, info.usedFramebufferSize);
+
+    if (!f) {
+        if (errorMessage.empty())
+            errorMessage = "Error: Failed to retrieve frame " + std::to_string(n) + (errorMsg ? std::string(" with error: ") + errorMsg : std::string());
+        if (!outputError)
+            vsapi->cancelRequests(cancelToken);
+        outputError = true;
+    }
+
+    if (--benchmarkPass.pendingOutputs[index] == 0) {
+        std::chrono::duration<double, std::milli> latency = currentTime - benchmarkPass.requestTimes[index];
+        benchmarkPass.latencies[index] = latency.count();
+        benchmarkPass.completed++;
+        if (!outputError && benchmarkPass.nextRequest < benchmarkPass.frames.size())
+            requestBenchmarkFrame();
+    }
+
+    condition.notify_one();
+}
+
+// requests the frames keeping the same number of requests in flight as when outputting, returns the time it took in seconds
+static double runBenchmarkPass(const std::vector<int> &frames) {
+    std::unique_lock<std::mutex> lock(mutex);
+    benchmarkPass.frames = frames;
+    benchmarkPass.requestTimes.assign(frames.size(), std::chrono::time_point<std::chrono::high_resolution_clock>());
+    benchmarkPass.pendingOutputs.assign(frames.size(), alphaNode ? 2 : 1);
+    benchmarkPass.latencies.assign(frames.size(), 0);
+    benchmarkPass.nextRequest = 0;
+    benchmarkPass.completed = 0;
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> passStart(std::chrono::high_resolution_clock::now());
+    while (benchmarkPass.nextRequest < frames.size() && benchmarkPass.nextRequest < static_cast<size_t>(requests))
+        requestBenchmarkFrame();
+    condition.wait(lock, [] { return benchmarkPass.completed == benchmarkPass.nextRequest && (outputError || benchmarkPass.nextRequest == benchmarkPass.frames.size()); });
+    std::chrono::duration<double> elapsedSeconds = std::chrono::high_resolution_clock::now() - passStart;
+    return elapsedSeconds.count();
+}
+
+// nearest rank percentile of sorted values
+static double percentile(const std::vector<double> &values, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p * values.size()));
+    return values[std::min(std::max<size_t>(rank, 1), values.size()) - 1];
+}
+
+// the wall and cpu time spent in all filters so far
+static void sumProfileTimes(VSCore *core, double &wallSeconds, double &cpuSeconds) {
+    wallSeconds = 0;
+    cpuSeconds = 0;
+    VSMap *profile = vsapi->getProfile(core);
+    for (int i = 0; i < vsapi->propNumElements(profile, "name"); i++) {
+        wallSeconds += vsapi->propGetFloat(profile, "wall_time", i, nullptr);
+        cpuSeconds += vsapi->propGetFloat(profile, "cpu_time", i, nullptr);
+    }
+    vsapi->freeMap(profile);
+}
+
+// requests the frames without writing them anywhere and writes statistics about it as json to the output file
+static bool runBenchmark() {
+    VSCore *core = vsscript_getCore(se);
+    VSCoreInfo info;
+    vsapi->getCoreInfo2(core, &info);
+    if (requests < 1)
+        requests = info.numThreads;
+
+    std::vector<int> frames;
+    for (int n = startFrame; n < totalFrames; n++)
+        frames.push_back(n);
+    if (benchmarkOrder == boReverse)
+        std::reverse(frames.begin(), frames.end());
+
+    // always seeded the same way so runs can be compared
+    std::mt19937 generator;
+    if (benchmarkOrder == boRandom)
+        std::shuffle(frames.begin(), frames.end(), generator);
+
+    if (benchmarkWarmup > 0)
+        runBenchmarkPass(std::vector<int>(frames.begin(), frames.begin() + std::min<size_t>(benchmarkWarmup, frames.size())));
+
+    // the time spent in filters is only needed for the measured passes, with --profile it's already
+    // enabled and what was collected so far is subtracted so the final profile keeps everything
+    bool wasProfiling = !!vsapi->setProfiling(-1, core);
+    vsapi->setProfiling(1, core);
+    double startBusySeconds;
+    double startCpuSeconds;
+    sumProfileTimes(core, startBusySeconds, startCpuSeconds);
+    peakMemoryUse = 0;
+
+    std::vector<double> latencies;
+    std::vector<double> passFps;
+    double totalSeconds = 0;
+    for (int i = 0; i < benchmarkRepetitions && !outputError; i++) {
+        if (i > 0 && benchmarkOrder == boRandom)
+            std::shuffle(frames.begin(), frames.end(), generator);
+        double seconds = runBenchmarkPass(frames);
+        totalSeconds += seconds;
+        passFps.push_back(frames.size() / seconds);
+        latencies.insert(latencies.end(), benchmarkPass.latencies.begin(), benchmarkPass.latencies.end());
+    }
+
+    if (outputError) {
+        fprintf(stderr, "%s\n", errorMessage.c_str());
+        return true;
+    }
+
+    // busy means running a filter's getFrame function
+    double busySeconds;
+    double cpuSeconds;
+    sumProfileTimes(core, busySeconds, cpuSeconds);
+    busySeconds -= startBusySeconds;
+    cpuSeconds -= startCpuSeconds;
+    if (!wasProfiling)
+        vsapi->setProfiling(0, core);
+
+    std::sort(latencies.begin(), latencies.end());
+    double meanLatency = 0;
+    for (double latency : latencies)
+        meanLatency += latency;
+    meanLatency /= latencies.size();
+    double fps = latencies.size() / totalSeconds;
+
+    static const char *const orderNames[] = { "linear", "reverse", "random" };
+    std::ostringstream stream;
+    stream.imbue(std::locale("C"));
+    stream << "{\n";
+    stream << "  \"frames\": " << frames.size() << ",\n";
+    stream << "  \"warmup_frames\": " << std::min<size_t>(benchmarkWarmup, frames.size()) << ",\n";
+    stream << "  \"repetitions\": " << benchmarkRepetitions << ",\n";
+    stream << "  \"order\": \"" << orderNames[benchmarkOrder] << "\",\n";
+    stream << "  \"requests\": " << requests << ",\n";
+    stream << "  \"threads\": " << info.numThreads << ",\n";
+    stream << "  \"seconds\": " << totalSeconds << ",\n";
+    stream << "  \"fps\": " << fps << ",\n";
+    stream << "  \"repetition_fps\": [";
+    for (size_t i = 0; i < passFps.size(); i++)
+        stream << (i ? ", " : "") << passFps[i];
+    stream << "],\n";
+    stream << "  \"latency_ms\": { \"mean\": " << meanLatency << ", \"median\": " << percentile(latencies, 0.5) << ", \"p99\": " << percentile(latencies, 0.99)
+        << ", \"min\": " << latencies.front() << ", \"max\": " << latencies.back() << " },\n";
+    stream << "  \"peak_framebuffer_bytes\": " << peakMemoryUse << ",\n";
+    stream << "  \"thread_utilization\": " << busySeconds / (info.numThreads * totalSeconds) << ",\n";
+    stream << "  \"cpu_utilization\": " << cpuSeconds / (info.numThreads * totalSeconds) << "\n";
+    stream << "}\n";
+
+    fprintf(stderr, "Requested %d frames %d times in %.2f seconds (%.2f fps), latency median %.2f ms, p99 %.2f ms\n", static_cast<int>(frames.size()), benchmarkRepetitions, totalSeconds, fps, percentile(latencies, 0.5), percentile(latencies, 0.99));
+
+    std::string report = stream.str();
+    if (outFile && fwrite(report.c_str(), 1, report.size(), outFile) != report.size()) {
+        fprintf(stderr, "Error: failed to write benchmark results, errno: %d\n", errno);
+        return true;
+    }
+    return false;
+}
+
+// the filters that took the most time first, the cache columns are only filled in for caches
+static void printProfileTable() {
+    VSMap *profile = vsapi->getProfile(vsscript_getCore(se));
+    int numEntries = vsapi->propNumElements(profile, "name");
+    double totalWallTime = 0;
+    for (int i = 0; i < numEntries; i++)
+        totalWallTime += vsapi->propGetFloat(profile, "wall_time", i, nullptr);
+
+    fprintf(stderr, "%-24s %10s %10s %6s %10s %10s %10s %10s %10s %10s\n", "Filter", "Calls", "Wall (s)", "Wall %", "CPU (s)", "Alloc (MB)", "Initial", "Ready", "Hits", "Misses");
+    for (int i = 0; i < numEntries; i++) {
+        double wallTime = vsapi->propGetFloat(profile, "wall_time", i, nullptr);
+        fprintf(stderr, "%-24.24s %10" PRId64 " %10.3f %6.1f %10.3f %10.1f %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 "\n",
+            vsapi->propGetData(profile, "name", i, nullptr),
+            vsapi->propGetInt(profile, "calls", i, nullptr),
+            wallTime,
+            totalWallTime > 0 ? 100 * wallTime / totalWallTime : 0.0,
+            vsapi->propGetFloat(profile, "cpu_time", i, nullptr),
+            vsapi->propGetInt(profile, "bytes", i, nullptr) / (1024.0 * 1024.0),
+            vsapi->propGetInt(profile, "ar_initial", i, nullptr),
+            vsapi->propGetInt(profile, "ar_frame_ready", i, nullptr) + vsapi->propGetInt(profile, "ar_all_frames_ready", i, nullptr),
+            vsapi->propGetInt(profile, "cache_hits", i, nullptr),
+            vsapi->propGetInt(profile, "cache_near_misses", i, nullptr) + vsapi->propGetInt(profile, "cache_far_misses", i, nullptr));
+    }
+
+    int64_t codeCacheHits = 0;
+    int64_t codeCacheMisses = 0;
+    for (int i = 0; i < numEntries; i++) {
+        codeCacheHits += vsapi->propGetInt(profile, "code_cache_hits", i, nullptr);
+        codeCacheMisses += vsapi->propGetInt(profile, "code_cache_misses", i, nullptr);
+    }
+    if (codeCacheHits || codeCacheMisses)
+        fprintf(stderr, "Compiled code: %" PRId64 " reused, %" PRId64 " compiled\n", codeCacheHits, codeCacheMisses);
+
+    vsapi->freeMap(profile);
+}
+
 static bool outputNode() {
     if (requests < 1) {
         VSCoreInfo info;
@@ -362,21 +684,23 @@ static bool outputNode() {
         }
     }
 
-    size_t size = vi->width * vi->height * vi->format->bytesPerSample;
-    buffer.resize(size);
+    // the frames are written directly to the file descriptor from here on
+    if (outFile)
+        fflush(outFile);
 
     std::unique_lock<std::mutex> lock(mutex);
 
     int requestStart = completedFrames;
     int intitalRequestSize = std::min(requests, totalFrames - requestStart);
-    requestedFrames = requestStart + intitalRequestSize;
-    for (int n = requestStart; n < requestStart + intitalRequestSize; n++) {
-        vsapi->getFrameAsync(n, node, frameDoneCallback, nullptr);
-        if (alphaNode)
-            vsapi->getFrameAsync(n, alphaNode, frameDoneCallback, nullptr);
-    }
+    requestedFrames = requestStart;
+    writtenFrames = requestStart;
+    for (int n = requestStart; n < requestStart + intitalRequestSize; n++)
+        requestFrame();
 
-    condition.wait(lock);
+    lock.unlock();
+    std::thread writer(writerThread);
+    writer.join();
+    lock.lock();
 
     if (outputError) {
         for (auto &iter : reorderMap) {
@@ -456,6 +780,12 @@ static void printHelp() {
         "  -t, --timecodes FILE  Write timecodes v2 file\n"
         "  -c  --preserve-cwd    Don't temporarily change the working directory the script path\n"
         "  -p, --progress        Print progress to stderr\n"
+        "      --profile         Print the time spent in each filter to stderr when done\n"
+        "      --trace FILE      Write a timeline of the frame processing in the chrome trace format\n"
+        "      --benchmark       Only request the frames and write statistics as json to the output\n"
+        "      --warmup N        Frames to request before measuring in benchmark mode\n"
+        "      --repeat N        Number of times to request all frames in benchmark mode\n"
+        "      --order ORDER     Request frames in linear, reverse or random order in benchmark mode\n"
         "  -i, --info            Show video info and exit\n"
         "  -v, --version         Show version info and exit\n"
         "\n"
@@ -472,6 +802,8 @@ static void printHelp() {
         "    vspipe --arg deinterlace=yes --arg \"message=fluffy kittens\" script.vpy output.raw\n"
         "  Pipe to x264 and write timecodes file:\n"
         "    vspipe script.vpy - --y4m --timecodes timecodes.txt | x264 --demuxer y4m -o script.mkv -\n"
+        "  Measure how fast frames can be requested in random order:\n"
+        "    vspipe --benchmark --warmup 10 --repeat 3 --order random script.vpy results.json\n"
         );
 }
 
@@ -484,7 +816,7 @@ int wmain(int argc, wchar_t **argv) {
 #else
 int main(int argc, char **argv) {
 #endif
-    nstring outputFilename, scriptFilename, timecodesFilename;
+    nstring outputFilename, scriptFilename, timecodesFilename, traceFilename;
     bool showHelp = false;
     std::map<std::string, std::string> scriptArgs;
 
@@ -496,6 +828,53 @@ int main(int argc, char **argv) {
             y4m = true;
         } else if (argString == NSTRING("-p") || argString == NSTRING("--progress")) {
             printFrameNumber = true;
+        } else if (argString == NSTRING("--profile")) {
+            printProfile = true;
+        } else if (argString == NSTRING("--benchmark")) {
+            benchmark = true;
+        } else if (argString == NSTRING("--warmup")) {
+            if (argc <= arg + 1) {
+                fprintf(stderr, "No warmup frame count specified\n");
+                return 1;
+            }
+
+            if (!nstringToInt(argv[arg + 1], benchmarkWarmup) || benchmarkWarmup < 0) {
+                fprintf(stderr, "Couldn't convert %s to a non-negative integer (warmup)\n", nstringToUtf8(argv[arg + 1]).c_str());
+                return 1;
+            }
+
+            arg++;
+        } else if (argString == NSTRING("--repeat")) {
+            if (argc <= arg + 1) {
+                fprintf(stderr, "No repetition count specified\n");
+                return 1;
+            }
+
+            if (!nstringToInt(argv[arg + 1], benchmarkRepetitions) || benchmarkRepetitions < 1) {
+                fprintf(stderr, "Couldn't convert %s to a positive integer (repeat)\n", nstringToUtf8(argv[arg + 1]).c_str());
+                return 1;
+            }
+
+            arg++;
+        } else if (argString == NSTRING("--order")) {
+            if (argc <= arg + 1) {
+                fprintf(stderr, "No request order specified\n");
+                return 1;
+            }
+
+            nstring order = argv[arg + 1];
+            if (order == NSTRING("linear")) {
+                benchmarkOrder = boLinear;
+            } else if (order == NSTRING("reverse")) {
+                benchmarkOrder = boReverse;
+            } else if (order == NSTRING("random")) {
+                benchmarkOrder = boRandom;
+            } else {
+                fprintf(stderr, "Unknown request order: %s\n", nstringToUtf8(order).c_str());
+                return 1;
+            }
+
+            arg++;
         } else if (argString == NSTRING("-i") || argString == NSTRING("--info")) {
             showInfo = true;
         } else if (argString == NSTRING("-h") || argString == NSTRING("--help")) {
@@ -588,6 +967,15 @@ int main(int argc, char **argv) {
 
             timecodesFilename = argv[arg + 1];
 
+            arg++;
+        } else if (argString == NSTRING("--trace")) {
+            if (argc <= arg + 1) {
+                fprintf(stderr, "No trace file specified\n");
+                return 1;
+            }
+
+            traceFilename = argv[arg + 1];
+
             arg++;
         } else if (scriptFilename.empty() && !argString.empty() && argString.substr(0, 1) != NSTRING("-")) {
             scriptFilename = argString;
@@ -613,6 +1001,9 @@ int main(int argc, char **argv) {
     } else if (outputFilename.empty()) {
         fprintf(stderr, "No output file specified\n");
         return 1;
+    } else if (benchmark && (y4m || !timecodesFilename.empty())) {
+        fprintf(stderr, "Cannot combine benchmark mode with y4m headers or timecodes\n");
+        return 1;
     }
 
     if (outputFilename == NSTRING("-")) {
@@ -739,8 +1130,18 @@ int main(int argc, char **argv) {
             return 1;
         }
 
+        if (printProfile)
+            vsapi->setProfiling(1, vsscript_getCore(se));
+        if (!traceFilename.empty())
+            vsapi->setTracing(1, vsscript_getCore(se));
+
         lastFpsReportTime = std::chrono::high_resolution_clock::now();
-        error = outputNode();
+        cancelToken = vsapi->createCancelToken(vsscript_getCore(se));
+        if (benchmark)
+            error = runBenchmark();
+        else
+            error = outputNode();
+        vsapi->freeCancelToken(cancelToken);
     }
 
     if (outFile)
@@ -749,9 +1150,21 @@ int main(int argc, char **argv) {
         fclose(timecodesFile);
 
     if (!showInfo) {
-        int totalFrames = outputFrames - startFrame;
-        std::chrono::duration<double> elapsedSeconds = std::chrono::high_resolution_clock::now() - start;
-        fprintf(stderr, "Output %d frames in %.2f seconds (%.2f fps)\n", totalFrames, elapsedSeconds.count(), totalFrames / elapsedSeconds.count());
+        if (!benchmark) {
+            int totalFrames = outputFrames - startFrame;
+            std::chrono::duration<double> elapsedSeconds = std::chrono::high_resolution_clock::now() - start;
+            fprintf(stderr, "Output %d frames in %.2f seconds (%.2f fps)\n", totalFrames, elapsedSeconds.count(), totalFrames / elapsedSeconds.count());
+        }
+        if (printProfile)
+            printProfileTable();
+    }
+
+    if (!traceFilename.empty() && !showInfo) {
+        vsapi->setTracing(0, vsscript_getCore(se));
+        if (!vsapi->saveTrace(nstringToUtf8(traceFilename).c_str(), vsscript_getCore(se))) {
+            fprintf(stderr, "Failed to write the trace file\n");
+            error = true;
+        }
     }
     vsapi->freeNode(node);
     vsapi->freeNode(alphaNode);
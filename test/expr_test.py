@@ -420,6 +420,23 @@ class CoreTestSequence(unittest.TestCase):
         val = clip.get_frame(0).get_read_array(0)[0,0]
         self.assertEqual(val, 35)
 
+    def test_expr_chain1(self):
+        clip1 = self.core.std.BlankClip(format=vs.GRAY8, color=10)
+        clip2 = self.core.std.Expr(clip1, "x 3 *")
+        clip3 = self.core.std.Expr(clip2, "x 255 /", format=vs.GRAYS)
+        clip = self.core.std.Expr((clip3, clip1, clip2), "x 255 * y + z -", format=vs.GRAY16)
+        val = clip.get_frame(0).get_read_array(0)[0,0]
+        self.assertEqual(val, 10)
+
+    def test_expr_chain2(self):
+        clip1 = self.core.std.BlankClip(format=vs.YUV444P8, color=[10, 20, 30])
+        clip2 = self.core.std.Expr(clip1, ["x 2 *", ""])
+        clip = self.core.std.Expr(clip2, ["", "x 1 +", ""])
+        frame = clip.get_frame(0)
+        self.assertEqual(frame.get_read_array(0)[0,0], 20)
+        self.assertEqual(frame.get_read_array(1)[0,0], 21)
+        self.assertEqual(frame.get_read_array(2)[0,0], 30)
+
 
         
 if __name__ == '__main__':
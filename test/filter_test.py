@@ -1,4 +1,10 @@
 import unittest
+import tempfile
+import json
+import os
+import shutil
+import subprocess
+import sys
 import vapoursynth as vs
 
 class FilterTestSequence(unittest.TestCase):
@@ -7,6 +13,18 @@ class FilterTestSequence(unittest.TestCase):
         self.core = vs.core
         self.Transpose = self.core.std.Transpose
         self.BlankClip = self.core.std.BlankClip
+
+    def assertClipsEqual(self, a, b):
+        for n in range(a.num_frames):
+            for plane in range(a.format.num_planes):
+                frame = self.core.std.PlaneStats(a, b, plane=plane).get_frame(n)
+                self.assertEqual(frame.props['PlaneStatsDiff'], 0)
+
+    def startProfiling(self):
+        # turning it off first throws away what earlier tests collected
+        self.core.profiling = False
+        self.core.profiling = True
+        self.addCleanup(setattr, self.core, 'profiling', False)
 		
     def test_transpose8_test(self):
         clip = self.BlankClip(format=vs.YUV420P8, color=[0, 0, 0], width=1156, height=752)
@@ -20,5 +38,248 @@ class FilterTestSequence(unittest.TestCase):
         clip = self.BlankClip(format=vs.YUV444PS, color=[0, 0, 0], width=1156, height=752)
         self.Transpose(clip).get_frame(0)
 
+    def test_persistent_cache(self):
+        with tempfile.TemporaryDirectory() as path:
+            clip = self.BlankClip(format=vs.YUV420P8, color=[100, 50, 200], width=320, height=240, length=5)
+            first = self.core.std.PersistentCache(self.core.std.BoxBlur(clip, hradius=3), path=path)
+            first.get_frame(2)
+            second = self.core.std.PersistentCache(self.core.std.BoxBlur(clip, hradius=3), path=path)
+            frame = self.core.std.PlaneStats(second, first).get_frame(2)
+            self.assertEqual(frame.props['PlaneStatsDiff'], 0)
+            self.assertEqual(frame.props['_DurationDen'], clip.get_frame(2).props['_DurationDen'])
+
+    def test_region_chain(self):
+        def chain(clip, barrier):
+            for f in (self.core.std.Minimum, lambda c: self.core.std.Convolution(c, matrix=[1, 2, 3, 4, 3, 2, 1], mode='v'), self.core.std.Invert, self.core.std.Median):
+                clip = f(clip)
+                if barrier:
+                    clip = self.core.std.AssumeFPS(clip, fpsnum=25)
+            return self.core.std.MakeDiff(clip, self.core.std.BoxBlur(clip, hradius=2, vradius=0), planes=[0, 2])
+
+        for format in (vs.YUV420P8, vs.YUV420P16, vs.YUV444PS):
+            clip = self.core.text.FrameNum(self.BlankClip(format=format, width=642, height=482, length=2))
+            a = chain(clip, False)
+            b = chain(clip, True)
+            self.assertClipsEqual(a, b)
+
+    def test_crop_shared(self):
+        for format in (vs.YUV420P8, vs.YUV420P16, vs.YUV444PS):
+            clip = self.core.text.FrameNum(self.BlankClip(format=format, width=640, height=480, length=2))
+            reference = self.core.text.FrameNum(self.BlankClip(format=format, width=640, height=480, length=2))
+            for left, top, right, bottom in ((0, 20, 0, 40), (64, 2, 0, 0), (0, 0, 6, 0), (2, 4, 6, 8)):
+                cropped = self.core.std.Crop(clip, left=left, top=top, right=right, bottom=bottom)
+                # drawing on a crop must not change the frame it was cropped from
+                self.core.text.Text(cropped, 'x' * 80).get_frame(1)
+                self.assertClipsEqual(cropped, self.core.std.Crop(reference, left=left, top=top, right=right, bottom=bottom))
+                self.assertClipsEqual(clip, reference)
+
+    def runScript(self, script, settings=None):
+        # a fresh core is needed for settings that only take effect when it's created or can only be set once
+        with tempfile.TemporaryDirectory() as path:
+            env = dict(os.environ)
+            if settings:
+                os.mkdir(os.path.join(path, 'vapoursynth'))
+                with open(os.path.join(path, 'vapoursynth', 'vapoursynth.conf'), 'w') as f:
+                    f.write(settings)
+                env['XDG_CONFIG_HOME'] = path
+            result = subprocess.run([sys.executable, '-c', script], env=env, stdout=subprocess.PIPE, stderr=subprocess.PIPE, universal_newlines=True)
+        self.assertEqual(result.returncode, 0, result.stderr)
+        return result
+
+    @unittest.skipUnless(sys.platform.startswith('linux'), 'the settings file is only read from XDG_CONFIG_HOME on linux')
+    def test_numa_mode(self):
+        # two fake nodes on the same cpu, so frames are created and freed on different nodes
+        script = ('import vapoursynth as vs\n'
+                  'clip = vs.core.text.FrameNum(vs.core.std.BlankClip(format=vs.YUV420P8, width=640, height=480, length=30))\n'
+                  'clip = vs.core.std.PlaneStats(vs.core.std.BoxBlur(vs.core.std.Invert(clip), hradius=2))\n'
+                  'print([clip.get_frame(n).props["PlaneStatsAverage"] for n in range(30)])\n')
+        cpu = min(os.sched_getaffinity(0))
+        result = self.runScript(script, 'NumaAware=true\nNumaNodes={0};{0}\n'.format(cpu))
+        self.assertNotIn('numa mode disabled', result.stderr)
+        clip = self.core.text.FrameNum(self.BlankClip(format=vs.YUV420P8, width=640, height=480, length=30))
+        clip = self.core.std.PlaneStats(self.core.std.BoxBlur(self.core.std.Invert(clip), hradius=2))
+        self.assertEqual(result.stdout.strip(), str([clip.get_frame(n).props['PlaneStatsAverage'] for n in range(30)]))
+
+    def test_cache_spill(self):
+        script = """
+import tempfile
+import vapoursynth as vs
+core = vs.core
+core.add_cache = False
+calls = []
+
+def mark(n, f):
+    calls.append(n)
+    fout = f.copy()
+    fout.get_write_array(0)[0, 0] = n
+    fout.props['Marked'] = n
+    fout.props['Name'] = 'frame {}'.format(n)
+    return fout
+
+clip = core.std.BlankClip(format=vs.YUV420P8, width=32, height=32, length=20, color=[10, 20, 30])
+clip = core.std.ModifyFrame(clip, clip, mark)
+try:
+    core.std.Cache(clip, spill=True)
+    raise AssertionError('spill without SetCacheSpill')
+except vs.Error as e:
+    assert 'SetCacheSpill' in str(e)
+
+with tempfile.TemporaryDirectory() as path:
+    core.std.SetCacheSpill(path=path, size=1)
+    spilled = core.std.Cache(clip, size=2, fixed=True, spill=True)
+    for n in range(20):
+        spilled.get_frame(n)
+    # everything but the two frames still in memory has to come back from the spill file
+    for n in range(20):
+        spilled.get_frame(n)
+    assert len(calls) == 20, calls
+    for n in range(20):
+        a = spilled.get_frame(n)
+        b = clip.get_frame(n)
+        assert dict(a.props) == dict(b.props), (dict(a.props), dict(b.props))
+        for plane in range(3):
+            assert core.std.PlaneStats(spilled, clip, plane=plane).get_frame(n).props['PlaneStatsDiff'] == 0
+print('ok')
+"""
+        self.assertEqual(self.runScript(script).stdout.strip(), 'ok')
+
+    @unittest.skipUnless(sys.platform.startswith('linux'), 'needs /proc to tell if a plugin is loaded')
+    def test_lazy_plugin_loading(self):
+        # any plugin will do, vinverse is small and has no dependencies
+        candidates = [os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '.libs', 'libvinverse.so'),
+                      '/usr/lib/vapoursynth/libvinverse.so', '/usr/local/lib/vapoursynth/libvinverse.so']
+        source = next((c for c in candidates if os.path.isfile(c)), None)
+        if source is None:
+            self.skipTest('the vinverse plugin is not built')
+
+        with tempfile.TemporaryDirectory() as path:
+            pluginDir = os.path.join(path, 'plugins')
+            os.mkdir(pluginDir)
+            plugin = os.path.join(pluginDir, 'libvinverse.so')
+            shutil.copy(source, plugin)
+            manifest = os.path.join(path, 'plugins.manifest')
+            settings = 'UserPluginDir={}\nAutoloadSystemPluginDir=false\nPluginManifest={}\n'.format(pluginDir, manifest)
+            script = ('import vapoursynth as vs\n'
+                      'def loaded():\n'
+                      '    with open("/proc/self/maps") as f:\n'
+                      '        return {!r} in f.read()\n'
+                      'functions = vs.core.get_plugins()["biz.srsfckn.Vinverse"]["functions"]\n'
+                      'before = loaded()\n'
+                      'vs.core.vinverse.Vinverse(vs.core.std.BlankClip(format=vs.YUV420P8)).get_frame(0)\n'
+                      'print(before, "Vinverse" in functions, loaded())\n').format(plugin)
+
+            # the first run loads it to create the manifest, after that listing it doesn't load it and using it does
+            self.assertEqual(self.runScript(script, settings).stdout.split(), ['True', 'True', 'True'])
+            with open(manifest) as f:
+                self.assertIn('\tbiz.srsfckn.Vinverse\tvinverse\t', f.read())
+            self.assertEqual(self.runScript(script, settings).stdout.split(), ['False', 'True', 'True'])
+
+            # a rebuild within the same second with the same size must still be noticed
+            st = os.stat(plugin)
+            os.utime(plugin, ns=(st.st_atime_ns, st.st_mtime_ns + 1))
+            self.assertEqual(self.runScript(script, settings).stdout.split(), ['True', 'True', 'True'])
+            self.assertEqual(self.runScript(script, settings).stdout.split(), ['False', 'True', 'True'])
+
+    def test_profile(self):
+        self.startProfiling()
+        clip = self.core.std.Invert(self.BlankClip(format=vs.YUV420P8, width=320, height=240, length=3))
+        for n in range(3):
+            clip.get_frame(n)
+        profile = self.core.get_profile()
+        invert = [entry for entry in profile if entry['name'] == 'Invert']
+        self.assertEqual(len(invert), 1)
+        self.assertEqual(invert[0]['ar_initial'], 3)
+        self.assertGreaterEqual(invert[0]['calls'], 6)
+        self.assertGreater(invert[0]['bytes'], 0)
+
+    def test_trace(self):
+        with tempfile.TemporaryDirectory() as path:
+            self.core.tracing = False
+            self.core.tracing = True
+            clip = self.core.std.Invert(self.BlankClip(format=vs.YUV420P8, width=320, height=240, length=3))
+            for n in range(3):
+                clip.get_frame(n)
+            self.core.tracing = False
+            filename = os.path.join(path, 'trace.json')
+            self.core.save_trace(filename)
+            with open(filename) as f:
+                events = json.load(f)['traceEvents']
+            invert = [e for e in events if e['name'] == 'Invert' and e['args']['reason'] == 'all_frames_ready']
+            self.assertEqual(sorted(e['args']['frame'] for e in invert), [0, 1, 2])
+
+    def test_request_priority(self):
+        clip = self.core.std.BoxBlur(self.BlankClip(format=vs.YUV420P8, width=320, height=240, length=20), hradius=2)
+        futures = [clip.get_frame_async(n, vs.BACKGROUND) for n in range(10)]
+        futures.append(clip.get_frame_async(15, vs.INTERACTIVE, 1000))
+        futures.append(clip.get_frame_async(16, priority=vs.SPECULATIVE))
+        for n, f in zip(list(range(10)) + [15, 16], futures):
+            self.assertEqual(f.result().props['_DurationDen'], clip.get_frame(n).props['_DurationDen'])
+
+    def test_cancel_requests(self):
+        clip = self.core.std.BoxBlur(self.BlankClip(format=vs.YUV420P8, width=320, height=240, length=100), hradius=2)
+        token = self.core.create_cancel_token()
+        token.cancel()
+        with self.assertRaises(vs.Error):
+            clip.get_frame_async(50, token=token).result()
+        # requests with a token that is never cancelled are unaffected
+        futures = [clip.get_frame_async(n, token=self.core.create_cancel_token()) for n in range(10)]
+        for f in futures:
+            f.result()
+
+    def test_frame_props_copy(self):
+        frame = self.BlankClip(format=vs.YUV420P8, length=1).get_frame(0)
+        copy = frame.copy()
+        copy.props['_DurationNum'] = 7
+        copy.props['List'] = [1, 2, 3]
+        self.assertEqual(frame.props['_DurationNum'], 1)
+        self.assertNotIn('List', frame.props)
+        self.assertEqual(copy.props['List'], [1, 2, 3])
+        copy.props['Float'] = [0.5, 1.5]
+        self.assertEqual(copy.props['Float'], [0.5, 1.5])
+
+    def test_expr_neighbours(self):
+        for format in (vs.YUV420P8, vs.YUV420P16):
+            clip = self.core.text.FrameNum(self.BlankClip(format=format, width=642, height=482, length=2))
+            cross = self.core.std.Convolution(clip, matrix=[0, 1, 0, 1, 0, 1, 0, 1, 0], divisor=1)
+            row = self.core.std.Convolution(clip, matrix=[1, 2, 3, 4, 3], divisor=1, mode='h')
+            for a, b in ((cross, self.core.std.Expr(clip, 'x[0,-1] x[-1,0] + x[1,0] + x[0,1] +', boundary=1)),
+                         (row, self.core.std.Expr(clip, 'x[-2,0]:m x[-1,0]:m 2 * + x 3 * + x[1,0]:m 4 * + x[2,0]:m 3 * +'))):
+                self.assertClipsEqual(a, b)
+        clip = self.BlankClip(format=vs.GRAY8, width=4, height=1, length=1)
+        with self.assertRaises(vs.Error):
+            self.core.std.Expr(clip, 'x[1,0')
+
+    def test_expr_code_cache(self):
+        self.startProfiling()
+        clip = self.BlankClip(format=vs.YUV420P8, length=1)
+        first = self.core.std.Expr(clip, 'x 3 * 7 + 0.9 pow')
+        second = self.core.std.Expr(clip, 'x 3 * 7 + 0.9 pow')
+        first.get_frame(0)
+        second.get_frame(0)
+        exprs = [entry for entry in self.core.get_profile() if entry['name'] == 'Expr']
+        misses = sum(entry['code_cache_misses'] for entry in exprs)
+        # nothing is compiled without the jit, otherwise the three planes of both are the same code
+        self.assertIn(misses, (0, 1))
+        self.assertEqual(sum(entry['code_cache_hits'] for entry in exprs), 5 * misses)
+
+    def test_expr_interpreter(self):
+        exprs = ['x 2 * 3 +', 'x[-1,0] x[1,0] max x[0,-1] - x 64 > 255 0 ? +', 'x 0.5 * sqrt 7 -']
+        for format in (vs.YUV420P8, vs.YUV420P16):
+            clip = self.core.text.FrameNum(self.BlankClip(format=format, width=330, height=242, length=2))
+            jit = [self.core.std.Expr(clip, expr) for expr in exprs]
+            self.core.std.SetMaxCPU('none')
+            try:
+                interpreted = [self.core.std.Expr(clip, expr) for expr in exprs]
+            finally:
+                self.core.std.SetMaxCPU('max')
+            for a, b in zip(jit, interpreted):
+                self.assertClipsEqual(a, b)
+
+    def test_persistent_cache_function(self):
+        with tempfile.TemporaryDirectory() as path:
+            clip = self.core.std.FrameEval(self.BlankClip(), lambda n, clip: clip)
+            with self.assertRaises(vs.Error):
+                self.core.std.PersistentCache(clip, path=path)
+
 if __name__ == '__main__':
     unittest.main()